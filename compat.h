@@ -26,6 +26,25 @@
 # define MAXREPLAYLINELEN 10000
 #endif
 
+/* the most a "replay since" will send, for the same reasons.  if
+ * there's more than this since the time asked for, only the end of it
+ * is sent.
+ */
+#if !defined(MAXREPLAYSINCE)
+# define MAXREPLAYSINCE (1024 * 1024)
+#endif
+
+/* console output is collected into writes to the logfile of up to
+ * LOGBUFFERSIZE bytes, none of it waiting more than LOGFLUSHTIME
+ * milliseconds (these are the defaults for logbuffer and logflush)
+ */
+#if !defined(LOGBUFFERSIZE)
+# define LOGBUFFERSIZE (16 * 1024)
+#endif
+#if !defined(LOGFLUSHTIME)
+# define LOGFLUSHTIME 1000
+#endif
+
 /* the default escape sequence used to give meta commands
  */
 #if !defined(DEFATTN)
@@ -84,6 +103,12 @@
 #ifdef HAVE_SYS_SELECT_H
 # include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #ifndef FD_ZERO
 typedef long fd_set;
@@ -41,6 +41,7 @@
 #include <group.h>
 #include <readcfg.h>
 #include <main.h>
+#include <resolve.h>
 
 #if USE_IPV6
 # include <net/if.h>
@@ -50,22 +51,22 @@
 #endif
 
 #if !USE_IPV6
-/* Compare an Internet address (IPv4 expected), with an address pattern
- * passed as a character string representing an address in the Internet
- * standard `.' notation, optionally followed by a slash and an integer
- * specifying the number of bits in the network portion of the address
- * (the netmask size). If not specified explicitly, the netmask size used
- * is that implied by the address class. If either the netmask is specified
+/* Convert an address pattern, passed as a character string representing
+ * an address in the Internet standard `.' notation, optionally followed
+ * by a slash and an integer specifying the number of bits in the network
+ * portion of the address (the netmask size), into an address and prefix
+ * length. If not specified explicitly, the netmask size used is that
+ * implied by the address class. If either the netmask is specified
  * explicitly, or the local network address part of the pattern is zero,
  * then only the network number parts of the addresses are compared;
- * otherwise the entire addresses are compared.
+ * otherwise the entire addresses are compared (a prefix of 32 bits).
  *
- * Returns 0 if the addresses match, else returns 1.
+ * Returns 0 if the pattern is usable, else returns 1.
  */
-int
-AddrCmp(struct in_addr *addr, char *pattern)
+static int
+AddrPrefix(char *pattern, in_addr_t *prefix, int *bits)
 {
-    in_addr_t hostaddr, pattern_addr, netmask;
+    in_addr_t pattern_addr, netmask;
     char *p, *slash_posn;
     static STRING *buf = (STRING *)0;
 # if HAVE_INET_ATON
@@ -110,59 +111,179 @@ AddrCmp(struct in_addr *addr, char *pattern)
 	else
 	    return 1;		/* unsupported address class */
     }
-    netmask = htonl(netmask);
-    if (~netmask & pattern_addr)
+    netmask &= 0xffffffff;
+    if (~netmask & ntohl(pattern_addr) & 0xffffffff)
 	netmask = 0xffffffff;	/* compare entire addresses */
-    hostaddr = addr->s_addr;
 
-    CONDDEBUG((1, "AddrCmp(): host=%lx(%lx/%lx) acl=%lx(%lx/%lx)",
-	       hostaddr & netmask, hostaddr, netmask,
-	       pattern_addr & netmask, pattern_addr, netmask));
-    return (hostaddr & netmask) != (pattern_addr & netmask);
+    *prefix = ntohl(pattern_addr) & netmask;
+    for (*bits = 0; netmask & 0x80000000; netmask <<= 1)
+	(*bits)++;
+    CONDDEBUG((1, "AddrPrefix(): %s is %lx/%d", pattern,
+	       (unsigned long)*prefix, *bits));
+    return 0;
+}
+
+/* the access list, compiled by AccessCompile().  the first entry that
+ * matches wins, so the CIDR entries go in a binary radix tree where
+ * each node has the earliest entry with exactly its prefix - the
+ * earliest one along an address's path is its match.  hostname entries
+ * are kept in order, and only the ones ahead of that match (which need
+ * DNS) are checked the old way.  verdicts that didn't need DNS are
+ * cached by address until the next AccessCompile()
+ */
+typedef struct accNode {
+    int child[2];
+    int first;			/* entry with this prefix, or -1 */
+} ACCNODE;
+
+static ACCNODE *accNodes = (ACCNODE *)0;
+static int accNodeCount = 0;
+static int accNodeAlloc = 0;
+static ACCESS **accEntries = (ACCESS **)0;	/* by list position */
+static int accCount = 0;
+static int *accHosts = (int *)0;	/* positions of hostname entries */
+static int accHostCount = 0;
+
+#define ACCCACHESIZE	256
+
+static struct accCache {
+    in_addr_t addr;
+    unsigned long gen;
+    int entry;			/* -1 for the default */
+} accCache[ACCCACHESIZE];
+static unsigned long accGen = 0;
+
+static int
+AccNodeNew(void)
+{
+    if (accNodeCount == accNodeAlloc) {
+	accNodeAlloc = (accNodeAlloc == 0) ? 64 : accNodeAlloc * 2;
+	if ((accNodes =
+	     (ACCNODE *)realloc(accNodes,
+				accNodeAlloc * sizeof(ACCNODE))) ==
+	    (ACCNODE *)0)
+	    OutOfMem();
+    }
+    accNodes[accNodeCount].child[0] = accNodes[accNodeCount].child[1] =
+	-1;
+    accNodes[accNodeCount].first = -1;
+    return accNodeCount++;
+}
+
+static void
+AccTreeAdd(in_addr_t prefix, int bits, int entry)
+{
+    int n = 0, b, i;
+
+    for (i = 0; i < bits; i++) {
+	b = (prefix >> (31 - i)) & 1;
+	if (accNodes[n].child[b] == -1) {
+	    int c = AccNodeNew();	/* might move accNodes */
+	    accNodes[n].child[b] = c;
+	}
+	n = accNodes[n].child[b];
+    }
+    if (accNodes[n].first == -1)
+	accNodes[n].first = entry;
+}
+
+/* the earliest CIDR entry matching addr, or accCount */
+static int
+AccTreeFind(in_addr_t addr)
+{
+    int n = 0, i, found = accCount;
+
+    for (i = 0; n != -1; i++) {
+	if (accNodes[n].first != -1 && accNodes[n].first < found)
+	    found = accNodes[n].first;
+	if (i == 32)
+	    break;
+	n = accNodes[n].child[(addr >> (31 - i)) & 1];
+    }
+    return found;
 }
 #endif /* USE_IPV6 */
 
+/* rebuild the compiled form of pACList - called whenever it changes
+ */
+void
+AccessCompile(void)
+{
+#if !USE_IPV6
+    ACCESS *pACtmp;
+    in_addr_t prefix;
+    int bits, i;
+
+    accNodeCount = accCount = accHostCount = 0;
+    AccNodeNew();
+    accGen++;
+
+    for (pACtmp = pACList; pACtmp != (ACCESS *)0; pACtmp = pACtmp->pACnext)
+	accCount++;
+    if (accEntries != (ACCESS **)0)
+	free(accEntries);
+    if (accHosts != (int *)0)
+	free(accHosts);
+    if ((accEntries =
+	 (ACCESS **)calloc(accCount + 1, sizeof(ACCESS *))) ==
+	(ACCESS **)0 ||
+	(accHosts = (int *)calloc(accCount + 1, sizeof(int))) == (int *)0)
+	OutOfMem();
+
+    for (i = 0, pACtmp = pACList; pACtmp != (ACCESS *)0;
+	 pACtmp = pACtmp->pACnext, i++) {
+	accEntries[i] = pACtmp;
+	if (pACtmp->isCIDR != 0) {
+	    if (AddrPrefix(pACtmp->pcwho, &prefix, &bits) == 0)
+		AccTreeAdd(prefix, bits, i);
+	} else if (strspn(pACtmp->pcwho, "0123456789.") ==
+		   strlen(pACtmp->pcwho) &&
+		   (prefix = inet_addr(pACtmp->pcwho)) != (in_addr_t) (-1)) {
+	    /* an address, like SetDefAccess() uses, is just itself */
+	    AccTreeAdd(ntohl(prefix), 32, i);
+	} else
+	    accHosts[accHostCount++] = i;
+    }
+    CONDDEBUG((1, "AccessCompile(): %d entries, %d hostnames, %d nodes",
+	       accCount, accHostCount, accNodeCount));
+#endif
+}
+
 /* return the access type for a given host entry			(ksb)
+ * or '?' if that needs a lookup the resolver hasn't finished - try
+ * again once ResolveReady() says so.  *peername gets the client's
+ * name, if we log those and the resolver has it.
  */
 char
 AccType(INADDR_STYPE *addr, char **peername)
 {
     ACCESS *pACtmp;
-    socklen_t so;
     char ret;
+    char **names = (char **)0;	/* not asked for yet */
+    int nameState = RESOLVE_FAIL;
 #if USE_IPV6
     int error;
-    char host[NI_MAXHOST];
     char ipaddr[NI_MAXHOST];
 #else
-    struct hostent *he = (struct hostent *)0;
-    int a;
-# if TRUST_REVERSE_DNS
-    char **revNames = (char **)0;
-# endif
-
-    CONDDEBUG((1, "AccType(): ip=%s", inet_ntoa(*addr)));
+    int a, h, first, pending = 0;
+    struct accCache *pCache;
+    in_addr_t hostaddr;
+    char ipaddr[16];
+    char **addrs;
 #endif /* USE_IPV6 */
 
     ret = config->defaultaccess;
-    so = sizeof(*addr);
 
 #if USE_IPV6
     error =
-	getnameinfo((struct sockaddr *)addr, so, ipaddr, sizeof(ipaddr),
-		    NULL, 0, NI_NUMERICHOST);
+	getnameinfo((struct sockaddr *)addr, sizeof(*addr), ipaddr,
+		    sizeof(ipaddr), NULL, 0, NI_NUMERICHOST);
     if (error) {
 	Error("AccType(): getnameinfo failed: %s", gai_strerror(error));
-	goto common_ret;
+	return ret;
     }
     CONDDEBUG((1, "AccType(): ip=%s", ipaddr));
 
-    error =
-	getnameinfo((struct sockaddr *)addr, so, host, sizeof(host), NULL,
-		    0, 0);
-    if (!error)
-	CONDDEBUG((1, "AccType(): host=%s", host));
-
     for (pACtmp = pACList; pACtmp != (ACCESS *)0; pACtmp = pACtmp->pACnext) {
 	CONDDEBUG((1, "AccType(): who=%s, trust=%c", pACtmp->pcwho,
 		   pACtmp->ctrust));
@@ -173,84 +294,70 @@ AccType(INADDR_STYPE *addr, char **peername)
 	    goto common_ret;
 	}
 
-	if (!error && strstr(host, pACtmp->pcwho) != NULL) {
-	    CONDDEBUG((1, "AccType(): match for host=%s", host));
+	/* only now does the name matter */
+	if (names == (char **)0)
+	    nameState = ResolveName(ipaddr, &names);
+	if (nameState == RESOLVE_PENDING) {
+	    ret = '?';
+	    goto common_ret;
+	}
+	if (names[0] != (char *)0 &&
+	    strstr(names[0], pACtmp->pcwho) != NULL) {
+	    CONDDEBUG((1, "AccType(): match for host=%s", names[0]));
 	    ret = pACtmp->ctrust;
 	    goto common_ret;
 	}
     }
   common_ret:
-    if (config->loghostnames == FLAGTRUE && !error)
-	*peername = StrDup(host);
+    if (config->loghostnames == FLAGTRUE && peername != (char **)0) {
+	if (names == (char **)0)
+	    nameState = ResolveName(ipaddr, &names);
+	if (nameState == RESOLVE_OK && names[0] != (char *)0)
+	    *peername = StrDup(names[0]);
+    }
 #else
-# if TRUST_REVERSE_DNS
-    /* if we trust reverse dns, we get the names associated with
-     * the address we're checking and then check each of those
-     * against the access list entries (below).
+    StrCpy(ipaddr, inet_ntoa(*addr), sizeof(ipaddr));
+    CONDDEBUG((1, "AccType(): ip=%s", ipaddr));
+
+    /* the tree has the first CIDR entry that matches, so only the
+     * hostname entries ahead of it need checking (and DNS)
      */
-    if ((he =
-	 gethostbyaddr((char *)addr, so,
-		       AF_INET)) == (struct hostent *)0) {
-	Error("AccType(): gethostbyaddr(%s): %s", inet_ntoa(*addr),
-	      hstrerror(h_errno));
+    if (accGen == 0)
+	AccessCompile();
+    hostaddr = ntohl(addr->s_addr) & 0xffffffff;
+    pCache =
+	&accCache[(((hostaddr * 2654435761UL) & 0xffffffff) >> 16) %
+		  ACCCACHESIZE];
+    if (pCache->gen == accGen && pCache->addr == hostaddr) {
+	first = pCache->entry;
     } else {
-	char *hname;
-	if (he->h_name != (char *)0) {
-	    /* count up the number of names */
-	    for (a = 0, hname = he->h_aliases[a]; hname != (char *)0;
-		 hname = he->h_aliases[++a]);
-	    a += 2;		/* h_name + (char *)0 */
-	    /* now duplicate them */
-	    if ((revNames =
-		 (char **)calloc(a, sizeof(char *))) != (char **)0) {
-		for (hname = he->h_name, a = 0; hname != (char *)0;
-		     hname = he->h_aliases[a++]) {
-		    if ((revNames[a] = StrDup(hname)) == (char *)0)
-			break;
-		    CONDDEBUG((1, "AccType(): revNames[%d]='%s'", a,
-			       hname));
-		}
-	    }
+	first = AccTreeFind(hostaddr);
+	if (accHostCount == 0 || accHosts[0] > first) {
+	    pCache->addr = hostaddr;
+	    pCache->gen = accGen;
+	    pCache->entry = first;
 	}
     }
-# endif
+    CONDDEBUG((1, "AccType(): first CIDR match is #%d of %d", first,
+	       accCount));
 
-    for (pACtmp = pACList; pACtmp != (ACCESS *)0; pACtmp = pACtmp->pACnext) {
+    /* once one entry is waiting on the resolver nothing after it
+     * can decide, but we still ask about the rest so the answers all
+     * come back together
+     */
+    for (h = 0; h < accHostCount && accHosts[h] < first; h++) {
+	pACtmp = accEntries[accHosts[h]];
 	CONDDEBUG((1, "AccType(): who=%s, trust=%c", pACtmp->pcwho,
 		   pACtmp->ctrust));
-	if (pACtmp->isCIDR != 0) {
-	    if (AddrCmp(addr, pACtmp->pcwho) == 0) {
+
+	if (ResolveHost(pACtmp->pcwho, &addrs, (void *)0) == RESOLVE_PENDING)
+	    pending = 1;
+	for (a = 0; !pending && addrs[a] != (char *)0; a++) {
+	    CONDDEBUG((1, "AccType(): addr=%s", addrs[a]));
+	    if (strcmp(addrs[a], ipaddr) == 0) {
 		ret = pACtmp->ctrust;
 		goto common_ret;
 	    }
-	    continue;
-	}
-
-	if ((he = gethostbyname(pACtmp->pcwho)) == (struct hostent *)0) {
-	    Error("AccType(): gethostbyname(%s): %s", pACtmp->pcwho,
-		  hstrerror(h_errno));
-	} else if (4 != he->h_length || AF_INET != he->h_addrtype) {
-	    Error
-		("AccType(): gethostbyname(%s): wrong address size (4 != %d) or address family (%d != %d)",
-		 pACtmp->pcwho, he->h_length, AF_INET, he->h_addrtype);
-	} else {
-	    for (a = 0; he->h_addr_list[a] != (char *)0; a++) {
-		CONDDEBUG((1, "AccType(): addr=%s",
-			   inet_ntoa(*(struct in_addr *)
-				     (he->h_addr_list[a]))));
-		if (
-# if HAVE_MEMCMP
-		       memcmp(&(addr->s_addr), he->h_addr_list[a],
-			      he->h_length)
-# else
-		       bcmp(&(addr->s_addr), he->h_addr_list[a],
-			    he->h_length)
-# endif
-		       == 0) {
-		    ret = pACtmp->ctrust;
-		    goto common_ret;
-		}
-	    }
 	}
 # if TRUST_REVERSE_DNS
 	/* we chop bits off client names so that we can put domain
@@ -260,20 +367,24 @@ AccType(INADDR_STYPE *addr, char **peername)
 	 * the .net top-level.  without TRUST_REVERSE_DNS, those names
 	 * better map to ip addresses for them to take effect.
 	 */
-	if (revNames != (char **)0) {
+	if (names == (char **)0)
+	    nameState = ResolveName(ipaddr, &names);
+	if (nameState == RESOLVE_PENDING)
+	    pending = 1;
+	if (!pending) {
 	    char *pcName;
 	    int wlen;
 	    int len;
 	    wlen = strlen(pACtmp->pcwho);
-	    for (a = 0; revNames[a] != (char *)0; a++) {
-		for (pcName = revNames[a], len = strlen(pcName);
+	    for (a = 0; names[a] != (char *)0; a++) {
+		for (pcName = names[a], len = strlen(pcName);
 		     len >= wlen; len = strlen(++pcName)) {
 		    CONDDEBUG((1, "AccType(): name=%s", pcName));
 		    if (strcasecmp(pcName, pACtmp->pcwho) == 0) {
 			if (peername != (char **)0)
-			    *peername = StrDup(revNames[a]);
+			    *peername = StrDup(names[a]);
 			ret = pACtmp->ctrust;
-			goto common_ret2;
+			return ret;
 		    }
 		    pcName = strchr(pcName, '.');
 		    if (pcName == (char *)0)
@@ -283,28 +394,18 @@ AccType(INADDR_STYPE *addr, char **peername)
 	}
 # endif
     }
+    if (pending)
+	ret = '?';
+    else if (first < accCount)
+	ret = accEntries[first]->ctrust;
 
   common_ret:
     if (config->loghostnames == FLAGTRUE && peername != (char **)0) {
-# if TRUST_REVERSE_DNS
-	if (revNames != (char **)0 && revNames[0] != (char *)0)
-	    *peername = StrDup(revNames[0]);
-# else
-	if ((he =
-	     gethostbyaddr((char *)addr, so,
-			   AF_INET)) != (struct hostent *)0) {
-	    *peername = StrDup(he->h_name);
-	}
-# endif
-    }
-# if TRUST_REVERSE_DNS
-  common_ret2:
-    if (revNames != (char **)0) {
-	for (a = 0; revNames[a] != (char *)0; a++)
-	    free(revNames[a]);
-	free(revNames);
+	if (names == (char **)0)
+	    nameState = ResolveName(ipaddr, &names);
+	if (nameState == RESOLVE_OK && names[0] != (char *)0)
+	    *peername = StrDup(names[0]);
     }
-# endif
 #endif /* USE_IPV6 */
     return ret;
 }
@@ -389,6 +490,7 @@ SetDefAccess(
 	pAddr++;
     }
 #endif
+    AccessCompile();
 }
 
 void
@@ -43,6 +43,7 @@ typedef struct access {
 } ACCESS;
 
 extern char AccType(INADDR_STYPE *, char **);
+extern void AccessCompile(void);
 extern void SetDefAccess(
 #if USE_IPV6
 			    void
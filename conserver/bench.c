@@ -0,0 +1,577 @@
+/*
+ *  Copyright conserver.com, 2000
+ *
+ *  Maintainer/Enhancer: Bryan Stansell (bryan@conserver.com)
+ */
+
+/*
+ * microbenchmarks for the hot paths in cutil.c, each next to a copy of
+ * the byte-at-a-time code it replaced (`make bench').  the outputs are
+ * compared too, so a faster wrong answer doesn't go unnoticed.
+ *
+ *   bench [-s seconds]                      everything below but master
+ *   bench [-s seconds] iac|scan|queue       just the one
+ *   bench [-s seconds] master host port [idle]
+ *                                           connect/groups/close against
+ *                                           a running conserver, with
+ *                                           idle connections held open
+ */
+
+#include <compat.h>
+
+#include <cutil.h>
+
+#if defined(USE_LIBWRAP)
+/* we don't use it...but we link to it */
+int allow_severity;
+int deny_severity;
+#endif
+
+
+SECTION sections[] = {
+    {(char *)0, (void *)0, (void *)0, (void *)0, (void *)0}
+};
+
+void
+DestroyDataStructures()
+{
+}
+
+#define BENCHSIZE	(1024 * 1024)	/* bytes per pass */
+#define BENCHREAD	4096	/* like group.c's reads */
+
+static double benchSecs = 1.0;
+static int failed = 0;
+
+static void *
+Alloc(size_t len)
+{
+    void *p;
+
+    if ((p = malloc(len)) == (void *)0)
+	OutOfMem();
+    return p;
+}
+
+static double
+Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, (struct timezone *)0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* console-ish text: 72 character lines, with an OB_IAC/OB_IAC pair
+ * every `every' bytes (never, if it's 0).  pairs aren't split across
+ * BENCHREAD reads, which the old code didn't handle
+ */
+static void
+Fill(unsigned char *buf, int len, int every)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+	buf[i] = (i % 73 == 72) ? '\n' : 'a' + i % 26;
+    if (every <= 0)
+	return;
+    for (i = every - 1; i + 1 < len; i += every) {
+	if (i % BENCHREAD == BENCHREAD - 1)
+	    continue;
+	buf[i] = OB_IAC;
+	buf[i + 1] = OB_IAC;
+    }
+}
+
+static void
+Report(char *what, char *how, double oldRate, double newRate)
+{
+    printf("  %-10s %-24s %8.0f -> %8.0f MB/s\n", what, how,
+	   oldRate / (1024 * 1024), newRate / (1024 * 1024));
+}
+
+/* run fn over the buffer until benchSecs go by, returning bytes/sec */
+static double
+Rate(void (*fn) (unsigned char *, int), unsigned char *buf, int len)
+{
+    double start, elapsed;
+    long bytes = 0;
+
+    start = Now();
+    do {
+	fn(buf, len);
+	bytes += len;
+    } while ((elapsed = Now() - start) < benchSecs);
+    return bytes / elapsed;
+}
+
+/* ParseIACBuf() before it used memchr() */
+static int
+OldParseIACBuf(CONSFILE *cfp, void *msg, int *len)
+{
+    int l = 0;
+    unsigned char *b = msg;
+
+    if (*len <= 0)
+	return -1;
+    for (; l < *len; l++) {
+	if (b[l] == OB_IAC) {
+	    if (l + 1 == *len)
+		return l;
+
+	    if (b[l + 1] == OB_IAC) {
+		--(*len);
+		MemMove(b + l, b + l + 1, *len - l);
+	    } else {
+		return l;
+	    }
+	}
+    }
+    return l;
+}
+
+static CONSFILE *iacFile;
+static unsigned char *iacSrc, *iacWork;
+static int (*iacFn) (CONSFILE *, void *, int *);
+
+static void
+UnquoteAll(unsigned char *buf, int len)
+{
+    int off, n, l;
+
+    memcpy(iacWork, iacSrc, len);
+    for (off = 0; off < len; off += BENCHREAD) {
+	l = (len - off < BENCHREAD) ? len - off : BENCHREAD;
+	n = iacFn(iacFile, iacWork + off, &l);
+	if (n < 0)
+	    break;
+    }
+}
+
+/* quoting going out, the way FileWrite() did it a byte at a time */
+static STRING *quoted;
+static CONSFILE *nullFile;
+
+static void
+OldQuote(unsigned char *buf, int len)
+{
+    int i, off, l;
+
+    for (off = 0; off < len; off += BENCHREAD) {
+	l = (len - off < BENCHREAD) ? len - off : BENCHREAD;
+	BuildString((char *)0, quoted);
+	for (i = off; i < off + l; i++) {
+	    if (buf[i] == OB_IAC)
+		BuildStringChar((char)OB_IAC, quoted);
+	    BuildStringChar((char)buf[i], quoted);
+	}
+	if (write(FileFDNum(nullFile), quoted->string, quoted->used - 1) < 0)
+	    break;
+    }
+}
+
+static void
+NewQuote(unsigned char *buf, int len)
+{
+    int off, l;
+
+    for (off = 0; off < len; off += BENCHREAD) {
+	l = (len - off < BENCHREAD) ? len - off : BENCHREAD;
+	FileWrite(nullFile, FLAGFALSE, (char *)buf + off, l);
+    }
+}
+
+static void
+BenchIAC(void)
+{
+    static int every[] = { 0, 1024, 7 };
+    static char *how[] = { "no 0xff", "a 0xff pair per KB",
+	"a 0xff pair every 7"
+    };
+    unsigned char *a, *b;
+    double o, n;
+    int i, off, la, lb, fd;
+    CONSFILE *outFile;
+    STRING *queued;
+
+    printf("iac: client input (ParseIACBuf) and output (FileWrite)\n");
+    iacSrc = Alloc(BENCHSIZE);
+    iacWork = Alloc(BENCHSIZE);
+    a = Alloc(BENCHSIZE);
+    b = Alloc(BENCHSIZE);
+    if ((fd = open("/dev/null", O_WRONLY)) < 0) {
+	Error("open(/dev/null): %s", strerror(errno));
+	exit(EX_OSERR);
+    }
+    iacFile = FileOpenFD(-1, simpleFile);
+    FileSetQuoteIAC(iacFile, FLAGTRUE);
+    nullFile = FileOpenFD(fd, simpleFile);
+    FileSetQuoteIAC(nullFile, FLAGTRUE);
+    quoted = AllocString();
+    queued = AllocString();
+
+    for (i = 0; i < sizeof(every) / sizeof(int); i++) {
+	Fill(iacSrc, BENCHSIZE, every[i]);
+
+	/* the same bytes have to come out of both */
+	memcpy(a, iacSrc, BENCHSIZE);
+	memcpy(b, iacSrc, BENCHSIZE);
+	for (off = 0; off < BENCHSIZE; off += BENCHREAD) {
+	    la = lb = BENCHREAD;
+	    if (OldParseIACBuf(iacFile, a + off, &la) !=
+		ParseIACBuf(iacFile, b + off, &lb) || la != lb ||
+		memcmp(a + off, b + off, la) != 0) {
+		printf("  %s: ParseIACBuf() differs at %d\n", how[i], off);
+		failed = 1;
+		break;
+	    }
+	}
+
+	BuildString((char *)0, quoted);
+	for (off = 0; off < BENCHSIZE; off++) {
+	    if (iacSrc[off] == OB_IAC)
+		BuildStringChar((char)OB_IAC, quoted);
+	    BuildStringChar((char)iacSrc[off], quoted);
+	}
+	outFile = FileOpenFD(-1, simpleFile);
+	FileSetQuoteIAC(outFile, FLAGTRUE);
+	for (off = 0; off < BENCHSIZE; off += BENCHREAD)
+	    FileWrite(outFile, FLAGTRUE, (char *)iacSrc + off, BENCHREAD);
+	BuildString((char *)0, queued);
+	FileQueued(outFile, queued);
+	FileClose(&outFile);
+	if (queued->used != quoted->used ||
+	    memcmp(queued->string, quoted->string, quoted->used) != 0) {
+	    printf("  %s: FileWrite() quoting differs\n", how[i]);
+	    failed = 1;
+	}
+
+	iacFn = OldParseIACBuf;
+	o = Rate(UnquoteAll, iacSrc, BENCHSIZE);
+	iacFn = ParseIACBuf;
+	n = Rate(UnquoteAll, iacSrc, BENCHSIZE);
+	Report("in", how[i], o, n);
+
+	o = Rate(OldQuote, iacSrc, BENCHSIZE);
+	n = Rate(NewQuote, iacSrc, BENCHSIZE);
+	Report("out", how[i], o, n);
+    }
+    FileClose(&nullFile);
+    FileClose(&iacFile);
+    DestroyString(quoted);
+    DestroyString(queued);
+    free(a);
+    free(b);
+    free(iacWork);
+    free(iacSrc);
+}
+
+/* DoConsoleRead()'s scans, a byte at a time and with MemFind2() and
+ * MemStrip()
+ */
+static unsigned char *scanOut;
+static volatile size_t scanSink;
+
+static void
+OldFind(unsigned char *buf, int len)
+{
+    int i, n = 0;
+
+    for (i = 0; i < len; i++)
+	if (buf[i] == OB_IAC || buf[i] == '\000')
+	    n++;
+    scanSink = n;
+}
+
+static void
+NewFind(unsigned char *buf, int len)
+{
+    size_t i, n = 0;
+
+    for (i = MemFind2(buf, len, OB_IAC, '\000'); i < len;
+	 i += 1 + MemFind2(buf + i + 1, len - i - 1, OB_IAC, '\000'))
+	n++;
+    scanSink = n;
+}
+
+static void
+OldStrip(unsigned char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+	scanOut[i] = buf[i] & 127;
+}
+
+static void
+NewStrip(unsigned char *buf, int len)
+{
+    MemStrip(scanOut, buf, len);
+}
+
+static void
+BenchScan(void)
+{
+    unsigned char *buf;
+    size_t o;
+    int i;
+
+    printf("scan: console data (MemFind2, MemStrip)\n");
+    buf = Alloc(BENCHSIZE);
+    scanOut = Alloc(BENCHSIZE);
+    Fill(buf, BENCHSIZE, 0);
+    /* a telnet command and a high bit now and then */
+    for (i = 4000; i < BENCHSIZE; i += 4096) {
+	buf[i] = OB_IAC;
+	buf[i + 1] = '\373';
+	buf[i + 2] = '\000';
+	buf[i + 40] |= 0x80;
+    }
+
+    OldFind(buf, BENCHSIZE);
+    o = scanSink;
+    NewFind(buf, BENCHSIZE);
+    if (o != scanSink) {
+	printf("  MemFind2() found %lu, not %lu\n", (unsigned long)scanSink,
+	       (unsigned long)o);
+	failed = 1;
+    }
+    Report("find", "IAC or NUL", Rate(OldFind, buf, BENCHSIZE),
+	   Rate(NewFind, buf, BENCHSIZE));
+    Report("strip", "striphigh", Rate(OldStrip, buf, BENCHSIZE),
+	   Rate(NewStrip, buf, BENCHSIZE));
+    free(scanOut);
+    free(buf);
+}
+
+/* a slow reader: BENCHSIZE bytes are queued on a socket and the other
+ * end takes BENCHREAD at a time, so every write is a partial one.  the
+ * old way kept the backlog in a STRING and ShiftString()ed it down
+ * after each write.
+ */
+static int queueFds[2];
+
+static void
+Drain(void)
+{
+    char buf[BENCHREAD];
+
+    while (read(queueFds[1], buf, sizeof(buf)) > 0);
+}
+
+static void
+OldQueue(unsigned char *buf, int len)
+{
+    static STRING *wbuf = (STRING *)0;
+    int off, r;
+
+    if (wbuf == (STRING *)0)
+	wbuf = AllocString();
+    BuildString((char *)0, wbuf);
+    for (off = 0; off < len; off += BENCHREAD)
+	BuildStringN((char *)buf + off,
+		     (len - off < BENCHREAD) ? len - off : BENCHREAD, wbuf);
+    while (wbuf->used > 1) {
+	if ((r = write(queueFds[0], wbuf->string, wbuf->used - 1)) > 0) {
+	    if (r == wbuf->used - 1)
+		BuildString((char *)0, wbuf);
+	    else
+		ShiftString(wbuf, r);
+	}
+	Drain();
+    }
+}
+
+static CONSFILE *queueFile;
+
+static void
+NewQueue(unsigned char *buf, int len)
+{
+    int off;
+
+    for (off = 0; off < len; off += BENCHREAD)
+	FileWrite(queueFile, FLAGTRUE, (char *)buf + off,
+		  (len - off < BENCHREAD) ? len - off : BENCHREAD);
+    while (!FileBufEmpty(queueFile)) {
+	FileWrite(queueFile, FLAGFALSE, (char *)0, 0);
+	Drain();
+    }
+}
+
+static void
+BenchQueue(void)
+{
+    unsigned char *buf;
+    int sz = BENCHREAD;
+
+    printf("queue: writes to a slow reader (FileWrite)\n");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, queueFds) < 0) {
+	Error("socketpair(): %s", strerror(errno));
+	exit(EX_OSERR);
+    }
+    setsockopt(queueFds[0], SOL_SOCKET, SO_SNDBUF, (char *)&sz,
+	       sizeof(sz));
+    setsockopt(queueFds[1], SOL_SOCKET, SO_RCVBUF, (char *)&sz,
+	       sizeof(sz));
+    if (!SetFlags(queueFds[0], O_NONBLOCK, 0) ||
+	!SetFlags(queueFds[1], O_NONBLOCK, 0))
+	exit(EX_OSERR);
+    buf = Alloc(BENCHSIZE);
+    Fill(buf, BENCHSIZE, 0);
+    queueFile = FileOpenFD(queueFds[0], simpleSocket);
+
+    Report("backlog", "1MB, 4KB reads", Rate(OldQueue, buf, BENCHSIZE),
+	   Rate(NewQueue, buf, BENCHSIZE));
+    FileClose(&queueFile);
+    close(queueFds[1]);
+    free(buf);
+}
+
+/* what a burst of `console' runs does to the master: connect, ask for
+ * the groups, and go, from a few processes at once while `idle'
+ * connections sit there
+ */
+#define MASTERPROCS	8
+
+static int
+MasterConnect(struct sockaddr_in *sin)
+{
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    if (connect(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/* read until the master says something ending in a newline */
+static int
+MasterReply(int fd)
+{
+    char buf[1024];
+    int r;
+
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+	if (buf[r - 1] == '\n')
+	    return 0;
+    return -1;
+}
+
+static void
+BenchMaster(char *host, char *port, int idle)
+{
+    struct sockaddr_in sin;
+    int i, p, fd, status, *idlefds, pfd[2];
+    long count, total = 0;
+    double start;
+    pid_t pid;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short)atoi(port));
+    if ((sin.sin_addr.s_addr = inet_addr(host)) == (in_addr_t) (-1)) {
+	Error("%s: not a numeric address", host);
+	exit(EX_USAGE);
+    }
+    if ((idlefds = (int *)calloc(idle + 1, sizeof(int))) == (int *)0)
+	OutOfMem();
+    for (i = 0; i < idle; i++) {
+	if ((idlefds[i] = MasterConnect(&sin)) < 0) {
+	    Error("idle connection #%d: %s", i, strerror(errno));
+	    exit(EX_UNAVAILABLE);
+	}
+    }
+    if (pipe(pfd) < 0) {
+	Error("pipe(): %s", strerror(errno));
+	exit(EX_OSERR);
+    }
+
+    for (p = 0; p < MASTERPROCS; p++) {
+	if ((pid = fork()) < 0) {
+	    Error("fork(): %s", strerror(errno));
+	    exit(EX_OSERR);
+	}
+	if (pid != 0)
+	    continue;
+	count = 0;
+	start = Now();
+	while (Now() - start < benchSecs) {
+	    if ((fd = MasterConnect(&sin)) < 0)
+		continue;
+	    if (MasterReply(fd) == 0 && write(fd, "groups\r\n", 8) == 8 &&
+		MasterReply(fd) == 0)
+		count++;
+	    close(fd);
+	}
+	_exit(write(pfd[1], &count, sizeof(count)) == sizeof(count) ?
+	      EX_OK : EX_IOERR);
+    }
+    for (p = 0; p < MASTERPROCS; p++) {
+	wait(&status);
+	if (read(pfd[0], &count, sizeof(count)) == sizeof(count))
+	    total += count;
+    }
+    for (i = 0; i < idle; i++)
+	close(idlefds[i]);
+    free(idlefds);
+    printf("master: %d idle connections: %.0f connections/sec\n", idle,
+	   total / benchSecs);
+}
+
+static void
+Usage(void)
+{
+    fprintf(stderr,
+	    "usage: %s [-s seconds] [iac|scan|queue|master host port [idle]]\n",
+	    progname);
+    exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+    char *what = (char *)0;
+
+    if ((progname = strrchr(argv[0], '/')) == (char *)0)
+	progname = argv[0];
+    else
+	progname++;
+    thepid = getpid();
+    SimpleSignal(SIGPIPE, SIG_IGN);
+
+    while ((i = getopt(argc, argv, "s:")) != -1) {
+	switch (i) {
+	    case 's':
+		if ((benchSecs = atof(optarg)) <= 0)
+		    Usage();
+		break;
+	    default:
+		Usage();
+	}
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc > 0)
+	what = argv[0];
+
+    if (what != (char *)0 && strcmp(what, "master") == 0) {
+	if (argc < 3)
+	    Usage();
+	BenchMaster(argv[1], argv[2], (argc > 3) ? atoi(argv[3]) : 0);
+	exit(EX_OK);
+    }
+    if (what == (char *)0 || strcmp(what, "iac") == 0)
+	BenchIAC();
+    if (what == (char *)0 || strcmp(what, "scan") == 0)
+	BenchScan();
+    if (what == (char *)0 || strcmp(what, "queue") == 0)
+	BenchQueue();
+    if (what != (char *)0 && strcmp(what, "iac") != 0 &&
+	strcmp(what, "scan") != 0 && strcmp(what, "queue") != 0)
+	Usage();
+    exit(failed ? EX_SOFTWARE : EX_OK);
+}
@@ -40,6 +40,8 @@
 #include <client.h>
 #include <group.h>
 #include <readcfg.h>
+#include <main.h>
+#include <resolve.h>
 
 #if USE_IPV6
 # include <sys/socket.h>
@@ -108,6 +110,488 @@ BumpClient(CONSENT *pCE, char *message)
  * so we don't drop chars...
  */
 #define REPLAYBUFFER 4096
+#define REPLAYINDEXBLOCK 512	/* index records read at a time */
+#define REPLAYSEGMENTS 64	/* most rolled logfiles a replay reads */
+
+/* open a logfile for reading (see FileFrames()).  a rolled one might
+ * have been through logcompress since, so path.gz will do too.  if it's
+ * there but compressed in a way we can't read, errno is EINVAL.
+ */
+static CONSFILE *
+ReplayOpen(char *path, FLAG rolled)
+{
+    static STRING *gz = (STRING *)0;
+    CONSFILE *fdLog;
+
+    if ((fdLog = FileOpen(path, O_RDONLY, 0644)) == (CONSFILE *)0) {
+	if (rolled != FLAGTRUE || errno != ENOENT)
+	    return fdLog;
+	if (gz == (STRING *)0)
+	    gz = AllocString();
+	BuildString((char *)0, gz);
+	BuildStringPrint(gz, "%s.gz", path);
+	if ((fdLog =
+	     FileOpen(gz->string, O_RDONLY, 0644)) == (CONSFILE *)0)
+	    return fdLog;
+	path = gz->string;
+    }
+    if (FileFrames(fdLog, path, FLAGFALSE) < 0) {
+	FileClose(&fdLog);
+	errno = EINVAL;
+    }
+    return fdLog;
+}
+
+/* open rolled logfile *seg (0 is the newest) of the console.  if it's
+ * gone (logfilekeep, logfileage, someone else) the catalog is out of
+ * date, so it's thrown away for the next replay to rebuild.  ones we
+ * can't read (compressed, with no zlib here) are skipped, telling
+ * fdOut, and *seg says which one was opened.
+ */
+static CONSFILE *
+ReplayOpenRolled(CONSENT *pCE, int *seg, char **path, CONSFILE *fdOut)
+{
+    LOGSEGS *segs;
+    CONSFILE *fdLog = (CONSFILE *)0;
+    int err, skipped = 0;
+
+    for (; *seg < REPLAYSEGMENTS; (*seg)++) {
+	if ((segs = LogSegments(pCE)) == (LOGSEGS *)0 || *seg >= segs->n)
+	    break;
+	if ((fdLog =
+	     ReplayOpen(segs->path[*seg], FLAGTRUE)) != (CONSFILE *)0) {
+	    *path = segs->path[*seg];
+	    break;
+	}
+	err = errno;
+	CONDDEBUG((1, "ReplayOpenRolled(): [%s] %s: %s", pCE->server,
+		   segs->path[*seg], strerror(err)));
+	if (err == ENOENT) {
+	    LogSegmentsDrop(pCE);
+	    break;
+	}
+	skipped = err;
+    }
+    if (skipped != 0)
+	FileWrite(fdOut, FLAGFALSE, (skipped == EINVAL) ?
+		  "[-- older log compressed; not readable --]\r\n" :
+		  "[-- older log not readable --]\r\n", -1);
+    return fdLog;
+}
+
+/* send bytes [from,to) of the logfile to fdOut */
+static int
+ReplayCopy(CONSFILE *fdLog, CONSFILE *fdOut, off_t from, off_t to,
+	   char *buf)
+{
+    int r;
+
+    if (from >= to)
+	return 0;
+    if (FileSeek(fdLog, from, SEEK_SET) < 0)
+	return -1;
+    while (from < to) {
+	r = (to - from > REPLAYBUFFER) ? REPLAYBUFFER : (int)(to - from);
+	if ((r = FileRead(fdLog, buf, r)) <= 0)
+	    return -1;
+	FileWrite(fdOut, FLAGFALSE, buf, r);
+	from += r;
+    }
+    return 0;
+}
+
+/* read the logfile line [from,to) into line */
+static int
+ReplayLine(CONSFILE *fdLog, off_t from, off_t to, STRING *line)
+{
+    char buf[REPLAYBUFFER];
+    int r;
+
+    BuildString((char *)0, line);
+    if (FileSeek(fdLog, from, SEEK_SET) < 0)
+	return -1;
+    while (from < to) {
+	r = (to - from > sizeof(buf)) ? sizeof(buf) : (int)(to - from);
+	if ((r = FileRead(fdLog, buf, r)) <= 0)
+	    return -1;
+	BuildStringN(buf, r, line);
+	from += r;
+    }
+    return 0;
+}
+
+/* output a run of MARK lines as one, the way Replay() always has:
+ * the first one, or "[-- MARK -- first .. last -- MARK --]"
+ */
+static void
+ReplayMarks(CONSFILE *fdOut, STRING *first, STRING *last)
+{
+    char *s;
+
+    if (last->used <= 1) {
+	FileWrite(fdOut, FLAGFALSE, first->string, first->used - 1);
+	return;
+    }
+    if ((s = strrchr(first->string, ']')) != (char *)0)
+	*s = '\000';
+    FileWrite(fdOut, FLAGTRUE, first->string, -1);
+    FileWrite(fdOut, FLAGTRUE, " .. ", 4);
+    if ((s = strrchr(last->string, ']')) != (char *)0)
+	*s = '\000';
+    FileWrite(fdOut, FLAGTRUE, last->string + sizeof("[-- MARK -- ") - 1,
+	      -1);
+    FileWrite(fdOut, FLAGFALSE, " -- MARK --]\r\n", -1);
+}
+
+/* Replay() with the help of the line index of the logfile at path
+ * (see FileIndexLines()), which says where the last 'back' lines start
+ * and which of them are MARKs without us reading the logfile
+ * backwards.  if the logfile doesn't have that many lines, the rest
+ * come from the end of rolled logfile seg (and so on back), which are
+ * sent first.  returns -1 if the index can't answer (it doesn't reach
+ * back far enough, or doesn't match the logfile) before anything
+ * has been sent, so the caller can fall back to the slow way.
+ */
+static int
+ReplayIndexed(CONSENT *pCE, char *path, CONSFILE *fdLog, off_t size,
+	      CONSFILE *fdOut, unsigned short back, char *buf, int seg)
+{
+    static STRING *ipath = (STRING *)0;
+    static STRING *first = (STRING *)0;
+    static STRING *last = (STRING *)0;
+    unsigned char *recs = (unsigned char *)0;
+    off_t *starts = (off_t *)0;	/* line starts, newest first */
+    char *marks = (char *)0;	/* and whether they're MARKs */
+    int nstarts = 0, astarts = 0;
+    CONSFILE *fdIdx = (CONSFILE *)0;
+    CONSFILE *fdSeg;
+    struct stat stIdx, stSeg;
+    off_t nrec, p, e, start = -1, from;
+    int flags, pmark = 0, was_mark = 0, ln = 0;
+    int i, j, n, retval = -1;
+    char c;
+
+    if (back == 0)
+	return -1;
+    if (ipath == (STRING *)0) {
+	ipath = AllocString();
+	first = AllocString();
+	last = AllocString();
+    }
+    BuildString((char *)0, ipath);
+    BuildStringPrint(ipath, "%s%s", path, LINEINDEXSUFFIX);
+    if ((fdIdx = FileOpen(ipath->string, O_RDONLY, 0644)) == (CONSFILE *)0)
+	return -1;
+    if (FileStat(fdIdx, &stIdx) != 0)
+	goto done;
+    nrec = stIdx.st_size / LINEINDEXREC;
+    if ((recs = malloc(REPLAYINDEXBLOCK * LINEINDEXREC)) == 0)
+	OutOfMem();
+
+    /* walk the index backwards counting lines the same way the
+     * byte-at-a-time code below does
+     */
+    p = size;
+    while (start < 0 && nrec > 0) {
+	n = (nrec > REPLAYINDEXBLOCK) ? REPLAYINDEXBLOCK : (int)nrec;
+	nrec -= n;
+	if (FileSeek(fdIdx, nrec * LINEINDEXREC, SEEK_SET) < 0 ||
+	    FileRead(fdIdx, recs, n * LINEINDEXREC) != n * LINEINDEXREC)
+	    goto done;
+	for (i = n - 1; i >= 0 && start < 0; i--) {
+	    e = LineIndexGet(recs + i * LINEINDEXREC, &flags);
+	    if (flags & LINEINDEXBASE) {
+		/* the index only goes back to the top of the file
+		 * if it was started on an empty one
+		 */
+		if (nrec + i != 0 || e != 0)
+		    goto done;
+	    } else if (e >= p) {
+		/* newlines not in the logfile yet (still queued), and
+		 * the one at the very end, don't start a line
+		 */
+		if (nstarts != 0)
+		    goto done;
+		if (e == p)
+		    pmark = flags & LINEINDEXMARK;
+		continue;
+	    }
+	    if (p - e >= MAXREPLAYLINELEN) {
+		start = p - MAXREPLAYLINELEN + 1;
+		break;
+	    }
+	    if (flags & LINEINDEXBASE) {
+		start = 0;
+		if (p == 0)
+		    break;
+	    }
+	    if (nstarts == astarts) {
+		astarts = astarts ? astarts * 2 : 64;
+		if ((starts = realloc(starts, astarts * sizeof(off_t))) ==
+		    (off_t *)0 ||
+		    (marks = realloc(marks, astarts)) == (char *)0)
+		    OutOfMem();
+	    }
+	    starts[nstarts] = (start == 0) ? 0 : e;
+	    marks[nstarts++] = pmark ? 1 : 0;
+	    if (start == 0)
+		break;
+	    if (pmark && was_mark)
+		ln--;
+	    was_mark = pmark;
+	    if (++ln >= back) {
+		start = e;
+		break;
+	    }
+	    p = e;
+	    pmark = flags & LINEINDEXMARK;
+	}
+    }
+    if (start < 0)
+	goto done;
+    FileClose(&fdIdx);
+
+    /* the oldest and newest line starts should follow a newline, else
+     * the index and the logfile have parted ways (truncated under us?).
+     * oldest first, so a gzipped one is read front to back.
+     */
+    for (i = nstarts - 1; i >= 0; i = (i > 0) ? 0 : -1) {
+	if (starts[i] == 0)
+	    continue;
+	if (FileSeek(fdLog, starts[i] - 1, SEEK_SET) < 0 ||
+	    FileRead(fdLog, &c, 1) != 1 || c != '\n')
+	    goto done;
+    }
+
+    /* ran out of logfile?  the line at the top wasn't counted */
+    if (start == 0 && size != 0)
+	ln++;
+    if (start == 0 && ln < back &&
+	(fdSeg =
+	 ReplayOpenRolled(pCE, &seg, &path, fdOut)) != (CONSFILE *)0) {
+	if (FileStat(fdSeg, &stSeg) == 0)
+	    ReplayIndexed(pCE, path, fdSeg, stSeg.st_size, fdOut,
+			  back - ln, buf, seg + 1);
+	FileClose(&fdSeg);
+    }
+
+    /* now send it on, oldest first, folding runs of MARKs together */
+    from = start;
+    for (i = nstarts - 1; i >= 0; i--) {
+	if (!marks[i])
+	    continue;
+	if (ReplayCopy(fdLog, fdOut, from, starts[i], buf) < 0)
+	    goto done;
+	for (j = i; j > 0 && marks[j - 1]; j--);
+	if (ReplayLine(fdLog, starts[i], (i > 0 ? starts[i - 1] : size),
+		       first) < 0)
+	    goto done;
+	BuildString((char *)0, last);
+	if (j != i &&
+	    ReplayLine(fdLog, starts[j], (j > 0 ? starts[j - 1] : size),
+		       last) < 0)
+	    goto done;
+	ReplayMarks(fdOut, first, last);
+	from = (j > 0) ? starts[j - 1] : size;
+	i = j;
+    }
+    if (ReplayCopy(fdLog, fdOut, from, size, buf) < 0)
+	goto done;
+    retval = 0;
+
+  done:
+    if (recs != (unsigned char *)0)
+	free(recs);
+    if (starts != (off_t *)0)
+	free(starts);
+    if (marks != (char *)0)
+	free(marks);
+    FileClose(&fdIdx);
+    return retval;
+}
+
+/* byte p of the scrollback, counting from the oldest (at base) */
+#define SBBYTE(sb, base, p) ((sb)->buf[((base) + (p)) % (sb)->size])
+
+/* send bytes [from,to) of the scrollback to fdOut */
+static void
+ScrollbackCopy(SCROLLBACK *sb, int base, CONSFILE *fdOut, int from,
+	       int to)
+{
+    int a, n;
+
+    while (from < to) {
+	a = (base + from) % sb->size;
+	n = sb->size - a;
+	if (n > to - from)
+	    n = to - from;
+	FileWrite(fdOut, FLAGFALSE, sb->buf + a, n);
+	from += n;
+    }
+}
+
+/* copy the scrollback line [from,to) into line */
+static void
+ScrollbackLine(SCROLLBACK *sb, int base, int from, int to, STRING *line)
+{
+    BuildString((char *)0, line);
+    for (; from < to; from++)
+	BuildStringChar(SBBYTE(sb, base, from), line);
+}
+
+/* where the last newline at or before b (and not before lo) is in
+ * the scrollback, or -1 if there isn't one.  it looks a block at a
+ * time, forwards with memchr(), since that's much quicker than going
+ * back a byte at a time.
+ */
+#define SCROLLBACKBLOCK 1024
+
+static int
+ScrollbackPrevNL(SCROLLBACK *sb, int base, int b, int lo)
+{
+    char *s, *e, *nl;
+    int a, n;
+
+    while (b >= lo) {
+	/* the block ending at b, within [lo,b] and contiguous */
+	a = (base + b) % sb->size;
+	n = (a + 1 < b - lo + 1) ? a + 1 : b - lo + 1;
+	if (n > SCROLLBACKBLOCK)
+	    n = SCROLLBACKBLOCK;
+	e = sb->buf + a + 1;
+	for (s = e - n, nl = (char *)0;
+	     (s = memchr(s, '\n', e - s)) != (char *)0; s++)
+	    nl = s;
+	if (nl != (char *)0)
+	    return b - (int)(e - 1 - nl);
+	b -= n;
+    }
+    return -1;
+}
+
+/* is the scrollback line [from,to) a MARK? */
+static int
+ScrollbackIsMark(SCROLLBACK *sb, int base, int from, int to,
+		 STRING *line)
+{
+    char dummy[4];
+    int j;
+
+    if (to - from > 64 || SBBYTE(sb, base, from) != '[')
+	return 0;
+    ScrollbackLine(sb, base, from, to, line);
+    return sscanf(line->string + 1,
+		  "-- MARK -- %3c %3c %d %d:%d:%d %d]\r\n",
+		  dummy, dummy, &j, &j, &j, &j, &j) == 7;
+}
+
+/* Replay() from the console's scrollback (see ScrollbackInit()),
+ * which holds the tail of what went to the logfile.  returns -1,
+ * having sent nothing, if there isn't one or it doesn't go back far
+ * enough (unless partial is set, when what it has will do).
+ */
+static int
+ReplayScrollback(CONSENT *pCE, CONSFILE *fdOut, unsigned short back,
+		 FLAG partial)
+{
+    static STRING *first = (STRING *)0;
+    static STRING *last = (STRING *)0;
+    SCROLLBACK *sb = pCE->sb;
+    int *starts = (int *)0;	/* line starts, newest first */
+    char *marks = (char *)0;	/* and whether they're MARKs */
+    int nstarts = 0, astarts = 0;
+    int base, p, b, e, lo, start, from;
+    int is_mark, was_mark = 0, ln = 0;
+    int i, j;
+
+    if (sb == (SCROLLBACK *)0 || back == 0)
+	return -1;
+    if (first == (STRING *)0) {
+	first = AllocString();
+	last = AllocString();
+    }
+    base = (sb->head - sb->used + sb->size) % sb->size;
+
+    /* count lines back from the end like the logfile code does */
+    p = sb->used;
+    b = p - 1;
+    if (b >= 0 && SBBYTE(sb, base, b) == '\n')
+	b--;
+    for (;;) {
+	lo = p - MAXREPLAYLINELEN;
+	if ((b = ScrollbackPrevNL(sb, base, b, lo < 0 ? 0 : lo)) < 0 &&
+	    lo >= 0) {
+	    start = lo + 1;
+	    break;
+	}
+	e = b + 1;
+	if (b < 0 && (sb->wrapped == FLAGTRUE || e == p)) {
+	    /* ran out of scrollback (the oldest line is only part of
+	     * one if it's wrapped).  the logfile might go back further
+	     */
+	    if (partial != FLAGTRUE)
+		goto fallback;
+	    start = p;
+	    break;
+	}
+	is_mark = ScrollbackIsMark(sb, base, e, p, first);
+	if (nstarts == astarts) {
+	    astarts = astarts ? astarts * 2 : 64;
+	    if ((starts = realloc(starts, astarts * sizeof(int))) ==
+		(int *)0 || (marks = realloc(marks, astarts)) == (char *)0)
+		OutOfMem();
+	}
+	starts[nstarts] = e;
+	marks[nstarts++] = is_mark;
+	if (is_mark && was_mark)
+	    ln--;
+	was_mark = is_mark;
+	if (++ln >= back) {
+	    start = e;
+	    break;
+	}
+	if (b < 0) {
+	    if (partial != FLAGTRUE)
+		goto fallback;
+	    start = 0;
+	    break;
+	}
+	p = e;
+	b--;
+    }
+
+    /* send it on, oldest first, folding runs of MARKs together */
+    from = start;
+    for (i = nstarts - 1; i >= 0; i--) {
+	if (!marks[i])
+	    continue;
+	ScrollbackCopy(sb, base, fdOut, from, starts[i]);
+	for (j = i; j > 0 && marks[j - 1]; j--);
+	ScrollbackLine(sb, base, starts[i],
+		       (i > 0 ? starts[i - 1] : sb->used), first);
+	BuildString((char *)0, last);
+	if (j != i)
+	    ScrollbackLine(sb, base, starts[j],
+			   (j > 0 ? starts[j - 1] : sb->used), last);
+	ReplayMarks(fdOut, first, last);
+	from = (j > 0) ? starts[j - 1] : sb->used;
+	i = j;
+    }
+    ScrollbackCopy(sb, base, fdOut, from, sb->used);
+
+    if (starts != (int *)0)
+	free(starts);
+    if (marks != (char *)0)
+	free(marks);
+    return 0;
+
+  fallback:
+    if (starts != (int *)0)
+	free(starts);
+    if (marks != (char *)0)
+	free(marks);
+    return -1;
+}
 
 void
 Replay(CONSENT *pCE, CONSFILE *fdOut, unsigned short back)
@@ -126,10 +610,21 @@ Replay(CONSENT *pCE, CONSFILE *fdOut, unsigned short back)
     unsigned long dmallocMarkReplay = 0;
 #endif
 
+    if (pCE != (CONSENT *)0 &&
+	ReplayScrollback(pCE, fdOut, back,
+			 (pCE->logfile == (char *)0) ? FLAGTRUE : FLAGFALSE)
+	== 0)
+	return;
+
+    /* the logfile needs to be caught up before we read it */
+    LogFlush(pCE);
     if (pCE != (CONSENT *)0 && pCE->logfile != (char *)0)
-	fdLog = FileOpen(pCE->logfile, O_RDONLY, 0644);
+	fdLog = ReplayOpen(pCE->logfile, FLAGFALSE);
 
     if (fdLog == (CONSFILE *)0) {
+	if (pCE != (CONSENT *)0 &&
+	    ReplayScrollback(pCE, fdOut, back, FLAGTRUE) == 0)
+	    return;
 	FileWrite(fdOut, FLAGFALSE, "[no log file on this console]\r\n",
 		  -1);
 	return;
@@ -148,6 +643,11 @@ Replay(CONSENT *pCE, CONSFILE *fdOut, unsigned short back)
 
     if ((char *)0 == (buf = malloc(REPLAYBUFFER)))
 	OutOfMem();
+    if (ReplayIndexed
+	(pCE, pCE->logfile, fdLog, stLog.st_size, fdOut, back, buf,
+	 0) == 0)
+	goto common_exit;
+
     bp = buf + 1;		/* just give it something - it resets below */
 
     line = AllocString();
@@ -355,6 +855,338 @@ Replay(CONSENT *pCE, CONSFILE *fdOut, unsigned short back)
 }
 
 
+/* turn what the user typed for a "replay since" into a time:
+ *   hh:mm[:ss]                 the last time it was that (local) time
+ *   yyyy-mm-dd [hh:mm[:ss]]    a (local) date and time
+ *   -n[s|m|h|d]                that long ago (minutes by default)
+ *   @n                         seconds since the epoch
+ * returns -1 if it makes no sense.
+ */
+int
+ParseSince(char *str, time_t now, time_t *when)
+{
+    struct tm tm;
+    struct tm *ptm;
+    long n;
+    int i, y, mo, d, h = 0, mi = 0, sec = 0;
+    int dated = 0;
+    char unit = 'm', junk;
+
+    while (isspace((int)*str))
+	str++;
+
+    if (*str == '@') {
+	if (sscanf(str + 1, "%ld%c", &n, &junk) != 1 || n < 0)
+	    return -1;
+	*when = (time_t)n;
+	return 0;
+    }
+
+    if (*str == '-') {
+	if ((i = sscanf(str + 1, "%ld%c%c", &n, &unit, &junk)) < 1 ||
+	    i > 2 || n < 0)
+	    return -1;
+	switch (unit) {
+	    case 's':
+		break;
+	    case 'm':
+		n *= 60;
+		break;
+	    case 'h':
+		n *= 60 * 60;
+		break;
+	    case 'd':
+		n *= 24 * 60 * 60;
+		break;
+	    default:
+		return -1;
+	}
+	*when = now - n;
+	return 0;
+    }
+
+    if ((ptm = localtime(&now)) == (struct tm *)0)
+	return -1;
+    tm = *ptm;
+    if (sscanf(str, "%d-%d-%d", &y, &mo, &d) == 3) {
+	tm.tm_year = y - 1900;
+	tm.tm_mon = mo - 1;
+	tm.tm_mday = d;
+	dated = 1;
+	if ((str = strchr(str, ' ')) == (char *)0)
+	    str = "0:0";
+    }
+    if (sscanf(str, "%d:%d", &h, &mi) != 2)
+	return -1;
+    sscanf(str, "%d:%d:%d", &h, &mi, &sec);
+    if (h < 0 || h > 23 || mi < 0 || mi > 59 || sec < 0 || sec > 60)
+	return -1;
+    tm.tm_hour = h;
+    tm.tm_min = mi;
+    tm.tm_sec = sec;
+    tm.tm_isdst = -1;
+    if ((*when = mktime(&tm)) == (time_t)-1)
+	return -1;
+
+    /* just a time means the last time it was that time */
+    if (!dated && *when > now) {
+	tm.tm_mday--;
+	tm.tm_isdst = -1;
+	*when = mktime(&tm);
+    }
+    return 0;
+}
+
+/* look when up in the time index of the logfile at path (open on
+ * fdLog, size bytes long; see FileIndexTime()).  *off gets where the
+ * last record at or before it points, or -1 if when is before the
+ * first record, whose time and offset go in *tfirst and *first.
+ * returns 0 if all is well, -1 if there's no time index, and -2 if it
+ * doesn't match the logfile.
+ */
+static int
+ReplaySinceFind(char *path, CONSFILE *fdLog, off_t size, time_t when,
+		off_t *off, time_t *tfirst, off_t *first)
+{
+    static STRING *tpath = (STRING *)0;
+    CONSFILE *fdIdx = (CONSFILE *)0;
+    unsigned char rec[TIMEINDEXREC];
+    struct stat stIdx;
+    off_t lo, hi, mid, at;
+    time_t t;
+    int retval = -2;
+    char c;
+
+    if (tpath == (STRING *)0)
+	tpath = AllocString();
+    BuildString((char *)0, tpath);
+    BuildStringPrint(tpath, "%s%s", path, TIMEINDEXSUFFIX);
+
+    if ((fdIdx = FileOpen(tpath->string, O_RDONLY, 0644)) == (CONSFILE *)0
+	|| FileStat(fdIdx, &stIdx) != 0 || stIdx.st_size < TIMEINDEXREC) {
+	retval = -1;
+	goto common_exit;
+    }
+
+    /* find the last record at or before when */
+    *off = -1;
+    lo = 0;
+    hi = stIdx.st_size / TIMEINDEXREC - 1;
+    while (lo <= hi) {
+	mid = lo + (hi - lo) / 2;
+	if (FileSeek(fdIdx, mid * TIMEINDEXREC, SEEK_SET) < 0 ||
+	    FileRead(fdIdx, rec, TIMEINDEXREC) != TIMEINDEXREC)
+	    goto common_exit;
+	t = (time_t)LineIndexGet(rec, (int *)0);
+	if (t <= when) {
+	    *off = LineIndexGet(rec + LINEINDEXREC, (int *)0);
+	    lo = mid + 1;
+	} else
+	    hi = mid - 1;
+    }
+    if (FileSeek(fdIdx, 0, SEEK_SET) < 0 ||
+	FileRead(fdIdx, rec, TIMEINDEXREC) != TIMEINDEXREC)
+	goto common_exit;
+    *tfirst = (time_t)LineIndexGet(rec, (int *)0);
+    *first = LineIndexGet(rec + LINEINDEXREC, (int *)0);
+
+    /* it should be at the start of a line in the logfile */
+    at = (*off < 0) ? *first : *off;
+    if (at > size ||
+	(at > 0 && (FileSeek(fdLog, at - 1, SEEK_SET) < 0 ||
+		    FileRead(fdLog, &c, 1) != 1 || c != '\n')))
+	goto common_exit;
+    retval = 0;
+
+  common_exit:
+    if (fdIdx != (CONSFILE *)0)
+	FileClose(&fdIdx);
+    return retval;
+}
+
+/* where the first line at or after at starts in the logfile at path
+ * (open on fdLog, size bytes long).  the line index says, if it goes
+ * back that far and agrees with the logfile, else it's the byte after
+ * the next newline.  returns size if there's no line start after at.
+ */
+static off_t
+ReplayLineStart(char *path, CONSFILE *fdLog, off_t at, off_t size)
+{
+    static STRING *ipath = (STRING *)0;
+    CONSFILE *fdIdx;
+    unsigned char rec[LINEINDEXREC];
+    struct stat stIdx;
+    off_t lo, hi, mid, e, found = -1;
+    char buf[REPLAYBUFFER];
+    char *nl;
+    int r;
+
+    if (at <= 0 || at >= size)
+	return (at <= 0) ? 0 : size;
+
+    if (ipath == (STRING *)0)
+	ipath = AllocString();
+    BuildString((char *)0, ipath);
+    BuildStringPrint(ipath, "%s%s", path, LINEINDEXSUFFIX);
+    if ((fdIdx = FileOpen(ipath->string, O_RDONLY, 0644)) != (CONSFILE *)0) {
+	/* the first record at or after at, as long as one before it
+	 * shows the index covers at
+	 */
+	if (FileStat(fdIdx, &stIdx) == 0) {
+	    lo = 0;
+	    hi = stIdx.st_size / LINEINDEXREC - 1;
+	    while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (FileSeek(fdIdx, mid * LINEINDEXREC, SEEK_SET) < 0 ||
+		    FileRead(fdIdx, rec, LINEINDEXREC) != LINEINDEXREC) {
+		    found = -1;
+		    break;
+		}
+		if ((e = LineIndexGet(rec, (int *)0)) >= at) {
+		    found = (mid > 0) ? e : -1;
+		    hi = mid - 1;
+		} else
+		    lo = mid + 1;
+	    }
+	}
+	FileClose(&fdIdx);
+	if (found >= 0 && found <= size &&
+	    FileSeek(fdLog, found - 1, SEEK_SET) >= 0 &&
+	    FileRead(fdLog, buf, 1) == 1 && buf[0] == '\n')
+	    return found;
+    }
+
+    /* no help there, so look for the newline */
+    if (FileSeek(fdLog, --at, SEEK_SET) < 0)
+	return size;
+    while (at < size) {
+	r = (size - at > sizeof(buf)) ? sizeof(buf) : (int)(size - at);
+	if ((r = FileRead(fdLog, buf, r)) <= 0)
+	    return size;
+	if ((nl = memchr(buf, '\n', r)) != (char *)0)
+	    return at + (nl - buf) + 1;
+	at += r;
+    }
+    return size;
+}
+
+/* send everything logged since when, using the logfile's time index
+ * (see FileIndexTime()) to find where to start, so the logfile is
+ * read from there on and nothing before it is looked at.  if it's
+ * older than the logfile, the rolled logfiles (see LogSegments()) are
+ * looked up the same way, newest first, until one goes back far
+ * enough.  a logfile with nothing in its time index yet is all later
+ * than when.
+ */
+void
+ReplaySince(CONSENT *pCE, CONSFILE *fdOut, time_t when)
+{
+    CONSFILE *fdLog = (CONSFILE *)0;
+    CONSFILE *fds[REPLAYSEGMENTS + 1];
+    char *paths[REPLAYSEGMENTS + 1];
+    off_t from[REPLAYSEGMENTS + 1], size[REPLAYSEGMENTS + 1];
+    off_t off, first, noff, nfirst, total, skip;
+    time_t tfirst, ntfirst;
+    struct stat st;
+    char buf[REPLAYBUFFER];
+    char *path;
+    int n, i, r, seg;
+
+    if (pCE != (CONSENT *)0 && pCE->logfile != (char *)0) {
+	LogFlush(pCE);
+	fdLog = ReplayOpen(pCE->logfile, FLAGFALSE);
+    }
+    if (fdLog == (CONSFILE *)0 || FileStat(fdLog, &st) != 0) {
+	FileClose(&fdLog);
+	FileWrite(fdOut, FLAGFALSE, "[no log file on this console]\r\n",
+		  -1);
+	return;
+    }
+
+    /* fds[0] is the logfile, fds[1] on back are the rolled ones that
+     * are needed
+     */
+    fds[0] = fdLog;
+    paths[0] = pCE->logfile;
+    n = 1;
+    if ((r = ReplaySinceFind(pCE->logfile, fdLog, st.st_size, when, &off,
+			     &tfirst, &first)) == -1) {
+	/* nothing's been indexed since the logfile was started (just
+	 * rolled, or the index was removed), so all of it is later
+	 */
+	off = -1;
+	tfirst = 0;
+	first = 0;
+    } else if (r != 0)
+	goto botch;
+    size[0] = st.st_size;
+    from[0] = off;
+    for (seg = 0; off < 0 && n <= REPLAYSEGMENTS; seg++) {
+	/* it's older than that, so see if a rolled one goes back
+	 * further (and if so, all of this one is wanted)
+	 */
+	if ((fds[n] =
+	     ReplayOpenRolled(pCE, &seg, &path, fdOut)) == (CONSFILE *)0)
+	    break;
+	if (FileStat(fds[n], &st) != 0 ||
+	    ReplaySinceFind(path, fds[n], st.st_size, when, &noff,
+			    &ntfirst, &nfirst) != 0) {
+	    FileClose(&fds[n]);
+	    break;
+	}
+	from[n - 1] = 0;
+	size[n] = st.st_size;
+	if ((paths[n] = StrDup(path)) == (char *)0)
+	    OutOfMem();
+	from[n++] = off = noff;
+	tfirst = ntfirst;
+	first = nfirst;
+    }
+    if (off < 0) {
+	/* it's before anything we know about, so start at the top of
+	 * the oldest index and say so
+	 */
+	from[n - 1] = first;
+	if (first > 0 && tfirst != 0)
+	    FilePrint(fdOut, FLAGFALSE,
+		      "[-- nothing indexed before %.24s --]\r\n",
+		      ctime(&tfirst));
+    }
+
+    for (total = 0, i = 0; i < n; i++)
+	total += size[i] - from[i];
+    if (total > MAXREPLAYSINCE) {
+	for (skip = total - MAXREPLAYSINCE, i = n - 1; skip > 0; i--) {
+	    if (size[i] - from[i] <= skip) {
+		skip -= size[i] - from[i];
+		from[i] = size[i];
+	    } else {
+		/* and not in the middle of a line */
+		from[i] = ReplayLineStart(paths[i], fds[i], from[i] + skip,
+					  size[i]);
+		skip = 0;
+	    }
+	}
+	FilePrint(fdOut, FLAGFALSE,
+		  "[-- only the last %d bytes follow --]\r\n",
+		  MAXREPLAYSINCE);
+    }
+    for (i = n - 1; i >= 0; i--)
+	ReplayCopy(fds[i], fdOut, from[i], size[i], buf);
+    goto common_exit;
+
+  botch:
+    FileWrite(fdOut, FLAGFALSE,
+	      "[time index doesn't match the log file]\r\n", -1);
+
+  common_exit:
+    for (i = 0; i < n; i++) {
+	FileClose(&fds[i]);
+	if (i > 0)
+	    free(paths[i]);
+    }
+}
+
 /* these bit tell us which parts of the Truth to tell the client	(ksb)
  */
 #define WHEN_SPY	0x01
@@ -393,6 +1225,7 @@ static HELP aHLTable[] = {
     {WHEN_ALWAYS, "r       replay the last %hu lines"},
     {WHEN_ALWAYS, "R       set number of replay lines"},
     {WHEN_ATTACH, "s       spy mode (read only)"},
+    {WHEN_ALWAYS, "t       replay since a time"},
     {WHEN_ALWAYS, "u       show host status"},
     {WHEN_ALWAYS, "v       show version info"},
     {WHEN_ALWAYS, "w       who is on this console"},
@@ -484,10 +1317,16 @@ HelpUser(CONSCLIENT *pCL)
     FileWrite(pCL->fd, FLAGFALSE, (char *)0, 0);
 }
 
+/* check the new client against the access list (and fill in
+ * peername).  returns 1 if it's let in, 0 if not (after telling it
+ * so), and -1 if we have to wait on the resolver to know - call it
+ * again after ResolveReady().
+ */
 int
 ClientAccessOk(CONSCLIENT *pCL)
 {
     char *peername = (char *)0;
+    char **names;
     int retval = 1;
 
 #if USE_IPV6 || !USE_UNIX_DOMAIN_SOCKETS
@@ -535,7 +1374,8 @@ ClientAccessOk(CONSCLIENT *pCL)
 	FileWrite(pCL->fd, FLAGFALSE, "access from your host refused\r\n",
 		  -1);
 	retval = 0;
-    }
+    } else if (pCL->caccess == '?')
+	retval = -1;
   setpeer:
 #else
     struct in_addr addr;
@@ -550,7 +1390,8 @@ ClientAccessOk(CONSCLIENT *pCL)
 	FileWrite(pCL->fd, FLAGFALSE, "access from your host refused\r\n",
 		  -1);
 	retval = 0;
-    }
+    } else if (pCL->caccess == '?')
+	retval = -1;
 #endif
 
     if (pCL->peername != (STRING *)0) {
@@ -583,7 +1424,54 @@ ClientAccessOk(CONSCLIENT *pCL)
 	    BuildString("<unknown>", pCL->peername);
 #endif
     }
+    /* until the resolver has a name, the address will do */
+    pCL->fpeerwait = (retval != 0 && peername == (char *)0 &&
+		      config->loghostnames == FLAGTRUE &&
+		      ResolveName(pCL->peername->string,
+				  &names) == RESOLVE_PENDING);
     if (peername != (char *)0)
 	free(peername);
     return retval;
 }
+
+/* if pCL was waiting on the resolver for its name and the name is in,
+ * use it instead of the address (in acid, too)
+ */
+void
+ClientPeerName(CONSCLIENT *pCL)
+{
+    static STRING *acid = (STRING *)0;
+    char **names;
+    int len, alen;
+
+    if (!pCL->fpeerwait)
+	return;
+    switch (ResolveName(pCL->peername->string, &names)) {
+	case RESOLVE_PENDING:
+	    return;
+	case RESOLVE_OK:
+	    if (names[0] == (char *)0)
+		break;
+	    CONDDEBUG((1, "ClientPeerName(): %s is %s",
+		       pCL->peername->string, names[0]));
+	    len = strlen(pCL->peername->string);
+	    /* the master's clients don't have an acid yet */
+	    alen = (pCL->acid->string ==
+		    (char *)0) ? 0 : strlen(pCL->acid->string);
+	    if (alen >= len &&
+		strcmp(pCL->acid->string + alen - len,
+		       pCL->peername->string) == 0) {
+		if (acid == (STRING *)0)
+		    acid = AllocString();
+		BuildString((char *)0, acid);
+		BuildStringN(pCL->acid->string, alen - len, acid);
+		BuildString(names[0], acid);
+		BuildString((char *)0, pCL->acid);
+		BuildString(acid->string, pCL->acid);
+	    }
+	    BuildString((char *)0, pCL->peername);
+	    BuildString(names[0], pCL->peername);
+	    break;
+    }
+    pCL->fpeerwait = 0;
+}
@@ -49,6 +49,7 @@ typedef enum clientState {
     S_CEXEC,			/* client execing a program                */
     S_REPLAY,			/* set replay length for 'r'               */
     S_PLAYBACK,			/* set replay length for 'p'               */
+    S_SINCE,			/* get the time to replay from for 't'     */
     S_NOTE,			/* send a note to the logfile              */
     S_TASK,			/* invoke a task on the server side        */
     S_CONFIRM			/* confirm input                           */
@@ -62,6 +63,8 @@ typedef struct client {		/* Connection Information:              */
     short fro;			/* read-only permission                 */
     short fecho;		/* echo commands (not set by machines)  */
     short fiwait;		/* client wanting for console init      */
+    short fpending;		/* on the pCLpend list                  */
+    short fpeerwait;		/* peername waits on the resolver       */
     STRING *acid;		/* login and location of client         */
     STRING *peername;		/* location of client                   */
     STRING *username;		/* login of client                      */
@@ -75,8 +78,9 @@ typedef struct client {		/* Connection Information:              */
      *pCLscan,			/* next client fd to scan after select  */
 	/* scan lists link ALL clients together */
     **ppCLbnext,		/* back link for next ptr               */
-     *pCLnext;			/* next person on this list             */
+     *pCLnext,			/* next person on this list             */
     /* next lists link clients on a console */
+     *pCLpend;			/* next client with I/O to do           */
     char ic[2];			/* two character escape sequence        */
     unsigned short replay;	/* lines to replay for 'r'              */
     unsigned short playback;	/* lines to replay for 'p'              */
@@ -92,7 +96,10 @@ typedef struct client {		/* Connection Information:              */
 } CONSCLIENT;
 
 extern void Replay(CONSENT *, CONSFILE *, unsigned short);
+extern int ParseSince(char *, time_t, time_t *);
+extern void ReplaySince(CONSENT *, CONSFILE *, time_t);
 extern void HelpUser(CONSCLIENT *);
 extern void FindWrite(CONSENT *);
 extern int ClientAccessOk(CONSCLIENT *);
+extern void ClientPeerName(CONSCLIENT *);
 extern void BumpClient(CONSENT *, char *);
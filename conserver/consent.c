@@ -47,6 +47,7 @@
 #include <access.h>
 #include <readcfg.h>
 #include <main.h>
+#include <resolve.h>
 
 
 BAUD baud[] = {
@@ -308,10 +309,6 @@ StopInit(CONSENT *pCE)
     }
 
     if (pCE->initfile != (CONSFILE *)0) {
-	int initfile = FileFDNum(pCE->initfile);
-	FD_CLR(initfile, &rinit);
-	initfile = FileFDOutNum(pCE->initfile);
-	FD_CLR(initfile, &winit);
 	FileClose(&pCE->initfile);
 	pCE->initfile = (CONSFILE *)0;
     }
@@ -364,7 +361,6 @@ IpmiSOLCreate(CONSENT *pCE)
 void
 StartInit(CONSENT *pCE)
 {
-    int i;
     pid_t iNewGrp;
     extern char **environ;
     int pin[2];
@@ -424,9 +420,8 @@ StartInit(CONSENT *pCE)
 	    Msg("[%s] initcmd started: pid %lu", pCE->server,
 		(unsigned long)pCE->initpid);
 	    TagLogfileAct(pCE, "initcmd started");
-	    FD_SET(pin[0], &rinit);
-	    if (maxfd < pin[0] + 1)
-		maxfd = pin[0] + 1;
+	    FileSetOwner(pCE->initfile, FDOWNER_CONSOLE, pCE);
+	    FDWatch(pin[0], FDWATCH_READ);
 	    fflush(stderr);
 	    return;
     }
@@ -454,11 +449,7 @@ StartInit(CONSENT *pCE)
 
     /* setup new process with clean file descriptors
      */
-    i = GetMaxFiles();
-    for ( /* i above */ ; --i > 2;) {
-	if (i != pout[0] && i != pin[1])
-	    close(i);
-    }
+    CloseFiles(pout[0], pin[1]);
     /* leave 2 until we have to close it */
     close(1);
     close(0);
@@ -551,7 +542,6 @@ SetupTty(CONSENT *pCE, int fd)
 static int
 VirtDev(CONSENT *pCE)
 {
-    int i;
     pid_t iNewGrp;
     extern char **environ;
     char *pcShell, **ppcArgv;
@@ -592,11 +582,7 @@ VirtDev(CONSENT *pCE)
 
     /* setup new process with clean filew descriptors
      */
-    i = GetMaxFiles();
-    for ( /* i above */ ; --i > 2;) {
-	if (i != pCE->execSlaveFD)
-	    close(i);
-    }
+    CloseFiles(pCE->execSlaveFD, -1);
     /* leave 2 until we *have to close it*
      */
     close(1);
@@ -667,7 +653,7 @@ char *
 ConsState(CONSENT *pCE)
 {
     if (!pCE->fup)
-	return "down";
+	return (pCE->ioState == INRESOLVE) ? "resolving" : "down";
 
     if (pCE->initfile != (CONSFILE *)0)
 	return "initializing";
@@ -677,6 +663,8 @@ ConsState(CONSENT *pCE)
 	    return "up";
 	case INCONNECT:
 	    return "connecting";
+	case INRESOLVE:
+	    return "resolving";
 	case ISDISCONNECTED:
 	    return "disconnected";
 #if HAVE_OPENSSL
@@ -701,6 +689,7 @@ ConsState(CONSENT *pCE)
 void
 ConsDown(CONSENT *pCE, FLAG downHard, FLAG force)
 {
+    LogFlush(pCE);
     if (force != FLAGTRUE &&
 	!(FileBufEmpty(pCE->fdlog) && FileBufEmpty(pCE->cofile) &&
 	  FileBufEmpty(pCE->initfile))) {
@@ -709,18 +698,20 @@ ConsDown(CONSENT *pCE, FLAG downHard, FLAG force)
     }
 
     StopInit(pCE);
+    ConsTimerClear(pCE, CT_STATE);
+    ConsTimerClear(pCE, CT_IDLE);
+    ConsTimerClear(pCE, CT_BREAK);
+    ConsTimerClear(pCE, CT_REUP);
+    ReUpRelease(pCE);
     if (pCE->ipid != 0) {
 	CONDDEBUG((1, "ConsDown(): sending pid %lu signal %d",
 		   (unsigned long)pCE->ipid, SIGHUP));
 	kill(pCE->ipid, SIGHUP);
 	pCE->ipid = 0;
     }
-    if (pCE->cofile != (CONSFILE *)0) {
-	int cofile = FileFDNum(pCE->cofile);
-	FD_CLR(cofile, &rinit);
-	FD_CLR(cofile, &winit);
+    if (pCE->cofile != (CONSFILE *)0)
 	FileClose(&pCE->cofile);
-    }
+    pCE->fstalled = 0;
 #if HAVE_FREEIPMI
     /* need to do this after cofile close above as
      * ipmiconsole_ctx_destroy will close the fd */
@@ -734,7 +725,11 @@ ConsDown(CONSENT *pCE, FLAG downHard, FLAG force)
 	    TagLogfile(pCE, "Console logging restored");
 	}
 	TagLogfile(pCE, "Console down");
-	FD_CLR(FileFDNum(pCE->fdlog), &winit);
+	/* don't leave a logsync hanging */
+	if (pCE->ctslot[CT_LOGSYNC] != 0) {
+	    ConsTimerClear(pCE, CT_LOGSYNC);
+	    FileSync(pCE->fdlog);
+	}
 	FileClose(&pCE->fdlog);
     }
     if (pCE->type == EXEC && pCE->execSlaveFD != 0) {
@@ -758,17 +753,19 @@ ConsDown(CONSENT *pCE, FLAG downHard, FLAG force)
 void
 ConsInit(CONSENT *pCE)
 {
-    time_t tyme;
     extern int FallBack(char **, int *);
     int cofile = -1;
     int ret;
+    char **addrs = (char **)0;
 #if HAVE_GETTIMEOFDAY
     struct timeval tv;
 #else
     time_t tv;
 #endif
 
-    if (pCE->spintimer > 0 && pCE->spinmax > 0) {
+    /* coming back from the resolver (below) doesn't count twice */
+    if (pCE->spintimer > 0 && pCE->spinmax > 0 &&
+	pCE->ioState != INRESOLVE) {
 #if HAVE_GETTIMEOFDAY
 	if (gettimeofday(&tv, (void *)0) == 0) {
 	    /* less than pCE->spintimer seconds gone by? */
@@ -804,6 +801,18 @@ ConsInit(CONSENT *pCE)
 	usleep(250000);		/* pause 0.25 sec to let things settle a bit */
     }
 
+    /* a host console needs an address before anything else, and the
+     * rest of the group shouldn't wait on dns while it gets one - the
+     * group comes back here once the resolver has it (ConsResolved())
+     */
+    if (pCE->type == HOST &&
+	ResolveHost(pCE->host, &addrs, pCE) == RESOLVE_PENDING) {
+	CONDDEBUG((1, "[%s] ConsInit(): waiting on the resolver for %s",
+		   pCE->server, pCE->host));
+	pCE->ioState = INRESOLVE;
+	return;
+    }
+
     pCE->autoReUp = 0;
     pCE->fronly = 0;
     pCE->nolog = 0;
@@ -813,15 +822,14 @@ ConsInit(CONSENT *pCE)
     /* try to open them again
      */
     if (pCE->logfile != (char *)0) {
-	if ((CONSFILE *)0 ==
-	    (pCE->fdlog =
-	     FileOpen(pCE->logfile, O_RDWR | O_CREAT | O_APPEND, 0644))) {
+	if ((CONSFILE *)0 == (pCE->fdlog = LogOpen(pCE))) {
 	    Error("[%s] FileOpen(%s): %s: forcing down", pCE->server,
 		  pCE->logfile, strerror(errno));
 	    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
 	    return;
 	}
     }
+    ScrollbackInit(pCE);
 
     TagLogfile(pCE, "Console up");
 
@@ -855,18 +863,24 @@ ConsInit(CONSENT *pCE)
 	case HOST:
 	    {
 #if USE_IPV6
-		int error;
-		char host[NI_MAXHOST];
+		int a;
 		char serv[NI_MAXSERV];
-		struct addrinfo *ai, *rp, hints;
+		struct addrinfo *ai, hints;
 #else
 		struct sockaddr_in port;
-		struct hostent *hp;
 #endif /* USE_IPV6 */
 #if HAVE_SETSOCKOPT
 		int one = 1;
 #endif
 
+		/* the addresses came from the resolver up top */
+		if (addrs[0] == (char *)0) {
+		    Error("[%s] no address for %s: forcing down",
+			  pCE->server, pCE->host);
+		    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
+		    return;
+		}
+
 		usleep(100000);	/* Not all terminal servers can keep up */
 
 #if USE_IPV6
@@ -876,33 +890,20 @@ ConsInit(CONSENT *pCE)
 		bzero(&hints, sizeof(hints));
 # endif
 
-		hints.ai_flags = AI_ADDRCONFIG;
+		hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
 		hints.ai_socktype = SOCK_STREAM;
 		snprintf(serv, sizeof(serv), "%hu", pCE->netport);
 
-		error = getaddrinfo(pCE->host, serv, &hints, &ai);
-		if (error) {
-		    Error("[%s] getaddrinfo(%s): %s: forcing down",
-			  pCE->server, pCE->host, gai_strerror(error));
-		    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
-		    return;
-		}
-
-		rp = ai;
-		while (rp) {
-		    error =
-			getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-				    sizeof(host), serv, sizeof(serv),
-				    NI_NUMERICHOST | NI_NUMERICSERV);
-		    if (error)
+		for (a = 0; addrs[a] != (char *)0; a++) {
+		    if (getaddrinfo(addrs[a], serv, &hints, &ai) != 0)
 			continue;
 		    CONDDEBUG((1,
 			       "[%s]: trying hostname=%s, ip=%s, port=%s",
-			       pCE->server, pCE->host, host, serv));
+			       pCE->server, pCE->host, addrs[a], serv));
 
 		    cofile =
-			socket(rp->ai_family, rp->ai_socktype,
-			       rp->ai_protocol);
+			socket(ai->ai_family, ai->ai_socktype,
+			       ai->ai_protocol);
 		    if (cofile != -1) {
 # if HAVE_SETSOCKOPT
 			if (setsockopt
@@ -913,17 +914,18 @@ ConsInit(CONSENT *pCE)
 			if (!SetFlags(cofile, O_NONBLOCK, 0))
 			    goto fail;
 			if ((ret =
-			     connect(cofile, rp->ai_addr,
-				     rp->ai_addrlen)) == 0)
+			     connect(cofile, ai->ai_addr,
+				     ai->ai_addrlen)) == 0 ||
+			    errno == EINPROGRESS)
 			    goto success;
 		      fail:
 			close(cofile);
 		    }
-		    rp = rp->ai_next;
+		    freeaddrinfo(ai);
 		}
 
 		Error("[%s]: Unable to connect to %s:%s", pCE->server,
-		      host, serv);
+		      pCE->host, serv);
 		ConsDown(pCE, FLAGTRUE, FLAGTRUE);
 		return;
 	      success:
@@ -935,20 +937,12 @@ ConsInit(CONSENT *pCE)
 		bzero((char *)&port, sizeof(port));
 # endif
 
-		if ((hp = gethostbyname(pCE->host)) == NULL) {
-		    Error("[%s] gethostbyname(%s): %s: forcing down",
-			  pCE->server, pCE->host, hstrerror(h_errno));
-		    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
-		    return;
-		}
-# if HAVE_MEMCPY
-		memcpy(&port.sin_addr.s_addr, hp->h_addr_list[0],
-		       hp->h_length);
+# if HAVE_INET_ATON
+		inet_aton(addrs[0], &port.sin_addr);
 # else
-		bcopy(hp->h_addr_list[0], &port.sin_addr.s_addr,
-		      hp->h_length);
+		port.sin_addr.s_addr = inet_addr(addrs[0]);
 # endif
-		port.sin_family = hp->h_addrtype;
+		port.sin_family = AF_INET;
 		port.sin_port = htons(pCE->netport);
 
 		if ((cofile = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -1002,13 +996,10 @@ ConsInit(CONSENT *pCE)
 	    }
 	    if (ret == 0) {
 		pCE->ioState = ISNORMAL;
-		pCE->stateTimer = 0;
+		ConsTimerClear(pCE, CT_STATE);
 	    } else {
 		pCE->ioState = INCONNECT;
-		pCE->stateTimer = time((time_t *)0) + CONNECTTIMEOUT;
-		if (timers[T_STATE] == (time_t)0 ||
-		    timers[T_STATE] > pCE->stateTimer)
-		    timers[T_STATE] = pCE->stateTimer;
+		ConsTimerSet(pCE, CT_STATE, CONNECTTIMEOUT * 1000L);
 	    }
 	    pCE->fup = 1;
 	    break;
@@ -1073,13 +1064,10 @@ ConsInit(CONSENT *pCE)
 	    }
 	    if (ret == 0) {
 		pCE->ioState = ISNORMAL;
-		pCE->stateTimer = 0;
+		ConsTimerClear(pCE, CT_STATE);
 	    } else {
 		pCE->ioState = INCONNECT;
-		pCE->stateTimer = time((time_t *)0) + CONNECTTIMEOUT;
-		if (timers[T_STATE] == (time_t)0 ||
-		    timers[T_STATE] > pCE->stateTimer)
-		    timers[T_STATE] = pCE->stateTimer;
+		ConsTimerSet(pCE, CT_STATE, CONNECTTIMEOUT * 1000L);
 	    }
 	    pCE->fup = 1;
 	    break;
@@ -1141,14 +1129,11 @@ ConsInit(CONSENT *pCE)
 		char b[1];
 		FileRead(pCE->cofile, b, 1);	/* trust it's NULL */
 		pCE->ioState = ISNORMAL;
-		pCE->stateTimer = 0;
+		ConsTimerClear(pCE, CT_STATE);
 	    } else {
 		/* Error status cases will be handled in Kiddie() */
 		pCE->ioState = INCONNECT;
-		pCE->stateTimer = time((time_t *)0) + CONNECTTIMEOUT;
-		if (timers[T_STATE] == (time_t)0 ||
-		    timers[T_STATE] > pCE->stateTimer)
-		    timers[T_STATE] = pCE->stateTimer;
+		ConsTimerSet(pCE, CT_STATE, CONNECTTIMEOUT * 1000L);
 	    }
 	    pCE->fup = 1;
 	    break;
@@ -1189,6 +1174,7 @@ ConsInit(CONSENT *pCE)
     }
 
     if (cofile != -1) {
+	FileSetOwner(pCE->cofile, FDOWNER_CONSOLE, pCE);
 	/* if we're waiting for connect() to finish, watch the
 	 * write bit, otherwise watch for the read bit
 	 */
@@ -1198,33 +1184,16 @@ ConsInit(CONSENT *pCE)
 	    && pCE->type != IPMI
 #endif
 	    )
-	    FD_SET(cofile, &winit);
+	    FDWatch(cofile, FDWATCH_WRITE);
 	else
-	    FD_SET(cofile, &rinit);
-	if (maxfd < cofile + 1)
-	    maxfd = cofile + 1;
+	    FDWatch(cofile, FDWATCH_READ);
     }
 
-    tyme = time((time_t *)0);
-
-    if (pCE->ioState == ISNORMAL) {
-	pCE->lastWrite = tyme;
-	if (pCE->idletimeout != (time_t)0 &&
-	    (timers[T_CIDLE] == (time_t)0 ||
-	     timers[T_CIDLE] > pCE->lastWrite + pCE->idletimeout))
-	    timers[T_CIDLE] = pCE->lastWrite + pCE->idletimeout;
-    }
+    if (pCE->ioState == ISNORMAL)
+	ConsIdleReset(pCE);
 
     /* If we have marks, adjust the next one so that it's in the future */
-    if (pCE->nextMark > 0) {
-	if (tyme >= pCE->nextMark) {
-	    /* Add as many pCE->mark values as necessary so that we move
-	     * beyond the current time.
-	     */
-	    pCE->nextMark +=
-		(((tyme - pCE->nextMark) / pCE->mark) + 1) * pCE->mark;
-	}
-    }
+    ConsMarkReset(pCE);
 
     if (pCE->downHard == FLAGTRUE) {
 	if (pCE->ioState == ISNORMAL) {
@@ -1245,6 +1214,68 @@ ConsInit(CONSENT *pCE)
 	StartInit(pCE);
 }
 
+/* take over a console that's already up.  an older conserver had it
+ * (see GroupUpgrade()) and has filled in the runtime bits that go with
+ * cofile, the descriptor (or -1 for a noop console).  this is the tail
+ * end of ConsInit(), without the connecting or the initcmd.
+ */
+void
+ConsAdopt(CONSENT *pCE, int cofile)
+{
+#if HAVE_GETTIMEOFDAY
+    struct timeval tv;
+#else
+    time_t tv;
+#endif
+
+    pCE->autoReUp = 0;
+    pCE->iend = 0;
+    pCE->fup = 1;
+    pCE->ioState = ISNORMAL;
+
+    if (cofile != -1) {
+	if ((pCE->cofile =
+	     FileOpenFD(cofile,
+			(pCE->type == HOST || pCE->type == UDS) ?
+			simpleSocket : simpleFile)) == (CONSFILE *)0) {
+	    Error("[%s] FileOpenFD(%d) failed: forcing down", pCE->server,
+		  cofile);
+	    close(cofile);
+	    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
+	    return;
+	}
+	FileSetOwner(pCE->cofile, FDOWNER_CONSOLE, pCE);
+	FDWatch(cofile, FDWATCH_READ);
+    }
+
+    if (pCE->logfile != (char *)0) {
+	if ((CONSFILE *)0 == (pCE->fdlog = LogOpen(pCE))) {
+	    Error("[%s] FileOpen(%s): %s: forcing down", pCE->server,
+		  pCE->logfile, strerror(errno));
+	    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
+	    return;
+	}
+    }
+    ScrollbackInit(pCE);
+    /* what the old one had in memory is gone, so replays have to go
+     * to the logfile for anything older than what comes in now
+     */
+    if (pCE->sb != (SCROLLBACK *)0)
+	pCE->sb->wrapped = FLAGTRUE;
+
+    Verbose("[%s] carried over by upgrade", pCE->server);
+
+    ConsIdleReset(pCE);
+    ConsMarkReset(pCE);
+#if HAVE_GETTIMEOFDAY
+    if (gettimeofday(&tv, (void *)0) == 0)
+	pCE->lastInit = tv;
+#else
+    if ((tv = time((time_t *)0)) != (time_t)-1)
+	pCE->lastInit = tv;
+#endif
+}
+
 int
 AddrsMatch(char *addr1, char *addr2)
 {
@@ -1436,11 +1467,8 @@ AddrsMatch(char *addr1, char *addr2)
 #endif /* USE_IPV6 */
 }
 
-/* thread ther list of uniq console server machines, aliases for	(ksb)
- * machines will screw us up
- */
-REMOTE *
-FindUniq(REMOTE *pRCAll)
+static REMOTE *
+FindUniqSeen(REMOTE *pRCAll, NAMEMAP *seen)
 {
     REMOTE *pRC;
 
@@ -1450,7 +1478,14 @@ FindUniq(REMOTE *pRCAll)
     if (pRCAll == (REMOTE *)0)
 	return (REMOTE *)0;
 
-    pRCAll->pRCuniq = FindUniq(pRCAll->pRCnext);
+    pRCAll->pRCuniq = FindUniqSeen(pRCAll->pRCnext, seen);
+
+    /* a host name we've already been through got the same answer
+     * then, so skip the address lookups
+     */
+    if (NameMapFind(seen, pRCAll->rhost) != (void *)0)
+	return pRCAll->pRCuniq;
+    NameMapAdd(seen, pRCAll->rhost, pRCAll);
 
     /* if it is in the returned list of uniq hosts, return that list
      * else add us by returning our node
@@ -1462,6 +1497,20 @@ FindUniq(REMOTE *pRCAll)
     return pRCAll;
 }
 
+/* thread ther list of uniq console server machines, aliases for	(ksb)
+ * machines will screw us up
+ */
+REMOTE *
+FindUniq(REMOTE *pRCAll)
+{
+    NAMEMAP *seen = NameMapNew();
+    REMOTE *pRC;
+
+    pRC = FindUniqSeen(pRCAll, seen);
+    NameMapDestroy(&seen);
+    return pRC;
+}
+
 void
 DestroyRemoteConsole(REMOTE *pRCList)
 {
@@ -61,6 +61,43 @@ typedef enum consType {
 #endif
 } CONSTYPE;
 
+/* what to do with a client whose output queue passes outputlimit
+ */
+typedef enum outPolicy {
+    UNKNOWNPOLICY = 0,
+    OPDROP,			/* skip the oldest data, leave a note   */
+    OPDISCONNECT,		/* kick the client off                  */
+    OPBLOCK			/* stop reading the console             */
+} OUTPOLICY;
+
+/* how a new logfile is written (see FileFrames())
+ */
+typedef enum logFormat {
+    UNKNOWNFORMAT = 0,
+    LFPLAIN,			/* just the console output              */
+    LFFRAMED			/* compressed frames                    */
+} LOGFORMAT;
+
+/* the tail of what's been logged for a console, kept in memory
+ * (see the scrollback option) so replays can skip the logfile
+ */
+typedef struct scrollback {
+    char *buf;			/* ring of logged bytes                 */
+    int size;			/* how many buf holds                   */
+    int head;			/* where the next byte goes             */
+    int used;			/* how many are in there                */
+    FLAG wrapped;		/* older bytes have been overwritten    */
+} SCROLLBACK;
+
+/* the logfiles RollLog() has rolled for a console, as found on disk
+ * (see LogSegments()).  the names are the ones RollLog() gave them,
+ * before logcompress had a go.
+ */
+typedef struct logSegments {
+    char **path;		/* newest first                         */
+    int n;			/* how many                             */
+} LOGSEGS;
+
 #if HAVE_FREEIPMI
 # define IPMIL_UNKNOWN  (0)
 # define IPMIL_USER     (IPMICONSOLE_PRIVILEGE_USER+1)
@@ -68,6 +105,18 @@ typedef enum consType {
 # define IPMIL_ADMIN    (IPMICONSOLE_PRIVILEGE_ADMIN+1)
 #endif
 
+/* per-console timers, kept in the group's timer heap
+ */
+#define CT_STATE	0	/* ioState timeout (connect())          */
+#define CT_IDLE		1	/* idletimeout                          */
+#define CT_MARK		2	/* next logfile mark                    */
+#define CT_BREAK	3	/* end of a \d delay in wbuf            */
+#define CT_LOGFLUSH	4	/* oldest buffered log data is due      */
+#define CT_LOGSYNC	5	/* time to fdatasync() the logfile      */
+#define CT_LOGROLL	6	/* logfile is past logfilemax           */
+#define CT_REUP		7	/* next automatic reinit is due         */
+#define CT_MAX		8	/* CT_MAX *must* be last */
+
 typedef struct names {
     char *name;
     struct names *next;
@@ -131,18 +180,29 @@ typedef struct consent {	/* console information                  */
     unsigned short breakNum;	/* break type [1-35]                    */
     char *logfile;		/* logfile                              */
     off_t logfilemax;		/* size limit for rolling logfile       */
+    char *logcompress;		/* command run on a rolled logfile      */
+    int logfilekeep;		/* rolled logfiles to keep (0 == all)   */
+    long logfileage;		/* oldest rolled logfile to keep (s)    */
     char *initcmd;		/* initcmd command                      */
     char *initsubst;		/* initcmd substitution pattern         */
     uid_t inituid;		/* user to run initcmd as               */
     gid_t initgid;		/* group to run initcmd as              */
     char *motd;			/* motd                                 */
-    time_t idletimeout;		/* idle timeout                         */
+    long idletimeout;		/* idle timeout (ms)                    */
     char *idlestring;		/* string to print when idle            */
     unsigned short spinmax;	/* initialization spin maximum          */
     unsigned short spintimer;	/* initialization spin timer            */
     char *replstring;		/* generic string for replacements      */
     char *tasklist;		/* list of valid tasks                  */
     char *breaklist;		/* list of valid break sequences        */
+    int outputlimit;		/* max bytes queued for a client        */
+    OUTPOLICY outputpolicy;	/* and what to do when it's reached     */
+    int scrollback;		/* bytes of log to keep in memory       */
+    int logbuffer;		/* log bytes to collect (<0 == none)    */
+    long logflush;		/* longest log data waits (ms)          */
+    int loglines;		/* or lines to collect (0 == no limit)  */
+    long logsync;		/* time between fdatasync()s (ms)       */
+    LOGFORMAT logformat;	/* format of new logfiles               */
     /* timestamp stuff */
     int mark;			/* Mark (chime) interval                */
     long nextMark;		/* Next mark (chime) time               */
@@ -156,6 +216,7 @@ typedef struct consent {	/* console information                  */
     FLAG autoreinit;		/* auto-reinitialize if failed          */
     FLAG unloved;		/* copy "unloved" data to stdout        */
     FLAG login;			/* allow logins to the console          */
+    FLAG logindex;		/* keep a line index with the logfile   */
 
     /*** runtime settings ***/
     CONSFILE *fdlog;		/* the local log file                   */
@@ -167,11 +228,18 @@ typedef struct consent {	/* console information                  */
     CONSFILE *initfile;		/* the command run on init              */
     pid_t taskpid;		/* pid of task running                  */
     CONSFILE *taskfile;		/* the output from the task (read-only) */
+    SCROLLBACK *sb;		/* in-memory tail of the log            */
+    int logpending;		/* lines sitting in the log buffer      */
+    off_t logsize;		/* bytes written to the logfile         */
+    time_t logrolled;		/* time the logfile was last rolled     */
+    FLAG logbol;		/* the logfile so far ends in a newline */
+    FLAG logrollwait;		/* roll once the current line is done   */
+    LOGSEGS *segs;		/* the rolled logfiles, once looked for */
     STRING *wbuf;		/* write() buffer                       */
     int wbufIAC;		/* next IAC location in wbuf            */
     IOSTATE ioState;		/* state of the socket                  */
-    time_t stateTimer;		/* timer for ioState states             */
-    time_t lastWrite;		/* time of last data sent to console    */
+    struct timeval lastWrite;	/* time of last data sent to console    */
+    int ctslot[CT_MAX];		/* timer heap slot (+1) of each timer   */
 #if HAVE_GETTIMEOFDAY
     struct timeval lastInit;	/* time of last initialization          */
 #else
@@ -186,10 +254,17 @@ typedef struct consent {	/* console information                  */
     FLAG sentDoEcho;		/* have we sent telnet DO ECHO cmd?     */
     FLAG sentDoSGA;		/* have we sent telnet DO SGA cmd?      */
     unsigned short autoReUp;	/* is it coming back up automatically?  */
+    unsigned int reupTries;	/* automatic reinits in a row           */
+    struct reupHost *reupHost;	/* connect slot held for the scheduler  */
     FLAG downHard;		/* did it go down unexpectedly?         */
     unsigned short nolog;	/* don't log output                     */
     unsigned short fup;		/* we setup this line?                  */
     unsigned short fronly;	/* we can only read this console        */
+    unsigned short fpending;	/* on the pCEpend list                  */
+    unsigned short fstalled;	/* not reading, a client is backed up   */
+    unsigned long outskipped;	/* bytes skipped for slow clients       */
+    unsigned long outdisconnects;	/* slow clients disconnected            */
+    unsigned long outstalls;	/* times a slow client stalled us       */
 
     /*** list management ***/
     struct client *pCLon;	/* clients on this console              */
@@ -197,6 +272,7 @@ typedef struct consent {	/* console information                  */
     CONSENTUSERS *rw;		/* rw users                             */
     CONSENTUSERS *ro;		/* ro users                             */
     struct consent *pCEnext;	/* next console entry                   */
+    struct consent *pCEpend;	/* next console with I/O to do          */
 } CONSENT;
 
 typedef struct remote {		/* console at another host              */
@@ -210,6 +286,7 @@ typedef struct remote {		/* console at another host              */
 extern PARITY *FindParity(char *);
 extern BAUD *FindBaud(char *);
 extern void ConsInit(CONSENT *);
+extern void ConsAdopt(CONSENT *, int);
 extern void ConsDown(CONSENT *, FLAG, FLAG);
 extern REMOTE *FindUniq(REMOTE *);
 extern void DestroyRemoteConsole(REMOTE *);
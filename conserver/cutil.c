@@ -10,6 +10,7 @@
 #include <version.h>
 
 #include <net/if.h>
+#include <dirent.h>
 #if USE_IPV6
 # include <ifaddrs.h>
 #endif
@@ -19,6 +20,14 @@
 #if HAVE_OPENSSL
 # include <openssl/ssl.h>
 #endif
+#if HAVE_ZLIB
+# include <zlib.h>
+#endif
+#if defined(__GNUC__) && defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 
 int fVerbose = 0, fErrorPrinted = 0;
@@ -32,9 +41,6 @@ int stringCount = 0;		/* count of allStrings list */
 struct in_addr *myAddrs = (struct in_addr *)0;
 #endif
 char myHostname[MAXHOSTNAME];	/* staff.cc.purdue.edu                  */
-fd_set rinit;
-fd_set winit;
-int maxfd = 0;
 int debugLineNo = 0;
 char *debugFileName = (char *)0;
 int isMaster = 1;
@@ -583,7 +589,8 @@ GetMaxFiles(void)
 #  endif /* HAVE_GETDTABLESIZE */
 # endif	/* HAVE_GETRLIMIT */
 #endif /* HAVE_SYSCONF */
-#ifdef FD_SETSIZE
+#if defined(FD_SETSIZE) && !HAVE_SYS_EPOLL_H
+    /* select() can't go past FD_SETSIZE */
     if (FD_SETSIZE <= mf) {
 	mf = (FD_SETSIZE - 1);
     }
@@ -592,227 +599,1767 @@ GetMaxFiles(void)
     return mf;
 }
 
-/* Routines for the generic I/O stuff for conserver.  This will handle
- * all open(), close(), read(), and write() calls.
+/* the highest descriptor that might be open.  with epoll,
+ * GetMaxFiles() is the whole rlimit (maybe a million or more), which is
+ * a lot of close()s to do before every exec, so /proc/self/fd is used
+ * to find the real one where there is one.
  */
+static int
+HighestFile(void)
+{
+    DIR *d;
+    struct dirent *de;
+    int fd, hi = -1;
+
+    if ((d = opendir("/proc/self/fd")) == (DIR *)0)
+	return GetMaxFiles() - 1;
+    while ((de = readdir(d)) != (struct dirent *)0) {
+	if (de->d_name[0] < '0' || de->d_name[0] > '9')
+	    continue;
+	if ((fd = atoi(de->d_name)) > hi)
+	    hi = fd;
+    }
+    closedir(d);
+    return hi;
+}
 
-/* This encapsulates a regular file descriptor in a CONSFILE
- * object.  Returns a CONSFILE pointer to that object.
+/* close every descriptor above 2 but keep1 and keep2 (-1 for none), as
+ * a child does before an exec
  */
-CONSFILE *
-FileOpenFD(int fd, enum consFileType type)
+void
+CloseFiles(int keep1, int keep2)
 {
-    CONSFILE *cfp;
+    int i, hi, top;
 
-    if ((cfp = (CONSFILE *)calloc(1, sizeof(CONSFILE)))
-	== (CONSFILE *)0)
-	OutOfMem();
-    cfp->ftype = type;
-    cfp->fd = fd;
-    cfp->wbuf = AllocString();
-#if HAVE_OPENSSL
-    cfp->ssl = (SSL *)0;
-    cfp->waitForRead = cfp->waitForWrite = FLAGFALSE;
+    top = (keep1 > keep2) ? keep1 : keep2;
+#if HAVE_CLOSEFROM
+    /* closefrom() does the rest */
+    hi = top;
+#else
+    hi = HighestFile();
 #endif
-#if DEBUG_CONSFILE_IO
-    {
-	char buf[1024];
-	sprintf(buf, "CONSFILE-%s-%lu-%d.w", progname,
-		(unsigned long)thepid, fd);
-	if ((cfp->debugwfd =
-	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
-	    sprintf(buf, "[---- STARTED - %s ----]\n",
-		    StrTime((time_t *)0));
-	    write(cfp->debugwfd, buf, strlen(buf));
-	}
-	sprintf(buf, "CONSFILE-%s-%lu-%d.r", progname,
-		(unsigned long)thepid, fd);
-	if ((cfp->debugrfd =
-	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
-	    sprintf(buf, "[---- STARTED - %s ----]\n",
-		    StrTime((time_t *)0));
-	    write(cfp->debugrfd, buf, strlen(buf));
-	}
-    }
+    for (i = 3; i <= hi; i++)
+	if (i != keep1 && i != keep2)
+	    close(i);
+#if HAVE_CLOSEFROM
+    closefrom((top < 3) ? 3 : top + 1);
 #endif
+}
 
-    CONDDEBUG((2, "FileOpenFD(): encapsulated fd %d type %d", fd, type));
-    return cfp;
+/* set close-on-exec on every descriptor above 2 */
+void
+CloseFilesOnExec(void)
+{
+    int i;
+
+    for (i = HighestFile(); i > 2; i--)
+	fcntl(i, F_SETFD, FD_CLOEXEC);
 }
 
-/* This encapsulates a pipe pair in a CONSFILE
- * object.  Returns a CONSFILE pointer to that object.
+/* Routines to keep track of which file descriptors we're interested in
+ * and which ones are ready for I/O.  These used to be a pair of fd_sets
+ * (rinit and winit) that every loop copied and handed to select(), and
+ * then every console and client was checked against the results.  That
+ * capped us at FD_SETSIZE descriptors and made each pass through the
+ * loop cost as much as the whole group.  Now the watch list lives here
+ * and is backed by epoll where we have it (select() otherwise), the fds
+ * that came back ready are kept in a list, and each CONSFILE can carry
+ * an owner so the loops can go straight from a ready fd to the console
+ * or client behind it.
  */
-CONSFILE *
-FileOpenPipe(int fd, int fdout)
+static unsigned char *fdWatch = (unsigned char *)0;	/* FDWATCH_* wanted */
+static unsigned char *fdReady = (unsigned char *)0;	/* FDWATCH_* ready */
+static unsigned char *fdPosted = (unsigned char *)0;	/* FDWATCH_* posted */
+static CONSFILE **fdFile = (CONSFILE **)0;	/* fd -> CONSFILE map */
+static int fdSlots = 0;		/* size of the arrays above */
+static int *readyList = (int *)0;	/* fds set in fdReady */
+static int readyCount = 0;
+static int *postList = (int *)0;	/* fds set in fdPosted */
+static int postCount = 0;
+#if HAVE_SYS_EPOLL_H
+# define FDEP_NONE	0	/* not in the epoll set */
+# define FDEP_ADDED	1	/* in the epoll set */
+# define FDEP_ALWAYS	2	/* can't be polled (regular file) */
+static unsigned char *fdEpoll = (unsigned char *)0;	/* FDEP_* */
+static int fdAlwaysCount = 0;	/* number of FDEP_ALWAYS fds */
+static int epfd = -1;
+static pid_t eppid = 0;
+static struct epoll_event *epEvents = (struct epoll_event *)0;
+#else
+static fd_set rinit;
+static fd_set winit;
+static int maxfd = 0;
+#endif
+
+static void
+FDGrow(int fd)
 {
-    CONSFILE *cfp;
+    int n;
 
-    if ((cfp = (CONSFILE *)calloc(1, sizeof(CONSFILE)))
-	== (CONSFILE *)0)
+    if (fd < fdSlots)
+	return;
+    for (n = (fdSlots == 0 ? 64 : fdSlots); n <= fd; n *= 2);
+    if ((fdWatch =
+	 (unsigned char *)realloc(fdWatch, n * sizeof(*fdWatch))) == 0 ||
+	(fdReady =
+	 (unsigned char *)realloc(fdReady, n * sizeof(*fdReady))) == 0 ||
+	(fdPosted =
+	 (unsigned char *)realloc(fdPosted, n * sizeof(*fdPosted))) == 0 ||
+	(fdFile =
+	 (CONSFILE **)realloc(fdFile, n * sizeof(*fdFile))) == 0 ||
+	(readyList = (int *)realloc(readyList, n * sizeof(*readyList))) == 0
+	|| (postList = (int *)realloc(postList, n * sizeof(*postList))) == 0)
 	OutOfMem();
-    cfp->ftype = simplePipe;
-    cfp->fd = fd;
-    cfp->fdout = fdout;
-    cfp->wbuf = AllocString();
-#if HAVE_OPENSSL
-    cfp->ssl = (SSL *)0;
-    cfp->waitForRead = cfp->waitForWrite = FLAGFALSE;
+#if HAVE_SYS_EPOLL_H
+    if ((fdEpoll =
+	 (unsigned char *)realloc(fdEpoll, n * sizeof(*fdEpoll))) == 0 ||
+	(epEvents =
+	 (struct epoll_event *)realloc(epEvents,
+				       n * sizeof(*epEvents))) == 0)
+	OutOfMem();
+    memset(fdEpoll + fdSlots, 0, (n - fdSlots) * sizeof(*fdEpoll));
 #endif
-#if DEBUG_CONSFILE_IO
-    {
-	char buf[1024];
-	sprintf(buf, "CONSFILE-%s-%lu-%d.w", progname,
-		(unsigned long)thepid, fdout);
-	if ((cfp->debugwfd =
-	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
-	    sprintf(buf, "[---- STARTED - %s ----]\n",
-		    StrTime((time_t *)0));
-	    write(cfp->debugwfd, buf, strlen(buf));
-	}
-	sprintf(buf, "CONSFILE-%s-%lu-%d.r", progname,
-		(unsigned long)thepid, fd);
-	if ((cfp->debugrfd =
-	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
-	    sprintf(buf, "[---- STARTED - %s ----]\n",
-		    StrTime((time_t *)0));
-	    write(cfp->debugrfd, buf, strlen(buf));
+    memset(fdWatch + fdSlots, 0, (n - fdSlots) * sizeof(*fdWatch));
+    memset(fdReady + fdSlots, 0, (n - fdSlots) * sizeof(*fdReady));
+    memset(fdPosted + fdSlots, 0, (n - fdSlots) * sizeof(*fdPosted));
+    memset(fdFile + fdSlots, 0, (n - fdSlots) * sizeof(*fdFile));
+    fdSlots = n;
+}
+
+#if HAVE_SYS_EPOLL_H
+/* push the interest for fd out to the kernel.  regular files can't be
+ * handed to epoll (EPERM), so those are marked as always ready, which
+ * is what select() would have told us anyway.
+ */
+static void
+FDEpollSync(int fd)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (fdWatch[fd] == 0) {
+	if (fdEpoll[fd] == FDEP_ADDED)
+	    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+	else if (fdEpoll[fd] == FDEP_ALWAYS)
+	    fdAlwaysCount--;
+	fdEpoll[fd] = FDEP_NONE;
+	return;
+    }
+    if (fdEpoll[fd] == FDEP_ALWAYS)
+	return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (fdWatch[fd] & FDWATCH_READ)
+	ev.events |= EPOLLIN;
+    if (fdWatch[fd] & FDWATCH_WRITE)
+	ev.events |= EPOLLOUT;
+    op = (fdEpoll[fd] == FDEP_ADDED) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epfd, op, fd, &ev) == 0) {
+	fdEpoll[fd] = FDEP_ADDED;
+	return;
+    }
+    /* the fd may have been closed and reused behind our back, so the
+     * kernel's idea of the set can differ from ours...just flip it
+     */
+    if (errno == ENOENT || errno == EEXIST) {
+	op = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(epfd, op, fd, &ev) == 0) {
+	    fdEpoll[fd] = FDEP_ADDED;
+	    return;
 	}
     }
+    if (errno == EPERM) {
+	fdEpoll[fd] = FDEP_ALWAYS;
+	fdAlwaysCount++;
+	return;
+    }
+    Error("FDEpollSync(): epoll_ctl(%d): %s", fd, strerror(errno));
+}
+
+/* the epoll instance is shared across fork(), so each process gets
+ * its own (and rebuilds it from the watch list) the first time it
+ * touches it
+ */
+static void
+FDEpollInit(void)
+{
+    int fd;
+
+    if (epfd != -1 && eppid == getpid())
+	return;
+    if (epfd != -1)
+	close(epfd);
+    if ((epfd = epoll_create(64)) == -1) {
+	Error("FDEpollInit(): epoll_create(): %s", strerror(errno));
+	Bye(EX_OSERR);
+    }
+    fcntl(epfd, F_SETFD, FD_CLOEXEC);
+    eppid = getpid();
+    fdAlwaysCount = 0;
+    for (fd = 0; fd < fdSlots; fd++) {
+	fdEpoll[fd] = FDEP_NONE;
+	if (fdWatch[fd] != 0)
+	    FDEpollSync(fd);
+    }
+}
 #endif
 
-    CONDDEBUG((2, "FileOpenPipe(): encapsulated pipe pair fd %d and fd %d",
-	       fd, fdout));
-    return cfp;
+/* start watching fd for FDWATCH_READ and/or FDWATCH_WRITE */
+void
+FDWatch(int fd, int how)
+{
+    if (fd < 0)
+	return;
+    FDGrow(fd);
+    if ((fdWatch[fd] & how) == how)
+	return;
+    fdWatch[fd] |= how;
+#if HAVE_SYS_EPOLL_H
+    FDEpollInit();
+    FDEpollSync(fd);
+#else
+    if (how & FDWATCH_READ)
+	FD_SET(fd, &rinit);
+    if (how & FDWATCH_WRITE)
+	FD_SET(fd, &winit);
+    if (maxfd < fd + 1)
+	maxfd = fd + 1;
+#endif
 }
 
-/* This is to "unencapsulate" the file descriptor */
-int
-FileUnopen(CONSFILE *cfp)
+/* stop watching fd for FDWATCH_READ and/or FDWATCH_WRITE */
+void
+FDUnwatch(int fd, int how)
 {
-    int retval = 0;
+    if (fd < 0 || fd >= fdSlots || (fdWatch[fd] & how) == 0)
+	return;
+    fdWatch[fd] &= ~how;
+    fdReady[fd] &= ~how;
+#if HAVE_SYS_EPOLL_H
+    FDEpollInit();
+    FDEpollSync(fd);
+#else
+    if (how & FDWATCH_READ)
+	FD_CLR(fd, &rinit);
+    if (how & FDWATCH_WRITE)
+	FD_CLR(fd, &winit);
+#endif
+}
 
-    if (cfp == (CONSFILE *)0)
-	return 0;
+/* forget everything we were watching (new process, new loop) */
+void
+FDWatchReset(void)
+{
+    int fd;
 
-    switch (cfp->ftype) {
-	case simpleFile:
-	    retval = cfp->fd;
-	    break;
-	case simplePipe:
-	    retval = cfp->fd;
-	    break;
-	case simpleSocket:
-	    retval = cfp->fd;
-	    break;
-#if HAVE_OPENSSL
-	case SSLSocket:
-	    retval = -1;
-	    break;
+    for (fd = 0; fd < fdSlots; fd++) {
+#if HAVE_SYS_EPOLL_H
+	fdEpoll[fd] = FDEP_NONE;
 #endif
-	default:
-	    retval = -1;
-	    break;
+	fdWatch[fd] = fdReady[fd] = fdPosted[fd] = 0;
     }
-    CONDDEBUG((2, "FileUnopen(): unopened fd %d", cfp->fd));
-    DestroyString(cfp->wbuf);
-#if DEBUG_CONSFILE_IO
-    if (cfp->debugwfd != -1)
-	close(cfp->debugwfd);
-    if (cfp->debugrfd != -1)
-	close(cfp->debugrfd);
+    readyCount = postCount = 0;
+#if HAVE_SYS_EPOLL_H
+    /* a fresh instance, so nothing stale comes back from the kernel */
+    if (epfd != -1)
+	close(epfd);
+    epfd = -1;
+    FDEpollInit();
+#else
+    FD_ZERO(&rinit);
+    FD_ZERO(&winit);
+    maxfd = 0;
 #endif
-    free(cfp);
+}
 
-    return retval;
+/* make fd look ready on the next FDWait() without waiting on it.
+ * used when something we'd normally wait on the kernel for has
+ * already happened (a write buffer drained outside the loop, say).
+ */
+void
+FDPost(int fd, int how)
+{
+    if (fd < 0)
+	return;
+    FDGrow(fd);
+    if (fdPosted[fd] == 0)
+	postList[postCount++] = fd;
+    fdPosted[fd] |= how;
 }
 
-/* This opens a file like open(2).  Returns a CONSFILE pointer
- * or a (CONSFILE *)0 on error
+static void
+FDAddReady(int fd, int how)
+{
+    how &= fdWatch[fd] | fdPosted[fd];
+    if (how == 0)
+	return;
+    if (fdReady[fd] == 0)
+	readyList[readyCount++] = fd;
+    fdReady[fd] |= how;
+}
+
+/* wait for something we're watching to become ready, like select().
+ * returns the number of ready fds, 0 on timeout, or -1 (and errno)
+ * on error.  the results are then available via FDIsReady(),
+ * FileCanRead(), FileCanWrite(), and FileNextReady().
  */
-CONSFILE *
-FileOpen(const char *path, int flag, int mode)
+int
+FDWait(struct timeval *tvp)
 {
-    CONSFILE *cfp;
-    int fd;
+    int i, fd, n;
+#if HAVE_SYS_EPOLL_H
+    int timeout;
+#else
+    fd_set rmask;
+    fd_set wmask;
+    struct timeval tv;
+#endif
 
-    if (-1 == (fd = open(path, flag, mode))) {
-	CONDDEBUG((2, "FileOpen(): failed to open `%s'", path));
-	return (CONSFILE *)0;
+    for (i = 0; i < readyCount; i++)
+	fdReady[readyList[i]] = 0;
+    readyCount = 0;
+
+#if HAVE_SYS_EPOLL_H
+    FDEpollInit();
+    if (postCount > 0 || fdAlwaysCount > 0)
+	timeout = 0;
+    else if (tvp == (struct timeval *)0)
+	timeout = -1;
+    else
+	timeout = tvp->tv_sec * 1000 + (tvp->tv_usec + 999) / 1000;
+    if ((n =
+	 epoll_wait(epfd, epEvents, fdSlots > 0 ? fdSlots : 1,
+		    timeout)) == -1)
+	return -1;
+    for (i = 0; i < n; i++) {
+	int how = 0;
+	fd = epEvents[i].data.fd;
+	if (epEvents[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	    how |= FDWATCH_READ;
+	if (epEvents[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+	    how |= FDWATCH_WRITE;
+	FDAddReady(fd, how);
     }
-    if ((cfp = (CONSFILE *)calloc(1, sizeof(CONSFILE)))
-	== (CONSFILE *)0)
-	OutOfMem();
-    cfp->ftype = simpleFile;
-    cfp->fd = fd;
-    cfp->wbuf = AllocString();
-#if HAVE_OPENSSL
-    cfp->ssl = (SSL *)0;
-    cfp->waitForRead = cfp->waitForWrite = FLAGFALSE;
-#endif
-#if DEBUG_CONSFILE_IO
-    {
-	char buf[1024];
-	sprintf(buf, "CONSFILE-%s-%lu-%d.w", progname,
-		(unsigned long)thepid, fd);
-	if ((cfp->debugwfd =
-	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
-	    sprintf(buf, "[---- STARTED - %s ----]\n",
-		    StrTime((time_t *)0));
-	    write(cfp->debugwfd, buf, strlen(buf));
-	}
-	sprintf(buf, "CONSFILE-%s-%lu-%d.r", progname,
-		(unsigned long)thepid, fd);
-	if ((cfp->debugrfd =
-	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
-	    sprintf(buf, "[---- STARTED - %s ----]\n",
-		    StrTime((time_t *)0));
-	    write(cfp->debugrfd, buf, strlen(buf));
+    if (fdAlwaysCount > 0) {
+	for (fd = 0; fd < fdSlots; fd++)
+	    if (fdEpoll[fd] == FDEP_ALWAYS)
+		FDAddReady(fd, fdWatch[fd]);
+    }
+#else
+    rmask = rinit;
+    wmask = winit;
+    if (postCount > 0) {
+	tv.tv_sec = tv.tv_usec = 0;
+	tvp = &tv;
+    }
+    if ((n = select(maxfd, &rmask, &wmask, (fd_set *)0, tvp)) == -1)
+	return -1;
+    for (fd = 0; n > 0 && fd < maxfd; fd++) {
+	int how = 0;
+	if (FD_ISSET(fd, &rmask))
+	    how |= FDWATCH_READ;
+	if (FD_ISSET(fd, &wmask))
+	    how |= FDWATCH_WRITE;
+	if (how != 0) {
+	    FDAddReady(fd, how);
+	    n--;
 	}
     }
 #endif
 
-    CONDDEBUG((2, "FileOpen(): opened `%s' as fd %d", path, fd));
-    return cfp;
+    for (i = 0; i < postCount; i++) {
+	fd = postList[i];
+	FDAddReady(fd, fdPosted[fd]);
+	fdPosted[fd] = 0;
+    }
+    postCount = 0;
+
+    return readyCount;
 }
 
-/* Unless otherwise stated, returns the same values as close(2).
- * The CONSFILE object passed in *CANNOT* be used once calling
- * this function - even if there was an error.
- */
+/* are we watching fd for `how'? */
 int
-FileClose(CONSFILE **pcfp)
+FDIsWatched(int fd, int how)
 {
-    CONSFILE *cfp;
-    int retval = 0;
-#if defined(__CYGWIN__)
-    struct linger lingeropt;
-#endif
-
-    cfp = *pcfp;
-    if (cfp == (CONSFILE *)0)
+    if (fd < 0 || fd >= fdSlots)
 	return 0;
+    return (fdWatch[fd] & how) != 0;
+}
 
-    switch (cfp->ftype) {
-	case simpleFile:
-	    do {
-		retval = close(cfp->fd);
-	    } while (retval == -1 && errno == EINTR);
-	    break;
-	case simplePipe:
-	    do {
-		retval = close(cfp->fd);
-	    } while (retval == -1 && errno == EINTR);
-	    do {
-		retval = close(cfp->fdout);
-	    } while (retval == -1 && errno == EINTR);
-	    break;
-	case simpleSocket:
-#if defined(__CYGWIN__)
-	    /* flush out the client socket - set it to blocking,
-	     * then write to it
-	     */
-	    SetFlags(cfp->fd, 0, O_NONBLOCK);
+/* did the last FDWait() say fd was ready for `how'? */
+int
+FDIsReady(int fd, int how)
+{
+    if (fd < 0 || fd >= fdSlots)
+	return 0;
+    return (fdReady[fd] & how) != 0;
+}
+
+static void
+FDSetFile(int fd, CONSFILE *cfp)
+{
+    if (fd < 0)
+	return;
+    FDGrow(fd);
+    fdFile[fd] = cfp;
+}
+
+/* drop all interest in the fds of cfp, it's going away */
+static void
+FDForgetFile(CONSFILE *cfp)
+{
+    int fd = cfp->fd;
+
+    if (fd >= 0 && fd < fdSlots && fdFile[fd] == cfp) {
+	FDUnwatch(fd, FDWATCH_READ | FDWATCH_WRITE);
+	fdPosted[fd] = 0;
+	fdFile[fd] = (CONSFILE *)0;
+    }
+    if (cfp->ftype != simplePipe)
+	return;
+    fd = cfp->fdout;
+    if (fd >= 0 && fd < fdSlots && fdFile[fd] == cfp) {
+	FDUnwatch(fd, FDWATCH_READ | FDWATCH_WRITE);
+	fdPosted[fd] = 0;
+	fdFile[fd] = (CONSFILE *)0;
+    }
+}
+
+/* tag cfp with whatever owns it, so FileNextReady() can hand that
+ * back when one of its fds is ready
+ */
+void
+FileSetOwner(CONSFILE *cfp, int kind, void *owner)
+{
+    if (cfp == (CONSFILE *)0)
+	return;
+    cfp->ownerkind = kind;
+    cfp->owner = owner;
+}
+
+/* walk the fds from the last FDWait(), returning the owners of the
+ * ones that belong to a CONSFILE with one.  *pi starts at zero.  an
+ * owner may come back more than once (a pipe pair, say).
+ */
+void *
+FileNextReady(int *pi, int *kind)
+{
+    CONSFILE *cfp;
+
+    while (*pi < readyCount) {
+	int fd = readyList[(*pi)++];
+	if ((cfp = fdFile[fd]) == (CONSFILE *)0 || cfp->owner == (void *)0)
+	    continue;
+	*kind = cfp->ownerkind;
+	return cfp->owner;
+    }
+    return (void *)0;
+}
+
+/* framed logfiles (see FRAMES in cutil.h)
+ *
+ * the frames are written and read with one deflate and one inflate
+ * stream shared by everything, since a frame is always finished
+ * before we go back to the event loop.  that keeps a framed logfile
+ * down to a couple of file descriptors and its read cache, instead of
+ * a few hundred KB of zlib state per console.
+ */
+
+/* read len bytes at offset off of fd, returning how many there were */
+static int
+ReadAt(int fd, off_t off, void *buf, int len)
+{
+    int r, got = 0;
+
+    if (lseek(fd, off, SEEK_SET) < 0)
+	return -1;
+    while (got < len) {
+	if ((r = read(fd, (char *)buf + got, len - got)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (r == 0)
+	    break;
+	got += r;
+    }
+    return got;
+}
+
+#if HAVE_ZLIB
+/* reading a gzip file with no frame index, front to back */
+typedef struct frameStream {
+    z_stream zs;
+    off_t zpos;			/* compressed bytes read so far */
+    char in[8192];
+} FRAMESTREAM;
+#endif
+
+static void
+FileFramesDrop(CONSFILE *cfp)
+{
+    if (cfp->frm == (FRAMES *)0)
+	return;
+    if (cfp->frm->fd >= 0)
+	close(cfp->frm->fd);
+#if HAVE_ZLIB
+    if (cfp->frm->zs != (void *)0) {
+	inflateEnd(&((FRAMESTREAM *)cfp->frm->zs)->zs);
+	free(cfp->frm->zs);
+    }
+#endif
+    if (cfp->frm->buf != (char *)0)
+	free(cfp->frm->buf);
+    free(cfp->frm);
+    cfp->frm = (FRAMES *)0;
+}
+
+#if HAVE_ZLIB
+static char *frameZbuf = (char *)0;	/* a compressed frame */
+static int frameZsize = 0;
+
+static void
+FrameRoom(char **pbuf, int *psize, int len)
+{
+    if (len <= *psize)
+	return;
+    if ((*pbuf = (char *)realloc(*pbuf, len)) == (char *)0)
+	OutOfMem();
+    *psize = len;
+}
+
+static z_stream *
+FrameInflater(void)
+{
+    static z_stream *zs = (z_stream *)0;
+
+    if (zs == (z_stream *)0) {
+	if ((zs = (z_stream *)calloc(1, sizeof(z_stream))) ==
+	    (z_stream *)0)
+	    OutOfMem();
+	/* gzip headers only */
+	if (inflateInit2(zs, 15 + 16) != Z_OK)
+	    OutOfMem();
+    } else
+	inflateReset(zs);
+    return zs;
+}
+
+/* the end offsets of frame n (frame 0 is the empty one before the
+ * first real one)
+ */
+static int
+FrameIndexGet(FRAMES *f, off_t n, off_t *off, off_t *zoff)
+{
+    unsigned char rec[FRAMEINDEXREC];
+
+    if (n == 0) {
+	*off = *zoff = 0;
+	return 0;
+    }
+    if (ReadAt(f->fd, (n - 1) * FRAMEINDEXREC, rec, FRAMEINDEXREC) !=
+	FRAMEINDEXREC)
+	return -1;
+    *off = LineIndexGet(rec, (int *)0);
+    *zoff = LineIndexGet(rec + LINEINDEXREC, (int *)0);
+    return 0;
+}
+
+/* note a frame that ends at off (zoff in the logfile itself) */
+static void
+FrameIndexAdd(FRAMES *f, off_t off, off_t zoff)
+{
+    unsigned char rec[FRAMEINDEXREC];
+    int r;
+
+    f->size = off;
+    f->zsize = zoff;
+    f->nrec++;
+    LineIndexPut(rec, off, 0);
+    LineIndexPut(rec + LINEINDEXREC, zoff, 0);
+    while ((r = write(f->fd, rec, sizeof(rec))) < 0 && errno == EINTR);
+    if (r != sizeof(rec))
+	Error("FrameIndexAdd(): write(%d): %s", f->fd,
+	      (r < 0) ? strerror(errno) : "short write");
+}
+
+/* index whatever complete frames follow the last indexed one, up to
+ * end (the logfile size).  an unfinished frame is left out.
+ */
+static void
+FrameScan(CONSFILE *cfp, off_t end)
+{
+    FRAMES *f = cfp->frm;
+    z_stream *zs = FrameInflater();
+    char in[8192], out[16384];
+    off_t pos = f->zsize;
+    int r;
+
+    zs->avail_in = 0;
+    for (;;) {
+	if (zs->avail_in == 0) {
+	    if (pos >= end)
+		break;
+	    r = (end - pos > sizeof(in)) ? sizeof(in) : (int)(end - pos);
+	    if ((r = ReadAt(cfp->fd, pos, in, r)) <= 0)
+		break;
+	    zs->next_in = (Bytef *)in;
+	    zs->avail_in = r;
+	    pos += r;
+	}
+	zs->next_out = (Bytef *)out;
+	zs->avail_out = sizeof(out);
+	r = inflate(zs, Z_NO_FLUSH);
+	if (r == Z_STREAM_END) {
+	    FrameIndexAdd(f, f->size + zs->total_out, pos - zs->avail_in);
+	    r = zs->avail_in;
+	    inflateReset(zs);
+	    zs->avail_in = r;
+	} else if (r != Z_OK && r != Z_BUF_ERROR)
+	    break;
+    }
+}
+
+/* decompress the frame holding uncompressed offset off into the cache */
+static int
+FrameLoad(CONSFILE *cfp, off_t off)
+{
+    FRAMES *f = cfp->frm;
+    z_stream *zs;
+    off_t lo = 1, hi = f->nrec, mid, start, zstart, end, zend;
+
+    /* the first frame that ends past off */
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (FrameIndexGet(f, mid, &end, &zend) != 0)
+	    return -1;
+	if (end > off)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    if (FrameIndexGet(f, lo - 1, &start, &zstart) != 0 ||
+	FrameIndexGet(f, lo, &end, &zend) != 0 || end <= off)
+	return -1;
+    /* ours are never more than FRAMEMAX, but who knows what we've
+     * been handed
+     */
+    if (end - start > 64 * FRAMEMAX || zend - zstart > 64 * FRAMEMAX) {
+	Error("FrameLoad(): fd %d: frame at %ld is too big", cfp->fd,
+	      (long)zstart);
+	return -1;
+    }
+
+    FrameRoom(&frameZbuf, &frameZsize, (int)(zend - zstart));
+    FrameRoom(&f->buf, &f->bsize, (int)(end - start));
+    if (ReadAt(cfp->fd, zstart, frameZbuf, (int)(zend - zstart)) !=
+	(int)(zend - zstart))
+	return -1;
+    zs = FrameInflater();
+    zs->next_in = (Bytef *)frameZbuf;
+    zs->avail_in = (uInt) (zend - zstart);
+    zs->next_out = (Bytef *)f->buf;
+    zs->avail_out = (uInt) (end - start);
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END ||
+	zs->total_out != end - start) {
+	Error("FrameLoad(): fd %d: bad frame at %ld", cfp->fd,
+	      (long)zstart);
+	f->blen = 0;
+	return -1;
+    }
+    f->bstart = start;
+    f->blen = (int)(end - start);
+    return 0;
+}
+
+/* decompress the FRAMEMAX bytes holding uncompressed offset off of an
+ * unindexed gzip file into the cache, starting over from the top if
+ * it's behind us.  returns -1 on errors and if off isn't there.
+ */
+static int
+FrameStreamLoad(CONSFILE *cfp, off_t off)
+{
+    FRAMES *f = cfp->frm;
+    FRAMESTREAM *fs = (FRAMESTREAM *)f->zs;
+    int r;
+
+    if (off < f->bstart) {
+	inflateReset(&fs->zs);
+	fs->zs.avail_in = 0;
+	fs->zpos = 0;
+	f->bstart = 0;
+	f->blen = 0;
+    }
+    FrameRoom(&f->buf, &f->bsize, FRAMEMAX);
+    while (off >= f->bstart + f->blen) {
+	f->bstart += f->blen;
+	fs->zs.next_out = (Bytef *)f->buf;
+	fs->zs.avail_out = FRAMEMAX;
+	for (;;) {
+	    if (fs->zs.avail_in == 0) {
+		if ((r = ReadAt(cfp->fd, fs->zpos, fs->in,
+				sizeof(fs->in))) < 0)
+		    return -1;
+		if (r == 0)
+		    break;
+		fs->zs.next_in = (Bytef *)fs->in;
+		fs->zs.avail_in = r;
+		fs->zpos += r;
+	    }
+	    r = inflate(&fs->zs, Z_NO_FLUSH);
+	    if (r == Z_STREAM_END) {
+		/* there may be more members after this one */
+		r = fs->zs.avail_in;
+		inflateReset(&fs->zs);
+		fs->zs.avail_in = r;
+	    } else if (r != Z_OK && r != Z_BUF_ERROR) {
+		Error("FrameStreamLoad(): fd %d: bad data at %ld", cfp->fd,
+		      (long)(fs->zpos - fs->zs.avail_in));
+		f->blen = 0;
+		return -1;
+	    }
+	    if (fs->zs.avail_out == 0)
+		break;
+	}
+	if ((f->blen = FRAMEMAX - fs->zs.avail_out) == 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/* set up to read a gzip file that has no frame index.  there's no
+ * telling how big it is without decompressing it (the gzip trailer only
+ * covers the last member, mod 4GB), so it's done once here.
+ */
+static void
+FrameStreamOpen(CONSFILE *cfp, struct stat *st)
+{
+    FRAMES *f = cfp->frm;
+    FRAMESTREAM *fs;
+
+    if ((fs = (FRAMESTREAM *)calloc(1, sizeof(FRAMESTREAM))) ==
+	(FRAMESTREAM *)0)
+	OutOfMem();
+    if (inflateInit2(&fs->zs, 15 + 16) != Z_OK)
+	OutOfMem();
+    f->zs = (void *)fs;
+    f->zsize = st->st_size;
+    while (FrameStreamLoad(cfp, f->bstart + f->blen) == 0);
+    f->size = f->bstart + f->blen;
+}
+
+#endif /* HAVE_ZLIB */
+
+/* read from uncompressed offset off of a framed logfile.  returns the
+ * bytes read, 0 at the end, -1 on error
+ */
+static int
+FrameReadAt(CONSFILE *cfp, off_t off, void *buf, int len)
+{
+#if HAVE_ZLIB
+    FRAMES *f = cfp->frm;
+
+    if (off >= f->size)
+	return 0;
+    if (off < f->bstart || off >= f->bstart + f->blen) {
+	if (((f->zs != (void *)0) ? FrameStreamLoad(cfp, off) :
+	     FrameLoad(cfp, off)) != 0)
+	    return -1;
+    }
+    if (len > f->bstart + f->blen - off)
+	len = (int)(f->bstart + f->blen - off);
+    memcpy(buf, f->buf + (off - f->bstart), len);
+    return len;
+#else
+    return -1;
+#endif
+}
+
+/* read from offset off of the logfile open on cfp without disturbing
+ * anything a writer would care about (as FileIndexLines() needs to)
+ */
+static int
+FileReadAt(CONSFILE *cfp, off_t off, void *buf, int len)
+{
+    if (cfp->frm != (FRAMES *)0)
+	return FrameReadAt(cfp, off, buf, len);
+    return ReadAt(cfp->fd, off, buf, len);
+}
+
+/* check whether the logfile open on cfp (whose name is path) is
+ * framed (or, when reading, just gzipped) and, if so, set it up so
+ * FileRead() and friends decompress it and FileWrite() compresses
+ * (when writing is set).  an empty file
+ * is made framed only if writing is set.  returns 1 if it's framed, 0
+ * if not, and -1 if it's framed but we can't read it.
+ */
+int
+FileFrames(CONSFILE *cfp, const char *path, FLAG writing)
+{
+    unsigned char magic[2];
+    struct stat st;
+    int r;
+#if HAVE_ZLIB
+    static STRING *fpath = (STRING *)0;
+    struct stat fst;
+    FRAMES *f;
+    int fd;
+#endif
+
+    if (cfp == (CONSFILE *)0 || path == (char *)0)
+	return -1;
+    FileFramesDrop(cfp);
+
+    if (fstat(cfp->fd, &st) != 0)
+	return -1;
+    if (st.st_size == 0) {
+	if (writing != FLAGTRUE)
+	    return 0;
+    } else {
+	r = ReadAt(cfp->fd, 0, magic, 2);
+	/* a plain file gets read from the top, as if we hadn't looked */
+	lseek(cfp->fd, 0, SEEK_SET);
+	if (r != 2 || magic[0] != 0x1f || magic[1] != 0x8b)
+	    return 0;
+    }
+
+#if HAVE_ZLIB
+    if (fpath == (STRING *)0)
+	fpath = AllocString();
+    BuildString((char *)0, fpath);
+    BuildStringPrint(fpath, "%s%s", path, FRAMEINDEXSUFFIX);
+    if ((fd = open(fpath->string,
+		   (writing == FLAGTRUE) ? O_RDWR | O_CREAT | O_APPEND :
+		   O_RDONLY, 0644)) < 0 &&
+	(writing == FLAGTRUE || errno != ENOENT)) {
+	Error("FileFrames(): open(%s): %s", fpath->string,
+	      strerror(errno));
+	return -1;
+    }
+    if ((f = (FRAMES *)calloc(1, sizeof(FRAMES))) == (FRAMES *)0)
+	OutOfMem();
+    f->fd = fd;
+    cfp->frm = f;
+
+    /* no index, so it's read the slow way */
+    if (fd < 0) {
+	FrameStreamOpen(cfp, &st);
+	return 1;
+    }
+
+    /* the last frame indexed has to be in the logfile, or we start
+     * over from the top
+     */
+    if (fstat(fd, &fst) == 0)
+	f->nrec = fst.st_size / FRAMEINDEXREC;
+    if (f->nrec > 0 &&
+	(FrameIndexGet(f, f->nrec, &f->size, &f->zsize) != 0 ||
+	 f->zsize > st.st_size)) {
+	f->nrec = f->size = f->zsize = 0;
+    }
+
+    /* the writer indexes anything that isn't, and drops a frame that
+     * didn't get finished
+     */
+    if (writing == FLAGTRUE && (f->nrec * FRAMEINDEXREC != fst.st_size ||
+				f->zsize != st.st_size)) {
+	if (ftruncate(fd, f->nrec * FRAMEINDEXREC) != 0) {
+	    Error("FileFrames(): ftruncate(%s): %s", fpath->string,
+		  strerror(errno));
+	    FileFramesDrop(cfp);
+	    return -1;
+	}
+	FrameScan(cfp, st.st_size);
+	CONDDEBUG((1, "FileFrames(): %s: %ld frames, %ld of %ld bytes",
+		   path, (long)f->nrec, (long)f->zsize, (long)st.st_size));
+	if (f->zsize != st.st_size && ftruncate(cfp->fd, f->zsize) != 0)
+	    Error("FileFrames(): ftruncate(%s): %s", path,
+		  strerror(errno));
+    }
+    return 1;
+#else
+    {
+	static int told = 0;
+
+	/* once is enough for the logs */
+	if (!told++)
+	    Error
+		("FileFrames(): %s is compressed and there's no zlib support, so it can't be read",
+		 path);
+	else
+	    CONDDEBUG((1, "FileFrames(): %s is compressed, no zlib",
+		       path));
+    }
+    return -1;
+#endif
+}
+
+/* line indexes
+ *
+ * Replay() wants the last few lines of a logfile, and used to find them
+ * by reading the file backwards a byte at a time.  instead, FileWrite()
+ * records where every newline written to a logfile lands in an index
+ * file next to it (the logfile name plus LINEINDEXSUFFIX), flagging
+ * the MARK lines so Replay() can fold them together without looking at
+ * the text.  if the index doesn't line up with the logfile when it's
+ * attached (it's missing, the logfile was edited or rotated by someone
+ * else, ...) it starts over at the current end of the logfile, and
+ * anything older is found the old way.
+ */
+#define LINEINDEXSLACK	65536	/* most unindexed tail we'll check */
+
+void
+LineIndexPut(unsigned char *b, off_t off, int flags)
+{
+    int i;
+
+    b[0] = (unsigned char)flags;
+    for (i = LINEINDEXREC - 1; i > 0; i--) {
+	b[i] = (unsigned char)(off & 0xff);
+	off >>= 8;
+    }
+}
+
+off_t
+LineIndexGet(unsigned char *b, int *flags)
+{
+    off_t off = 0;
+    int i;
+
+    if (flags != (int *)0)
+	*flags = b[0];
+    for (i = 1; i < LINEINDEXREC; i++)
+	off = (off << 8) | b[i];
+    return off;
+}
+
+static void
+FileIndexDrop(CONSFILE *cfp)
+{
+    if (cfp->lidx == (LINEINDEX *)0)
+	return;
+    if (cfp->lidx->fd >= 0)
+	close(cfp->lidx->fd);
+    if (cfp->lidx->tfd >= 0)
+	close(cfp->lidx->tfd);
+    free(cfp->lidx);
+    cfp->lidx = (LINEINDEX *)0;
+}
+
+static int
+FileIndexSave(CONSFILE *cfp, unsigned char *recs, int len)
+{
+    int r;
+
+    if (cfp->lidx->fd < 0)
+	return 0;
+    while (len > 0) {
+	if ((r = write(cfp->lidx->fd, recs, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    Error("FileIndexSave(): write(%d): %s: dropping line index",
+		  cfp->lidx->fd, strerror(errno));
+	    FileIndexDrop(cfp);
+	    return -1;
+	}
+	recs += r;
+	len -= r;
+    }
+    return 0;
+}
+
+static void
+FileIndexTimeSave(CONSFILE *cfp, time_t when, off_t off)
+{
+    unsigned char rec[TIMEINDEXREC];
+    int r;
+
+    LineIndexPut(rec, (off_t)when, 0);
+    LineIndexPut(rec + LINEINDEXREC, off, 0);
+    while ((r = write(cfp->lidx->tfd, rec, sizeof(rec))) < 0 &&
+	   errno == EINTR);
+    if (r != sizeof(rec)) {
+	Error("FileIndexTimeSave(): write(%d): %s: dropping time index",
+	      cfp->lidx->tfd, (r < 0) ? strerror(errno) : "short write");
+	close(cfp->lidx->tfd);
+	cfp->lidx->tfd = -1;
+	return;
+    }
+    cfp->lidx->tlast = when;
+}
+
+/* open the time index that goes with a line index (keep says whether
+ * the line index was good, and so whether this one might be)
+ */
+static void
+FileIndexTimeOpen(CONSFILE *cfp, const char *path, int keep)
+{
+    static STRING *tpath = (STRING *)0;
+    unsigned char rec[TIMEINDEXREC];
+    struct stat st;
+    off_t tsize = 0;
+    int fd;
+
+    cfp->lidx->tfd = -1;
+    if (tpath == (STRING *)0)
+	tpath = AllocString();
+    BuildString((char *)0, tpath);
+    BuildStringPrint(tpath, "%s%s", path, TIMEINDEXSUFFIX);
+
+    if ((fd = open(tpath->string, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+	Error("FileIndexTimeOpen(): open(%s): %s", tpath->string,
+	      strerror(errno));
+	return;
+    }
+    /* the last record has to point inside the logfile */
+    if (keep && fstat(fd, &st) == 0) {
+	tsize = st.st_size - st.st_size % TIMEINDEXREC;
+	if (tsize >= TIMEINDEXREC &&
+	    lseek(fd, tsize - TIMEINDEXREC, SEEK_SET) >= 0 &&
+	    read(fd, rec, TIMEINDEXREC) == TIMEINDEXREC &&
+	    LineIndexGet(rec + LINEINDEXREC, (int *)0) <= cfp->lidx->off)
+	    cfp->lidx->tlast = (time_t)LineIndexGet(rec, (int *)0);
+	else
+	    tsize = 0;
+    }
+    if ((tsize == 0 || tsize != st.st_size) && ftruncate(fd, tsize) != 0) {
+	close(fd);
+	return;
+    }
+    cfp->lidx->tfd = fd;
+}
+
+/* does the logfile (open on cfp) have a newline anywhere in [from,to)? */
+static int
+FileIndexHasNL(CONSFILE *cfp, off_t from, off_t to)
+{
+    char buf[4096];
+    int r;
+
+    if (from >= to)
+	return 0;
+    while (from < to) {
+	r = (to - from > sizeof(buf)) ? sizeof(buf) : (int)(to - from);
+	if ((r = FileReadAt(cfp, from, buf, r)) <= 0)
+	    return -1;
+	if (memchr(buf, '\n', r) != (void *)0)
+	    return 1;
+	from += r;
+    }
+    return 0;
+}
+
+/* keep a line index for the logfile open on cfp (whose name is path).
+ * without lines, there's just the time index (which still needs to
+ * know where lines start) and any old line index is removed.  returns
+ * 0 if all is well, -1 if there's no index.
+ */
+int
+FileIndexLines(CONSFILE *cfp, const char *path, FLAG lines)
+{
+    static STRING *ipath = (STRING *)0;
+    struct stat st, ist;
+    unsigned char rec[LINEINDEXREC];
+    off_t isize, last = 0, end;
+    int fd, flags, ok = 0;
+    char c;
+
+    if (cfp == (CONSFILE *)0 || path == (char *)0)
+	return -1;
+    FileIndexDrop(cfp);
+
+    if (ipath == (STRING *)0)
+	ipath = AllocString();
+    BuildString((char *)0, ipath);
+    BuildStringPrint(ipath, "%s%s", path, LINEINDEXSUFFIX);
+
+    if (fstat(cfp->fd, &st) != 0)
+	return -1;
+    end = (cfp->frm != (FRAMES *)0) ? cfp->frm->size : st.st_size;
+    if (lines != FLAGTRUE) {
+	unlink(ipath->string);
+	if ((cfp->lidx = (LINEINDEX *)calloc(1, sizeof(LINEINDEX)))
+	    == (LINEINDEX *)0)
+	    OutOfMem();
+	cfp->lidx->fd = -1;
+	cfp->lidx->off = end;
+	cfp->lidx->bol = (end == 0 ||
+			  (FileReadAt(cfp, end - 1, &c, 1) == 1 &&
+			   c == '\n')) ? FLAGTRUE : FLAGFALSE;
+	cfp->lidx->mark = FLAGFALSE;
+	FileIndexTimeOpen(cfp, path, 1);
+	return 0;
+    }
+    if ((fd = open(ipath->string, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+	Error("FileIndexLines(): open(%s): %s", ipath->string,
+	      strerror(errno));
+	return -1;
+    }
+    if (fstat(fd, &ist) != 0) {
+	close(fd);
+	return -1;
+    }
+
+    /* the last record has to be at or before the end of the logfile,
+     * right after a newline (unless it's the base), with no newline
+     * after it
+     */
+    isize = ist.st_size - ist.st_size % LINEINDEXREC;
+    if (isize >= LINEINDEXREC &&
+	lseek(fd, isize - LINEINDEXREC, SEEK_SET) >= 0 &&
+	read(fd, rec, LINEINDEXREC) == LINEINDEXREC) {
+	last = LineIndexGet(rec, &flags);
+	if (last <= end && end - last <= LINEINDEXSLACK &&
+	    FileIndexHasNL(cfp, last, end) == 0) {
+	    if (flags & LINEINDEXBASE)
+		ok = 1;
+	    else
+		ok = (FileReadAt(cfp, last - 1, &c, 1) == 1 && c == '\n');
+	}
+    }
+
+    if (!ok) {
+	CONDDEBUG((1, "FileIndexLines(): starting %s at %ld",
+		   ipath->string, (long)end));
+	isize = 0;
+    }
+    if (isize != ist.st_size && ftruncate(fd, isize) != 0) {
+	close(fd);
+	return -1;
+    }
+
+    if ((cfp->lidx = (LINEINDEX *)calloc(1, sizeof(LINEINDEX)))
+	== (LINEINDEX *)0)
+	OutOfMem();
+    cfp->lidx->fd = fd;
+    cfp->lidx->off = end;
+    /* the start of an empty logfile is a line start too, so the
+     * first time record can point at it
+     */
+    cfp->lidx->bol = ((ok && last == end) ||
+		      end == 0) ? FLAGTRUE : FLAGFALSE;
+    cfp->lidx->mark = FLAGFALSE;
+    FileIndexTimeOpen(cfp, path, ok);
+    if (!ok) {
+	LineIndexPut(rec, end, LINEINDEXBASE);
+	return FileIndexSave(cfp, rec, LINEINDEXREC);
+    }
+    return 0;
+}
+
+/* the line about to be written is a MARK */
+void
+FileIndexMark(CONSFILE *cfp)
+{
+    if (cfp != (CONSFILE *)0 && cfp->lidx != (LINEINDEX *)0 &&
+	cfp->lidx->bol == FLAGTRUE)
+	cfp->lidx->mark = FLAGTRUE;
+}
+
+/* note that the logfile is at time when (if it's been long enough
+ * since the last time we did, or force is set).  it's recorded
+ * against the next line start
+ */
+void
+FileIndexTime(CONSFILE *cfp, time_t when, FLAG force)
+{
+    if (cfp == (CONSFILE *)0 || cfp->lidx == (LINEINDEX *)0 ||
+	cfp->lidx->tfd < 0)
+	return;
+    /* keep it in order, even if the clock goes backwards */
+    if (when < cfp->lidx->tlast ||
+	(force != FLAGTRUE && when < cfp->lidx->tlast + TIMEINDEXGRAIN))
+	return;
+    if (cfp->lidx->bol == FLAGTRUE)
+	FileIndexTimeSave(cfp, when, cfp->lidx->off);
+    else if (cfp->lidx->tpend == 0)
+	cfp->lidx->tpend = when;
+}
+
+/* write out the records FileIndexData() has been holding onto (once
+ * the data they point at has been written)
+ */
+static void
+FileIndexFlush(CONSFILE *cfp)
+{
+    if (cfp->lidx == (LINEINDEX *)0 || cfp->lidx->npend == 0)
+	return;
+    if (FileIndexSave(cfp, cfp->lidx->pend, cfp->lidx->npend) < 0)
+	return;
+    cfp->lidx->npend = 0;
+}
+
+/* note the newlines in data headed for the logfile */
+static void
+FileIndexData(CONSFILE *cfp, const char *buf, int len)
+{
+    unsigned char *recs = cfp->lidx->pend;
+    const char *p = buf;
+    const char *e = buf + len;
+    int n = cfp->lidx->npend;
+
+    /* no line index, so only a pending time record cares */
+    if (cfp->lidx->fd < 0) {
+	if (cfp->lidx->tpend != 0 &&
+	    (p = memchr(buf, '\n', len)) != (char *)0) {
+	    if (cfp->lidx->tfd >= 0)
+		FileIndexTimeSave(cfp, cfp->lidx->tpend,
+				  cfp->lidx->off + (p + 1 - buf));
+	    cfp->lidx->tpend = 0;
+	}
+	cfp->lidx->off += len;
+	cfp->lidx->bol = (buf[len - 1] == '\n') ? FLAGTRUE : FLAGFALSE;
+	return;
+    }
+
+    while (p < e && (p = memchr(p, '\n', e - p)) != (char *)0) {
+	p++;
+	if (cfp->lidx->tpend != 0) {
+	    if (cfp->lidx->tfd >= 0)
+		FileIndexTimeSave(cfp, cfp->lidx->tpend,
+				  cfp->lidx->off + (p - buf));
+	    cfp->lidx->tpend = 0;
+	}
+	LineIndexPut(recs + n, cfp->lidx->off + (p - buf),
+		     (cfp->lidx->mark == FLAGTRUE) ? LINEINDEXMARK : 0);
+	cfp->lidx->mark = FLAGFALSE;
+	n += LINEINDEXREC;
+	if (n == sizeof(cfp->lidx->pend)) {
+	    if (FileIndexSave(cfp, recs, n) < 0)
+		return;
+	    n = 0;
+	}
+    }
+    /* the rest go out with the data (see FileIndexFlush()) */
+    cfp->lidx->npend = n;
+    cfp->lidx->off += len;
+    cfp->lidx->bol = (buf[len - 1] == '\n') ? FLAGTRUE : FLAGFALSE;
+}
+
+/* write queues
+ *
+ * everything waiting to go out on a CONSFILE is kept in a list of
+ * segments (cfp->whead), each pointing into a reference counted chunk.
+ * shared chunks (from FileWriteChunk()) are queued by reference, so a
+ * console with lots of clients doesn't copy its output once per
+ * client.  private data from FileWrite() is copied into chunks the
+ * queue owns, filling the last one before starting another.  sending
+ * data just moves the front segment along (or frees it), so a slow
+ * reader with a big backlog doesn't cost a memmove() of the rest of
+ * the backlog every time a bit of it goes out.
+ */
+#define FILECHUNKSIZE	4096	/* size of private chunks */
+#define FILECHUNKPOOL	64	/* how many spare ones we keep */
+
+static WSEG *wsegFree = (WSEG *)0;
+static CHUNK *chunkFree = (CHUNK *)0;	/* linked through quoted */
+static int chunkFreeCount = 0;
+
+/* a chunk with room for size bytes (but holding none) */
+static CHUNK *
+NewChunk(int size)
+{
+    CHUNK *c;
+
+    if (size == FILECHUNKSIZE && chunkFree != (CHUNK *)0) {
+	c = chunkFree;
+	chunkFree = c->quoted;
+	chunkFreeCount--;
+    } else if ((c = (CHUNK *)malloc(sizeof(CHUNK) + size)) == (CHUNK *)0)
+	OutOfMem();
+    c->refs = 1;
+    c->len = 0;
+    c->size = size;
+    c->quoted = (CHUNK *)0;
+    c->data = (char *)(c + 1);
+    return c;
+}
+
+CHUNK *
+AllocChunk(const char *buf, int len)
+{
+    CHUNK *c;
+
+    if (len < 0)
+	len = 0;
+    c = NewChunk(len);
+    if (len > 0)
+	memcpy(c->data, buf, len);
+    c->len = len;
+    return c;
+}
+
+void
+ReleaseChunk(CHUNK *c)
+{
+    if (c == (CHUNK *)0 || --c->refs > 0)
+	return;
+    if (c->quoted != (CHUNK *)0 && c->quoted != c)
+	ReleaseChunk(c->quoted);
+    if (c->size == FILECHUNKSIZE && chunkFreeCount < FILECHUNKPOOL) {
+	c->quoted = chunkFree;
+	chunkFree = c;
+	chunkFreeCount++;
+	return;
+    }
+    free(c);
+}
+
+/* append buf to out, doubling any OB_IAC characters */
+static void
+QuoteIAC(char *buf, int len, STRING *out)
+{
+    char *p;
+    int o = 0;
+
+    while (o < len &&
+	   (p = memchr(buf + o, (char)OB_IAC, len - o)) != (char *)0) {
+	BuildStringN(buf + o, p - buf + 1 - o, out);
+	BuildStringChar((char)OB_IAC, out);
+	o = p - buf + 1;
+    }
+    if (o < len)
+	BuildStringN(buf + o, len - o, out);
+}
+
+/* the version of c to send to a quoteiac CONSFILE (made once and then
+ * shared by everyone that needs it)
+ */
+static CHUNK *
+ChunkQuoted(CHUNK *c)
+{
+    static STRING *q = (STRING *)0;
+
+    if (c->quoted != (CHUNK *)0)
+	return c->quoted;
+    if (memchr(c->data, (char)OB_IAC, c->len) == (void *)0) {
+	c->quoted = c;
+	return c;
+    }
+    if (q == (STRING *)0)
+	q = AllocString();
+    BuildString((char *)0, q);
+    QuoteIAC(c->data, c->len, q);
+    c->quoted = AllocChunk(q->string, q->used - 1);
+    return c->quoted;
+}
+
+/* a segment covering all of c (which gains a reference) */
+static WSEG *
+NewWSeg(CHUNK *c)
+{
+    WSEG *s;
+
+    if (wsegFree != (WSEG *)0) {
+	s = wsegFree;
+	wsegFree = s->next;
+    } else if ((s = (WSEG *)malloc(sizeof(WSEG))) == (WSEG *)0)
+	OutOfMem();
+    c->refs++;
+    s->chunk = c;
+    s->off = 0;
+    s->len = c->len;
+    s->next = (WSEG *)0;
+    return s;
+}
+
+static void
+FileQueueChunk(CONSFILE *cfp, CHUNK *c)
+{
+    WSEG *s = NewWSeg(c);
+
+    if (cfp->wtail == (WSEG *)0)
+	cfp->whead = s;
+    else
+	cfp->wtail->next = s;
+    cfp->wtail = s;
+    cfp->wqlen += c->len;
+}
+
+/* copy private data onto the end of the queue */
+static void
+FileQueueData(CONSFILE *cfp, const char *buf, int len)
+{
+    WSEG *s = cfp->wtail;
+    CHUNK *c;
+    int l;
+
+    while (len > 0) {
+	/* only top up a chunk that's ours alone and that this
+	 * segment runs to the end of
+	 */
+	if (s == (WSEG *)0 || (c = s->chunk)->refs != 1 ||
+	    c->len >= c->size || s->off + s->len != c->len) {
+	    c = NewChunk(len > FILECHUNKSIZE ? len : FILECHUNKSIZE);
+	    FileQueueChunk(cfp, c);
+	    ReleaseChunk(c);
+	    s = cfp->wtail;
+	}
+	l = c->size - c->len;
+	if (l > len)
+	    l = len;
+	memcpy(c->data + c->len, buf, l);
+	c->len += l;
+	s->len += l;
+	cfp->wqlen += l;
+	buf += l;
+	len -= l;
+    }
+}
+
+/* same, but doubling any OB_IAC characters.  the quoted bytes are
+ * gathered in q first, so data thick with OB_IAC doesn't go on the
+ * queue a byte or two at a time
+ */
+static void
+FileQueueQuoted(CONSFILE *cfp, char *buf, int len)
+{
+    char q[BUFSIZ];
+    char *p;
+    int o = 0, n = 0, l;
+
+    while (o < len) {
+	if ((p = memchr(buf + o, (char)OB_IAC, len - o)) == (char *)0)
+	    l = len - o;
+	else
+	    l = p - buf + 1 - o;
+	if (p == (char *)0 && n == 0) {
+	    /* nothing (more) to double */
+	    FileQueueData(cfp, buf + o, l);
+	    return;
+	}
+	if (n + l + 1 > sizeof(q)) {
+	    if (n > 0)
+		FileQueueData(cfp, q, n);
+	    n = 0;
+	    if (l + 1 > sizeof(q)) {
+		/* a long run without one goes straight on */
+		FileQueueData(cfp, buf + o, l);
+		o += l;
+		if (p != (char *)0)
+		    q[n++] = (char)OB_IAC;
+		continue;
+	    }
+	}
+	memcpy(q + n, buf + o, l);
+	n += l;
+	if (p != (char *)0)
+	    q[n++] = (char)OB_IAC;
+	o += l;
+    }
+    if (n > 0)
+	FileQueueData(cfp, q, n);
+}
+
+static void
+FileDropQueue(CONSFILE *cfp)
+{
+    WSEG *s;
+
+    while ((s = cfp->whead) != (WSEG *)0) {
+	cfp->whead = s->next;
+	ReleaseChunk(s->chunk);
+	s->next = wsegFree;
+	wsegFree = s;
+    }
+    cfp->wtail = (WSEG *)0;
+    cfp->wqlen = 0;
+    cfp->wnote = (WSEG *)0;
+}
+
+/* throw away n bytes that have been sent from the front of the queue */
+static void
+FileConsume(CONSFILE *cfp, int n)
+{
+    WSEG *s;
+    int l;
+
+    while (n > 0 && (s = cfp->whead) != (WSEG *)0) {
+	l = (n < s->len) ? n : s->len;
+#if DEBUG_CONSFILE_IO
+	if (cfp->debugwfd != -1)
+	    write(cfp->debugwfd, s->chunk->data + s->off, l);
+#endif
+	s->off += l;
+	s->len -= l;
+	cfp->wqlen -= l;
+	n -= l;
+	if (s->len == 0) {
+	    if ((cfp->whead = s->next) == (WSEG *)0)
+		cfp->wtail = (WSEG *)0;
+	    if (s == cfp->wnote)
+		cfp->wnote = (WSEG *)0;
+	    ReleaseChunk(s->chunk);
+	    s->next = wsegFree;
+	    wsegFree = s;
+	}
+    }
+}
+
+#if !HAVE_WRITEV || HAVE_OPENSSL
+/* the first contiguous piece of queued data */
+static int
+FileQueueHead(CONSFILE *cfp, char **buf)
+{
+    if (cfp->whead != (WSEG *)0) {
+	*buf = cfp->whead->chunk->data + cfp->whead->off;
+	return cfp->whead->len;
+    }
+    *buf = (char *)0;
+    return 0;
+}
+#endif
+
+#if HAVE_WRITEV
+# define FILEIOVMAX	64
+/* fill iov with up to max pieces of queued data, returns the count */
+static int
+FileQueueIOV(CONSFILE *cfp, struct iovec *iov, int max)
+{
+    WSEG *s;
+    int n = 0;
+
+    for (s = cfp->whead; s != (WSEG *)0 && n < max; s = s->next) {
+	iov[n].iov_base = s->chunk->data + s->off;
+	iov[n].iov_len = s->len;
+	n++;
+    }
+    return n;
+}
+#endif
+
+/* Routines for the generic I/O stuff for conserver.  This will handle
+ * all open(), close(), read(), and write() calls.
+ */
+
+/* This encapsulates a regular file descriptor in a CONSFILE
+ * object.  Returns a CONSFILE pointer to that object.
+ */
+CONSFILE *
+FileOpenFD(int fd, enum consFileType type)
+{
+    CONSFILE *cfp;
+
+    if ((cfp = (CONSFILE *)calloc(1, sizeof(CONSFILE)))
+	== (CONSFILE *)0)
+	OutOfMem();
+    cfp->ftype = type;
+    cfp->fd = fd;
+#if HAVE_OPENSSL
+    cfp->ssl = (SSL *)0;
+    cfp->waitForRead = cfp->waitForWrite = FLAGFALSE;
+#endif
+#if DEBUG_CONSFILE_IO
+    {
+	char buf[1024];
+	sprintf(buf, "CONSFILE-%s-%lu-%d.w", progname,
+		(unsigned long)thepid, fd);
+	if ((cfp->debugwfd =
+	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
+	    sprintf(buf, "[---- STARTED - %s ----]\n",
+		    StrTime((time_t *)0));
+	    write(cfp->debugwfd, buf, strlen(buf));
+	}
+	sprintf(buf, "CONSFILE-%s-%lu-%d.r", progname,
+		(unsigned long)thepid, fd);
+	if ((cfp->debugrfd =
+	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
+	    sprintf(buf, "[---- STARTED - %s ----]\n",
+		    StrTime((time_t *)0));
+	    write(cfp->debugrfd, buf, strlen(buf));
+	}
+    }
+#endif
+
+    FDSetFile(fd, cfp);
+
+    CONDDEBUG((2, "FileOpenFD(): encapsulated fd %d type %d", fd, type));
+    return cfp;
+}
+
+/* This encapsulates a pipe pair in a CONSFILE
+ * object.  Returns a CONSFILE pointer to that object.
+ */
+CONSFILE *
+FileOpenPipe(int fd, int fdout)
+{
+    CONSFILE *cfp;
+
+    if ((cfp = (CONSFILE *)calloc(1, sizeof(CONSFILE)))
+	== (CONSFILE *)0)
+	OutOfMem();
+    cfp->ftype = simplePipe;
+    cfp->fd = fd;
+    cfp->fdout = fdout;
+#if HAVE_OPENSSL
+    cfp->ssl = (SSL *)0;
+    cfp->waitForRead = cfp->waitForWrite = FLAGFALSE;
+#endif
+#if DEBUG_CONSFILE_IO
+    {
+	char buf[1024];
+	sprintf(buf, "CONSFILE-%s-%lu-%d.w", progname,
+		(unsigned long)thepid, fdout);
+	if ((cfp->debugwfd =
+	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
+	    sprintf(buf, "[---- STARTED - %s ----]\n",
+		    StrTime((time_t *)0));
+	    write(cfp->debugwfd, buf, strlen(buf));
+	}
+	sprintf(buf, "CONSFILE-%s-%lu-%d.r", progname,
+		(unsigned long)thepid, fd);
+	if ((cfp->debugrfd =
+	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
+	    sprintf(buf, "[---- STARTED - %s ----]\n",
+		    StrTime((time_t *)0));
+	    write(cfp->debugrfd, buf, strlen(buf));
+	}
+    }
+#endif
+
+    FDSetFile(fd, cfp);
+    FDSetFile(fdout, cfp);
+
+    CONDDEBUG((2, "FileOpenPipe(): encapsulated pipe pair fd %d and fd %d",
+	       fd, fdout));
+    return cfp;
+}
+
+/* This is to "unencapsulate" the file descriptor */
+int
+FileUnopen(CONSFILE *cfp)
+{
+    int retval = 0;
+
+    if (cfp == (CONSFILE *)0)
+	return 0;
+
+    FDForgetFile(cfp);
+
+    switch (cfp->ftype) {
+	case simpleFile:
+	    retval = cfp->fd;
+	    break;
+	case simplePipe:
+	    retval = cfp->fd;
+	    break;
+	case simpleSocket:
+	    retval = cfp->fd;
+	    break;
+#if HAVE_OPENSSL
+	case SSLSocket:
+	    retval = -1;
+	    break;
+#endif
+	default:
+	    retval = -1;
+	    break;
+    }
+    CONDDEBUG((2, "FileUnopen(): unopened fd %d", cfp->fd));
+    FileDropQueue(cfp);
+    FileIndexDrop(cfp);
+    FileFramesDrop(cfp);
+#if DEBUG_CONSFILE_IO
+    if (cfp->debugwfd != -1)
+	close(cfp->debugwfd);
+    if (cfp->debugrfd != -1)
+	close(cfp->debugrfd);
+#endif
+    free(cfp);
+
+    return retval;
+}
+
+/* This opens a file like open(2).  Returns a CONSFILE pointer
+ * or a (CONSFILE *)0 on error
+ */
+CONSFILE *
+FileOpen(const char *path, int flag, int mode)
+{
+    CONSFILE *cfp;
+    int fd;
+
+    if (-1 == (fd = open(path, flag, mode))) {
+	CONDDEBUG((2, "FileOpen(): failed to open `%s'", path));
+	return (CONSFILE *)0;
+    }
+    if ((cfp = (CONSFILE *)calloc(1, sizeof(CONSFILE)))
+	== (CONSFILE *)0)
+	OutOfMem();
+    cfp->ftype = simpleFile;
+    cfp->fd = fd;
+#if HAVE_OPENSSL
+    cfp->ssl = (SSL *)0;
+    cfp->waitForRead = cfp->waitForWrite = FLAGFALSE;
+#endif
+#if DEBUG_CONSFILE_IO
+    {
+	char buf[1024];
+	sprintf(buf, "CONSFILE-%s-%lu-%d.w", progname,
+		(unsigned long)thepid, fd);
+	if ((cfp->debugwfd =
+	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
+	    sprintf(buf, "[---- STARTED - %s ----]\n",
+		    StrTime((time_t *)0));
+	    write(cfp->debugwfd, buf, strlen(buf));
+	}
+	sprintf(buf, "CONSFILE-%s-%lu-%d.r", progname,
+		(unsigned long)thepid, fd);
+	if ((cfp->debugrfd =
+	     open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1) {
+	    sprintf(buf, "[---- STARTED - %s ----]\n",
+		    StrTime((time_t *)0));
+	    write(cfp->debugrfd, buf, strlen(buf));
+	}
+    }
+#endif
+
+    FDSetFile(fd, cfp);
+
+    CONDDEBUG((2, "FileOpen(): opened `%s' as fd %d", path, fd));
+    return cfp;
+}
+
+/* Unless otherwise stated, returns the same values as close(2).
+ * The CONSFILE object passed in *CANNOT* be used once calling
+ * this function - even if there was an error.
+ */
+int
+FileClose(CONSFILE **pcfp)
+{
+    CONSFILE *cfp;
+    int retval = 0;
+#if defined(__CYGWIN__)
+    struct linger lingeropt;
+#endif
+
+    cfp = *pcfp;
+    if (cfp == (CONSFILE *)0)
+	return 0;
+
+    FDForgetFile(cfp);
+
+    switch (cfp->ftype) {
+	case simpleFile:
+	    do {
+		retval = close(cfp->fd);
+	    } while (retval == -1 && errno == EINTR);
+	    break;
+	case simplePipe:
+	    do {
+		retval = close(cfp->fd);
+	    } while (retval == -1 && errno == EINTR);
+	    do {
+		retval = close(cfp->fdout);
+	    } while (retval == -1 && errno == EINTR);
+	    break;
+	case simpleSocket:
+#if defined(__CYGWIN__)
+	    /* flush out the client socket - set it to blocking,
+	     * then write to it
+	     */
+	    SetFlags(cfp->fd, 0, O_NONBLOCK);
 
 	    /* sent it a byte - guaranteed to block - ensure delivery
 	     * of prior data yeah - this is a bit paranoid - try
@@ -860,7 +2407,9 @@ FileClose(CONSFILE **pcfp)
     } else {
 	CONDDEBUG((2, "FileClose(): closed fd %d", cfp->fd));
     }
-    DestroyString(cfp->wbuf);
+    FileDropQueue(cfp);
+    FileIndexDrop(cfp);
+    FileFramesDrop(cfp);
 #if DEBUG_CONSFILE_IO
     if (cfp->debugwfd != -1)
 	close(cfp->debugwfd);
@@ -884,6 +2433,15 @@ FileRead(CONSFILE *cfp, void *buf, int len)
 
     switch (cfp->ftype) {
 	case simpleFile:
+	    if (cfp->frm != (FRAMES *)0) {
+		if ((retval =
+		     FrameReadAt(cfp, cfp->frm->pos, buf, len)) > 0)
+		    cfp->frm->pos += retval;
+		else
+		    retval = -1;
+		break;
+	    }
+	    /* fall through */
 	case simplePipe:
 	case simpleSocket:
 	    while (retval < 0) {
@@ -914,8 +2472,8 @@ FileRead(CONSFILE *cfp, void *buf, int len)
 	case SSLSocket:
 	    if (cfp->waitForWrite == FLAGTRUE) {
 		cfp->waitForWrite = FLAGFALSE;
-		if (cfp->wbuf->used <= 1)
-		    FD_CLR(cfp->fd, &winit);
+		if (FileBufEmpty(cfp))
+		    FDUnwatch(cfp->fd, FDWATCH_WRITE);
 	    }
 	    retval = SSL_read(cfp->ssl, buf, len);
 	    switch (SSL_get_error(cfp->ssl, retval)) {
@@ -926,7 +2484,7 @@ FileRead(CONSFILE *cfp, void *buf, int len)
 		    break;
 		case SSL_ERROR_WANT_WRITE:
 		    cfp->waitForWrite = FLAGTRUE;
-		    FD_SET(cfp->fd, &winit);
+		    FDWatch(cfp->fd, FDWATCH_WRITE);
 		    retval = 0;
 		    break;
 		default:
@@ -987,72 +2545,27 @@ FileRead(CONSFILE *cfp, void *buf, int len)
     return retval;
 }
 
-/* returns: -1 on error or eof, >= 0 for valid reads */
-int
-FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
+/* push out as much of the write queue as we can.
+ * returns: -1 on error or eof, >= 0 for the bytes written
+ */
+static int
+FileDrain(CONSFILE *cfp, int len_orig)
 {
-    int len_orig = len;
     int len_out = 0;
     int retval = 0;
     int fdout = 0;
+#if !HAVE_WRITEV || HAVE_OPENSSL
+    char *buf;
+    int len;
+#endif
 
     if (cfp->ftype == simplePipe)
 	fdout = cfp->fdout;
     else
 	fdout = cfp->fd;
 
-    if (cfp->errored == FLAGTRUE) {
-	if (cfp->wbuf->used > 1)
-	    BuildString((char *)0, cfp->wbuf);
-	FD_CLR(fdout, &winit);
-	return -1;
-    }
-
-    if (len < 0 && buf != (char *)0)
-	len = strlen(buf);
-
-    if (fDebug && len > 0 && buf != (char *)0) {
-	static STRING *tmpString = (STRING *)0;
-	if (tmpString == (STRING *)0)
-	    tmpString = AllocString();
-	BuildString((char *)0, tmpString);
-	if (len > 30) {
-	    FmtCtlStr(buf, 30, tmpString);
-	    CONDDEBUG((2, "FileWrite(): sending `%s'... to fd %d",
-		       tmpString->string, fdout));
-	} else {
-	    FmtCtlStr(buf, len, tmpString);
-	    CONDDEBUG((2, "FileWrite(): sending `%s' to fd %d",
-		       tmpString->string, fdout));
-	}
-    }
-
-    /* save the data */
-    if (len > 0 && buf != (char *)0) {
-	if (cfp->quoteiac == FLAGTRUE) {
-	    int l, o;
-	    for (o = l = 0; l < len; l++) {
-		if (buf[l] == (char)OB_IAC) {
-		    BuildStringN(buf + o, l + 1 - o, cfp->wbuf);
-		    BuildStringChar((char)OB_IAC, cfp->wbuf);
-		    o = l + 1;
-		}
-	    }
-	    if (o < len)
-		BuildStringN(buf + o, len - o, cfp->wbuf);
-	} else
-	    BuildStringN(buf, len, cfp->wbuf);
-    }
-
-    if (bufferonly == FLAGTRUE)
-	return 0;
-
-    /* point at the local data */
-    buf = cfp->wbuf->string;
-    len = cfp->wbuf->used - 1;
-
     /* if we don't have any, forget it */
-    if (buf == (char *)0 || len <= 0)
+    if (FileBufEmpty(cfp))
 	return 0;
 
     /* so, we could be blocking or non-blocking.  since we may be able
@@ -1063,8 +2576,19 @@ FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
 	case simplePipe:
 	case simpleFile:
 	case simpleSocket:
-	    while (len > 0) {
-		if ((retval = write(fdout, buf, len)) < 0) {
+	    while (!FileBufEmpty(cfp)) {
+#if HAVE_WRITEV
+		struct iovec iov[FILEIOVMAX];
+		int n = FileQueueIOV(cfp, iov, FILEIOVMAX);
+		if (n == 1)
+		    retval = write(fdout, iov[0].iov_base, iov[0].iov_len);
+		else
+		    retval = writev(fdout, iov, n);
+#else
+		len = FileQueueHead(cfp, &buf);
+		retval = write(fdout, buf, len);
+#endif
+		if (retval < 0) {
 		    if (errno == EINTR)
 			continue;
 		    if (errno == EAGAIN) {
@@ -1092,12 +2616,7 @@ FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
 			  strerror(errno));
 		    break;
 		}
-#if DEBUG_CONSFILE_IO
-		if (cfp->debugwfd != -1)
-		    write(cfp->debugwfd, buf, retval);
-#endif
-		buf += retval;
-		len -= retval;
+		FileConsume(cfp, retval);
 		len_out += retval;
 	    }
 	    break;
@@ -1105,7 +2624,7 @@ FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
 	case SSLSocket:
 	    if (cfp->waitForRead == FLAGTRUE)
 		cfp->waitForRead = FLAGFALSE;
-	    while (len > 0) {
+	    while ((len = FileQueueHead(cfp, &buf)) > 0) {
 		/* in theory, SSL_write always returns 'len' on success
 		 * so the while() loop is a noop.  but, just in case i
 		 * read something wrong, we treat SSL_write like write().
@@ -1116,10 +2635,10 @@ FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
 			break;
 		    case SSL_ERROR_WANT_READ:
 			cfp->waitForRead = FLAGTRUE;
-			retval = len_out = 0;
+			retval = 0;
 			break;
 		    case SSL_ERROR_WANT_WRITE:
-			retval = len_out = 0;
+			retval = 0;
 			break;
 		    default:
 			Error("FileWrite(): SSL error on fd %d", cfp->fd);
@@ -1140,12 +2659,7 @@ FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
 		}
 		if (retval <= 0)
 		    break;
-# if DEBUG_CONSFILE_IO
-		if (cfp->debugwfd != -1)
-		    write(cfp->debugwfd, buf, retval);
-# endif
-		buf += retval;
-		len -= retval;
+		FileConsume(cfp, retval);
 		len_out += retval;
 	    }
 	    break;
@@ -1156,47 +2670,233 @@ FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
     }
 
     /* so, if we saw an error, just bail...all is done anyway */
+    if (retval >= 0)
+	retval = len_out;
+
+    if (retval < 0) {
+	FileDropQueue(cfp);
+	cfp->errored = FLAGTRUE;
+    }
+
+    if (FileBufEmpty(cfp)) {
+	/* if someone was waiting on this to drain (ISFLUSHING), let
+	 * them know it has, since the fd won't tell them now
+	 */
+	if (FDIsWatched(fdout, FDWATCH_WRITE)) {
+	    FDUnwatch(fdout, FDWATCH_WRITE);
+	    FDPost(fdout, FDWATCH_WRITE);
+	}
+    } else {
+	FDWatch(fdout, FDWATCH_WRITE);
+	CONDDEBUG((2, "FileWrite(): buffered %d byte%s for fd %d",
+		   cfp->wqlen, (cfp->wqlen == 1) ? "" : "s", fdout));
+    }
+
     if (retval >= 0) {
-	if (len_out > 0) {
-	    /* save the rest for later */
-	    if (len > 0) {
-		ShiftString(cfp->wbuf, len_out);
-	    } else {
-		BuildString((char *)0, cfp->wbuf);
+	CONDDEBUG((2, "FileWrite(): wrote %d byte%s to fd %d", retval,
+		   (retval == 1) ? "" : "s", fdout));
+    } else {
+	CONDDEBUG((2, "FileWrite(): write of %d byte%s to fd %d: %s",
+		   len_orig, (retval == -1) ? "" : "s", fdout,
+		   strerror(errno)));
+    }
+
+    return retval;
+}
+
+#if HAVE_ZLIB
+/* compress the write queue of a framed logfile into frames of up to
+ * FRAMEMAX bytes and write them out (FileWrite() calls this instead
+ * of FileDrain()).  returns -1 on error, else the bytes written.
+ */
+static int
+FrameDeflate(z_stream *zs, char *data, int len, int flush)
+{
+    int r;
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = len;
+    do {
+	FrameRoom(&frameZbuf, &frameZsize, (int)zs->total_out + 16384);
+	zs->next_out = (Bytef *)frameZbuf + zs->total_out;
+	zs->avail_out = frameZsize - (int)zs->total_out;
+	r = deflate(zs, flush);
+	if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+	    return -1;
+    } while (zs->avail_in > 0 ||
+	     (flush == Z_FINISH && r != Z_STREAM_END));
+    return 0;
+}
+
+static int
+FrameEnd(CONSFILE *cfp, z_stream *zs, int len)
+{
+    FRAMES *f = cfp->frm;
+    int r, n, zlen;
+
+    if (FrameDeflate(zs, (char *)0, 0, Z_FINISH) < 0)
+	return -1;
+    zlen = (int)zs->total_out;
+    for (n = 0; n < zlen; n += r) {
+	if ((r = write(cfp->fd, frameZbuf + n, zlen - n)) < 0) {
+	    if (errno == EINTR) {
+		r = 0;
+		continue;
+	    }
+	    Error("FrameEnd(): write(%d): %s", cfp->fd, strerror(errno));
+	    return -1;
+	}
+    }
+    FrameIndexAdd(f, f->size + len, f->zsize + zlen);
+    deflateReset(zs);
+    return len;
+}
+
+static int
+FileFrameWrite(CONSFILE *cfp)
+{
+    static z_stream *zs = (z_stream *)0;
+    WSEG *s;
+    int o, n, len = 0, total = 0;
+
+    if (zs == (z_stream *)0) {
+	if ((zs = (z_stream *)calloc(1, sizeof(z_stream))) ==
+	    (z_stream *)0)
+	    OutOfMem();
+	if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+			 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	    OutOfMem();
+    }
+
+    /* once we're writing, we're done reading */
+    if (cfp->frm->buf != (char *)0) {
+	free(cfp->frm->buf);
+	cfp->frm->buf = (char *)0;
+	cfp->frm->bsize = cfp->frm->blen = 0;
+    }
+
+    for (s = cfp->whead; s != (WSEG *)0; s = s->next) {
+	for (o = 0; o < s->len; o += n) {
+	    n = s->len - o;
+	    if (n > FRAMEMAX - len)
+		n = FRAMEMAX - len;
+	    if (FrameDeflate(zs, s->chunk->data + s->off + o, n,
+			     Z_NO_FLUSH) < 0)
+		goto botch;
+	    if ((len += n) == FRAMEMAX) {
+		if (FrameEnd(cfp, zs, len) < 0)
+		    goto botch;
+		total += len;
+		len = 0;
 	    }
 	}
-	retval = len_out;
+    }
+    if (len > 0) {
+	if (FrameEnd(cfp, zs, len) < 0)
+	    goto botch;
+	total += len;
+    }
+    FileDropQueue(cfp);
+    CONDDEBUG((2, "FileWrite(): wrote %d bytes in frames to fd %d",
+	       total, cfp->fd));
+    return total;
+
+  botch:
+    deflateReset(zs);
+    FileDropQueue(cfp);
+    cfp->errored = FLAGTRUE;
+    return -1;
+}
+#endif
+
+/* returns: -1 on error or eof, >= 0 for valid reads */
+int
+FileWrite(CONSFILE *cfp, FLAG bufferonly, char *buf, int len)
+{
+    int fdout = 0;
+    int retval;
+
+    if (cfp->ftype == simplePipe)
+	fdout = cfp->fdout;
+    else
+	fdout = cfp->fd;
+
+    if (cfp->errored == FLAGTRUE) {
+	FileDropQueue(cfp);
+	FDUnwatch(fdout, FDWATCH_WRITE);
+	return -1;
+    }
+
+    if (len < 0 && buf != (char *)0)
+	len = strlen(buf);
+
+    if (fDebug && len > 0 && buf != (char *)0) {
+	static STRING *tmpString = (STRING *)0;
+	if (tmpString == (STRING *)0)
+	    tmpString = AllocString();
+	BuildString((char *)0, tmpString);
+	if (len > 30) {
+	    FmtCtlStr(buf, 30, tmpString);
+	    CONDDEBUG((2, "FileWrite(): sending `%s'... to fd %d",
+		       tmpString->string, fdout));
+	} else {
+	    FmtCtlStr(buf, len, tmpString);
+	    CONDDEBUG((2, "FileWrite(): sending `%s' to fd %d",
+		       tmpString->string, fdout));
+	}
     }
 
-    if (retval < 0) {
-	if (cfp->wbuf->used > 1)
-	    BuildString((char *)0, cfp->wbuf);
-	cfp->errored = FLAGTRUE;
+    /* save the data */
+    if (len > 0 && buf != (char *)0) {
+	if (cfp->lidx != (LINEINDEX *)0)
+	    FileIndexData(cfp, buf, len);
+	if (cfp->quoteiac == FLAGTRUE)
+	    FileQueueQuoted(cfp, buf, len);
+	else
+	    FileQueueData(cfp, buf, len);
     }
 
-    if (cfp->wbuf->used <= 1)
-	FD_CLR(fdout, &winit);
-    else {
-	FD_SET(fdout, &winit);
-	CONDDEBUG((2, "FileWrite(): buffered %d byte%s for fd %d",
-		   (cfp->wbuf->used <= 1) ? 0 : cfp->wbuf->used,
-		   (cfp->wbuf->used <= 1) ? "" : "s", fdout));
-    }
+    if (bufferonly == FLAGTRUE)
+	return 0;
 
-    if (retval >= 0) {
-	CONDDEBUG((2, "FileWrite(): wrote %d byte%s to fd %d", retval,
-		   (retval == 1) ? "" : "s", fdout));
-    } else {
-	CONDDEBUG((2, "FileWrite(): write of %d byte%s to fd %d: %s",
-		   len_orig, (retval == -1) ? "" : "s", fdout,
-		   strerror(errno)));
+#if HAVE_ZLIB
+    if (cfp->frm != (FRAMES *)0)
+	retval = FileFrameWrite(cfp);
+    else
+#endif
+	retval = FileDrain(cfp, len);
+    FileIndexFlush(cfp);
+    return retval;
+}
+
+/* queue (a reference to) a shared chunk on cfp and try to send it.
+ * returns just like FileWrite()
+ */
+int
+FileWriteChunk(CONSFILE *cfp, FLAG bufferonly, CHUNK *chunk)
+{
+    if (cfp->errored == FLAGTRUE)
+	return FileWrite(cfp, bufferonly, (char *)0, 0);
+
+    if (cfp->quoteiac == FLAGTRUE)
+	chunk = ChunkQuoted(chunk);
+
+    if (chunk->len > 0) {
+	CONDDEBUG((2, "FileWriteChunk(): queueing %d byte%s for fd %d",
+		   chunk->len, (chunk->len == 1) ? "" : "s",
+		   FileFDOutNum(cfp)));
+	FileQueueChunk(cfp, chunk);
     }
 
-    return retval;
+    if (bufferonly == FLAGTRUE)
+	return 0;
+
+    return FileDrain(cfp, chunk->len);
 }
 
+/* was cfp ready for reading in the last FDWait()? */
 int
-FileCanRead(CONSFILE *cfp, fd_set *prfd, fd_set *pwfd)
+FileCanRead(CONSFILE *cfp)
 {
 #if HAVE_OPENSSL
     int fdout;
@@ -1212,18 +2912,20 @@ FileCanRead(CONSFILE *cfp, fd_set *prfd, fd_set *pwfd)
 	fdout = cfp->fd;
 #endif
 
-    return ((FD_ISSET(cfp->fd, prfd)
+    return ((FDIsReady(cfp->fd, FDWATCH_READ)
 #if HAVE_OPENSSL
 	     && cfp->waitForRead != FLAGTRUE) || (fdout >= 0 &&
-						  FD_ISSET(fdout, pwfd)
+						  FDIsReady(fdout,
+							    FDWATCH_WRITE)
 						  && cfp->waitForWrite ==
 						  FLAGTRUE
 #endif
 	    ));
 }
 
+/* was cfp ready for writing in the last FDWait()? */
 int
-FileCanWrite(CONSFILE *cfp, fd_set *prfd, fd_set *pwfd)
+FileCanWrite(CONSFILE *cfp)
 {
     int fdout;
 
@@ -1235,11 +2937,11 @@ FileCanWrite(CONSFILE *cfp, fd_set *prfd, fd_set *pwfd)
     else
 	fdout = cfp->fd;
 
-    return ((FD_ISSET(fdout, pwfd)
+    return ((FDIsReady(fdout, FDWATCH_WRITE)
 #if HAVE_OPENSSL
-	     && cfp->waitForWrite != FLAGTRUE) || (FD_ISSET(cfp->fd, prfd)
-						   && cfp->waitForRead ==
-						   FLAGTRUE
+	     && cfp->waitForWrite != FLAGTRUE) ||
+	    (FDIsReady(cfp->fd, FDWATCH_READ)
+	     && cfp->waitForRead == FLAGTRUE
 #endif
 	    ));
 }
@@ -1249,7 +2951,85 @@ FileBufEmpty(CONSFILE *cfp)
 {
     if (cfp == (CONSFILE *)0)
 	return 1;
-    return (cfp->wbuf->used <= 1);
+    return (cfp->whead == (WSEG *)0);
+}
+
+/* how many bytes are waiting to be written */
+int
+FileBufLen(CONSFILE *cfp)
+{
+    if (cfp == (CONSFILE *)0)
+	return 0;
+    return cfp->wqlen;
+}
+
+/* copy the queued data, as it would go out, onto the end of msg */
+void
+FileQueued(CONSFILE *cfp, STRING *msg)
+{
+    WSEG *s;
+
+    if (cfp == (CONSFILE *)0)
+	return;
+    for (s = cfp->whead; s != (WSEG *)0; s = s->next)
+	BuildStringN(s->chunk->data + s->off, s->len, msg);
+}
+
+/* throw away the oldest queued data until no more than keep bytes are
+ * left, and put note (a printf() format with a single %d for the number
+ * of bytes lost) where it was.  the first segment is never touched,
+ * since part of it may already be out the door (and an OB_IAC pair or
+ * an SSL record could be split).  if the note from a previous call
+ * gets dropped, its count carries over into the new one.  returns the
+ * number of bytes of data thrown away.
+ */
+int
+FileSkipQueue(CONSFILE *cfp, int keep, char *note)
+{
+    WSEG *head, *s;
+    int skipped = 0;
+    int carried = 0;
+    int n;
+    CHUNK *c;
+    static STRING *msg = (STRING *)0;
+
+    if (cfp == (CONSFILE *)0 || (head = cfp->whead) == (WSEG *)0)
+	return 0;
+
+    while (cfp->wqlen > keep && (s = head->next) != (WSEG *)0) {
+	if (s == cfp->wnote) {
+	    carried = cfp->wskipped;
+	    cfp->wnote = (WSEG *)0;
+	} else
+	    skipped += s->len;
+	cfp->wqlen -= s->len;
+	if ((head->next = s->next) == (WSEG *)0)
+	    cfp->wtail = head;
+	ReleaseChunk(s->chunk);
+	s->next = wsegFree;
+	wsegFree = s;
+    }
+
+    if ((n = skipped + carried) == 0 || note == (char *)0)
+	return skipped;
+
+    if (msg == (STRING *)0)
+	msg = AllocString();
+    BuildString((char *)0, msg);
+    BuildStringPrint(msg, note, n);
+    c = AllocChunk(msg->string, msg->used - 1);
+    s = NewWSeg(c);
+    ReleaseChunk(c);
+    if ((s->next = head->next) == (WSEG *)0)
+	cfp->wtail = s;
+    head->next = s;
+    cfp->wqlen += s->len;
+    cfp->wnote = s;
+    cfp->wskipped = n;
+
+    CONDDEBUG((2, "FileSkipQueue(): skipped %d byte%s for fd %d",
+	       skipped, (skipped == 1) ? "" : "s", FileFDOutNum(cfp)));
+    return skipped;
 }
 
 void
@@ -1522,6 +3302,9 @@ FileStat(CONSFILE *cfp, struct stat *buf)
     switch (cfp->ftype) {
 	case simpleFile:
 	    retval = fstat(cfp->fd, buf);
+	    /* the size of a framed logfile is what it decompresses to */
+	    if (retval == 0 && cfp->frm != (FRAMES *)0)
+		buf->st_size = cfp->frm->size;
 	    break;
 	case simplePipe:
 	    retval = -1;
@@ -1545,6 +3328,24 @@ FileStat(CONSFILE *cfp, struct stat *buf)
     return retval;
 }
 
+/* get what's been written to cfp onto the disk, returns the same
+ * values as fsync(2)
+ */
+int
+FileSync(CONSFILE *cfp)
+{
+    int retval;
+
+    do {
+#if HAVE_FDATASYNC
+	retval = fdatasync(cfp->fd);
+#else
+	retval = fsync(cfp->fd);
+#endif
+    } while (retval == -1 && errno == EINTR);
+    return retval;
+}
+
 /* Unless otherwise stated, returns the same values as lseek(2) */
 int
 FileSeek(CONSFILE *cfp, off_t offset, int whence)
@@ -1556,6 +3357,15 @@ FileSeek(CONSFILE *cfp, off_t offset, int whence)
 
     switch (cfp->ftype) {
 	case simpleFile:
+	    if (cfp->frm != (FRAMES *)0) {
+		if (whence == SEEK_CUR)
+		    offset += cfp->frm->pos;
+		else if (whence == SEEK_END)
+		    offset += cfp->frm->size;
+		if ((retval = (offset < 0) ? -1 : (int)offset) >= 0)
+		    cfp->frm->pos = offset;
+		break;
+	    }
 	    retval = lseek(cfp->fd, offset, whence);
 	    break;
 	case simplePipe:
@@ -1705,13 +3515,15 @@ FileSetSSL(CONSFILE *cfp, SSL *ssl)
 
 /* return -1 on error, 0 for "wait" state, 1 for success */
 int
-FileCanSSLAccept(CONSFILE *cfp, fd_set *prfd, fd_set *pwfd)
+FileCanSSLAccept(CONSFILE *cfp)
 {
     if (cfp == (CONSFILE *)0)
 	return 0;
 
-    return ((FD_ISSET(cfp->fd, prfd) && cfp->waitForRead == FLAGTRUE) ||
-	    (FD_ISSET(cfp->fd, pwfd) && cfp->waitForWrite == FLAGTRUE) ||
+    return ((FDIsReady(cfp->fd, FDWATCH_READ) &&
+	     cfp->waitForRead == FLAGTRUE) ||
+	    (FDIsReady(cfp->fd, FDWATCH_WRITE) &&
+	     cfp->waitForWrite == FLAGTRUE) ||
 	    (cfp->waitForRead != FLAGTRUE &&
 	     cfp->waitForWrite != FLAGTRUE));
 }
@@ -1723,8 +3535,8 @@ FileSSLAccept(CONSFILE *cfp)
     int retval;
     if (cfp->waitForWrite == FLAGTRUE) {
 	cfp->waitForWrite = FLAGFALSE;
-	if (cfp->wbuf->used <= 1)
-	    FD_CLR(cfp->fd, &winit);
+	if (FileBufEmpty(cfp))
+	    FDUnwatch(cfp->fd, FDWATCH_WRITE);
     }
     cfp->waitForRead = FLAGFALSE;
 
@@ -1739,7 +3551,7 @@ FileSSLAccept(CONSFILE *cfp)
 	    return 0;
 	case SSL_ERROR_WANT_WRITE:
 	    cfp->waitForWrite = FLAGTRUE;
-	    FD_SET(cfp->fd, &winit);
+	    FDWatch(cfp->fd, FDWATCH_WRITE);
 	    return 0;
 	default:
 	    Error("FileSSLAccept(): SSL error on fd %d", cfp->fd);
@@ -1771,7 +3583,7 @@ FileSend(CONSFILE *cfp, const void *msg, size_t len, int flags)
 	fdout = cfp->fd;
 
     if (cfp->errored == FLAGTRUE) {
-	FD_CLR(fdout, &winit);
+	FDUnwatch(fdout, FDWATCH_WRITE);
 	return -1;
     }
 
@@ -1797,7 +3609,7 @@ FileSend(CONSFILE *cfp, const void *msg, size_t len, int flags)
 
     if (retval < 0) {
 	cfp->errored = FLAGTRUE;
-	FD_CLR(fdout, &winit);
+	FDUnwatch(fdout, FDWATCH_WRITE);
     }
 
     return retval;
@@ -2253,6 +4065,124 @@ StrDup(const char *msg)
     return buf;
 }
 
+/* FNV-1a over the lowercased string */
+unsigned long
+NameHash(const char *key)
+{
+    unsigned long h = 2166136261UL;
+
+    for (; *key != '\000'; key++)
+	h = (h ^ (unsigned char)tolower((unsigned char)*key)) * 16777619UL;
+    return h;
+}
+
+NAMEMAP *
+NameMapNew(void)
+{
+    NAMEMAP *map;
+
+    if ((map = (NAMEMAP *)calloc(1, sizeof(NAMEMAP))) == (NAMEMAP *)0)
+	OutOfMem();
+    map->mask = 63;
+    if ((map->bucket =
+	 (NAMEMAPENTRY **)calloc(map->mask + 1,
+				 sizeof(NAMEMAPENTRY *))) ==
+	(NAMEMAPENTRY **)0)
+	OutOfMem();
+    return map;
+}
+
+void
+NameMapDestroy(NAMEMAP **map)
+{
+    NAMEMAPENTRY *e, *next;
+    unsigned long i;
+
+    if (*map == (NAMEMAP *)0)
+	return;
+    for (i = 0; i <= (*map)->mask; i++) {
+	for (e = (*map)->bucket[i]; e != (NAMEMAPENTRY *)0; e = next) {
+	    next = e->next;
+	    free(e);
+	}
+    }
+    free((*map)->bucket);
+    free(*map);
+    *map = (NAMEMAP *)0;
+}
+
+/* a key can be added more than once; which of those entries
+ * NameMapFind() returns is up to the hashing
+ */
+void
+NameMapAdd(NAMEMAP *map, char *key, void *value)
+{
+    NAMEMAPENTRY *e, *next, **bucket;
+    unsigned long i, h;
+
+    if (map->count > 2 * map->mask) {
+	if ((bucket =
+	     (NAMEMAPENTRY **)calloc(2 * (map->mask + 1),
+				     sizeof(NAMEMAPENTRY *))) ==
+	    (NAMEMAPENTRY **)0)
+	    OutOfMem();
+	for (i = 0; i <= map->mask; i++) {
+	    for (e = map->bucket[i]; e != (NAMEMAPENTRY *)0; e = next) {
+		next = e->next;
+		h = NameHash(e->key) & (2 * map->mask + 1);
+		e->next = bucket[h];
+		bucket[h] = e;
+	    }
+	}
+	map->mask = 2 * map->mask + 1;
+	free(map->bucket);
+	map->bucket = bucket;
+    }
+    if ((e = (NAMEMAPENTRY *)malloc(sizeof(NAMEMAPENTRY))) ==
+	(NAMEMAPENTRY *)0)
+	OutOfMem();
+    h = NameHash(key) & map->mask;
+    e->key = key;
+    e->value = value;
+    e->next = map->bucket[h];
+    map->bucket[h] = e;
+    map->count++;
+}
+
+void *
+NameMapFind(NAMEMAP *map, const char *key)
+{
+    NAMEMAPENTRY *e;
+
+    if (map == (NAMEMAP *)0)
+	return (void *)0;
+    for (e = map->bucket[NameHash(key) & map->mask];
+	 e != (NAMEMAPENTRY *)0; e = e->next) {
+	if (strcasecmp(e->key, key) == 0)
+	    return e->value;
+    }
+    return (void *)0;
+}
+
+/* drop the entry for key that has this value */
+void
+NameMapDelete(NAMEMAP *map, const char *key, void *value)
+{
+    NAMEMAPENTRY **pe, *e;
+
+    if (map == (NAMEMAP *)0)
+	return;
+    for (pe = &map->bucket[NameHash(key) & map->mask];
+	 (e = *pe) != (NAMEMAPENTRY *)0; pe = &e->next) {
+	if (e->value == value && strcasecmp(e->key, key) == 0) {
+	    *pe = e->next;
+	    free(e);
+	    map->count--;
+	    return;
+	}
+    }
+}
+
 char *
 StringChar(STRING *msg, int offset, char c)
 {
@@ -2279,8 +4209,8 @@ StringChar(STRING *msg, int offset, char c)
 int
 ParseIACBuf(CONSFILE *cfp, void *msg, int *len)
 {
-    int l = 0;
-    unsigned char *b = msg;
+    int l = 0, n;
+    unsigned char *b = msg, *e, *p, *r, *w;
 
     if (*len <= 0)
 	return -1;
@@ -2321,20 +4251,102 @@ ParseIACBuf(CONSFILE *cfp, void *msg, int *len)
 	if (l == 0)
 	    return 0;
     }
-    for (; l < *len; l++) {
-	if (b[l] == OB_IAC) {
-	    if (l + 1 == *len)
-		return l;
 
-	    if (b[l + 1] == OB_IAC) {
-		--(*len);
-		MemMove(b + l, b + l + 1, *len - l);
-	    } else {
-		return l;
-	    }
-	}
+    /* jump from OB_IAC to OB_IAC, squeezing OB_IAC/OB_IAC pairs out as
+     * we go so the buffer is only moved once (almost always not at all)
+     */
+    e = b + *len;
+    r = w = b + l;
+    for (;;) {
+	p = memchr(r, OB_IAC, e - r);
+	n = ((p == (unsigned char *)0) ? e : p) - r;
+	if (w != r)
+	    MemMove(w, r, n);
+	w += n;
+	r += n;
+	if (p == (unsigned char *)0 || p + 1 == e || p[1] != OB_IAC)
+	    break;
+	*w++ = OB_IAC;
+	r += 2;
+    }
+    if (w != r) {
+	MemMove(w, r, e - r);
+	*len -= r - w;
+    }
+    return w - b;
+}
+
+/* return the offset of the first byte in buf that is c1 or c2, or
+ * len if there isn't one.  console data is almost all plain text, so
+ * we look at 32 (or 16) bytes a time where the compiler lets us
+ */
+size_t
+MemFind2(const void *buf, size_t len, int c1, int c2)
+{
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+#if defined(__GNUC__) && defined(__AVX2__)
+    __m256i v1 = _mm256_set1_epi8((char)c1);
+    __m256i v2 = _mm256_set1_epi8((char)c2);
+
+    for (; i + 32 <= len; i += 32) {
+	__m256i d = _mm256_loadu_si256((const __m256i *)(p + i));
+	unsigned int m =
+	    (unsigned int)_mm256_movemask_epi8(_mm256_or_si256
+					       (_mm256_cmpeq_epi8(d, v1),
+						_mm256_cmpeq_epi8(d, v2)));
+	if (m != 0)
+	    return i + __builtin_ctz(m);
+    }
+#elif defined(__GNUC__) && defined(__SSE2__)
+    __m128i v1 = _mm_set1_epi8((char)c1);
+    __m128i v2 = _mm_set1_epi8((char)c2);
+
+    for (; i + 16 <= len; i += 16) {
+	__m128i d = _mm_loadu_si128((const __m128i *)(p + i));
+	unsigned int m =
+	    (unsigned int)_mm_movemask_epi8(_mm_or_si128
+					    (_mm_cmpeq_epi8(d, v1),
+					     _mm_cmpeq_epi8(d, v2)));
+	if (m != 0)
+	    return i + __builtin_ctz(m);
     }
-    return l;
+#endif
+    for (; i < len; i++)
+	if (p[i] == (unsigned char)c1 || p[i] == (unsigned char)c2)
+	    return i;
+    return len;
+}
+
+/* copy len bytes from src to dst with the high bit of each stripped
+ * (for `striphigh' consoles)
+ */
+void
+MemStrip(void *dst, const void *src, size_t len)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    size_t i = 0;
+
+#if defined(__GNUC__) && defined(__AVX2__)
+    __m256i m = _mm256_set1_epi8(0x7f);
+
+    for (; i + 32 <= len; i += 32)
+	_mm256_storeu_si256((__m256i *)(d + i),
+			    _mm256_and_si256(_mm256_loadu_si256
+					     ((const __m256i *)(s + i)),
+					     m));
+#elif defined(__GNUC__) && defined(__SSE2__)
+    __m128i m = _mm_set1_epi8(0x7f);
+
+    for (; i + 16 <= len; i += 16)
+	_mm_storeu_si128((__m128i *)(d + i),
+			 _mm_and_si128(_mm_loadu_si128
+				       ((const __m128i *)(s + i)), m));
+#endif
+    for (; i < len; i++)
+	d[i] = s[i] & 127;
 }
 
 /* the format of the file should be as follows
@@ -2534,6 +4546,493 @@ GetWord(FILE *fp, int *line, short spaceok, STRING *word)
     return DONE;
 }
 
+/* configuration snapshots
+ *
+ * a snapshot is what ParseFile() handed to the sections[] handlers -
+ * every begin, item, end and abort, with its value and file/line - plus
+ * the path, mtime, size and hash of each file (and include) it read.
+ * replaying those events through the handlers builds the same tables
+ * parsing would, it just skips the tokenizing.  it's only used while
+ * every file still matches.  it's a cache, so the layout is native:
+ * a SNAPHEADER, the SNAPFILEs (each followed by its path), the section
+ * and item names (each section's list ends with an empty name), then
+ * the SNAPEVENTs (each followed by its value, if it has one)
+ */
+#define SNAPMAGIC	"cfsnap\n"
+#define SNAPFORMAT	1
+
+#define SNAP_BEGIN	1
+#define SNAP_ITEM	2
+#define SNAP_END	3
+#define SNAP_ABORT	4
+
+typedef struct snapHeader {
+    char magic[8];
+    unsigned int format;
+    unsigned int files;
+    unsigned int events;
+    unsigned long sum;		/* hash of everything after this */
+    char version[64];
+} SNAPHEADER;
+
+typedef struct snapFile {
+    long mtime;
+    long size;			/* -1 if it couldn't be read */
+    unsigned long hash;
+    unsigned int len;		/* of the path, with its '\0' */
+} SNAPFILE;
+
+typedef struct snapEvent {
+    unsigned char op;
+    unsigned char sec;
+    unsigned short item;
+    unsigned int file;
+    int line;
+    unsigned int len;		/* of the value, with its '\0' */
+} SNAPEVENT;
+
+static int snapRecording = 0;
+static STRING *snapFiles = (STRING *)0;
+static STRING *snapEvents = (STRING *)0;
+static unsigned int snapNFiles = 0;
+static unsigned int snapNEvents = 0;
+static unsigned int snapFileCur = 0;
+
+/* FNV-1a, from h */
+static unsigned long
+SnapHash(unsigned long h, unsigned char *buf, long len)
+{
+    long i;
+
+    for (i = 0; i < len; i++) {
+	h ^= buf[i];
+	h *= 16777619UL;
+    }
+    return h;
+}
+
+/* fill in sf for path, hashing the contents */
+static void
+SnapStat(char *path, SNAPFILE *sf, FLAG hash)
+{
+    struct stat st;
+    unsigned char buf[8192];
+    unsigned long h = 2166136261UL;
+    int fd, r;
+
+    /* the padding is written out and compared too */
+    memset(sf, 0, sizeof(*sf));
+    sf->size = -1;
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return;
+    if (fstat(fd, &st) != 0) {
+	close(fd);
+	return;
+    }
+    sf->mtime = (long)st.st_mtime;
+    sf->size = (long)st.st_size;
+    if (hash == FLAGTRUE) {
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+	    if (r < 0) {
+		if (errno == EINTR)
+		    continue;
+		sf->size = -1;
+		break;
+	    }
+	    h = SnapHash(h, buf, r);
+	}
+	sf->hash = h;
+    }
+    close(fd);
+}
+
+/* add path to the file table, returning its index */
+static int
+SnapFile(char *path)
+{
+    SNAPFILE sf;
+
+    if (!snapRecording)
+	return 0;
+    SnapStat(path, &sf, FLAGTRUE);
+    sf.len = strlen(path) + 1;
+    BuildStringN((char *)&sf, sizeof(sf), snapFiles);
+    BuildStringN(path, sf.len, snapFiles);
+    return snapNFiles++;
+}
+
+static void
+SnapEvent(int op, int sec, int item, char *value)
+{
+    SNAPEVENT se;
+
+    if (!snapRecording)
+	return;
+    memset(&se, 0, sizeof(se));
+    se.op = op;
+    se.sec = sec;
+    se.item = item;
+    se.file = snapFileCur;
+    se.line = line;
+    se.len = (value == (char *)0) ? 0 : strlen(value) + 1;
+    BuildStringN((char *)&se, sizeof(se), snapEvents);
+    if (se.len != 0)
+	BuildStringN(value, se.len, snapEvents);
+    snapNEvents++;
+}
+
+/* start (or stop, and forget) recording what ParseFile() does */
+void
+SnapshotRecord(FLAG on)
+{
+    if (snapFiles == (STRING *)0) {
+	snapFiles = AllocString();
+	snapEvents = AllocString();
+    }
+    BuildString((char *)0, snapFiles);
+    BuildString((char *)0, snapEvents);
+    snapNFiles = snapNEvents = 0;
+    snapFileCur = 0;
+    snapRecording = (on == FLAGTRUE);
+}
+
+/* the snapshot of what's been recorded */
+static void
+SnapImage(STRING *img)
+{
+    SNAPHEADER sh;
+    int i, j;
+
+    memset(&sh, 0, sizeof(sh));
+    memcpy(sh.magic, SNAPMAGIC, sizeof(sh.magic));
+    sh.format = SNAPFORMAT;
+    sh.files = snapNFiles;
+    sh.events = snapNEvents;
+    StrCpy(sh.version, MyVersion(), sizeof(sh.version));
+
+    BuildString((char *)0, img);
+    BuildStringN((char *)&sh, sizeof(sh), img);
+    BuildStringN(snapFiles->string, snapFiles->used - 1, img);
+    for (i = 0; sections[i].id != (char *)0; i++) {
+	BuildStringN(sections[i].id, strlen(sections[i].id) + 1, img);
+	for (j = 0; sections[i].items[j].id != (char *)0; j++)
+	    BuildStringN(sections[i].items[j].id,
+			 strlen(sections[i].items[j].id) + 1, img);
+	BuildStringN("", 1, img);
+    }
+    BuildStringN("", 1, img);
+    BuildStringN(snapEvents->string, snapEvents->used - 1, img);
+
+    sh.sum = SnapHash(2166136261UL, (unsigned char *)img->string +
+		      sizeof(sh), img->used - 1 - sizeof(sh));
+    memcpy(img->string, &sh, sizeof(sh));
+}
+
+/* write out what's been recorded, atomically */
+int
+SnapshotSave(char *path)
+{
+    STRING *img, *tmp;
+    int fd, r, off;
+
+    img = AllocString();
+    tmp = AllocString();
+    SnapImage(img);
+    BuildStringPrint(tmp, "%s.%lu", path, (unsigned long)getpid());
+    if ((fd = open(tmp->string, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+	Error("SnapshotSave(): open(%s): %s", tmp->string, strerror(errno));
+	DestroyString(img);
+	DestroyString(tmp);
+	return -1;
+    }
+    for (r = 0, off = 0; off < img->used - 1; off += r) {
+	if ((r = write(fd, img->string + off, img->used - 1 - off)) < 0) {
+	    if (errno == EINTR) {
+		r = 0;
+		continue;
+	    }
+	    break;
+	}
+    }
+    if (r < 0) {
+	Error("SnapshotSave(): write(%s): %s", tmp->string,
+	      strerror(errno));
+	close(fd);
+    } else if (close(fd) != 0 || rename(tmp->string, path) != 0) {
+	Error("SnapshotSave(): %s: %s", path, strerror(errno));
+	r = -1;
+    }
+    if (r < 0) {
+	unlink(tmp->string);
+	DestroyString(img);
+	DestroyString(tmp);
+	return -1;
+    }
+    CONDDEBUG((1, "SnapshotSave(): wrote %d bytes to `%s'", img->used - 1,
+	       path));
+    DestroyString(img);
+    DestroyString(tmp);
+    return 0;
+}
+
+/* read in a whole snapshot (writable, since the handlers hack up their
+ * values).  returns its length or -1
+ */
+static long
+SnapMap(char *path, char **base)
+{
+    struct stat st;
+    int fd;
+#if !HAVE_SYS_MMAN_H
+    long off;
+    int r;
+#endif
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(SNAPHEADER)) {
+	close(fd);
+	return -1;
+    }
+#if HAVE_SYS_MMAN_H
+    *base = mmap((void *)0, st.st_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*base == (char *)MAP_FAILED)
+	return -1;
+#else
+    if ((*base = malloc(st.st_size)) == (char *)0)
+	OutOfMem();
+    for (off = 0; off < st.st_size; off += r) {
+	if ((r = read(fd, *base + off, st.st_size - off)) <= 0) {
+	    if (r < 0 && errno == EINTR) {
+		r = 0;
+		continue;
+	    }
+	    free(*base);
+	    close(fd);
+	    return -1;
+	}
+    }
+    close(fd);
+#endif
+    return (long)st.st_size;
+}
+
+static void
+SnapUnmap(char *base, long len)
+{
+#if HAVE_SYS_MMAN_H
+    munmap(base, len);
+#else
+    free(base);
+#endif
+}
+
+/* is the snapshot in path what recording just produced? */
+int
+SnapshotCompare(char *path)
+{
+    STRING *img;
+    char *base;
+    long len;
+    int r;
+
+    if ((len = SnapMap(path, &base)) < 0)
+	return -1;
+    img = AllocString();
+    SnapImage(img);
+    r = (len == img->used - 1 &&
+	 memcmp(base, img->string, len) == 0) ? 0 : 1;
+    DestroyString(img);
+    SnapUnmap(base, len);
+    return r;
+}
+
+/* run the snapshot in path (taken from filename) through the sections[]
+ * handlers, the same way ParseFile() would have.  the whole thing is
+ * checked before any handler is called, so -1 (stale or unusable)
+ * means nothing's been touched
+ */
+int
+SnapshotReplay(char *path, char *filename)
+{
+    SNAPHEADER sh;
+    SNAPFILE sf, cur;
+    SNAPEVENT se;
+    char *base, *p, *end, **paths = (char **)0;
+    int *secMap = (int *)0, *itemMap = (int *)0, *itemBase = (int *)0;
+    int nsec = 0, nitem = 0, s, i, j;
+    unsigned int n;
+    long len;
+
+    if ((len = SnapMap(path, &base)) < 0) {
+	CONDDEBUG((1, "SnapshotReplay(): can't read `%s'", path));
+	return -1;
+    }
+    end = base + len;
+    memcpy(&sh, base, sizeof(sh));
+    if (memcmp(sh.magic, SNAPMAGIC, sizeof(sh.magic)) != 0 ||
+	sh.format != SNAPFORMAT ||
+	strncmp(sh.version, MyVersion(), sizeof(sh.version)) != 0) {
+	Verbose("snapshot `%s' is from another version", path);
+	goto stale;
+    }
+    if (sh.sum != SnapHash(2166136261UL, (unsigned char *)base +
+			   sizeof(sh), len - sizeof(sh)))
+	goto corrupt;
+    p = base + sizeof(sh);
+
+    /* every file has to be just as it was */
+    if (sh.files == 0 || sh.files > len)
+	goto corrupt;
+    if ((paths = (char **)calloc(sh.files, sizeof(char *))) == (char **)0)
+	OutOfMem();
+    for (n = 0; n < sh.files; n++) {
+	if (end - p < sizeof(sf))
+	    goto corrupt;
+	memcpy(&sf, p, sizeof(sf));
+	p += sizeof(sf);
+	if (sf.len == 0 || end - p < sf.len || p[sf.len - 1] != '\000')
+	    goto corrupt;
+	paths[n] = p;
+	p += sf.len;
+	if (n == 0 && strcmp(paths[n], filename) != 0) {
+	    Verbose("snapshot `%s' is of `%s'", path, paths[n]);
+	    goto stale;
+	}
+	SnapStat(paths[n], &cur, FLAGFALSE);
+	if (cur.mtime == sf.mtime && cur.size == sf.size && sf.size >= 0)
+	    SnapStat(paths[n], &cur, FLAGTRUE);
+	if (cur.mtime != sf.mtime || cur.size != sf.size ||
+	    cur.hash != sf.hash) {
+	    Verbose("snapshot `%s' is stale (`%s' changed)", path,
+		    paths[n]);
+	    goto stale;
+	}
+    }
+
+    /* map its section and item numbers to ours */
+    for (s = 0; p < end && *p != '\000'; s++) {
+	if ((secMap =
+	     (int *)realloc(secMap, (s + 1) * sizeof(int))) == (int *)0 ||
+	    (itemBase =
+	     (int *)realloc(itemBase, (s + 1) * sizeof(int))) == (int *)0)
+	    OutOfMem();
+	for (i = 0; sections[i].id != (char *)0; i++)
+	    if (strcmp(sections[i].id, p) == 0)
+		break;
+	if (sections[i].id == (char *)0) {
+	    Verbose("snapshot `%s' has unknown section `%s'", path, p);
+	    goto stale;
+	}
+	secMap[s] = i;
+	itemBase[s] = nitem;
+	if ((p = memchr(p, '\000', end - p)) == (char *)0)
+	    goto corrupt;
+	for (p++; p < end && *p != '\000'; nitem++) {
+	    if ((itemMap =
+		 (int *)realloc(itemMap,
+				(nitem + 1) * sizeof(int))) == (int *)0)
+		OutOfMem();
+	    for (j = 0; sections[i].items[j].id != (char *)0; j++)
+		if (strcmp(sections[i].items[j].id, p) == 0)
+		    break;
+	    itemMap[nitem] = j;	/* unknown items are checked below */
+	    if ((p = memchr(p, '\000', end - p)) == (char *)0)
+		goto corrupt;
+	    p++;
+	}
+	p++;
+    }
+    nsec = s;
+    if (p >= end)
+	goto corrupt;
+    p++;
+
+    /* check the events over before any of them are used */
+    {
+	char *q = p;
+	for (n = 0; n < sh.events; n++) {
+	    if (end - q < sizeof(se))
+		goto corrupt;
+	    memcpy(&se, q, sizeof(se));
+	    q += sizeof(se);
+	    if (se.sec >= nsec || se.file >= sh.files ||
+		se.op < SNAP_BEGIN || se.op > SNAP_ABORT ||
+		end - q < se.len || (se.len != 0 && q[se.len - 1] != '\000')
+		|| ((se.op == SNAP_BEGIN || se.op == SNAP_ITEM) &&
+		    se.len == 0))
+		goto corrupt;
+	    if (se.op == SNAP_ITEM) {
+		if (itemBase[se.sec] + se.item >= nitem ||
+		    (se.sec + 1 < nsec &&
+		     itemBase[se.sec] + se.item >= itemBase[se.sec + 1]))
+		    goto corrupt;
+		j = itemMap[itemBase[se.sec] + se.item];
+		if (sections[secMap[se.sec]].items[j].id == (char *)0) {
+		    Verbose("snapshot `%s' has an unknown keyword", path);
+		    goto stale;
+		}
+	    }
+	    q += se.len;
+	}
+	if (q != end)
+	    goto corrupt;
+    }
+
+    /* it's good, so go */
+    for (n = 0; n < sh.events; n++) {
+	memcpy(&se, p, sizeof(se));
+	p += sizeof(se);
+	file = paths[se.file];
+	line = se.line;
+	s = secMap[se.sec];
+	switch (se.op) {
+	    case SNAP_BEGIN:
+		(*sections[s].begin) (p);
+		break;
+	    case SNAP_ITEM:
+		(*sections[s].
+		 items[itemMap[itemBase[se.sec] + se.item]].reg) (p);
+		break;
+	    case SNAP_END:
+		(*sections[s].end) ();
+		break;
+	    case SNAP_ABORT:
+		(*sections[s].abort) ();
+		break;
+	}
+	p += se.len;
+    }
+    file = filename;
+    for (i = 0; sections[i].id != (char *)0; i++) {
+	(*sections[i].destroy) ();
+    }
+    free(paths);
+    free(secMap);
+    free(itemBase);
+    free(itemMap);
+    SnapUnmap(base, len);
+    CONDDEBUG((1, "SnapshotReplay(): %u events from `%s'", sh.events,
+	       path));
+    return 0;
+
+  corrupt:
+    Verbose("snapshot `%s' is corrupt", path);
+  stale:
+    if (paths != (char **)0)
+	free(paths);
+    if (secMap != (int *)0)
+	free(secMap);
+    if (itemBase != (int *)0)
+	free(itemBase);
+    if (itemMap != (int *)0)
+	free(itemMap);
+    SnapUnmap(base, len);
+    return -1;
+}
+
 void
 ParseFile(char *filename, FILE *fp, int level)
 {
@@ -2548,6 +5047,7 @@ ParseFile(char *filename, FILE *fp, int level)
     char *p;
     TOKEN token = DONE;
     int nextline = 1;		/* "next" line number */
+    int snapIdx;		/* our spot in the snapshot file table */
 
     if (level >= 10) {
 	if (isMaster)
@@ -2559,6 +5059,7 @@ ParseFile(char *filename, FILE *fp, int level)
     /* set some globals */
     line = 1;
     file = filename;
+    snapIdx = snapFileCur = SnapFile(filename);
 
     /* if we're parsing the base file, set static vars */
     if (level == 0) {
@@ -2579,6 +5080,8 @@ ParseFile(char *filename, FILE *fp, int level)
 		if (isMaster)
 		    Error("ParseFile(): fopen(%s): %s", word->string,
 			  strerror(errno));
+		/* if it shows up, the snapshot is stale */
+		SnapFile(word->string);
 	    } else {
 		char *fname;
 		/* word gets destroyed, so save the name */
@@ -2586,6 +5089,8 @@ ParseFile(char *filename, FILE *fp, int level)
 		ParseFile(fname, lfp, level + 1);
 		fclose(lfp);
 		free(fname);
+		file = filename;
+		snapFileCur = snapIdx;
 	    }
 	} else {
 	    switch (state) {
@@ -2624,6 +5129,7 @@ ParseFile(char *filename, FILE *fp, int level)
 		case NAME:
 		    switch (token) {
 			case WORD:
+			    SnapEvent(SNAP_BEGIN, secIndex, 0, word->string);
 			    (*sections[secIndex].begin) (word->string);
 			    state = LEFTB;
 			    break;
@@ -2653,6 +5159,7 @@ ParseFile(char *filename, FILE *fp, int level)
 			    if (isMaster)
 				Error("premature token '%s' [%s:%d]",
 				      word->string, file, line);
+			    SnapEvent(SNAP_ABORT, secIndex, 0, (char *)0);
 			    (*sections[secIndex].abort) ();
 			    state = START;
 			    break;
@@ -2693,6 +5200,7 @@ ParseFile(char *filename, FILE *fp, int level)
 			    }
 			    break;
 			case RIGHTBRACE:
+			    SnapEvent(SNAP_END, secIndex, 0, (char *)0);
 			    (*sections[secIndex].end) ();
 			    state = START;
 			    break;
@@ -2713,6 +5221,8 @@ ParseFile(char *filename, FILE *fp, int level)
 		case VALUE:
 		    switch (token) {
 			case WORD:
+			    SnapEvent(SNAP_ITEM, secIndex, keyIndex,
+				      word->string);
 			    (*sections[secIndex].items[keyIndex].
 			     reg) (word->string);
 			    state = SEMI;
@@ -2727,6 +5237,7 @@ ParseFile(char *filename, FILE *fp, int level)
 			    if (isMaster)
 				Error("premature token '%s' [%s:%d]",
 				      word->string, file, line);
+			    SnapEvent(SNAP_ABORT, secIndex, 0, (char *)0);
 			    (*sections[secIndex].abort) ();
 			    state = START;
 			    break;
@@ -2749,6 +5260,7 @@ ParseFile(char *filename, FILE *fp, int level)
 			    if (isMaster)
 				Error("premature token '%s' [%s:%d]",
 				      word->string, file, line);
+			    SnapEvent(SNAP_ABORT, secIndex, 0, (char *)0);
 			    (*sections[secIndex].abort) ();
 			    state = START;
 			    break;
@@ -2795,6 +5307,7 @@ ParseFile(char *filename, FILE *fp, int level)
 	    case LEFTB:
 	    case VALUE:
 	    case SEMI:
+		SnapEvent(SNAP_ABORT, secIndex, 0, (char *)0);
 		(*sections[secIndex].abort) ();
 		/* fall through */
 	    case NAME:
@@ -54,6 +54,7 @@ typedef enum IOState {
 #if HAVE_GSSAPI
     INGSSACCEPT,
 #endif
+    INRESOLVE,
     ISFLUSHING
 } IOSTATE;
 
@@ -72,12 +73,98 @@ typedef struct dynamicString {
     struct dynamicString *prev;
 } STRING;
 
+/* a read-only hunk of output that may sit in several CONSFILE write
+ * queues at once (console data fanned out to every attached client).
+ * whoever lets go of the last reference frees it.
+ */
+typedef struct chunk {
+    int refs;
+    int len;
+    int size;			/* room allocated for data */
+    struct chunk *quoted;	/* OB_IAC quoted version, once needed */
+    char *data;
+} CHUNK;
+
+typedef struct wseg {		/* a piece of a CONSFILE write queue */
+    CHUNK *chunk;
+    int off;
+    int len;
+    struct wseg *next;
+} WSEG;
+
+/* each record is LINEINDEXREC bytes: a flag byte and a big-endian
+ * offset.  the first is the LINEINDEXBASE offset the index starts at,
+ * the rest are the offsets just past each newline written after that.
+ */
+#define LINEINDEXSUFFIX	".idx"
+#define LINEINDEXREC	8
+#define LINEINDEXBASE	0x40
+#define LINEINDEXMARK	0x80
+#define LINEINDEXBATCH	64	/* records written at a time */
+
+/* newline offsets for a logfile, kept in a file next to it (see
+ * FileIndexLines())
+ */
+typedef struct lineIndex {
+    int fd;			/* the index file (-1 == none)          */
+    off_t off;			/* where the next byte written lands    */
+    FLAG bol;			/* at the beginning of a line           */
+    FLAG mark;			/* the line being written is a MARK     */
+    int tfd;			/* the time index file                  */
+    time_t tlast;		/* time of its last record              */
+    time_t tpend;		/* time for the next line start, or 0   */
+    int npend;			/* bytes of records not written yet     */
+    unsigned char pend[LINEINDEXBATCH * LINEINDEXREC];
+} LINEINDEX;
+
+/* the time index is sparse: TIMEINDEXREC byte records, each a time
+ * and the offset of the first line started at or after it (both
+ * written with LineIndexPut()), at most one every TIMEINDEXGRAIN
+ * seconds unless a MARK forces one.
+ */
+#define TIMEINDEXSUFFIX	".tdx"
+#define TIMEINDEXREC	16
+#define TIMEINDEXGRAIN	60
+
+/* a framed logfile is a series of gzip members ("frames"), each one
+ * what a single FileWrite() flushed (up to FRAMEMAX bytes of it), so
+ * any frame can be decompressed on its own.  the frame index next to
+ * it (the logfile name plus FRAMEINDEXSUFFIX) has a FRAMEINDEXREC byte
+ * record for each frame: the uncompressed and compressed offsets just
+ * past it (both written with LineIndexPut()).  FileStat(), FileSeek()
+ * and FileRead() work in uncompressed offsets on a framed CONSFILE, as
+ * do the line and time indexes, so replays don't know the difference.
+ * a gzip file without a frame index (a rolled logfile run through
+ * logcompress) can be read the same way, just by decompressing it from
+ * the top, and backwards seeks start over.
+ */
+#define FRAMEINDEXSUFFIX	".fdx"
+#define FRAMEINDEXREC	16
+#define FRAMEMAX	(64 * 1024)
+
+typedef struct logFrames {
+    int fd;			/* the frame index file                 */
+    off_t size;			/* uncompressed size of the logfile     */
+    off_t zsize;		/* and its actual size                  */
+    off_t nrec;			/* frames in the index                  */
+    off_t pos;			/* where FileRead() reads next          */
+    off_t bstart;		/* uncompressed offset of buf           */
+    int blen;			/* bytes of the frame in buf            */
+    int bsize;			/* room allocated for buf               */
+    char *buf;			/* the last frame read, decompressed    */
+    void *zs;			/* inflate state, if there's no index   */
+} FRAMES;
+
 typedef struct consFile {
     /* Standard socket type stuff */
     enum consFileType ftype;
     int fd;
     int fdout;			/* only used when a simplePipe */
-    STRING *wbuf;
+    WSEG *whead;		/* write queue (see FileWrite()) */
+    WSEG *wtail;
+    int wqlen;			/* bytes in the write queue */
+    WSEG *wnote;		/* FileSkipQueue() note, while queued */
+    int wskipped;		/* bytes wnote reports skipped */
     FLAG errored;
     FLAG quoteiac;
     FLAG sawiac;
@@ -85,6 +172,10 @@ typedef struct consFile {
     FLAG sawiacexec;
     FLAG sawiacabrt;
     FLAG sawiacgoto;
+    LINEINDEX *lidx;		/* see FileIndexLines() */
+    FRAMES *frm;		/* see FileFrames() */
+    int ownerkind;		/* see FileSetOwner() */
+    void *owner;
 #if HAVE_OPENSSL
     /* SSL stuff */
     SSL *ssl;
@@ -98,6 +189,14 @@ typedef struct consFile {
 #endif
 } CONSFILE;
 
+/* interest/readiness bits for FDWatch() and friends */
+#define FDWATCH_READ	1
+#define FDWATCH_WRITE	2
+
+/* owner kinds for FileSetOwner() */
+#define FDOWNER_CONSOLE	1
+#define FDOWNER_CLIENT	2
+
 typedef struct item {
     char *id;
     void (*reg) (char *);
@@ -131,6 +230,21 @@ typedef struct subst {
     int (*value) (char, char **, int *);
 } SUBST;
 
+/* case-insensitive string keyed map (see NameMapAdd()).  the keys
+ * aren't copied, so they have to outlive their entries
+ */
+typedef struct nameMapEntry {
+    char *key;
+    void *value;
+    struct nameMapEntry *next;
+} NAMEMAPENTRY;
+
+typedef struct nameMap {
+    NAMEMAPENTRY **bucket;
+    unsigned long mask;		/* bucket count - 1 */
+    int count;
+} NAMEMAP;
+
 extern int isMultiProc, fDebug, fVerbose, fErrorPrinted;
 extern char *progname;
 extern pid_t thepid;
@@ -139,9 +253,6 @@ extern char myHostname[];
 #if !USE_IPV6
 extern struct in_addr *myAddrs;
 #endif
-extern fd_set rinit;
-extern fd_set winit;
-extern int maxfd;
 extern int debugLineNo;
 extern char *debugFileName;
 extern int line;		/* used by ParseFile */
@@ -156,6 +267,17 @@ extern void Msg(char *, ...);
 extern void Verbose(char *, ...);
 extern void SimpleSignal(int, RETSIGTYPE(*)(int));
 extern int GetMaxFiles();
+extern void CloseFiles(int, int);
+extern void CloseFilesOnExec(void);
+extern void FDWatch(int, int);
+extern void FDUnwatch(int, int);
+extern void FDWatchReset(void);
+extern void FDPost(int, int);
+extern int FDWait(struct timeval *);
+extern int FDIsReady(int, int);
+extern int FDIsWatched(int, int);
+extern void FileSetOwner(CONSFILE *, int, void *);
+extern void *FileNextReady(int *, int *);
 extern char *FmtCtl(int, STRING *);
 extern void FmtCtlStr(char *, int, STRING *);
 extern CONSFILE *FileOpenFD(int, enum consFileType);
@@ -164,9 +286,14 @@ extern CONSFILE *FileOpen(const char *, int, int);
 extern int FileClose(CONSFILE **);
 extern int FileRead(CONSFILE *, void *, int);
 extern int FileWrite(CONSFILE *, FLAG, char *, int);
+extern int FileWriteChunk(CONSFILE *, FLAG, CHUNK *);
+extern CHUNK *AllocChunk(const char *, int);
+extern void ReleaseChunk(CHUNK *);
 extern void FileVWrite(CONSFILE *, FLAG, char *, va_list);
+extern void VWrite(CONSFILE *, FLAG, STRING *, char *, va_list);
 extern void FilePrint(CONSFILE *, FLAG, char *, ...);
 extern int FileStat(CONSFILE *, struct stat *);
+extern int FileSync(CONSFILE *);
 extern int FileSeek(CONSFILE *, off_t, int);
 extern int FileSend(CONSFILE *, const void *, size_t, int);
 extern int FileFDNum(CONSFILE *);
@@ -197,15 +324,36 @@ extern void Bye(int);
 extern void DestroyDataStructures(void);
 extern int IsMe(char *);
 extern char *PruneSpace(char *);
-extern int FileCanRead(CONSFILE *, fd_set *, fd_set *);
-extern int FileCanWrite(CONSFILE *, fd_set *, fd_set *);
+extern int FileCanRead(CONSFILE *);
+extern int FileCanWrite(CONSFILE *);
 extern int FileBufEmpty(CONSFILE *);
+extern int FileBufLen(CONSFILE *);
+extern void FileQueued(CONSFILE *, STRING *);
+extern int FileSkipQueue(CONSFILE *, int, char *);
+extern int FileFrames(CONSFILE *, const char *, FLAG);
+extern int FileIndexLines(CONSFILE *, const char *, FLAG);
+extern void FileIndexMark(CONSFILE *);
+extern void FileIndexTime(CONSFILE *, time_t, FLAG);
+extern void LineIndexPut(unsigned char *, off_t, int);
+extern off_t LineIndexGet(unsigned char *, int *);
 extern int SetFlags(int, int, int);
 extern char *StrDup(const char *);
+extern unsigned long NameHash(const char *);
+extern NAMEMAP *NameMapNew(void);
+extern void NameMapDestroy(NAMEMAP **);
+extern void NameMapAdd(NAMEMAP *, char *, void *);
+extern void *NameMapFind(NAMEMAP *, const char *);
+extern void NameMapDelete(NAMEMAP *, const char *, void *);
 extern int ParseIACBuf(CONSFILE *, void *, int *);
 extern void *MemMove(void *, void *, size_t);
+extern size_t MemFind2(const void *, size_t, int, int);
+extern void MemStrip(void *, const void *, size_t);
 extern char *StringChar(STRING *, int, char);
 extern void ParseFile(char *, FILE *, int);
+extern void SnapshotRecord(FLAG);
+extern int SnapshotSave(char *);
+extern int SnapshotCompare(char *);
+extern int SnapshotReplay(char *, char *);
 #if !USE_IPV6
 extern void ProbeInterfaces(in_addr_t);
 #endif
@@ -218,5 +366,5 @@ extern SSL *FileGetSSL(CONSFILE *);
 extern void FileSetSSL(CONSFILE *, SSL *);
 extern int SSLVerifyCallback(int, X509_STORE_CTX *);
 extern int FileSSLAccept(CONSFILE *);
-extern int FileCanSSLAccept(CONSFILE *, fd_set *, fd_set *);
+extern int FileCanSSLAccept(CONSFILE *);
 #endif
@@ -56,6 +56,7 @@
 #include <grp.h>
 #include <stdarg.h>
 #include <arpa/telnet.h>
+#include <dirent.h>
 
 #include <cutil.h>
 #include <consent.h>
@@ -65,6 +66,7 @@
 #include <readcfg.h>
 #include <master.h>
 #include <main.h>
+#include <resolve.h>
 #include <version.h>
 
 #if HAVE_PAM
@@ -79,10 +81,225 @@ static sig_atomic_t fSawChldHUP = 0, fSawReUp = 0, fSawGoAway =
 /* timers */
 time_t timers[T_MAX];
 
+/* consoles and clients with I/O to do on this pass through Kiddie() */
+static CONSENT *pCEpend = (CONSENT *)0;
+static CONSCLIENT *pCLpend = (CONSCLIENT *)0;
+
+#if defined(SCM_RIGHTS)
+/* the master has asked us to upgrade (see KiddieHandOff()) */
+static int fSawUpgrade = 0;
+#endif
+
 #if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
 static unsigned long dmallocMarkClientConnection = 0;
 #endif
 
+static void
+PendConsole(CONSENT *pCE)
+{
+    if (pCE == (CONSENT *)0 || pCE->fpending)
+	return;
+    pCE->fpending = 1;
+    pCE->pCEpend = pCEpend;
+    pCEpend = pCE;
+}
+
+static void
+PendClient(CONSCLIENT *pCL)
+{
+    if (pCL == (CONSCLIENT *)0 || pCL->fpending)
+	return;
+    pCL->fpending = 1;
+    pCL->pCLpend = pCLpend;
+    pCLpend = pCL;
+}
+
+/* per-console deadlines (connect timeouts, idle timeouts, marks, and
+ * break delays) are kept in a binary min-heap so that a wakeup only
+ * touches the consoles whose timer actually fired.  each console
+ * remembers where its entries live (pCE->ctslot[], zero meaning
+ * "not scheduled") so they can be moved or pulled in O(log n).
+ */
+typedef struct ctimer {
+    struct timeval when;
+    CONSENT *pCE;
+    int kind;
+} CTIMER;
+
+static CTIMER *ctHeap = (CTIMER *)0;
+static int ctUsed = 0;
+static int ctAlloc = 0;
+
+void
+TimerNow(struct timeval *tv)
+{
+#if HAVE_GETTIMEOFDAY
+    if (gettimeofday(tv, (void *)0) == 0)
+	return;
+#endif
+    tv->tv_sec = time((time_t *)0);
+    tv->tv_usec = 0;
+}
+
+static void
+TimerAdd(struct timeval *tv, long msec)
+{
+    tv->tv_sec += msec / 1000;
+    tv->tv_usec += (msec % 1000) * 1000;
+    if (tv->tv_usec >= 1000000) {
+	tv->tv_sec++;
+	tv->tv_usec -= 1000000;
+    }
+}
+
+static void
+CTPlace(int i, CTIMER *ct)
+{
+    ctHeap[i] = *ct;
+    ct->pCE->ctslot[ct->kind] = i + 1;
+}
+
+static void
+CTSiftUp(int i)
+{
+    CTIMER ct = ctHeap[i];
+
+    while (i > 0) {
+	int parent = (i - 1) / 2;
+	if (!timercmp(&ct.when, &ctHeap[parent].when, <))
+	    break;
+	CTPlace(i, &ctHeap[parent]);
+	i = parent;
+    }
+    CTPlace(i, &ct);
+}
+
+static void
+CTSiftDown(int i)
+{
+    CTIMER ct = ctHeap[i];
+
+    for (;;) {
+	int child = i * 2 + 1;
+	if (child >= ctUsed)
+	    break;
+	if (child + 1 < ctUsed &&
+	    timercmp(&ctHeap[child + 1].when, &ctHeap[child].when, <))
+	    child++;
+	if (!timercmp(&ctHeap[child].when, &ct.when, <))
+	    break;
+	CTPlace(i, &ctHeap[child]);
+	i = child;
+    }
+    CTPlace(i, &ct);
+}
+
+void
+ConsTimerClear(CONSENT *pCE, int kind)
+{
+    int i;
+
+    if (pCE == (CONSENT *)0 || pCE->ctslot[kind] == 0)
+	return;
+
+    i = pCE->ctslot[kind] - 1;
+    pCE->ctslot[kind] = 0;
+    if (--ctUsed == i)
+	return;
+    CTPlace(i, &ctHeap[ctUsed]);
+    if (i > 0 && timercmp(&ctHeap[i].when, &ctHeap[(i - 1) / 2].when, <))
+	CTSiftUp(i);
+    else
+	CTSiftDown(i);
+}
+
+void
+ConsTimerSetAt(CONSENT *pCE, int kind, struct timeval *when)
+{
+    int i;
+
+    if (pCE == (CONSENT *)0)
+	return;
+
+    if (pCE->ctslot[kind] != 0) {
+	i = pCE->ctslot[kind] - 1;
+	ctHeap[i].when = *when;
+	if (i > 0 &&
+	    timercmp(&ctHeap[i].when, &ctHeap[(i - 1) / 2].when, <))
+	    CTSiftUp(i);
+	else
+	    CTSiftDown(i);
+	return;
+    }
+
+    if (ctUsed >= ctAlloc) {
+	int n = ctAlloc == 0 ? 64 : ctAlloc * 2;
+	CTIMER *h;
+	if ((h = (CTIMER *)realloc(ctHeap, n * sizeof(CTIMER))) ==
+	    (CTIMER *)0)
+	    OutOfMem();
+	ctHeap = h;
+	ctAlloc = n;
+    }
+    ctHeap[ctUsed].when = *when;
+    ctHeap[ctUsed].pCE = pCE;
+    ctHeap[ctUsed].kind = kind;
+    CTSiftUp(ctUsed++);
+}
+
+/* schedule a console timer msec milliseconds from now */
+void
+ConsTimerSet(CONSENT *pCE, int kind, long msec)
+{
+    struct timeval when;
+
+    TimerNow(&when);
+    TimerAdd(&when, msec);
+    ConsTimerSetAt(pCE, kind, &when);
+}
+
+/* note that we just wrote to the console.  the idle timer is only
+ * armed here if it isn't already - when it fires, it checks lastWrite
+ * and pushes itself out if there's been activity since.
+ */
+void
+ConsIdleReset(CONSENT *pCE)
+{
+    TimerNow(&pCE->lastWrite);
+    if (pCE->idletimeout == 0)
+	ConsTimerClear(pCE, CT_IDLE);
+    else if (pCE->ctslot[CT_IDLE] == 0)
+	ConsTimerSet(pCE, CT_IDLE, pCE->idletimeout);
+}
+
+/* move the next mark into the future and (re)schedule it */
+void
+ConsMarkReset(CONSENT *pCE)
+{
+    struct timeval when;
+    time_t tyme;
+
+    if (pCE->mark <= 0 || pCE->nextMark <= 0) {
+	ConsTimerClear(pCE, CT_MARK);
+	return;
+    }
+    /* use the timer clock - time() can lag gettimeofday() by a tick,
+     * which would leave the mark due and have it fire over and over
+     */
+    TimerNow(&when);
+    tyme = when.tv_sec;
+    if (tyme >= pCE->nextMark) {
+	/* Add as many pCE->mark values as necessary so that we move
+	 * beyond the current time.
+	 */
+	pCE->nextMark +=
+	    (((tyme - pCE->nextMark) / pCE->mark) + 1) * pCE->mark;
+    }
+    when.tv_sec = pCE->nextMark;
+    when.tv_usec = 0;
+    ConsTimerSetAt(pCE, CT_MARK, &when);
+}
+
 void
 SendIWaitClientsMsg(CONSENT *pCE, char *message)
 {
@@ -182,8 +399,6 @@ StopTask(CONSENT *pCE)
     }
 
     if (pCE->taskfile != (CONSFILE *)0) {
-	int taskfile = FileFDNum(pCE->taskfile);
-	FD_CLR(taskfile, &rinit);
 	FileClose(&pCE->taskfile);
 	pCE->taskfile = (CONSFILE *)0;
     }
@@ -225,6 +440,47 @@ ClientWantsWrite(CONSCLIENT *pCL)
     pCE->pCLon = pCL;
 }
 
+/* a client is too far behind (outputpolicy block), so stop reading
+ * the console (and any task on it) until it catches up
+ */
+static void
+ConsStall(CONSENT *pCE)
+{
+    if (pCE->fstalled)
+	return;
+    pCE->fstalled = 1;
+    pCE->outstalls++;
+    CONDDEBUG((1, "ConsStall(): [%s] stalled", pCE->server));
+    if (pCE->cofile != (CONSFILE *)0)
+	FDUnwatch(FileFDNum(pCE->cofile), FDWATCH_READ);
+    if (pCE->taskfile != (CONSFILE *)0)
+	FDUnwatch(FileFDNum(pCE->taskfile), FDWATCH_READ);
+}
+
+/* start reading a stalled console again once every client watching
+ * it is down to half its outputlimit
+ */
+static void
+ConsUnstall(CONSENT *pCE)
+{
+    CONSCLIENT *pCL;
+
+    if (!pCE->fstalled)
+	return;
+    if (pCE->outputlimit != 0) {
+	for (pCL = pCE->pCLon; pCL != (CONSCLIENT *)0; pCL = pCL->pCLnext)
+	    if ((pCL->fcon || pCL->iState == S_CEXEC) &&
+		FileBufLen(pCL->fd) > pCE->outputlimit / 2)
+		return;
+    }
+    pCE->fstalled = 0;
+    CONDDEBUG((1, "ConsUnstall(): [%s] reading again", pCE->server));
+    if (pCE->cofile != (CONSFILE *)0 && pCE->ioState == ISNORMAL)
+	FDWatch(FileFDNum(pCE->cofile), FDWATCH_READ);
+    if (pCE->taskfile != (CONSFILE *)0)
+	FDWatch(FileFDNum(pCE->taskfile), FDWATCH_READ);
+}
+
 void
 DisconnectClient(GRPENT *pGE, CONSCLIENT *pCL, char *message, FLAG force)
 {
@@ -259,8 +515,6 @@ DisconnectClient(GRPENT *pGE, CONSCLIENT *pCL, char *message, FLAG force)
 	pCEServing->pCLon->pCLnext == (CONSCLIENT *)0)
 	ConsDown(pCEServing, FLAGFALSE, FLAGFALSE);
 
-    FD_CLR(FileFDNum(pCL->fd), &rinit);
-    FD_CLR(FileFDNum(pCL->fd), &winit);
     FileClose(&pCL->fd);
 
     /* mark as not writer, if he is
@@ -296,6 +550,9 @@ DisconnectClient(GRPENT *pGE, CONSCLIENT *pCL, char *message, FLAG force)
      */
     pCL->pCLnext = pGE->pCLfree;
     pGE->pCLfree = pCL;
+
+    /* it may have been the one holding the console up */
+    ConsUnstall(pCEServing);
 #if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
     CONDDEBUG((1, "DisconnectClient(): dmalloc / MarkClientConnection"));
     dmalloc_log_changed(dmallocMarkClientConnection, 1, 0, 1);
@@ -489,12 +746,15 @@ DestroyConsent(GRPENT *pGE, CONSENT *pCE)
     CONSCLIENT *pCL;
     CONSENT **ppCE;
     NAMES *name;
+    int i;
 
     if (pCE == (CONSENT *)0 || pGE == (GRPENT *)0)
 	return;
 
     CONDDEBUG((1, "DestroyConsent(): destroying `%s'", pCE->server));
 
+    ResolveForget(pCE);
+
     /* must loop using pCLall and pCLscan for the same reason as the
      * drop: code.  this is basically the same set of code, but modified
      * since we know we're going to nuke the console itself.
@@ -509,8 +769,6 @@ DestroyConsent(GRPENT *pGE, CONSENT *pCE)
 		      -1);
 	}
 	Msg("[%s] logout %s", pCE->server, pCL->acid->string);
-	FD_CLR(FileFDNum(pCL->fd), &rinit);
-	FD_CLR(FileFDNum(pCL->fd), &winit);
 	FileClose(&pCL->fd);
 	if (pCL->fwr) {
 	    BumpClient(pCE, (char *)0);
@@ -538,6 +796,8 @@ DestroyConsent(GRPENT *pGE, CONSENT *pCE)
 
     StopTask(pCE);
     ConsDown(pCE, FLAGFALSE, FLAGTRUE);
+    for (i = 0; i < CT_MAX; i++)
+	ConsTimerClear(pCE, i);
 
     for (ppCE = &(pGE->pCElist); *ppCE != (CONSENT *)0;
 	 ppCE = &((*ppCE)->pCEnext)) {
@@ -572,6 +832,8 @@ DestroyConsent(GRPENT *pGE, CONSENT *pCE)
 	free(pCE->initcmd);
     if (pCE->motd != (char *)0)
 	free(pCE->motd);
+    if (pCE->logcompress != (char *)0)
+	free(pCE->logcompress);
     if (pCE->idlestring != (char *)0)
 	free(pCE->idlestring);
     if (pCE->replstring != (char *)0)
@@ -589,9 +851,24 @@ DestroyConsent(GRPENT *pGE, CONSENT *pCE)
 	free(pCE->aliases);
 	pCE->aliases = name;
     }
+    LogFlush(pCE);
     FileClose(&pCE->fdlog);
+    if (pCE->sb != (SCROLLBACK *)0) {
+	free(pCE->sb->buf);
+	free(pCE->sb);
+    }
+    LogSegmentsDrop(pCE);
     if (pCE->wbuf != (STRING *)0)
 	DestroyString(pCE->wbuf);
+    if (pCE->fpending) {
+	for (ppCE = &pCEpend; *ppCE != (CONSENT *)0;
+	     ppCE = &((*ppCE)->pCEpend)) {
+	    if (*ppCE == pCE) {
+		*ppCE = pCE->pCEpend;
+		break;
+	    }
+	}
+    }
     free(pCE);
 
     pGE->imembers--;
@@ -609,6 +886,9 @@ DestroyGroup(GRPENT *pGE)
     CONDDEBUG((1, "DestroyGroup(): destroying group #%d (%d members)",
 	       pGE->id, pGE->imembers));
 
+    if (pGE->hfd != -1)
+	close(pGE->hfd);
+
     /* nuke each console (which kicks off clients) */
     DestroyConsent(pGE, pGE->pCEctl);
     pCE = pGE->pCElist;
@@ -848,20 +1128,137 @@ FlagSawChldUSR2(int sig)
 #endif
 }
 
+/* automatic reinits are scheduled rather than done on the spot: each
+ * console waits a randomized delay that doubles (up to REUPMAX) with
+ * every try that fails, and no more than REUPPERHOST consoles of a
+ * remote host get to be connecting at once.  that way a terminal
+ * server that drops all its ports isn't hit by all of them again the
+ * moment it comes back.
+ */
+struct reupHost {
+    char *host;
+    int connecting;		/* consoles holding a connect slot      */
+};
+
+static NAMEMAP *reupHosts = (NAMEMAP *)0;
+
+/* the connect slots of pCE's host, if it has a remote one */
+static struct reupHost *
+ReUpHost(CONSENT *pCE)
+{
+    struct reupHost *rh;
+
+    if (pCE->host == (char *)0 || !(pCE->type == HOST
+#if HAVE_FREEIPMI
+				     || pCE->type == IPMI
+#endif
+	))
+	return (struct reupHost *)0;
+
+    if (reupHosts == (NAMEMAP *)0)
+	reupHosts = NameMapNew();
+    if ((rh =
+	 (struct reupHost *)NameMapFind(reupHosts,
+					pCE->host)) != (struct reupHost *)0)
+	return rh;
+    if ((rh =
+	 (struct reupHost *)calloc(1,
+				   sizeof(struct reupHost))) ==
+	(struct reupHost *)0)
+	OutOfMem();
+    if ((rh->host = StrDup(pCE->host)) == (char *)0)
+	OutOfMem();
+    NameMapAdd(reupHosts, rh->host, rh);
+    return rh;
+}
+
+/* give back the connect slot pCE holds (it's up or it's down) */
+void
+ReUpRelease(CONSENT *pCE)
+{
+    if (pCE->reupHost == (struct reupHost *)0)
+	return;
+    pCE->reupHost->connecting--;
+    pCE->reupHost = (struct reupHost *)0;
+}
+
+/* schedule the next automatic reinit of pCE (CT_REUP) */
+static void
+ConsReUpLater(CONSENT *pCE)
+{
+    long delay, max;
+    unsigned int i;
+
+    /* -F leaves it to reinitcheck or a person */
+    if (fNoautoreup) {
+	pCE->autoReUp = 1;
+	return;
+    }
+
+    delay = REUPMIN * 1000L;
+    if (pCE->reupTries == 0) {
+	/* the first one just gets spread out a bit */
+	delay = rand() % delay;
+    } else {
+	max = REUPMAX * 1000L;
+	for (i = 1; i < pCE->reupTries && delay < max; i++)
+	    delay *= 2;
+	if (delay > max)
+	    delay = max;
+	delay = delay / 2 + rand() % (delay / 2);
+    }
+    pCE->reupTries++;
+    pCE->autoReUp = 1;
+    CONDDEBUG((1, "[%s] ConsReUpLater(): try %u in %ldms", pCE->server,
+	       pCE->reupTries, delay));
+    ConsTimerSet(pCE, CT_REUP, delay);
+}
+
+/* the console went down on us, so bring it back (or not) */
 void
 ConsoleError(CONSENT *pCE)
 {
+    time_t up;
+
     if (pCE->autoreinit != FLAGTRUE) {
 	ConsDown(pCE, FLAGTRUE, FLAGTRUE);
-    } else {
-	/* Try an initial reconnect */
-	Msg("[%s] automatic reinitialization", pCE->server);
-	ConsInit(pCE);
+	return;
+    }
 
-	/* If we didn't succeed, try again later */
-	if (!pCE->fup)
-	    pCE->autoReUp = 1;
+    /* one that stayed up a while starts over with the short delays */
+#if HAVE_GETTIMEOFDAY
+    up = pCE->lastInit.tv_sec;
+#else
+    up = pCE->lastInit;
+#endif
+    if (time((time_t *)0) - up >= REUPMAX)
+	pCE->reupTries = 0;
+
+    if (ReUpHost(pCE) != (struct reupHost *)0) {
+	ConsDown(pCE, FLAGTRUE, FLAGTRUE);
+	ConsReUpLater(pCE);
+	return;
     }
+
+    /* Try an initial reconnect */
+    Msg("[%s] automatic reinitialization", pCE->server);
+    ConsInit(pCE);
+
+    /* If we didn't succeed, try again later */
+    if (!pCE->fup)
+	ConsReUpLater(pCE);
+}
+
+/* a connect() the scheduler started didn't work out */
+static void
+ConsConnectFailed(CONSENT *pCE)
+{
+    short ours = (pCE->reupHost != (struct reupHost *)0);
+
+    SendIWaitClientsMsg(pCE, "down]\r\n");
+    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
+    if (ours)
+	ConsReUpLater(pCE);
 }
 
 static void
@@ -877,10 +1274,9 @@ ReOpen(GRPENT *pGE)
 	if ((CONSFILE *)0 == pCE->fdlog) {
 	    continue;
 	}
+	LogFlush(pCE);
 	FileClose(&pCE->fdlog);
-	if ((CONSFILE *)0 ==
-	    (pCE->fdlog =
-	     FileOpen(pCE->logfile, O_RDWR | O_CREAT | O_APPEND, 0644))) {
+	if ((CONSFILE *)0 == (pCE->fdlog = LogOpen(pCE))) {
 	    Error("[%s] FileOpen(%s): %s: forcing down", pCE->server,
 		  pCE->logfile, strerror(errno));
 	    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
@@ -995,6 +1391,10 @@ ReUp(GRPENT *pGE, short automatic)
 	    if (pCE->fup || pCE->ondemand == FLAGTRUE ||
 		(automatic == 1 && !pCE->autoReUp))
 		continue;
+	    /* the scheduler has these (ConsReUpLater()) */
+	    if (automatic > 0 && (pCE->ctslot[CT_REUP] != 0 ||
+				  pCE->ioState == INRESOLVE))
+		continue;
 	    if (config->initdelay > 0) {
 		time_t t;
 		if ((t = InitDelay(pCE)) > 0) {
@@ -1028,182 +1428,612 @@ ReUp(GRPENT *pGE, short automatic)
 	timers[T_AUTOUP] = tyme + 60;
 }
 
+/* keep the last pCE->scrollback bytes logged in memory, starting over
+ * if the size has changed (or dropping it if scrollback is now off)
+ */
 void
-TagLogfile(const CONSENT *pCE, char *fmt, ...)
+ScrollbackInit(CONSENT *pCE)
 {
-    va_list ap;
-    va_start(ap, fmt);
-
-    if ((pCE == (CONSENT *)0) || (pCE->fdlog == (CONSFILE *)0))
+    if (pCE->sb != (SCROLLBACK *)0 && pCE->sb->size != pCE->scrollback) {
+	free(pCE->sb->buf);
+	free(pCE->sb);
+	pCE->sb = (SCROLLBACK *)0;
+    }
+    if (pCE->scrollback <= 0 || pCE->sb != (SCROLLBACK *)0)
 	return;
 
-    FileWrite(pCE->fdlog, FLAGTRUE, "[-- ", -1);
-    FileVWrite(pCE->fdlog, FLAGTRUE, fmt, ap);
-    FilePrint(pCE->fdlog, FLAGFALSE, " -- %s]\r\n", StrTime((time_t *)0));
-    va_end(ap);
+    if ((pCE->sb = (SCROLLBACK *)calloc(1, sizeof(SCROLLBACK)))
+	== (SCROLLBACK *)0 ||
+	(pCE->sb->buf = malloc(pCE->scrollback)) == (char *)0)
+	OutOfMem();
+    pCE->sb->size = pCE->scrollback;
+    pCE->sb->wrapped = FLAGFALSE;
 }
 
-void
-TagLogfileAct(const CONSENT *pCE, char *fmt, ...)
+static void
+ScrollbackWrite(SCROLLBACK *sb, const char *s, int len)
 {
-    va_list ap;
-    va_start(ap, fmt);
-
-    if ((pCE == (CONSENT *)0) || (pCE->fdlog == (CONSFILE *)0) ||
-	(pCE->activitylog != FLAGTRUE))
-	return;
-
-    FileWrite(pCE->fdlog, FLAGTRUE, "[-- ", -1);
-    FileVWrite(pCE->fdlog, FLAGTRUE, fmt, ap);
-    FilePrint(pCE->fdlog, FLAGFALSE, " -- %s]\r\n", StrTime((time_t *)0));
-    va_end(ap);
+    int n;
+
+    if (len >= sb->size) {
+	if (len > sb->size || sb->used > 0)
+	    sb->wrapped = FLAGTRUE;
+	s += len - sb->size;
+	len = sb->size;
+    }
+    while (len > 0) {
+	n = sb->size - sb->head;
+	if (n > len)
+	    n = len;
+	memcpy(sb->buf + sb->head, s, n);
+	if ((sb->head += n) == sb->size)
+	    sb->head = 0;
+	if ((sb->used += n) > sb->size) {
+	    sb->used = sb->size;
+	    sb->wrapped = FLAGTRUE;
+	}
+	s += n;
+	len -= n;
+    }
 }
 
-static void
-RollLogs(GRPENT *pGE)
+/* open (and index) the logfile, noting how big it already is so
+ * LogFlush() can tell when it passes logfilemax without a stat()
+ */
+CONSFILE *
+LogOpen(CONSENT *pCE)
 {
-    CONSENT *pCE;
+    CONSFILE *cfp;
     struct stat stLog;
-    char *t = (char *)0;
-    char timestr[40];
-    time_t tyme = (time_t)0;
-    short maxset = 0;
-    char buf[4096];
-    int roll = 0;
-    int r = 0;
-    CONSFILE *old;
-
-    if ((GRPENT *)0 == pGE)
-	return;
 
-    for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
-	if (pCE->logfilemax == 0)
-	    continue;
-	maxset = 1;
-	if (pCE->fdlog == (CONSFILE *)0)
-	    continue;
-	if (FileStat(pCE->fdlog, &stLog) != 0) {
-	    CONDDEBUG((1, "RollLogs(): FileStat(%d) failed",
-		       FileFDNum(pCE->fdlog)));
-	    continue;
-	}
-	if (stLog.st_size < pCE->logfilemax)
-	    continue;
-	if (pCE->logfilemax > 1024) {
-	    if (pCE->logfilemax > 0x100000)
-		Msg("[%s] logfile exceeds %dMB: rolling", pCE->server,
-		    pCE->logfilemax / 0x100000);
-	    else
-		Msg("[%s] logfile exceeds %dKB: rolling", pCE->server,
-		    pCE->logfilemax / 1024);
-	}
+    /* a new logfile (rolled or renamed) means new rolled ones too */
+    LogSegmentsDrop(pCE);
+    if ((cfp =
+	 FileOpen(pCE->logfile, O_RDWR | O_CREAT | O_APPEND,
+		  0644)) == (CONSFILE *)0)
+	return cfp;
+    FileSetOwner(cfp, FDOWNER_CONSOLE, pCE);
+    /* an existing logfile keeps whatever format it has (and is written
+     * that way), a new one gets logformat
+     */
+    if ((pCE->logformat == LFFRAMED ||
+	 (FileStat(cfp, &stLog) == 0 && stLog.st_size > 0)) &&
+	FileFrames(cfp, pCE->logfile, FLAGTRUE) < 0) {
+	FileClose(&cfp);
+	errno = EINVAL;
+	return cfp;
+    }
+    FileIndexLines(cfp, pCE->logfile, pCE->logindex);
+    if (FileStat(cfp, &stLog) == 0)
+	pCE->logsize = stLog.st_size;
+    else
+	pCE->logsize = 0;
+    /* if there's something there already, it might not end in a
+     * newline.  assuming it doesn't only puts off a roll a line.
+     */
+    pCE->logbol = (pCE->logsize == 0) ? FLAGTRUE : FLAGFALSE;
+    pCE->logrollwait = FLAGFALSE;
+    if (pCE->logfilemax != 0 && pCE->logsize >= pCE->logfilemax)
+	ConsTimerSet(pCE, CT_LOGROLL, 0);
+    return cfp;
+}
 
-	if (pCE->logfilemax < 4000)
-	    roll = 100;
-	else if (pCE->logfilemax > 160000)
-	    roll = 4000;
-	else
-	    roll = pCE->logfilemax * 0.025;
+/* write out whatever is sitting in the log buffer.  the first flush
+ * after a quiet spell starts the logsync clock, and a logfile that
+ * grows past logfilemax is rolled from the timer loop.
+ */
+void
+LogFlush(CONSENT *pCE)
+{
+    if (pCE == (CONSENT *)0)
+	return;
 
-	r = 0;
+    ConsTimerClear(pCE, CT_LOGFLUSH);
+    pCE->logpending = 0;
+    if (pCE->fdlog == (CONSFILE *)0 || FileBufEmpty(pCE->fdlog))
+	return;
+    CONDDEBUG((1, "LogFlush(): [%s] writing %d bytes", pCE->server,
+	       FileBufLen(pCE->fdlog)));
+    pCE->logsize += FileBufLen(pCE->fdlog);
+    FileWrite(pCE->fdlog, FLAGFALSE, (char *)0, 0);
+    if (pCE->logfilemax != 0 && pCE->logsize >= pCE->logfilemax &&
+	pCE->ctslot[CT_LOGROLL] == 0)
+	ConsTimerSet(pCE, CT_LOGROLL, 0);
+    if (pCE->logsync > 0 && pCE->ctslot[CT_LOGSYNC] == 0)
+	ConsTimerSet(pCE, CT_LOGSYNC, pCE->logsync);
+}
 
-	if (FileSeek(pCE->fdlog, stLog.st_size - roll, SEEK_SET) > 0) {
-	    if ((r = FileRead(pCE->fdlog, buf, 4096)) > 0) {
-		if (r == roll) {
-		    for (; r != 0 && buf[roll - r] != '\n'; r--);
-		    r--;	/* go beyond \n */
-		} else
-		    r = 0;
-	    }
-	}
+/* console output of len bytes (at s) was just added to the log buffer.
+ * write it all out if the buffer is full or enough lines are waiting,
+ * otherwise make sure it doesn't wait longer than logflush.  with
+ * logbuffer turned off, every read goes straight out like it always
+ * did.
+ */
+static void
+LogBuffered(CONSENT *pCE, char *s, int len)
+{
+    char *p, *e;
 
-	if (tyme == (time_t)0) {
-	    tyme = time((time_t *)0);
-	    strftime(timestr, sizeof(timestr), "-%Y%m%d-%H%M%S",
-		     gmtime(&tyme));
-	}
-	BuildTmpString((char *)0);
-	t = BuildTmpStringPrint("%s%s", pCE->logfile, timestr);
+    if (pCE->fdlog == (CONSFILE *)0)
+	return;
 
-	if (rename(pCE->logfile, t) != 0) {
-	    Error("[%s] RollLogs(): rename(%s,%s) failed: %s", pCE->server,
-		  pCE->logfile, t, strerror(errno));
-	    continue;
+    if (pCE->logbuffer <= 0 || FileBufLen(pCE->fdlog) >= pCE->logbuffer) {
+	LogFlush(pCE);
+	return;
+    }
+    if (pCE->loglines > 0) {
+	for (p = s, e = s + len;
+	     (p = memchr(p, '\n', e - p)) != (char *)0; p++)
+	    pCE->logpending++;
+	if (pCE->logpending >= pCE->loglines) {
+	    LogFlush(pCE);
+	    return;
 	}
+    }
+    if (pCE->ctslot[CT_LOGFLUSH] == 0)
+	ConsTimerSet(pCE, CT_LOGFLUSH, pCE->logflush);
+}
 
-	old = pCE->fdlog;
+static void RollLog(CONSENT *);
 
-	if ((pCE->fdlog =
-	     FileOpen(pCE->logfile, O_RDWR | O_CREAT | O_APPEND,
-		      0644)) == (CONSFILE *)0) {
-	    FileClose(&old);
-	    Error("[%s] RollLogs(): open(%s): %s: forcing down",
-		  pCE->server, pCE->logfile, strerror(errno));
-	    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
-	    continue;
-	}
-	if (r > 0) {
-	    FileWrite(pCE->fdlog, FLAGFALSE, buf + roll - r, r);
-	    ftruncate(FileFDNum(old), stLog.st_size - r);
-	}
+/* everything headed for the logfile goes through here so the
+ * scrollback sees it too (and it works without a logfile).  unless
+ * bufferonly is set, anything in the log buffer goes out with it.
+ * a roll that's waiting for the end of a line (see RollLog()) happens
+ * right after the first newline.
+ */
+static void
+LogWrite(CONSENT *pCE, FLAG bufferonly, char *s, int len)
+{
+    char *nl;
+    int n;
+
+    if (s != (char *)0 && len < 0)
+	len = strlen(s);
+    if (pCE->sb != (SCROLLBACK *)0 && s != (char *)0)
+	ScrollbackWrite(pCE->sb, s, len);
+    if (pCE->fdlog == (CONSFILE *)0)
+	return;
 
-	FileClose(&old);
+    if (pCE->logrollwait == FLAGTRUE && s != (char *)0 && len > 0 &&
+	(nl = memchr(s, '\n', len)) != (char *)0) {
+	n = nl - s + 1;
+	FileWrite(pCE->fdlog, FLAGTRUE, s, n);
+	pCE->logbol = FLAGTRUE;
+	RollLog(pCE);
+	s += n;
+	len -= n;
+	if (pCE->fdlog == (CONSFILE *)0)
+	    return;
     }
-
-    if (tyme != (time_t)0)
-	BuildTmpString((char *)0);
-
-    if (maxset == 0)
-	timers[T_ROLL] = (time_t)0;
-    else {
-	if (timers[T_ROLL] == (time_t)0)
-	    /* try and spread processes out a bit */
-	    timers[T_ROLL] = time((time_t *)0) + 300 + (pGE->id * 7) % 60;
-	else
-	    timers[T_ROLL] = time((time_t *)0) + 300;
+    if (s != (char *)0 && len > 0) {
+	FileWrite(pCE->fdlog, FLAGTRUE, s, len);
+	pCE->logbol = (s[len - 1] == '\n') ? FLAGTRUE : FLAGFALSE;
     }
+    if (bufferonly != FLAGTRUE)
+	LogFlush(pCE);
 }
 
 static void
-Mark(GRPENT *pGE)
+VTagLogfile(CONSENT *pCE, char *fmt, va_list ap)
 {
-    time_t tyme;
-    CONSENT *pCE;
-    static STRING *out = (STRING *)0;
+    static STRING *msg = (STRING *)0;
+    static STRING *tag = (STRING *)0;
+
+    if (msg == (STRING *)0) {
+	msg = AllocString();
+	tag = AllocString();
+    }
+    VWrite((CONSFILE *)0, FLAGFALSE, msg, fmt, ap);
+    BuildString((char *)0, tag);
+    BuildStringPrint(tag, "[-- %s -- %s]\r\n",
+		     msg->used > 1 ? msg->string : "",
+		     StrTime((time_t *)0));
+    LogWrite(pCE, FLAGFALSE, tag->string, tag->used - 1);
+}
 
-    if ((GRPENT *)0 == pGE)
-	return;
+void
+TagLogfile(CONSENT *pCE, char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
 
-    if (out == (STRING *)0)
-	out = AllocString();
+    if ((pCE == (CONSENT *)0) ||
+	(pCE->fdlog == (CONSFILE *)0 && pCE->sb == (SCROLLBACK *)0))
+	return;
 
-    BuildString((char *)0, out);
+    VTagLogfile(pCE, fmt, ap);
+    va_end(ap);
+}
+
+void
+TagLogfileAct(CONSENT *pCE, char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    if ((pCE == (CONSENT *)0) ||
+	(pCE->fdlog == (CONSFILE *)0 && pCE->sb == (SCROLLBACK *)0) ||
+	(pCE->activitylog != FLAGTRUE))
+	return;
 
-    /* [-- MARK -- `date`] */
-    BuildStringPrint(out, "[-- MARK -- %s]\r\n", StrTime(&tyme));
+    VTagLogfile(pCE, fmt, ap);
+    va_end(ap);
+}
 
-    timers[T_MARK] = (time_t)0;
+/* length of the "-YYYYMMDD-HHMMSS" RollLog() adds to a logfile name */
+#define ROLLSTAMPLEN	16
 
-    for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
-	if (pCE->nextMark > 0) {
-	    if (tyme >= pCE->nextMark) {
-		if ((CONSFILE *)0 != pCE->fdlog) {
-		    CONDDEBUG((1, "Mark(): [-- MARK --] stamp added to %s",
-			       pCE->logfile));
-		    FileWrite(pCE->fdlog, FLAGFALSE, out->string,
-			      out->used - 1);
-		}
-		/* Add as many pCE->mark values as necessary so that we move
-		 * beyond the current time.
-		 */
-		pCE->nextMark +=
-		    (((tyme - pCE->nextMark) / pCE->mark) + 1) * pCE->mark;
+/* is this a rolled copy of logfile `base' (base-YYYYMMDD-HHMMSS...)? */
+static int
+IsRolledLog(const char *name, const char *base, size_t blen)
+{
+    int i;
+
+    if (strncmp(name, base, blen) != 0 || name[blen] != '-')
+	return 0;
+    for (i = 1; i < ROLLSTAMPLEN; i++) {
+	if (i == 9) {
+	    if (name[blen + i] != '-')
+		return 0;
+	} else if (!isdigit((int)(name[blen + i])))
+	    return 0;
+    }
+    return 1;
+}
+
+static int
+CompareRolledLogs(const void *a, const void *b)
+{
+    /* newest first */
+    return strcmp(*(char *const *)b, *(char *const *)a);
+}
+
+/* the paths of the rolled copies of the logfile (and of their
+ * indexes, compressed copies, ...), newest first.  the first *plen
+ * bytes of each are the logfile's path and RollLog()'s timestamp, so
+ * everything from one roll has the same *plen byte prefix.  returns
+ * how many there are, -1 if the directory can't be read.
+ */
+static int
+RolledLogs(CONSENT *pCE, char ***ppaths, size_t *plen)
+{
+    char *dir, *base, *p;
+    size_t blen;
+    DIR *d;
+    struct dirent *de;
+    char **paths = (char **)0;
+    int n = 0, size = 0;
+    STRING *path;
+
+    if ((dir = StrDup(pCE->logfile)) == (char *)0)
+	OutOfMem();
+    if ((p = strrchr(dir, '/')) == (char *)0) {
+	base = dir;
+	p = ".";
+    } else {
+	*p = '\000';
+	base = p + 1;
+	p = (dir[0] == '\000') ? "/" : dir;
+    }
+    blen = strlen(base);
+
+    if ((d = opendir(p)) == (DIR *)0) {
+	Error("[%s] opendir(%s): %s", pCE->server, p, strerror(errno));
+	free(dir);
+	return -1;
+    }
+    path = AllocString();
+    while ((de = readdir(d)) != (struct dirent *)0) {
+	if (!IsRolledLog(de->d_name, base, blen))
+	    continue;
+	if (n == size) {
+	    size += 32;
+	    if ((paths =
+		 (char **)realloc(paths, size * sizeof(char *))) ==
+		(char **)0)
+		OutOfMem();
+	}
+	BuildString((char *)0, path);
+	BuildStringPrint(path, "%s/%s", p, de->d_name);
+	if ((paths[n++] = StrDup(path->string)) == (char *)0)
+	    OutOfMem();
+    }
+    closedir(d);
+    DestroyString(path);
+
+    if (n > 0)
+	qsort(paths, n, sizeof(char *), CompareRolledLogs);
+    *plen = strlen(p) + 1 + blen + ROLLSTAMPLEN;
+    *ppaths = paths;
+    free(dir);
+    return n;
+}
+
+/* apply logfilekeep and logfileage to the rolled copies of the logfile.
+ * everything that shares a timestamp (the indexes, a compressed copy)
+ * goes together.  this does a directory scan, so only the helper
+ * process forked by LogRetire() calls it.
+ */
+static void
+LogPrune(CONSENT *pCE)
+{
+    struct stat st;
+    char **paths;
+    size_t len;
+    int n, i, kept = 0;
+    time_t cutoff = (time_t)0;
+
+    if ((n = RolledLogs(pCE, &paths, &len)) <= 0)
+	return;
+
+    if (pCE->logfileage > 0)
+	cutoff = time((time_t *)0) - pCE->logfileage;
+
+    for (i = 0; i < n; i++) {
+	if (i == 0 || strncmp(paths[i], paths[i - 1], len) != 0)
+	    kept++;
+	if (pCE->logfilekeep > 0 && kept > pCE->logfilekeep) {
+	    /* over the count */
+	} else if (cutoff != (time_t)0 && stat(paths[i], &st) == 0 &&
+		   st.st_mtime < cutoff) {
+	    /* too old */
+	} else
+	    continue;
+	CONDDEBUG((1, "LogPrune(): [%s] removing %s", pCE->server,
+		   paths[i]));
+	if (unlink(paths[i]) != 0 && errno != ENOENT)
+	    Error("[%s] unlink(%s): %s", pCE->server, paths[i],
+		  strerror(errno));
+    }
+}
+
+/* forget what LogSegments() found (the logfile was rolled, renamed,
+ * or a rolled one has gone missing)
+ */
+void
+LogSegmentsDrop(CONSENT *pCE)
+{
+    int i;
+
+    if (pCE->segs == (LOGSEGS *)0)
+	return;
+    for (i = 0; i < pCE->segs->n; i++)
+	free(pCE->segs->path[i]);
+    if (pCE->segs->path != (char **)0)
+	free(pCE->segs->path);
+    free(pCE->segs);
+    pCE->segs = (LOGSEGS *)0;
+}
+
+/* the catalog of rolled logfiles that replays walk back through once
+ * the current logfile runs out.  the directory is only scanned the
+ * first time it's asked for after the logfile is (re)opened - new
+ * rolls come through LogOpen(), which drops it, and the compression
+ * and pruning done behind our back are noticed when a rolled logfile
+ * won't open.  returns 0 if there's no logfile.
+ */
+LOGSEGS *
+LogSegments(CONSENT *pCE)
+{
+    char **paths;
+    size_t len;
+    int n, i;
+    LOGSEGS *segs;
+
+    if (pCE->logfile == (char *)0)
+	return (LOGSEGS *)0;
+    if (pCE->segs != (LOGSEGS *)0)
+	return pCE->segs;
+
+    if ((segs = (LOGSEGS *)calloc(1, sizeof(LOGSEGS))) == (LOGSEGS *)0)
+	OutOfMem();
+    if ((n = RolledLogs(pCE, &paths, &len)) > 0) {
+	/* one entry per roll, named the way RollLog() named it */
+	if ((segs->path = (char **)calloc(n, sizeof(char *))) ==
+	    (char **)0)
+	    OutOfMem();
+	for (i = 0; i < n; i++) {
+	    if (segs->n > 0 &&
+		strncmp(paths[i], segs->path[segs->n - 1], len) == 0) {
+		free(paths[i]);
+		continue;
 	    }
-	    if (timers[T_MARK] == (time_t)0 ||
-		timers[T_MARK] > pCE->nextMark)
-		timers[T_MARK] = pCE->nextMark;
+	    paths[i][len] = '\000';
+	    segs->path[segs->n++] = paths[i];
 	}
+	free(paths);
+    }
+    CONDDEBUG((1, "LogSegments(): [%s] %d rolled logfiles", pCE->server,
+	       segs->n));
+    pCE->segs = segs;
+    return segs;
+}
+
+/* hand a rolled logfile off to a helper process that prunes the old
+ * copies and then runs logcompress on it (unless compress is false -
+ * framed logfiles are compressed already), so neither holds up the
+ * group.  ReapVirt() collects the helper.
+ */
+static void
+LogRetire(CONSENT *pCE, char *rolled, FLAG compress)
+{
+    pid_t pid;
+    extern char **environ;
+    static char *apcArgv[] = {
+	"/bin/sh", "-c", (char *)0, "sh", (char *)0, (char *)0
+    };
+    static STRING *cmd = (STRING *)0;
+
+    if (compress != FLAGTRUE || pCE->logcompress == (char *)0)
+	compress = FLAGFALSE;
+    if (compress == FLAGFALSE && pCE->logfilekeep == 0 &&
+	pCE->logfileage == 0)
+	return;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    switch (pid = fork()) {
+	case -1:
+	    Error("[%s] LogRetire(): fork(): %s", pCE->server,
+		  strerror(errno));
+	    return;
+	case 0:
+	    thepid = getpid();
+	    break;
+	default:
+	    CONDDEBUG((1, "LogRetire(): [%s] helper pid %lu for %s",
+		       pCE->server, (unsigned long)pid, rolled));
+	    return;
+    }
+
+    SimpleSignal(SIGHUP, SIG_DFL);
+    SimpleSignal(SIGTERM, SIG_DFL);
+    SimpleSignal(SIGCHLD, SIG_DFL);
+    SimpleSignal(SIGUSR1, SIG_DFL);
+    SimpleSignal(SIGUSR2, SIG_DFL);
+    SimpleSignal(SIGPIPE, SIG_DFL);
+
+    CloseFiles(-1, -1);
+
+    LogPrune(pCE);
+
+    if (compress == FLAGFALSE)
+	exit(EX_OK);
+
+    /* the filename is passed as $1 so the shell leaves it alone */
+    if (cmd == (STRING *)0)
+	cmd = AllocString();
+    BuildStringPrint(cmd, "exec %s \"$1\"", pCE->logcompress);
+    apcArgv[2] = cmd->string;
+    apcArgv[4] = rolled;
+    execve(apcArgv[0], apcArgv, environ);
+    Error("[%s] execve(%s): %s", pCE->server, pCE->logcompress,
+	  strerror(errno));
+    exit(EX_OSERR);
+}
+
+/* move a logfile that is past logfilemax aside and start a fresh one.
+ * this is just a few renames and an open - the old copies are dealt with
+ * by LogRetire() in the background.  it's only done between lines (so
+ * no line is split across two logfiles and replays count right), so
+ * if the logfile ends part way through one, LogWrite() calls back
+ * when it's done - unless the console has gone on for another
+ * logfilemax without a newline.
+ */
+static void
+RollLog(CONSENT *pCE)
+{
+    char *t;
+    char timestr[40];
+    time_t tyme;
+    CONSFILE *old;
+    int framed;
+    static STRING *rolled = (STRING *)0;
+    static STRING *idxfrom = (STRING *)0;
+    static STRING *idxto = (STRING *)0;
+
+    pCE->logrollwait = FLAGFALSE;
+    if (pCE->fdlog == (CONSFILE *)0 || pCE->logfilemax == 0)
+	return;
+
+    LogFlush(pCE);
+    ConsTimerClear(pCE, CT_LOGROLL);
+    if (pCE->logsize < pCE->logfilemax)
+	return;
+
+    /* the names are only good to the second */
+    tyme = time((time_t *)0);
+    if (tyme == pCE->logrolled) {
+	ConsTimerSet(pCE, CT_LOGROLL, 1000);
+	return;
+    }
+    if (pCE->logbol != FLAGTRUE && pCE->logsize < 2 * pCE->logfilemax) {
+	CONDDEBUG((1, "RollLog(): [%s] waiting for the end of the line",
+		   pCE->server));
+	pCE->logrollwait = FLAGTRUE;
+	return;
+    }
+    pCE->logrolled = tyme;
+
+    if (rolled == (STRING *)0) {
+	rolled = AllocString();
+	idxfrom = AllocString();
+	idxto = AllocString();
+    }
+
+    if (pCE->logfilemax > 1024) {
+	if (pCE->logfilemax > 0x100000)
+	    Msg("[%s] logfile exceeds %dMB: rolling", pCE->server,
+		pCE->logfilemax / 0x100000);
+	else
+	    Msg("[%s] logfile exceeds %dKB: rolling", pCE->server,
+		pCE->logfilemax / 1024);
+    }
+
+    strftime(timestr, sizeof(timestr), "-%Y%m%d-%H%M%S", gmtime(&tyme));
+    BuildString((char *)0, rolled);
+    t = BuildStringPrint(rolled, "%s%s", pCE->logfile, timestr);
+
+    if (rename(pCE->logfile, t) != 0) {
+	Error("[%s] RollLog(): rename(%s,%s) failed: %s", pCE->server,
+	      pCE->logfile, t, strerror(errno));
+	return;
+    }
+    /* the line, time and frame indexes go with it, if there are any */
+    BuildString((char *)0, idxfrom);
+    BuildStringPrint(idxfrom, "%s%s", pCE->logfile, LINEINDEXSUFFIX);
+    BuildString((char *)0, idxto);
+    BuildStringPrint(idxto, "%s%s", t, LINEINDEXSUFFIX);
+    rename(idxfrom->string, idxto->string);
+    BuildString((char *)0, idxfrom);
+    BuildStringPrint(idxfrom, "%s%s", pCE->logfile, TIMEINDEXSUFFIX);
+    BuildString((char *)0, idxto);
+    BuildStringPrint(idxto, "%s%s", t, TIMEINDEXSUFFIX);
+    rename(idxfrom->string, idxto->string);
+    BuildString((char *)0, idxfrom);
+    BuildStringPrint(idxfrom, "%s%s", pCE->logfile, FRAMEINDEXSUFFIX);
+    BuildString((char *)0, idxto);
+    BuildStringPrint(idxto, "%s%s", t, FRAMEINDEXSUFFIX);
+    rename(idxfrom->string, idxto->string);
+
+    old = pCE->fdlog;
+    if ((pCE->fdlog = LogOpen(pCE)) == (CONSFILE *)0) {
+	FileClose(&old);
+	Error("[%s] RollLog(): open(%s): %s: forcing down", pCE->server,
+	      pCE->logfile, strerror(errno));
+	ConsDown(pCE, FLAGTRUE, FLAGTRUE);
+	return;
+    }
+    framed = (old->frm != (FRAMES *)0);
+    FileClose(&old);
+
+    LogRetire(pCE, t, framed ? FLAGFALSE : FLAGTRUE);
+}
+
+static void
+Mark(CONSENT *pCE)
+{
+    time_t tyme;
+    static STRING *out = (STRING *)0;
+
+    if (out == (STRING *)0)
+	out = AllocString();
+
+    if ((CONSFILE *)0 != pCE->fdlog || (SCROLLBACK *)0 != pCE->sb) {
+	BuildString((char *)0, out);
+
+	/* [-- MARK -- `date`] */
+	BuildStringPrint(out, "[-- MARK -- %s]\r\n", StrTime(&tyme));
+
+	CONDDEBUG((1, "Mark(): [-- MARK --] stamp added to %s",
+		   pCE->logfile));
+	FileIndexTime(pCE->fdlog, tyme, FLAGTRUE);
+	FileIndexMark(pCE->fdlog);
+	LogWrite(pCE, FLAGFALSE, out->string, out->used - 1);
     }
+    ConsMarkReset(pCE);
 }
 
 void
@@ -1213,11 +2043,17 @@ WriteLog(CONSENT *pCE, char *s, int len)
     int j;
     static STRING *buf = (STRING *)0;
 
-    if ((CONSFILE *)0 == pCE->fdlog) {
+    if ((CONSFILE *)0 == pCE->fdlog && (SCROLLBACK *)0 == pCE->sb) {
 	return;
     }
+    /* feed the logfile's time index (it decides if it's been long
+     * enough since the last one)
+     */
+    FileIndexTime(pCE->fdlog, time((time_t *)0), FLAGFALSE);
+
     if (pCE->mark >= 0) {	/* no line marking */
-	FileWrite(pCE->fdlog, FLAGFALSE, s, len);
+	LogWrite(pCE, FLAGTRUE, s, len);
+	LogBuffered(pCE, s, len);
 	return;
     }
 
@@ -1227,13 +2063,13 @@ WriteLog(CONSENT *pCE, char *s, int len)
 
     for (j = 0; j < len; j++) {
 	if (pCE->nextMark == 0) {
-	    FileWrite(pCE->fdlog, FLAGTRUE, s + i, j - i);
+	    LogWrite(pCE, FLAGTRUE, s + i, j - i);
 	    i = j;
 
 	    if (buf->used <= 1)
 		BuildStringPrint(buf, "[%s]", StrTime((time_t *)0));
 
-	    FileWrite(pCE->fdlog, FLAGTRUE, buf->string, buf->used - 1);
+	    LogWrite(pCE, FLAGTRUE, buf->string, buf->used - 1);
 	    pCE->nextMark = pCE->mark;
 	}
 	if (s[j] == '\n') {
@@ -1244,9 +2080,9 @@ WriteLog(CONSENT *pCE, char *s, int len)
 	}
     }
     if (i < j) {
-	FileWrite(pCE->fdlog, FLAGTRUE, s + i, j - i);
+	LogWrite(pCE, FLAGTRUE, s + i, j - i);
     }
-    FileWrite(pCE->fdlog, FLAGFALSE, (char *)0, 0);
+    LogBuffered(pCE, s, len);
 }
 
 static RETSIGTYPE
@@ -1412,139 +2248,528 @@ ReapVirt(GRPENT *pGE)
 
 		/* If we didn't succeed, try again later */
 		if (!pCE->fup)
-		    pCE->autoReUp = 1;
+		    ConsReUpLater(pCE);
 	    }
 	    break;
 	}
     }
 }
 
-int
-CheckPasswd(CONSCLIENT *pCL, char *pw_string, FLAG empty_check)
+/* the password file is kept in memory, read again only when it looks
+ * different (or is gone), instead of being parsed on every login.
+ * each user maps to the first line with that name; *any* lines are
+ * kept aside and win if they come first, same as a top-down scan.
+ */
+typedef struct pwEnt {
+    char *user;
+    char *pw;
+    int line;			/* where it is in the file              */
+    struct pwEnt *same;		/* same name, different case            */
+    struct pwEnt *next;
+} PWENT;
+
+static PWENT *pwList = (PWENT *)0;
+static PWENT *pwAny = (PWENT *)0;	/* first *any* line             */
+static NAMEMAP *pwUsers = (NAMEMAP *)0;
+static char *pwPath = (char *)0;
+static struct stat pwStat;
+
+/* just enough SHA-256 (FIPS 180-4) for the HMAC the password cache
+ * keeps (see PasswdMac()).  values are held in unsigned longs, masked
+ * down to 32 bits
+ */
+#define SHA256_BLOCK	64
+#define SHA256_SIZE	32
+#define SHA256_MASK	0xffffffffUL
+#define SHA256_ROR(x, n)	((((x) >> (n)) | ((x) << (32 - (n)))) & SHA256_MASK)
+
+typedef struct sha256 {
+    unsigned long h[8];
+    unsigned long bytes;	/* how much has gone in             */
+    unsigned char block[SHA256_BLOCK];
+    int used;			/* how much of block is filled      */
+} SHA256;
+
+static const unsigned long sha256K[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+    0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+    0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+    0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+    0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+    0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+    0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+    0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+    0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+    0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+    0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+    0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+    0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+static void
+Sha256Init(SHA256 *s)
 {
-    FILE *fp;
-    int iLine = 0;
-    char *this_pw, *user;
+    static const unsigned long h0[8] = {
+	0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL,
+	0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+    };
 
-#if USE_UNIX_DOMAIN_SOCKETS
-# if TRUST_UDS_CRED
-    struct UDS_CRED_STYPE client_cred;
-    socklen_t client_cred_len = sizeof(client_cred);
-    memset(&client_cred, 0, sizeof(client_cred));
-    int err;
+    memcpy(s->h, h0, sizeof(s->h));
+    s->bytes = 0;
+    s->used = 0;
+}
 
-    if ((err =
-	 getsockopt(pCL->fd->fd, SOL_SOCKET, UDS_CRED_SO, &client_cred,
-		    &client_cred_len)) == -1) {
-	Error("CheckPasswd(): getsockopt(CREDENTIALS) failed: %s",
-	      strerror(err));
-    } else if (client_cred.pid != 0) {
-	/* Does pCL->username->string and client_cred.uid match ? */
-	struct passwd *pwd = (struct passwd *)0;
+static void
+Sha256Block(SHA256 *s)
+{
+    unsigned long w[64], v[8], t1, t2;
+    int i;
 
-	/* we allow root to impersonate anyone */
-	if (client_cred.UDS_CRED_UID == 0)
-	    return AUTH_SUCCESS;
+    for (i = 0; i < 16; i++)
+	w[i] = ((unsigned long)s->block[i * 4] << 24) |
+	    ((unsigned long)s->block[i * 4 + 1] << 16) |
+	    ((unsigned long)s->block[i * 4 + 2] << 8) |
+	    (unsigned long)s->block[i * 4 + 3];
+    for (; i < 64; i++)
+	w[i] = (w[i - 16] + w[i - 7] +
+		(SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^
+		 (w[i - 15] >> 3)) +
+		(SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^
+		 (w[i - 2] >> 10))) & SHA256_MASK;
+
+    memcpy(v, s->h, sizeof(v));
+    for (i = 0; i < 64; i++) {
+	t1 = v[7] + (SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^
+		     SHA256_ROR(v[4], 25)) +
+	    ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256K[i] + w[i];
+	t2 = (SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^
+	      SHA256_ROR(v[0], 22)) +
+	    ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+	v[7] = v[6];
+	v[6] = v[5];
+	v[5] = v[4];
+	v[4] = (v[3] + t1) & SHA256_MASK;
+	v[3] = v[2];
+	v[2] = v[1];
+	v[1] = v[0];
+	v[0] = (t1 + t2) & SHA256_MASK;
+    }
+    for (i = 0; i < 8; i++)
+	s->h[i] = (s->h[i] + v[i]) & SHA256_MASK;
+    s->used = 0;
+}
 
-	if ((pwd = getpwnam(pCL->username->string)) != NULL) {
-	    if (pwd->pw_uid == client_cred.UDS_CRED_UID) {
-		Verbose("user %s authenticated", pCL->username->string);
-		return AUTH_SUCCESS;
-	    }
-	}
+static void
+Sha256Update(SHA256 *s, const unsigned char *p, size_t len)
+{
+    s->bytes += len;
+    while (len-- > 0) {
+	s->block[s->used++] = *p++;
+	if (s->used == SHA256_BLOCK)
+	    Sha256Block(s);
     }
-# endif
-#endif
+}
 
-    if ((fp = fopen(config->passwdfile, "r")) == (FILE *)0) {
-	if (CheckPass(pCL->username->string, pw_string, empty_check) ==
-	    AUTH_SUCCESS) {
-	    Verbose("user %s authenticated", pCL->acid->string);
-	    return AUTH_SUCCESS;
-	}
-    } else {
-	char *wholeLine;
-	static STRING *saveLine = (STRING *)0;
+static void
+Sha256Final(SHA256 *s, unsigned char *out)
+{
+    unsigned long hi = s->bytes >> 29, lo = (s->bytes << 3) & SHA256_MASK;
+    int i;
 
-	if (saveLine == (STRING *)0)
-	    saveLine = AllocString();
-	BuildString((char *)0, saveLine);
+    s->block[s->used++] = 0x80;
+    if (s->used > SHA256_BLOCK - 8) {
+	while (s->used < SHA256_BLOCK)
+	    s->block[s->used++] = 0;
+	Sha256Block(s);
+    }
+    while (s->used < SHA256_BLOCK - 8)
+	s->block[s->used++] = 0;
+    for (i = 0; i < 4; i++) {
+	s->block[SHA256_BLOCK - 8 + i] = (hi >> (24 - i * 8)) & 0xff;
+	s->block[SHA256_BLOCK - 4 + i] = (lo >> (24 - i * 8)) & 0xff;
+    }
+    Sha256Block(s);
+    for (i = 0; i < SHA256_SIZE; i++)
+	out[i] = (s->h[i / 4] >> (24 - (i % 4) * 8)) & 0xff;
+}
 
-	while ((wholeLine = ReadLine(fp, saveLine, &iLine)) != (char *)0) {
-	    PruneSpace(wholeLine);
-	    /*printf("whole=<%s>\n", wholeLine); */
-	    if (wholeLine[0] == '\000')
-		continue;
+/* with `passwdcache', good passwords are remembered for a while, so a
+ * burst of logins doesn't crypt() (or PAM) the same thing each time.
+ * all that's kept is an HMAC-SHA256 of the name and password, keyed
+ * with random bytes that only this process has (never written down,
+ * and fresh in each group), so a hit is one cheap hash of what was
+ * typed.  without /dev/urandom nothing is cached
+ */
+typedef struct pwCache {
+    char *user;
+    unsigned char mac[SHA256_SIZE];
+    time_t expires;
+    struct pwCache *next;
+} PWCACHE;
+
+static PWCACHE *pwCacheList = (PWCACHE *)0;
+static NAMEMAP *pwCache = (NAMEMAP *)0;
+static unsigned char pwKey[SHA256_BLOCK];
+static pid_t pwKeyPid = 0;
 
-	    if ((char *)0 == (this_pw = strchr(wholeLine, ':'))) {
-		Error("CheckPasswd(): %s(%d) bad password line `%s'",
-		      config->passwdfile, iLine, wholeLine);
-		continue;
-	    }
-	    *this_pw++ = '\000';
-	    user = PruneSpace(wholeLine);
-	    this_pw = PruneSpace(this_pw);
+static void
+PasswdCacheFlush(void)
+{
+    PWCACHE *c;
 
-	    if (strcmp(user, "*any*") != 0 &&
-		strcmp(user, pCL->username->string) != 0)
-		continue;
+    while ((c = pwCacheList) != (PWCACHE *)0) {
+	pwCacheList = c->next;
+	free(c->user);
+	free(c);
+    }
+    NameMapDestroy(&pwCache);
+}
 
-	    /* If one is empty and the other isn't, instant failure */
-	    if ((*this_pw == '\000' && *pw_string != '\000') ||
-		(*this_pw != '\000' && *pw_string == '\000')) {
-		break;
-	    }
+/* make sure this process has its own key - anything cached under a
+ * parent's is thrown away.  returns 1 if there's a key to use
+ */
+static int
+PasswdKey(void)
+{
+    int fd, n;
 
-	    if ((*this_pw == '\000' && *pw_string == '\000') ||
-		((strcmp(this_pw, "*passwd*") ==
-		  0) ? (CheckPass(pCL->username->string, pw_string,
-				  empty_check) ==
-			AUTH_SUCCESS) : (strcmp(this_pw,
-						crypt(pw_string,
-						      this_pw)) == 0))) {
-		Verbose("user %s authenticated", pCL->acid->string);
-		fclose(fp);
-		return AUTH_SUCCESS;
-	    }
-	    break;
-	}
-	fclose(fp);
+    if (pwKeyPid == thepid)
+	return 1;
+    PasswdCacheFlush();
+    memset(pwKey, 0, sizeof(pwKey));
+    pwKeyPid = 0;
+    if ((fd = open("/dev/urandom", O_RDONLY)) == -1) {
+	CONDDEBUG((1, "PasswdKey(): open(/dev/urandom): %s",
+		   strerror(errno)));
+	return 0;
     }
-
-    return AUTH_INVALID;
+    n = read(fd, pwKey, SHA256_SIZE);
+    close(fd);
+    if (n != SHA256_SIZE) {
+	CONDDEBUG((1, "PasswdKey(): short read of /dev/urandom"));
+	return 0;
+    }
+    pwKeyPid = thepid;
+    return 1;
 }
 
-static char *
-IdleTyme(long tyme)
+/* HMAC-SHA256 (RFC 2104) of user and pw under pwKey */
+static void
+PasswdMac(char *user, char *pw, unsigned char *mac)
 {
-    long hours, minutes;
-    static STRING *timestr = (STRING *)0;
-
-    if (timestr == (STRING *)0)
-	timestr = AllocString();
+    unsigned char pad[SHA256_BLOCK];
+    SHA256 s;
+    int i;
 
-    minutes = tyme / 60;
-    hours = minutes / 60;
-    minutes = minutes % 60;
+    for (i = 0; i < SHA256_BLOCK; i++)
+	pad[i] = pwKey[i] ^ 0x36;
+    Sha256Init(&s);
+    Sha256Update(&s, pad, SHA256_BLOCK);
+    Sha256Update(&s, (unsigned char *)user, strlen(user) + 1);
+    Sha256Update(&s, (unsigned char *)pw, strlen(pw));
+    Sha256Final(&s, mac);
+
+    for (i = 0; i < SHA256_BLOCK; i++)
+	pad[i] = pwKey[i] ^ 0x5c;
+    Sha256Init(&s);
+    Sha256Update(&s, pad, SHA256_BLOCK);
+    Sha256Update(&s, mac, SHA256_SIZE);
+    Sha256Final(&s, mac);
+    memset(pad, 0, sizeof(pad));
+}
 
-    BuildString((char *)0, timestr);
-    if (hours < 24)
-	BuildStringPrint(timestr, " %2ld:%02ld", hours, minutes);
-    else if (hours < 24 * 2)
-	BuildStringPrint(timestr, " 1 day");
-    else if (hours < 24 * 10)
-	BuildStringPrint(timestr, "%1ld days", hours / 24);
-    else
-	BuildStringPrint(timestr, "%2lddays", hours / 24);
+/* compare without returning early, so the time taken says nothing
+ * about how much of the mac matched
+ */
+static int
+PasswdSame(const unsigned char *a, const unsigned char *b)
+{
+    size_t i;
+    unsigned char diff = 0;
 
-    return timestr->string;
+    for (i = 0; i < SHA256_SIZE; i++)
+	diff |= a[i] ^ b[i];
+    return diff == 0;
 }
 
-void
-PutConsole(CONSENT *pCEServing, unsigned char c, int quote)
+static int
+PasswdCached(char *user, char *pw)
 {
-    /* if we need to send an IAC char to a telnet-based port, quote
-     * the thing (which means send two to the port).  but, since we're
+    PWCACHE *c;
+    unsigned char mac[SHA256_SIZE];
+
+    if (config->passwdcache <= 0 || !PasswdKey() ||
+	(c = (PWCACHE *)NameMapFind(pwCache, user)) == (PWCACHE *)0)
+	return 0;
+    if (c->expires <= time((time_t *)0) || strcmp(c->user, user) != 0)
+	return 0;
+    PasswdMac(user, pw, mac);
+    return PasswdSame(c->mac, mac);
+}
+
+static void
+PasswdRemember(char *user, char *pw)
+{
+    PWCACHE *c;
+
+    if (config->passwdcache <= 0 || !PasswdKey())
+	return;
+
+    if (pwCache == (NAMEMAP *)0)
+	pwCache = NameMapNew();
+
+    if ((c = (PWCACHE *)NameMapFind(pwCache, user)) == (PWCACHE *)0) {
+	if ((c = (PWCACHE *)calloc(1, sizeof(PWCACHE))) == (PWCACHE *)0)
+	    OutOfMem();
+	if ((c->user = StrDup(user)) == (char *)0)
+	    OutOfMem();
+	NameMapAdd(pwCache, c->user, c);
+	c->next = pwCacheList;
+	pwCacheList = c;
+    } else if (strcmp(c->user, user) != 0) {
+	/* one per name, whatever the case */
+	NameMapDelete(pwCache, c->user, c);
+	free(c->user);
+	if ((c->user = StrDup(user)) == (char *)0)
+	    OutOfMem();
+	NameMapAdd(pwCache, c->user, c);
+    }
+    PasswdMac(user, pw, c->mac);
+    c->expires = time((time_t *)0) + config->passwdcache;
+}
+
+static void
+PasswdDrop(void)
+{
+    PWENT *e;
+
+    while ((e = pwList) != (PWENT *)0) {
+	pwList = e->next;
+	free(e->user);
+	free(e->pw);
+	free(e);
+    }
+    pwAny = (PWENT *)0;
+    NameMapDestroy(&pwUsers);
+    if (pwPath != (char *)0) {
+	free(pwPath);
+	pwPath = (char *)0;
+    }
+}
+
+/* make sure the in-memory copy matches config->passwdfile.  returns
+ * zero if there isn't one to use (so the system passwords are checked)
+ */
+static int
+PasswdLoad(void)
+{
+    FILE *fp;
+    struct stat st;
+    int iLine = 0, n = 0;
+    char *wholeLine, *this_pw, *user;
+    static STRING *saveLine = (STRING *)0;
+    PWENT *e, *f;
+
+    if (stat(config->passwdfile, &st) != 0) {
+	if (pwPath != (char *)0) {
+	    PasswdDrop();
+	    PasswdCacheFlush();
+	}
+	return 0;
+    }
+    if (pwPath != (char *)0 && strcmp(pwPath, config->passwdfile) == 0 &&
+	st.st_dev == pwStat.st_dev && st.st_ino == pwStat.st_ino &&
+	st.st_size == pwStat.st_size && st.st_mtime == pwStat.st_mtime &&
+	st.st_ctime == pwStat.st_ctime)
+	return 1;
+
+    /* it's new or it changed, so nothing we knew counts anymore */
+    PasswdDrop();
+    PasswdCacheFlush();
+    if ((fp = fopen(config->passwdfile, "r")) == (FILE *)0)
+	return 0;
+    if (fstat(fileno(fp), &pwStat) != 0)
+	pwStat = st;
+
+    if (saveLine == (STRING *)0)
+	saveLine = AllocString();
+    BuildString((char *)0, saveLine);
+    pwUsers = NameMapNew();
+
+    while ((wholeLine = ReadLine(fp, saveLine, &iLine)) != (char *)0) {
+	PruneSpace(wholeLine);
+	if (wholeLine[0] == '\000')
+	    continue;
+
+	if ((char *)0 == (this_pw = strchr(wholeLine, ':'))) {
+	    Error("PasswdLoad(): %s(%d) bad password line `%s'",
+		  config->passwdfile, iLine, wholeLine);
+	    continue;
+	}
+	*this_pw++ = '\000';
+	user = PruneSpace(wholeLine);
+	this_pw = PruneSpace(this_pw);
+
+	if (strcmp(user, "*any*") == 0) {
+	    if (pwAny != (PWENT *)0)
+		continue;
+	    f = (PWENT *)0;
+	} else {
+	    for (f = (PWENT *)NameMapFind(pwUsers, user);
+		 f != (PWENT *)0 && strcmp(f->user, user) != 0;
+		 f = f->same);
+	    /* only the first line for a user is ever looked at */
+	    if (f != (PWENT *)0)
+		continue;
+	}
+
+	if ((e = (PWENT *)calloc(1, sizeof(PWENT))) == (PWENT *)0)
+	    OutOfMem();
+	if ((e->user = StrDup(user)) == (char *)0 ||
+	    (e->pw = StrDup(this_pw)) == (char *)0)
+	    OutOfMem();
+	e->line = iLine;
+	e->next = pwList;
+	pwList = e;
+	n++;
+
+	if (strcmp(user, "*any*") == 0)
+	    pwAny = e;
+	else if ((f = (PWENT *)NameMapFind(pwUsers, user)) != (PWENT *)0) {
+	    e->same = f->same;
+	    f->same = e;
+	} else
+	    NameMapAdd(pwUsers, e->user, e);
+    }
+    fclose(fp);
+
+    if ((pwPath = StrDup(config->passwdfile)) == (char *)0)
+	OutOfMem();
+    CONDDEBUG((1, "PasswdLoad(): %d entries from %s", n, pwPath));
+    return 1;
+}
+
+/* the line a top-down scan of the password file would stop at */
+static PWENT *
+PasswdFind(char *user)
+{
+    PWENT *e;
+
+    for (e = (PWENT *)NameMapFind(pwUsers, user);
+	 e != (PWENT *)0 && strcmp(e->user, user) != 0; e = e->same);
+    if (pwAny != (PWENT *)0 && (e == (PWENT *)0 || pwAny->line < e->line))
+	e = pwAny;
+    return e;
+}
+
+int
+CheckPasswd(CONSCLIENT *pCL, char *pw_string, FLAG empty_check)
+{
+    char *this_pw;
+    PWENT *e;
+    int loaded;
+
+#if USE_UNIX_DOMAIN_SOCKETS
+# if TRUST_UDS_CRED
+    struct UDS_CRED_STYPE client_cred;
+    socklen_t client_cred_len = sizeof(client_cred);
+    memset(&client_cred, 0, sizeof(client_cred));
+    int err;
+
+    if ((err =
+	 getsockopt(pCL->fd->fd, SOL_SOCKET, UDS_CRED_SO, &client_cred,
+		    &client_cred_len)) == -1) {
+	Error("CheckPasswd(): getsockopt(CREDENTIALS) failed: %s",
+	      strerror(err));
+    } else if (client_cred.pid != 0) {
+	/* Does pCL->username->string and client_cred.uid match ? */
+	struct passwd *pwd = (struct passwd *)0;
+
+	/* we allow root to impersonate anyone */
+	if (client_cred.UDS_CRED_UID == 0)
+	    return AUTH_SUCCESS;
+
+	if ((pwd = getpwnam(pCL->username->string)) != NULL) {
+	    if (pwd->pw_uid == client_cred.UDS_CRED_UID) {
+		Verbose("user %s authenticated", pCL->username->string);
+		return AUTH_SUCCESS;
+	    }
+	}
+    }
+# endif
+#endif
+
+    loaded = PasswdLoad();
+    if (PasswdCached(pCL->username->string, pw_string)) {
+	Verbose("user %s authenticated", pCL->acid->string);
+	return AUTH_SUCCESS;
+    }
+
+    if (!loaded) {
+	if (CheckPass(pCL->username->string, pw_string, empty_check) ==
+	    AUTH_SUCCESS) {
+	    Verbose("user %s authenticated", pCL->acid->string);
+	    PasswdRemember(pCL->username->string, pw_string);
+	    return AUTH_SUCCESS;
+	}
+    } else if ((e = PasswdFind(pCL->username->string)) != (PWENT *)0) {
+	this_pw = e->pw;
+
+	/* If one is empty and the other isn't, instant failure */
+	if ((*this_pw == '\000' && *pw_string != '\000') ||
+	    (*this_pw != '\000' && *pw_string == '\000'))
+	    return AUTH_INVALID;
+
+	if ((*this_pw == '\000' && *pw_string == '\000') ||
+	    ((strcmp(this_pw, "*passwd*") ==
+	      0) ? (CheckPass(pCL->username->string, pw_string,
+			      empty_check) ==
+		    AUTH_SUCCESS) : (strcmp(this_pw,
+					    crypt(pw_string,
+						  this_pw)) == 0))) {
+	    Verbose("user %s authenticated", pCL->acid->string);
+	    PasswdRemember(pCL->username->string, pw_string);
+	    return AUTH_SUCCESS;
+	}
+    }
+
+    return AUTH_INVALID;
+}
+
+static char *
+IdleTyme(long tyme)
+{
+    long hours, minutes;
+    static STRING *timestr = (STRING *)0;
+
+    if (timestr == (STRING *)0)
+	timestr = AllocString();
+
+    minutes = tyme / 60;
+    hours = minutes / 60;
+    minutes = minutes % 60;
+
+    BuildString((char *)0, timestr);
+    if (hours < 24)
+	BuildStringPrint(timestr, " %2ld:%02ld", hours, minutes);
+    else if (hours < 24 * 2)
+	BuildStringPrint(timestr, " 1 day");
+    else if (hours < 24 * 10)
+	BuildStringPrint(timestr, "%1ld days", hours / 24);
+    else
+	BuildStringPrint(timestr, "%2lddays", hours / 24);
+
+    return timestr->string;
+}
+
+void
+PutConsole(CONSENT *pCEServing, unsigned char c, int quote)
+{
+    /* if we need to send an IAC char to a telnet-based port, quote
+     * the thing (which means send two to the port).  but, since we're
      * using IAC as a trigger for breaks and pauses, we have to load
      * two into the buffer here and two below (so two get sent).
      *
@@ -1579,6 +2804,8 @@ PutConsole(CONSENT *pCEServing, unsigned char c, int quote)
     if (c == IAC && pCEServing->wbufIAC == 0)
 	pCEServing->wbufIAC = pCEServing->wbuf->used;
 
+    PendConsole(pCEServing);
+
     CONDDEBUG((1, "PutConsole(): queued byte to console %s",
 	       pCEServing->server));
 }
@@ -1744,7 +2971,6 @@ SendBreak(CONSCLIENT *pCLServing, CONSENT *pCEServing, short bt)
 static int
 StartTask(CONSENT *pCE, char *cmd, uid_t uid, gid_t gid)
 {
-    int i;
     extern char **environ;
     char *pcShell, **ppcArgv;
     extern int FallBack(char **, int *);
@@ -1780,9 +3006,8 @@ StartTask(CONSENT *pCE, char *cmd, uid_t uid, gid_t gid)
 	    }
 	    Msg("[%s] task started: pid %lu", pCE->server,
 		(unsigned long)pCE->taskpid);
-	    FD_SET(cofile, &rinit);
-	    if (maxfd < cofile + 1)
-		maxfd = cofile + 1;
+	    FileSetOwner(pCE->taskfile, FDOWNER_CONSOLE, pCE);
+	    FDWatch(cofile, FDWATCH_READ);
 	    fflush(stderr);
 	    return 0;
     }
@@ -1810,10 +3035,7 @@ StartTask(CONSENT *pCE, char *cmd, uid_t uid, gid_t gid)
 
     /* setup new process with clean file descriptors
      */
-    i = GetMaxFiles();
-    for ( /* i above */ ; --i > 2;) {
-	close(i);
-    }
+    CloseFiles(-1, -1);
 
     if (geteuid() == 0) {
 	if (gid != 0)
@@ -2016,37 +3238,25 @@ HuntForConsole(GRPENT *pGE, char *name)
      * were already done by the master process, so
      * the first match should be what the user wants
      */
-    CONSENT *pCE = (CONSENT *)0;
+    NAMEREF **refs;
+    int i, n;
 
     if (name == (char *)0)
-	return pCE;
-
-    for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
-	NAMES *n = (NAMES *)0;
-	if (strcasecmp(name, pCE->server) == 0)
-	    break;
-	for (n = pCE->aliases; n != (NAMES *)0; n = n->next) {
-	    if (strcasecmp(name, n->name) == 0)
-		break;
-	}
-	if (n != (NAMES *)0)
-	    break;
-    }
-    if (pCE == (CONSENT *)0 && config->autocomplete == FLAGTRUE) {
-	NAMES *n = (NAMES *)0;
-	int len = strlen(name);
-	for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
-	    if (strncasecmp(name, pCE->server, len) == 0)
-		break;
-	    for (n = pCE->aliases; n != (NAMES *)0; n = n->next) {
-		if (strncasecmp(name, n->name, len) == 0)
-		    break;
-	    }
-	    if (n != (NAMES *)0)
-		break;
+	return (CONSENT *)0;
+
+    n = FindConsoleRefs(name, FLAGFALSE, &refs);
+    for (i = 0; i < n; i++) {
+	if (refs[i]->pGE == pGE)
+	    return refs[i]->pCE;
+    }
+    if (config->autocomplete == FLAGTRUE) {
+	n = FindConsoleRefs(name, FLAGTRUE, &refs);
+	for (i = 0; i < n; i++) {
+	    if (refs[i]->pGE == pGE)
+		return refs[i]->pCE;
 	}
     }
-    return pCE;
+    return (CONSENT *)0;
 }
 
 void
@@ -2394,7 +3604,7 @@ CommandInfo(GRPENT *pGE, CONSCLIENT *pCLServing, CONSENT *pCEServing,
 	}
 
 	FilePrint(pCLServing->fd, FLAGTRUE,
-		  ":%s:%s:%s,%s,%s,%s,%s,%d,%d:%d:%s:",
+		  ":%s:%s:%s,%s,%s,%s,%s,%d,%d:%d:%s",
 		  ((pCE->fup &&
 		    pCE->ioState == ISNORMAL) ? (pCE->initfile ==
 						 (CONSFILE *)0 ? "up" :
@@ -2407,6 +3617,7 @@ CommandInfo(GRPENT *pGE, CONSCLIENT *pCLServing, CONSENT *pCEServing,
 		  (pCE->tasklog == FLAGTRUE ? "task" : "notask"),
 		  pCE->mark, (pCE->fdlog ? pCE->fdlog->fd : -1),
 		  pCE->breakNum, (pCE->autoReUp ? "autoup" : "noautoup"));
+	FileWrite(pCLServing->fd, FLAGTRUE, ":", 1);
 	if (pCE->aliases != (NAMES *)0) {
 	    NAMES *n;
 	    comma = 0;
@@ -2449,11 +3660,25 @@ CommandInfo(GRPENT *pGE, CONSCLIENT *pCLServing, CONSENT *pCEServing,
 	    s = BuildTmpString(",unloved");
 	if (pCE->login == FLAGTRUE)
 	    s = BuildTmpString(",login");
-	FilePrint(pCLServing->fd, FLAGFALSE, ":%s:%s:%d:%s\r\n",
+	/* idletimeout goes out in (rounded up) seconds, as always */
+	FilePrint(pCLServing->fd, FLAGTRUE, ":%s:%s:%ld:%s",
 		  (s == (char *)0 ? "" : s + 1),
 		  (pCE->initcmd == (char *)0 ? "" : pCE->initcmd),
-		  pCE->idletimeout,
+		  (pCE->idletimeout + 999) / 1000,
 		  (pCE->idlestring == (char *)0 ? "" : pCE->idlestring));
+	FilePrint(pCLServing->fd, FLAGTRUE, ":%d,%s%s,%lu,%lu,%lu:",
+		  pCE->outputlimit,
+		  (pCE->outputpolicy == OPDISCONNECT ? "disconnect" :
+		   pCE->outputpolicy == OPBLOCK ? "block" : "drop"),
+		  (pCE->fstalled ? "ed" : ""), pCE->outskipped,
+		  pCE->outdisconnects, pCE->outstalls);
+	/* the next automatic reinit, if there's one scheduled */
+	if (pCE->ctslot[CT_REUP] != 0) {
+	    long next = ctHeap[pCE->ctslot[CT_REUP] - 1].when.tv_sec - tyme;
+	    FilePrint(pCLServing->fd, FLAGTRUE, "%u,%ld", pCE->reupTries,
+		      next < 0 ? 0L : next);
+	}
+	FileWrite(pCLServing->fd, FLAGFALSE, "\r\n", 2);
 	BuildTmpString((char *)0);
 	if (args != (char *)0)
 	    break;
@@ -2495,9 +3720,10 @@ CommandOpen(GRPENT *pGE, CONSCLIENT *pCLServing, CONSENT *pCEServing,
      * change fd's
      */
     ConsInit(pCEServing);
-    if (pCEServing->fup &&
-	(pCEServing->initfile != (CONSFILE *)0 ||
-	 pCEServing->ioState == INCONNECT)) {
+    if ((pCEServing->fup &&
+	 (pCEServing->initfile != (CONSFILE *)0 ||
+	  pCEServing->ioState == INCONNECT)) ||
+	pCEServing->ioState == INRESOLVE) {
 	FileWrite(pCLServing->fd, FLAGFALSE, "connecting...", -1);
 	pCLServing->fiwait = 1;
     } else if (pCEServing->fronly) {
@@ -2560,18 +3786,49 @@ TelOpt(int o)
     }
 }
 
+/* pCL has more console output queued than outputlimit allows, so
+ * apply the console's outputpolicy
+ */
+static void
+ClientOutputLimit(GRPENT *pGE, CONSENT *pCE, CONSCLIENT *pCL)
+{
+    int n;
+
+    switch (pCE->outputpolicy) {
+	case OPDISCONNECT:
+	    pCE->outdisconnects++;
+	    Msg("[%s] %s: output limit reached, disconnecting",
+		pCE->server, pCL->acid->string);
+	    /* no point in waiting for what's queued to go out */
+	    FileSkipQueue(pCL->fd, 0, (char *)0);
+	    DisconnectClient(pGE, pCL,
+			     "\r\n[-- output limit reached - disconnecting --]\r\n",
+			     FLAGTRUE);
+	    break;
+	case OPBLOCK:
+	    ConsStall(pCE);
+	    break;
+	case OPDROP:
+	case UNKNOWNPOLICY:
+	    n = FileSkipQueue(pCL->fd, pCE->outputlimit,
+			      "\r\n[-- %d bytes skipped --]\r\n");
+	    pCE->outskipped += n;
+	    break;
+    }
+}
+
 void
-DoConsoleRead(CONSENT *pCEServing)
+DoConsoleRead(GRPENT *pGE, CONSENT *pCEServing)
 {
     unsigned char acIn[BUFSIZ], acInOrig[BUFSIZ];
     int nr, i;
-    CONSCLIENT *pCL;
+    CONSCLIENT *pCL, *pCLnext;
+    CHUNK *chunk = (CHUNK *)0;
 
     int cofile = FileFDNum(pCEServing->cofile);
 
     if (!pCEServing->fup) {
-	FD_CLR(cofile, &rinit);
-	FD_CLR(cofile, &winit);
+	FDUnwatch(cofile, FDWATCH_READ | FDWATCH_WRITE);
 	return;
     }
 
@@ -2585,15 +3842,8 @@ DoConsoleRead(CONSENT *pCEServing)
     CONDDEBUG((1, "DoConsoleRead(): read %d bytes from fd %d", nr,
 	       cofile));
 
-    if (nr > 0) {
-	pCEServing->lastWrite = time((time_t *)0);
-	if (pCEServing->idletimeout != (time_t)0 &&
-	    (timers[T_CIDLE] == (time_t)0 ||
-	     timers[T_CIDLE] >
-	     pCEServing->lastWrite + pCEServing->idletimeout))
-	    timers[T_CIDLE] =
-		pCEServing->lastWrite + pCEServing->idletimeout;
-    }
+    if (nr > 0)
+	ConsIdleReset(pCEServing);
 
     if (pCEServing->type == HOST && pCEServing->raw != FLAGTRUE) {
 	/* Do a little Telnet Protocol interpretation
@@ -2607,6 +3857,23 @@ DoConsoleRead(CONSENT *pCEServing)
 	int new = 0, state;
 	state = pCEServing->telnetState;
 	for (i = 0; i < nr; ++i) {
+	    if (state == 0 || state == 5) {
+		/* copy the run up to the next IAC or NUL in one go -
+		 * only a NUL right after a \r needs the byte loop
+		 */
+		int n = MemFind2(acInOrig + i, nr - i, IAC, '\000');
+		if (n > 0) {
+		    if (pCEServing->striphigh == FLAGTRUE)
+			MemStrip(acIn + new, acInOrig + i, n);
+		    else
+			memcpy(acIn + new, acInOrig + i, n);
+		    new += n;
+		    i += n;
+		    state = (acInOrig[i - 1] == '\r') ? 5 : 0;
+		    if (i == nr)
+			break;
+		}
+	    }
 	    if (state == 0 && acInOrig[i] == IAC) {
 		CONDDEBUG((1, "DoConsoleRead(): [%s] got telnet `IAC'",
 			   pCEServing->server));
@@ -2696,13 +3963,10 @@ DoConsoleRead(CONSENT *pCEServing)
 	}
 	pCEServing->telnetState = state;
 	nr = new;
+    } else if (pCEServing->striphigh == FLAGTRUE) {
+	MemStrip(acIn, acInOrig, nr);
     } else {
-	for (i = 0; i < nr; ++i) {
-	    if (pCEServing->striphigh == FLAGTRUE)
-		acIn[i] = acInOrig[i] & 127;
-	    else
-		acIn[i] = acInOrig[i];
-	}
+	memcpy(acIn, acInOrig, nr);
     }
     if (nr == 0)
 	return;
@@ -2759,21 +4023,30 @@ DoConsoleRead(CONSENT *pCEServing)
 	}
     }
 
-    /* write console info to clients (not suspended)
+    /* write console info to clients (not suspended).  they all get
+     * a reference to the same chunk rather than their own copy.
      */
-    for (pCL = pCEServing->pCLon; (CONSCLIENT *)0 != pCL;
-	 pCL = pCL->pCLnext) {
-	if (pCL->fcon || pCL->iState == S_CEXEC)
-	    FileWrite(pCL->fd, FLAGFALSE, (char *)acIn, nr);
+    for (pCL = pCEServing->pCLon; (CONSCLIENT *)0 != pCL; pCL = pCLnext) {
+	pCLnext = pCL->pCLnext;
+	if (pCL->fcon || pCL->iState == S_CEXEC) {
+	    if (chunk == (CHUNK *)0)
+		chunk = AllocChunk((char *)acIn, nr);
+	    FileWriteChunk(pCL->fd, FLAGFALSE, chunk);
+	    if (pCEServing->outputlimit != 0 &&
+		FileBufLen(pCL->fd) > pCEServing->outputlimit)
+		ClientOutputLimit(pGE, pCEServing, pCL);
+	}
     }
+    ReleaseChunk(chunk);
 }
 
 void
-DoTaskRead(CONSENT *pCEServing)
+DoTaskRead(GRPENT *pGE, CONSENT *pCEServing)
 {
     unsigned char acInOrig[BUFSIZ];
     int nr, fd;
-    CONSCLIENT *pCL;
+    CONSCLIENT *pCL, *pCLnext;
+    CHUNK *chunk = (CHUNK *)0;
 
     if (pCEServing->taskfile == (CONSFILE *)0)
 	return;
@@ -2791,11 +4064,18 @@ DoTaskRead(CONSENT *pCEServing)
 
     /* write console info to clients (not suspended)
      */
-    for (pCL = pCEServing->pCLon; (CONSCLIENT *)0 != pCL;
-	 pCL = pCL->pCLnext) {
-	if (pCL->fcon)
-	    FileWrite(pCL->fd, FLAGFALSE, (char *)acInOrig, nr);
+    for (pCL = pCEServing->pCLon; (CONSCLIENT *)0 != pCL; pCL = pCLnext) {
+	pCLnext = pCL->pCLnext;
+	if (pCL->fcon) {
+	    if (chunk == (CHUNK *)0)
+		chunk = AllocChunk((char *)acInOrig, nr);
+	    FileWriteChunk(pCL->fd, FLAGFALSE, chunk);
+	    if (pCEServing->outputlimit != 0 &&
+		FileBufLen(pCL->fd) > pCEServing->outputlimit)
+		ClientOutputLimit(pGE, pCEServing, pCL);
+	}
     }
+    ReleaseChunk(chunk);
 }
 
 void
@@ -2929,6 +4209,99 @@ GatherLine(char c, int limit, GATHERTYPE g, CONSCLIENT *pCL)
     return 0;
 }
 
+/* move a logged in client from the control console to the one it
+ * asked for (the "call" command, or a client the master handed us).
+ * returns -1 if the client was dropped instead.
+ */
+static int
+ClientCall(GRPENT *pGE, CONSCLIENT *pCL, char *pcArgs)
+{
+    CONSENT *pCEwant, *pCE = pCL->pCEto;
+
+    pCEwant = HuntForConsole(pGE, pcArgs);
+
+    if (pCEwant == (CONSENT *)0) {
+	FilePrint(pCL->fd, FLAGFALSE, "%s: no such console\r\n", pcArgs);
+	DisconnectClient(pGE, pCL, (char *)0, FLAGFALSE);
+	return -1;
+    }
+
+    pCL->fro = ClientAccess(pCEwant, pCL->username->string);
+    if (pCL->fro == -1) {
+	FilePrint(pCL->fd, FLAGFALSE, "%s: permission denied\r\n",
+		  pcArgs);
+	DisconnectClient(pGE, pCL, (char *)0, FLAGFALSE);
+	return -1;
+    }
+
+    if (pCEwant->login != FLAGTRUE) {
+	if (pCEwant->motd == (char *)0) {
+	    FilePrint(pCL->fd, FLAGFALSE,
+		      "%s: no logins allowed at this time\r\n", pcArgs);
+	} else {
+	    FilePrint(pCL->fd, FLAGFALSE, "%s: %s\r\n", pcArgs,
+		      pCEwant->motd);
+	}
+	DisconnectClient(pGE, pCL, (char *)0, FLAGFALSE);
+	return -1;
+    }
+
+    /* remove from current host */
+    if ((CONSCLIENT *)0 != pCL->pCLnext) {
+	pCL->pCLnext->ppCLbnext = pCL->ppCLbnext;
+    }
+    *(pCL->ppCLbnext) = pCL->pCLnext;
+    if (pCL->fwr) {
+	pCL->fwr = 0;
+	pCL->fwantwr = 0;
+	TagLogfileAct(pCE, "%s detached", pCL->acid->string);
+	pCE->pCLwr = (CONSCLIENT *)0;
+	FindWrite(pCE);
+    }
+
+    /* inform operators of the change
+     */
+    Verbose("<group> attach %s to %s", pCL->acid->string,
+	    pCEwant->server);
+    Msg("[%s] login %s", pCEwant->server, pCL->acid->string);
+
+    /* set new host and link into new host list
+     */
+    pCE = pCEwant;
+    pCL->pCEto = pCE;
+    pCL->pCLnext = pCE->pCLon;
+    pCL->ppCLbnext = &pCE->pCLon;
+    if ((CONSCLIENT *)0 != pCL->pCLnext) {
+	pCL->pCLnext->ppCLbnext = &pCL->pCLnext;
+    }
+    pCE->pCLon = pCL;
+
+    /* try to reopen line if specified at server startup
+     */
+    if ((pCE->ondemand == FLAGTRUE || pCE->reinitoncc == FLAGTRUE) &&
+	!pCE->fup)
+	ConsInit(pCE);
+
+    /* try for attach on new console
+     */
+    if (pCE->fronly) {
+	FileWrite(pCL->fd, FLAGFALSE, "[console is read-only]\r\n", -1);
+    } else if (((CONSCLIENT *)0 == pCE->pCLwr) && !pCL->fro) {
+	pCE->pCLwr = pCL;
+	pCL->fwr = 1;
+	FileWrite(pCL->fd, FLAGFALSE, "[attached]\r\n", -1);
+	/* this keeps the ops console neat */
+	pCE->iend = 0;
+	TagLogfileAct(pCE, "%s attached", pCL->acid->string);
+    } else {
+	ClientWantsWrite(pCL);
+	FileWrite(pCL->fd, FLAGFALSE, "[spy]\r\n", -1);
+    }
+    pCL->fcon = 0;
+    pCL->iState = S_NORMAL;
+    return 0;
+}
+
 void
 DoClientRead(GRPENT *pGE, CONSCLIENT *pCLServing)
 {
@@ -2986,12 +4359,9 @@ DoClientRead(GRPENT *pGE, CONSCLIENT *pCLServing)
 	    continue;
 	}
 
-	for (i = 0; i < l; ++i) {
-	    acInOrig[i] = acIn[i];
-	    if (pCEServing->striphigh == FLAGTRUE) {
-		acIn[i] &= 127;
-	    }
-	}
+	memcpy(acInOrig, acIn, l);
+	if (pCEServing->striphigh == FLAGTRUE)
+	    MemStrip(acIn, acIn, l);
 
 	for (i = 0; i < l; ++i) {
 	    if (pGE->pCEctl == pCEServing) {
@@ -3142,107 +4512,9 @@ DoClientRead(GRPENT *pGE, CONSCLIENT *pCLServing)
 			FileWrite(pCLServing->fd, FLAGFALSE,
 				  "call requires argument\r\n", -1);
 		    else {
-			CONSENT *pCEwant = (CONSENT *)0;
-
-			pCEwant = HuntForConsole(pGE, pcArgs);
-
-			if (pCEwant == (CONSENT *)0) {
-			    FilePrint(pCLServing->fd, FLAGFALSE,
-				      "%s: no such console\r\n", pcArgs);
-			    DisconnectClient(pGE, pCLServing, (char *)0,
-					     FLAGFALSE);
-			    return;
-			}
-
-			pCLServing->fro =
-			    ClientAccess(pCEwant,
-					 pCLServing->username->string);
-			if (pCLServing->fro == -1) {
-			    FilePrint(pCLServing->fd, FLAGFALSE,
-				      "%s: permission denied\r\n", pcArgs);
-			    DisconnectClient(pGE, pCLServing, (char *)0,
-					     FLAGFALSE);
-			    return;
-			}
-
-			if (pCEwant->login != FLAGTRUE) {
-			    if (pCEwant->motd == (char *)0) {
-				FilePrint(pCLServing->fd, FLAGFALSE,
-					  "%s: no logins allowed at this time\r\n",
-					  pcArgs);
-			    } else {
-				FilePrint(pCLServing->fd, FLAGFALSE,
-					  "%s: %s\r\n", pcArgs,
-					  pCEwant->motd);
-			    }
-			    DisconnectClient(pGE, pCLServing, (char *)0,
-					     FLAGFALSE);
+			if (ClientCall(pGE, pCLServing, pcArgs) != 0)
 			    return;
-			}
-
-			/* remove from current host */
-			if ((CONSCLIENT *)0 != pCLServing->pCLnext) {
-			    pCLServing->pCLnext->ppCLbnext =
-				pCLServing->ppCLbnext;
-			}
-			*(pCLServing->ppCLbnext) = pCLServing->pCLnext;
-			if (pCLServing->fwr) {
-			    pCLServing->fwr = 0;
-			    pCLServing->fwantwr = 0;
-			    TagLogfileAct(pCEServing, "%s detached",
-					  pCLServing->acid->string);
-			    pCEServing->pCLwr = (CONSCLIENT *)0;
-			    FindWrite(pCEServing);
-			}
-
-			/* inform operators of the change
-			 */
-			Verbose("<group> attach %s to %s",
-				pCLServing->acid->string, pCEwant->server);
-			Msg("[%s] login %s", pCEwant->server,
-			    pCLServing->acid->string);
-
-			/* set new host and link into new host list
-			 */
-			pCEServing = pCEwant;
-			pCLServing->pCEto = pCEServing;
-			pCLServing->pCLnext = pCEServing->pCLon;
-			pCLServing->ppCLbnext = &pCEServing->pCLon;
-			if ((CONSCLIENT *)0 != pCLServing->pCLnext) {
-			    pCLServing->pCLnext->ppCLbnext =
-				&pCLServing->pCLnext;
-			}
-			pCEServing->pCLon = pCLServing;
-
-			/* try to reopen line if specified at server startup
-			 */
-			if ((pCEServing->ondemand == FLAGTRUE ||
-			     pCEServing->reinitoncc == FLAGTRUE) &&
-			    !pCEServing->fup)
-			    ConsInit(pCEServing);
-
-			/* try for attach on new console
-			 */
-			if (pCEServing->fronly) {
-			    FileWrite(pCLServing->fd, FLAGFALSE,
-				      "[console is read-only]\r\n", -1);
-			} else if (((CONSCLIENT *)0 == pCEServing->pCLwr)
-				   && !pCLServing->fro) {
-			    pCEServing->pCLwr = pCLServing;
-			    pCLServing->fwr = 1;
-			    FileWrite(pCLServing->fd, FLAGFALSE,
-				      "[attached]\r\n", -1);
-			    /* this keeps the ops console neat */
-			    pCEServing->iend = 0;
-			    TagLogfileAct(pCEServing, "%s attached",
-					  pCLServing->acid->string);
-			} else {
-			    ClientWantsWrite(pCLServing);
-			    FileWrite(pCLServing->fd, FLAGFALSE,
-				      "[spy]\r\n", -1);
-			}
-			pCLServing->fcon = 0;
-			pCLServing->iState = S_NORMAL;
+			pCEServing = pCLServing->pCEto;
 		    }
 		} else if (pCLServing->iState == S_NORMAL &&
 			   strcmp(pcCmd, "info") == 0) {
@@ -3423,6 +4695,29 @@ DoClientRead(GRPENT *pGE, CONSCLIENT *pCLServing)
 			}
 			continue;
 
+		    case S_SINCE:
+			if (GatherLine(acIn[i], 32, G_TEXT, pCLServing)) {
+			    time_t when;
+
+			    if (pCLServing->accmd->used <= 1) {
+				FileWrite(pCLServing->fd, FLAGFALSE, "]\r\n",
+					  3);
+			    } else if (ParseSince
+				       (pCLServing->accmd->string,
+					time((time_t *)0), &when) != 0) {
+				FileWrite(pCLServing->fd, FLAGFALSE,
+					  " <unknown time>]\r\n", -1);
+			    } else {
+				FilePrint(pCLServing->fd, FLAGFALSE,
+					  " (%.24s)]\r\n", ctime(&when));
+				ReplaySince(pCEServing, pCLServing->fd,
+					    when);
+			    }
+			    BuildString((char *)0, pCLServing->accmd);
+			    pCLServing->iState = S_NORMAL;
+			}
+			continue;
+
 		    case S_QUOTE:	/* send octal code              */
 			/* must type in 3 octal digits */
 			if (acIn[i] >= '0' && acIn[i] <= '7') {
@@ -3917,6 +5212,13 @@ DoClientRead(GRPENT *pGE, CONSCLIENT *pCLServing)
 				       pCLServing->replay);
 				break;
 
+			    case 't':	/* replay since a time */
+				FileWrite(pCLServing->fd, FLAGFALSE,
+					  "replay since: ", -1);
+				BuildString((char *)0, pCLServing->accmd);
+				pCLServing->iState = S_SINCE;
+				break;
+
 			    case 's':	/* spy mode */
 				if (!pCLServing->fwr) {
 				    goto unknownchar;
@@ -4088,6 +5390,11 @@ FlushConsole(CONSENT *pCEServing)
 	/* if we have data but aren't up, drop it */
 	BuildString((char *)0, pCEServing->wbuf);
 	pCEServing->wbufIAC = 0;
+	ConsTimerClear(pCEServing, CT_BREAK);
+	return;
+    }
+    /* in the middle of a \d delay - RunConsTimers() will call us */
+    if (pCEServing->ctslot[CT_BREAK] != 0) {
 	return;
     }
 
@@ -4207,10 +5514,13 @@ FlushConsole(CONSENT *pCEServing)
 		     }
 		     */
 		    CONDDEBUG((1,
-			       "Kiddie(): heavy IAC - doing usleep() for [%s] (break #%c - delay %dms)",
+			       "Kiddie(): heavy IAC - holding writes for [%s] (break #%c - delay %dms)",
 			       pCEServing->server, next, delay));
+		    /* rather than usleep() the whole group, we hold
+		     * this console's writes until the timer fires
+		     */
 		    if (delay != 0)
-			usleep(delay * 1000);
+			ConsTimerSet(pCEServing, CT_BREAK, delay);
 		} else if (next == BREAK) {
 		    CONDDEBUG((1,
 			       "Kiddie(): heavy IAC - sending break for [%s]",
@@ -4241,11 +5551,10 @@ FlushConsole(CONSENT *pCEServing)
 #endif
 		}
 		/* we do this 'cause we just potentially paused for
-		 * a half-second doing a break...or even the
-		 * intentional usleep().  we could take out the
-		 * justHadDelay bits and continue with the stream,
-		 * but this allows us to process other consoles and
-		 * then come around and do more on this one.  you
+		 * a half-second doing a break, or started a delay
+		 * that has to expire before the rest of the stream
+		 * goes out.  this allows us to process other consoles
+		 * and then come around and do more on this one.  you
 		 * see, someone could have a '\d\z\d\z\d\z' sequence
 		 * as a break string and we'd have about a 2 second
 		 * delay added up if we process it all at once.
@@ -4289,53 +5598,1034 @@ FlushConsole(CONSENT *pCEServing)
 	    pCEServing->wbufIAC = 0;
     }
 
-    if (buf->used > 1) {
-	CONDDEBUG((1, "Kiddie(): flushing buffer of %d bytes for [%s]",
-		   buf->used - 1, pCEServing->server));
-	if (FileWrite
-	    (pCEServing->cofile, FLAGFALSE, buf->string,
-	     buf->used - 1) < 0) {
-	    Error("[%s] write failure", pCEServing->server);
-	    ConsoleError(pCEServing);
-	    return;
+    if (buf->used > 1) {
+	CONDDEBUG((1, "Kiddie(): flushing buffer of %d bytes for [%s]",
+		   buf->used - 1, pCEServing->server));
+	if (FileWrite
+	    (pCEServing->cofile, FLAGFALSE, buf->string,
+	     buf->used - 1) < 0) {
+	    Error("[%s] write failure", pCEServing->server);
+	    ConsoleError(pCEServing);
+	    return;
+	}
+	BuildString((char *)0, buf);
+    }
+
+    /* nuke the data alread sent */
+    if (offset >= pCEServing->wbuf->used - 1) {
+	BuildString((char *)0, pCEServing->wbuf);
+    } else if (offset > 0) {
+	ShiftString(pCEServing->wbuf, offset);
+    }
+
+    if (pCEServing->wbuf->used > 1) {
+	char *iac = StringChar(pCEServing->wbuf, 0, (char)IAC);
+	CONDDEBUG((1, "Kiddie(): hunting for new IAC for [%s]",
+		   pCEServing->server));
+	if (iac == (char *)0)
+	    pCEServing->wbufIAC = 0;
+	else
+	    pCEServing->wbufIAC = (iac - pCEServing->wbuf->string) + 2;
+	if (pCEServing->ctslot[CT_BREAK] == 0) {
+	    CONDDEBUG((1,
+		       "Kiddie(): watching writability for fd %d 'cause we have buffered data",
+		       FileFDNum(pCEServing->cofile)));
+	    FDWatch(FileFDNum(pCEServing->cofile), FDWATCH_WRITE);
+	} else if (FileBufEmpty(pCEServing->cofile)) {
+	    CONDDEBUG((1,
+		       "Kiddie(): removing writability for fd %d 'cause we're in a delay",
+		       FileFDNum(pCEServing->cofile)));
+	    FDUnwatch(FileFDNum(pCEServing->cofile), FDWATCH_WRITE);
+	}
+    } else {
+	pCEServing->wbufIAC = 0;
+	if (FileBufEmpty(pCEServing->cofile)) {
+	    CONDDEBUG((1,
+		       "Kiddie(): removing writability for fd %d 'cause we don't have buffered data",
+		       FileFDNum(pCEServing->cofile)));
+	    FDUnwatch(FileFDNum(pCEServing->cofile), FDWATCH_WRITE);
+	}
+    }
+    ConsIdleReset(pCEServing);
+}
+
+/* do whatever I/O the last FDWait() says a console is ready for */
+static void
+DoConsoleIO(GRPENT *pGE, CONSENT *pCEServing)
+{
+#if HAVE_GETTIMEOFDAY
+    struct timeval tv;
+#else
+    time_t tv;
+#endif
+
+    if (!pCEServing->fup || pCEServing->type == NOOP)
+	return;
+
+    switch (pCEServing->ioState) {
+	case INCONNECT:
+#if HAVE_FREEIPMI
+	    if (pCEServing->type == IPMI) {
+		if (FileCanRead(pCEServing->cofile)) {
+		    if (IPMICONSOLE_CTX_STATUS_SOL_ESTABLISHED ==
+			ipmiconsole_ctx_status
+			(pCEServing->ipmictx)) {
+			/* Read in the NULL from OUTPUT_ON_SOL_ESTABLISHED flag */
+			char b[1];
+			FileRead(pCEServing->cofile, b, 1);	/* trust it's NULL */
+		    } else {
+			Error("[%s] IPMI error: %s: forcing down",
+			      pCEServing->server,
+			      ipmiconsole_ctx_errormsg(pCEServing->
+						       ipmictx));
+			/* no ConsoleError() for same reason as above */
+			ConsConnectFailed(pCEServing);
+			break;
+		    }
+		} else
+		    break;
+	    } else {
+#endif /* freeipmi */
+		/* deal with this state above as well */
+		if (FileCanWrite(pCEServing->cofile)) {
+		    socklen_t slen;
+		    int flags = 0;
+		    int cofile = FileFDNum(pCEServing->cofile);
+		    slen = sizeof(flags);
+		    /* So, getsockopt seems to return -1 if there is
+		     * something interesting in SO_ERROR under
+		     * solaris...sheesh.  So, the error message has
+		     * the small change it's not accurate.
+		     */
+		    if (getsockopt
+			(cofile, SOL_SOCKET, SO_ERROR,
+			 (char *)&flags, &slen) < 0) {
+			Error
+			    ("[%s] getsockopt(%u,SO_ERROR): %s: forcing down",
+			     pCEServing->server, cofile,
+			     strerror(errno));
+			/* no ConsoleError() for same reason as above */
+			ConsConnectFailed(pCEServing);
+			break;
+		    }
+		    if (flags != 0) {
+			Error("[%s] connect(%u): %s: forcing down",
+			      pCEServing->server, cofile,
+			      strerror(flags));
+			/* no ConsoleError() for same reason as above */
+			ConsConnectFailed(pCEServing);
+			break;
+		    }
+
+		    /* waiting for a connect(), we watch the write bit,
+		     * so switch around and now watch for the read and
+		     * start gathering data
+		     */
+		    FDWatch(cofile, FDWATCH_READ);
+		    FDUnwatch(cofile, FDWATCH_WRITE);
+		} else
+		    break;
+#if HAVE_FREEIPMI
+	    }
+#endif
+
+	    pCEServing->ioState = ISNORMAL;
+	    ConsTimerClear(pCEServing, CT_STATE);
+	    ReUpRelease(pCEServing);
+	    ConsIdleReset(pCEServing);
+#if HAVE_GETTIMEOFDAY
+	    if (gettimeofday(&tv, (void *)0) == 0)
+		pCEServing->lastInit = tv;
+#else
+	    if ((tv = time((time_t *)0)) != (time_t)-1)
+		pCEServing->lastInit = tv;
+#endif
+	    if (pCEServing->downHard == FLAGTRUE) {
+		Msg("[%s] console up", pCEServing->server);
+		pCEServing->downHard = FLAGFALSE;
+	    }
+	    SendIWaitClientsMsg(pCEServing, "up]\r\n");
+	    StartInit(pCEServing);
+	    break;
+	case ISNORMAL:
+	    if (FileCanRead(pCEServing->cofile))
+		DoConsoleRead(pGE, pCEServing);
+	    if (FileCanRead(pCEServing->initfile))
+		DoCommandRead(pCEServing);
+	    if (FileCanRead(pCEServing->taskfile))
+		DoTaskRead(pGE, pCEServing);
+	    /* fall through to ISFLUSHING for buffered data */
+	case ISFLUSHING:
+	    /* write cofile data */
+	    if (!FileBufEmpty(pCEServing->cofile) &&
+		FileCanWrite(pCEServing->cofile)) {
+		CONDDEBUG((1, "Master(): flushing fd %d",
+			   FileFDNum(pCEServing->cofile)));
+		if (FileWrite
+		    (pCEServing->cofile, FLAGFALSE, (char *)0,
+		     0) < 0) {
+		    Error("[%s] write failure",
+			  pCEServing->server);
+		    ConsoleError(pCEServing);
+		    break;
+		}
+	    }
+	    /* write fdlog data */
+	    if (!FileBufEmpty(pCEServing->fdlog) &&
+		FileCanWrite(pCEServing->fdlog)) {
+		CONDDEBUG((1, "Kiddie(): flushing fd %d",
+			   FileFDNum(pCEServing->fdlog)));
+		if (FileWrite
+		    (pCEServing->fdlog, FLAGFALSE, (char *)0,
+		     0) < 0) {
+		    Error("[%s] write failure",
+			  pCEServing->server);
+		    ConsoleError(pCEServing);
+		    break;
+		}
+	    }
+	    /* write initfile data */
+	    if (!FileBufEmpty(pCEServing->initfile) &&
+		FileCanWrite(pCEServing->initfile)) {
+		CONDDEBUG((1, "Kiddie(): flushing fd %d",
+			   FileFDNum(pCEServing->initfile)));
+		if (FileWrite
+		    (pCEServing->initfile, FLAGFALSE, (char *)0,
+		     0) < 0) {
+		    Error("[%s] write failure",
+			  pCEServing->server);
+		    ConsoleError(pCEServing);
+		    break;
+		}
+	    }
+	    /* stop if we're in ISFLUSHING state and out of data */
+	    if ((pCEServing->ioState == ISFLUSHING) &&
+		FileBufEmpty(pCEServing->cofile) &&
+		FileBufEmpty(pCEServing->fdlog) &&
+		FileBufEmpty(pCEServing->initfile))
+		/* no ConsoleError() for same reason as above */
+		ConsDown(pCEServing, FLAGFALSE, FLAGTRUE);
+	    break;
+	default:
+	    /* this really can't ever happen */
+	    Error
+		("Kiddie(): console socket state == %d -- THIS IS A BUG",
+		 pCEServing->ioState);
+	    /* no ConsoleError() for same reason as above */
+	    ConsDown(pCEServing, FLAGTRUE, FLAGTRUE);
+	    break;
+    }
+}
+
+/* do whatever I/O the last FDWait() says a client is ready for */
+static void
+DoClientIO(GRPENT *pGE, CONSCLIENT *pCLServing)
+{
+    switch (pCLServing->ioState) {
+#if HAVE_OPENSSL
+	case INSSLACCEPT:
+	    if (FileCanSSLAccept(pCLServing->fd)) {
+		int r;
+		if ((r = FileSSLAccept(pCLServing->fd)) < 0)
+		    DisconnectClient(pGE, pCLServing, (char *)0,
+				     FLAGFALSE);
+		else if (r == 1)
+		    pCLServing->ioState = ISNORMAL;
+	    }
+	    break;
+#endif
+#if HAVE_GSSAPI
+	case INGSSACCEPT:
+	    {
+		int r;
+		if ((r = AttemptGSSAPI(pCLServing)) < 0)
+		    DisconnectClient(pGE, pCLServing, (char *)0,
+				     FLAGFALSE);
+		else if (r == 1)
+		    pCLServing->ioState = ISNORMAL;
+	    }
+	    break;
+#endif
+	case INRESOLVE:
+	    /* still not listening (see KiddieClientAccess()) */
+	    FDUnwatch(FileFDNum(pCLServing->fd), FDWATCH_READ);
+	    break;
+	case ISNORMAL:
+	    if (FileCanRead(pCLServing->fd))
+		DoClientRead(pGE, pCLServing);
+	    /* fall through to ISFLUSHING for buffered data */
+	case ISFLUSHING:
+	    if (!FileBufEmpty(pCLServing->fd) &&
+		FileCanWrite(pCLServing->fd)) {
+		CONDDEBUG((1, "Kiddie(): flushing fd %d",
+			   FileFDNum(pCLServing->fd)));
+		if (FileWrite
+		    (pCLServing->fd, FLAGFALSE, (char *)0,
+		     0) < 0) {
+		    DisconnectClient(pGE, pCLServing, (char *)0,
+				     FLAGTRUE);
+		    break;
+		}
+		if (pCLServing->pCEto->fstalled)
+		    ConsUnstall(pCLServing->pCEto);
+	    }
+	    if ((pCLServing->ioState == ISFLUSHING) &&
+		FileBufEmpty(pCLServing->fd))
+		DisconnectClient(pGE, pCLServing, (char *)0,
+				 FLAGFALSE);
+	    break;
+	default:
+	    /* this really can't ever happen */
+	    Error
+		("Kiddie(): client socket state == %d -- THIS IS A BUG",
+		 pCLServing->ioState);
+	    DisconnectClient(pGE, pCLServing, (char *)0,
+			     FLAGFALSE);
+	    break;
+    }
+}
+
+/* set up a free client slot for the new connection fd, on the control
+ * console.  if it can't be done, fd is closed and we return (CONSCLIENT *)0
+ */
+static CONSCLIENT *
+KiddieNewClient(GRPENT *pGE, int fd)
+{
+    CONSCLIENT *pCL;
+
+    if (SetFlags(fd, O_NONBLOCK, 0)) {
+	pGE->pCLfree->fd = FileOpenFD(fd, simpleSocket);
+	FileSetQuoteIAC(pGE->pCLfree->fd, FLAGTRUE);
+    } else
+	pGE->pCLfree->fd = (CONSFILE *)0;
+
+    if ((CONSFILE *)0 == pGE->pCLfree->fd) {
+	Error("Kiddie(): FileOpenFD(): %s", strerror(errno));
+	close(fd);
+	return (CONSCLIENT *)0;
+    }
+
+    /* save pCL so we can advance to the next free one
+     */
+    pCL = pGE->pCLfree;
+    pGE->pCLfree = pCL->pCLnext;
+
+    /* init the identification stuff
+     */
+    BuildString((char *)0, pCL->peername);
+    BuildString((char *)0, pCL->acid);
+    BuildString("<unknown>@", pCL->acid);
+    BuildString((char *)0, pCL->username);
+    BuildString("<unknown>", pCL->username);
+    StrCpy(pCL->actym, StrTime(&(pCL->tym)), sizeof(pCL->actym));
+    pCL->typetym = pCL->tym;
+
+    /* link into the control list for the dummy console
+     */
+    pCL->pCEto = pGE->pCEctl;
+    pCL->pCLnext = pGE->pCEctl->pCLon;
+    pCL->ppCLbnext = &pGE->pCEctl->pCLon;
+    if ((CONSCLIENT *)0 != pCL->pCLnext) {
+	pCL->pCLnext->ppCLbnext = &pCL->pCLnext;
+    }
+    pGE->pCEctl->pCLon = pCL;
+
+    /* link into all clients list
+     */
+    pCL->pCLscan = pGE->pCLall;
+    pCL->ppCLbscan = &pGE->pCLall;
+    if ((CONSCLIENT *)0 != pCL->pCLscan) {
+	pCL->pCLscan->ppCLbscan = &pCL->pCLscan;
+    }
+    pGE->pCLall = pCL;
+
+    FileSetOwner(pCL->fd, FDOWNER_CLIENT, pCL);
+    FDWatch(FileFDNum(pCL->fd), FDWATCH_READ);
+
+    /* init the fsm
+     */
+    pCL->fecho = 0;
+    pCL->iState = S_IDENT;
+    pCL->ic[0] = DEFATTN;
+    pCL->ic[1] = DEFESC;
+    pCL->replay = DEFREPLAY;
+    pCL->playback = DEFPLAYBACK;
+    BuildString((char *)0, pCL->accmd);
+
+    /* mark as stopped (no output from console)
+     * and spy only (on chars to console)
+     */
+    pCL->fcon = 0;
+    pCL->fwr = 0;
+    pCL->fwantwr = 0;
+
+    /* remove from the free list
+     * if we ran out of free slots, calloc one...
+     */
+    if ((CONSCLIENT *)0 == pGE->pCLfree) {
+	if ((pGE->pCLfree = (CONSCLIENT *)calloc(1, sizeof(CONSCLIENT)))
+	    == (CONSCLIENT *)0)
+	    OutOfMem();
+	pGE->pCLfree->acid = AllocString();
+	pGE->pCLfree->username = AllocString();
+	pGE->pCLfree->peername = AllocString();
+	pGE->pCLfree->accmd = AllocString();
+    }
+    return pCL;
+}
+
+#if defined(SCM_RIGHTS)
+/* take a client the master handed us (see HandOff() in master.c) - it
+ * has already been let in and logged in there, so it goes straight on
+ * to the console it asked for.  the message is the access type and
+ * whether the peer name is still being looked up, then the user,
+ * acid, peer name, and console, one per line.  a message without a
+ * client is the master asking us to upgrade (see MasterUpgrade()).
+ */
+static void
+KiddieHandOff(GRPENT *pGE)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+	struct cmsghdr cm;
+	char space[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *cmp;
+    char buf[HANDOFFMAX + 1];
+    char *field[5];
+    CONSCLIENT *pCL;
+    int n, i, fd = -1;
+
+# if HAVE_MEMSET
+    memset((void *)&msg, 0, sizeof(msg));
+# else
+    bzero((char *)&msg, sizeof(msg));
+# endif
+    iov.iov_base = buf;
+    iov.iov_len = HANDOFFMAX;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+
+    if ((n = recvmsg(pGE->hfd, &msg, 0)) < 0) {
+	if (errno != EAGAIN && errno != EINTR)
+	    Error("KiddieHandOff(): recvmsg(): %s", strerror(errno));
+	return;
+    }
+    for (cmp = CMSG_FIRSTHDR(&msg); cmp != (struct cmsghdr *)0;
+	 cmp = CMSG_NXTHDR(&msg, cmp)) {
+	if (cmp->cmsg_level == SOL_SOCKET && cmp->cmsg_type == SCM_RIGHTS)
+	    memcpy(&fd, CMSG_DATA(cmp), sizeof(int));
+    }
+    if (fd == -1) {
+	if (n == 0) {
+	    /* the master is gone */
+	    FDUnwatch(pGE->hfd, FDWATCH_READ);
+	    close(pGE->hfd);
+	    pGE->hfd = -1;
+	} else if (n == sizeof(HANDOFFUPGRADE) - 1 &&
+		   strncmp(buf, HANDOFFUPGRADE, n) == 0)
+	    fSawUpgrade = 1;
+	return;
+    }
+
+    buf[n] = '\000';
+    for (field[0] = buf, i = 1; i < 5; i++) {
+	if ((field[i] = strchr(field[i - 1], '\n')) == (char *)0)
+	    break;
+	*field[i]++ = '\000';
+    }
+    if (i < 5 || strlen(field[0]) != 2 ||
+	(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+	Error("KiddieHandOff(): bad handoff message");
+	close(fd);
+	return;
+    }
+
+    if ((pCL = KiddieNewClient(pGE, fd)) == (CONSCLIENT *)0)
+	return;
+
+    pCL->caccess = field[0][0];
+    pCL->fpeerwait = (field[0][1] == 'w');
+    BuildString((char *)0, pCL->username);
+    BuildString(field[1], pCL->username);
+    BuildString((char *)0, pCL->acid);
+    BuildString(field[2], pCL->acid);
+    BuildString((char *)0, pCL->peername);
+    BuildString(field[3], pCL->peername);
+    pCL->ioState = ISNORMAL;
+    pCL->iState = S_NORMAL;
+    Verbose("<group> login %s (from master)", pCL->acid->string);
+    if (ClientCall(pGE, pCL, field[4]) == 0)
+	ClientPeerName(pCL);
+}
+#endif
+
+/* let a new client in (or not), unless ClientAccessOk() has to wait
+ * on the resolver - then we don't listen to it until we know
+ */
+static void
+KiddieClientAccess(GRPENT *pGE, CONSCLIENT *pCL)
+{
+    switch (ClientAccessOk(pCL)) {
+	case 1:
+	    pCL->ioState = ISNORMAL;
+	    FDWatch(FileFDNum(pCL->fd), FDWATCH_READ);
+	    /* say hi to start */
+	    FileWrite(pCL->fd, FLAGFALSE, "ok\r\n", -1);
+	    BuildString(pCL->peername->string, pCL->acid);
+	    CONDDEBUG((1, "Kiddie(): client acid initialized to `%s'",
+		       pCL->acid->string));
+	    break;
+	case 0:
+	    DisconnectClient(pGE, pCL, (char *)0, FLAGFALSE);
+	    break;
+	default:
+	    pCL->ioState = INRESOLVE;
+	    FDUnwatch(FileFDNum(pCL->fd), FDWATCH_READ);
+	    break;
+    }
+}
+
+/* bring up the consoles ConsInit() left waiting on the resolver,
+ * now that their addresses are in (the resolver hands back just the
+ * ones whose lookups finished)
+ */
+static void
+ConsResolved(void)
+{
+    CONSENT *pCE;
+    short autoReUp, ours;
+
+    while ((pCE = (CONSENT *)ResolveWaiter()) != (CONSENT *)0) {
+	if (pCE->ioState != INRESOLVE)
+	    continue;
+	autoReUp = pCE->autoReUp;
+	ours = (pCE->reupHost != (struct reupHost *)0);
+	ConsInit(pCE);
+	if (pCE->ioState == INRESOLVE)
+	    continue;
+	if (!pCE->fup) {
+	    pCE->autoReUp = autoReUp;
+	    SendIWaitClientsMsg(pCE, "down]\r\n");
+	    if (ours)
+		ConsReUpLater(pCE);
+	    continue;
+	}
+	if (pCE->ioState == ISNORMAL) {
+	    ReUpRelease(pCE);
+	    if (pCE->initfile == (CONSFILE *)0)
+		SendIWaitClientsMsg(pCE, "up]\r\n");
+	}
+    }
+}
+
+/* run the handlers of every console timer that has come due.  each
+ * entry is pulled from the heap before its handler runs, so handlers
+ * are free to schedule it again.
+ */
+static void
+RunConsTimers(void)
+{
+    struct timeval now, chime;
+    CONSENT *pCE;
+    struct reupHost *rh;
+    int kind;
+
+    TimerNow(&now);
+    while (ctUsed > 0 && !timercmp(&ctHeap[0].when, &now, >)) {
+	pCE = ctHeap[0].pCE;
+	kind = ctHeap[0].kind;
+	ConsTimerClear(pCE, kind);
+
+	switch (kind) {
+	    case CT_STATE:
+		/* state timeouts (currently connect() timeouts) */
+		if (pCE->ioState != INCONNECT)
+		    break;
+		Error("[%s] connect timeout: forcing down", pCE->server);
+		/* can't use ConsoleError() here otherwise we could reinit
+		 * the console repeatedly (immediately).  we know there are
+		 * no clients attached, so it's basically the same.
+		 */
+		ConsConnectFailed(pCE);
+		break;
+	    case CT_REUP:
+		/* an automatic reinit from ConsReUpLater() */
+		if (pCE->fup || pCE->ioState == INRESOLVE)
+		    break;
+		if ((rh = ReUpHost(pCE)) != (struct reupHost *)0 &&
+		    rh->connecting >= REUPPERHOST) {
+		    /* the host has enough going on, look again soon */
+		    ConsTimerSet(pCE, CT_REUP,
+				 REUPMIN * 500L + rand() % (REUPMIN * 1000L));
+		    break;
+		}
+		Msg("[%s] automatic reinitialization", pCE->server);
+		ConsInit(pCE);
+		if (rh != (struct reupHost *)0 &&
+		    (pCE->ioState == INCONNECT ||
+		     pCE->ioState == INRESOLVE)) {
+		    /* hold a slot until the connect() is done */
+		    rh->connecting++;
+		    pCE->reupHost = rh;
+		} else if (!pCE->fup)
+		    ConsReUpLater(pCE);
+		break;
+	    case CT_IDLE:
+		/* if we aren't in a normal state, skip it...the next
+		 * write will arm things again
+		 */
+		if (!(pCE->fup && pCE->ioState == ISNORMAL) ||
+		    pCE->idletimeout == 0)
+		    break;
+		/* should we check for a r/w user too and only idle when
+		 * they aren't connected?  right now, i think we want to
+		 * do the idle stuff even if we have users
+		 */
+		chime = pCE->lastWrite;
+		TimerAdd(&chime, pCE->idletimeout);
+		if (timercmp(&now, &chime, <)) {
+		    ConsTimerSetAt(pCE, CT_IDLE, &chime);
+		    break;
+		}
+		ExpandString(pCE->idlestring, pCE, 0);
+		TagLogfileAct(pCE, "idle timeout");
+		FlushConsole(pCE);
+		SendClientsMsg(pCE, "[-- idle timeout --]\r\n");
+		/* we're not technically correct here in saying the write
+		 * happened, but we don't want to accidentally trigger
+		 * another idle action, so we lie...when the buffer gets
+		 * flushed, this will be updated and correct.
+		 */
+		ConsIdleReset(pCE);
+		break;
+	    case CT_MARK:
+		Mark(pCE);
+		break;
+	    case CT_BREAK:
+		/* a \d delay is over, carry on with the write buffer */
+		FlushConsole(pCE);
+		break;
+	    case CT_LOGFLUSH:
+		LogFlush(pCE);
+		break;
+	    case CT_LOGSYNC:
+		if (pCE->fdlog != (CONSFILE *)0 &&
+		    FileSync(pCE->fdlog) != 0)
+		    Error("[%s] fdatasync(%s): %s", pCE->server,
+			  pCE->logfile, strerror(errno));
+		break;
+	    case CT_LOGROLL:
+		RollLog(pCE);
+		break;
+	}
+    }
+}
+
+/* write a string to the upgrade state, with its length up front so
+ * anything can be in it (see GroupUpgrade())
+ */
+static void
+UpgradeSave(FILE *fp, char *s, int len)
+{
+    if (s == (char *)0)
+	len = 0;
+    else if (len < 0)
+	len = strlen(s);
+    fprintf(fp, " %d:", len);
+    if (len > 0)
+	fwrite(s, 1, len, fp);
+}
+
+/* read one back into s.  returns the string, or (char *)0 if there
+ * wasn't one
+ */
+static char *
+UpgradeLoad(FILE *fp, STRING *s)
+{
+    char buf[BUFSIZ];
+    int len, n;
+
+    BuildString((char *)0, s);
+    if (fscanf(fp, " %d:", &len) != 1 || len < 0)
+	return (char *)0;
+    while (len > 0) {
+	n = (len > sizeof(buf)) ? sizeof(buf) : len;
+	if (fread(buf, 1, n, fp) != n)
+	    return (char *)0;
+	BuildStringN(buf, n, s);
+	len -= n;
+    }
+    return (s->used == 0) ? "" : s->string;
+}
+
+/* what a console talks to, so an upgrade can tell if the config still
+ * has the same console
+ */
+static char *
+UpgradeWhere(CONSENT *pCE)
+{
+    static STRING *where = (STRING *)0;
+
+    if (where == (STRING *)0)
+	where = AllocString();
+    BuildString((char *)0, where);
+    switch (pCE->type) {
+	case EXEC:
+	    BuildStringPrint(where, "%d %s", pCE->type,
+			     pCE->exec == (char *)0 ? "" : pCE->exec);
+	    break;
+	case HOST:
+	    BuildStringPrint(where, "%d %s %hu %d", pCE->type, pCE->host,
+			     pCE->netport, pCE->raw);
+	    break;
+	case UDS:
+	    BuildStringPrint(where, "%d %s", pCE->type, pCE->uds);
+	    break;
+	case DEVICE:
+	    BuildStringPrint(where, "%d %s", pCE->type, pCE->device);
+	    break;
+	default:
+	    BuildStringPrint(where, "%d", pCE->type);
+	    break;
+    }
+    return where->string;
+}
+
+#if defined(SCM_RIGHTS)
+/* the master has asked us to upgrade (see MasterUpgrade()), so hand
+ * what we have to a fresh copy of conserver in this same process (see
+ * ReExec()).  consoles that are up go along as they are - exec'd
+ * commands and all - as do the logged in clients that aren't using
+ * ssl, along with anything still queued for them, and our listening
+ * socket.  the rest are shut down and come back the usual way in the
+ * new process.  we only return if the exec fails.
+ */
+static void
+GroupUpgrade(GRPENT *pGE, int sfd)
+{
+    FILE *fp;
+    CONSENT *pCE;
+    CONSCLIENT *pCL, *pCLnext;
+    static STRING *q = (STRING *)0;
+
+    if ((fp = tmpfile()) == (FILE *)0) {
+	Error("GroupUpgrade(): tmpfile(): %s", strerror(errno));
+	return;
+    }
+    if (q == (STRING *)0)
+	q = AllocString();
+    Msg("upgrading");
+
+    /* clients still logging in (or using ssl) have to start over */
+    for (pCL = pGE->pCLall; pCL != (CONSCLIENT *)0; pCL = pCLnext) {
+	pCLnext = pCL->pCLscan;
+	AbortAnyClientExec(pCL);
+	if (pCL->ioState != ISNORMAL || pCL->iState == S_IDENT ||
+	    pCL->iState == S_PASSWD ||
+	    FileGetType(pCL->fd) != simpleSocket)
+	    DisconnectClient(pGE, pCL,
+			     "[-- Console server upgrading --]\r\n",
+			     FLAGTRUE);
+    }
+
+    /* consoles in the middle of an initcmd (or not up) go down, and
+     * the logfiles are closed so the new process can pick them up
+     * where we leave off
+     */
+    for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
+	StopTask(pCE);
+	if (!(pCE->fup && pCE->ioState == ISNORMAL &&
+	      pCE->initfile == (CONSFILE *)0
+#if HAVE_FREEIPMI
+	      /* the ipmi library's session can't be handed on */
+	      && pCE->type != IPMI
+#endif
+	    )) {
+	    ConsDown(pCE, FLAGFALSE, FLAGTRUE);
+	    continue;
+	}
+	LogFlush(pCE);
+	if (pCE->fdlog != (CONSFILE *)0) {
+	    if (pCE->ctslot[CT_LOGSYNC] != 0) {
+		ConsTimerClear(pCE, CT_LOGSYNC);
+		FileSync(pCE->fdlog);
+	    }
+	    FileClose(&pCE->fdlog);
+	}
+    }
+    if (unifiedlog != (CONSFILE *)0)
+	FileClose(&unifiedlog);
+
+    /* everything is closed on exec, except what we pass along */
+    CloseFilesOnExec();
+
+    fprintf(fp, "%u %hu %d %d\n", pGE->id, pGE->port, sfd, pGE->hfd);
+    UpgradePass(sfd);
+    UpgradePass(pGE->hfd);
+
+    for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
+	if (!pCE->fup)
+	    continue;
+	BuildString((char *)0, q);
+	FileQueued(pCE->cofile, q);
+	fprintf(fp, "console %d %d %lu %d %d %d %d %d %d",
+		FileFDNum(pCE->cofile), pCE->execSlaveFD,
+		(unsigned long)pCE->ipid, pCE->telnetState,
+		pCE->sentDoEcho, pCE->sentDoSGA, pCE->fronly, pCE->nolog,
+		pCE->wbufIAC);
+	UpgradeSave(fp, pCE->server, -1);
+	UpgradeSave(fp, UpgradeWhere(pCE), -1);
+	UpgradeSave(fp, pCE->execSlave, -1);
+	UpgradeSave(fp, pCE->wbuf->string,
+		    pCE->wbuf->used ? pCE->wbuf->used - 1 : 0);
+	UpgradeSave(fp, q->string, q->used ? q->used - 1 : 0);
+	fputc('\n', fp);
+	UpgradePass(FileFDNum(pCE->cofile));
+	if (pCE->execSlaveFD != 0)
+	    UpgradePass(pCE->execSlaveFD);
+    }
+
+    /* console by console, so each list keeps its order */
+    for (pCE = pGE->pCEctl; pCE != (CONSENT *)0;
+	 pCE = (pCE == pGE->pCEctl) ? pGE->pCElist : pCE->pCEnext) {
+	for (pCL = pCE->pCLon; pCL != (CONSCLIENT *)0; pCL = pCL->pCLnext) {
+	    BuildString((char *)0, q);
+	    FileQueued(pCL->fd, q);
+	    fprintf(fp,
+		    "client %d %d %d %d %d %d %d %d %d %d %d %hu %hu %ld %ld",
+		    FileFDNum(pCL->fd), pCL->fcon, pCL->fwr, pCL->fwantwr,
+		    pCL->fro, pCL->fecho, pCL->fiwait,
+		    pCL->iState == S_SUSP, pCL->caccess,
+		    (unsigned char)pCL->ic[0], (unsigned char)pCL->ic[1],
+		    pCL->replay, pCL->playback, (long)pCL->tym,
+		    (long)pCL->typetym);
+	    UpgradeSave(fp, (pCE == pGE->pCEctl) ? "" : pCE->server, -1);
+	    UpgradeSave(fp, pCL->username->string, -1);
+	    UpgradeSave(fp, pCL->acid->string, -1);
+	    UpgradeSave(fp, pCL->peername->string, -1);
+	    UpgradeSave(fp, pCL->actym, -1);
+	    UpgradeSave(fp, q->string, q->used ? q->used - 1 : 0);
+	    fputc('\n', fp);
+	    UpgradePass(FileFDNum(pCL->fd));
 	}
-	BuildString((char *)0, buf);
     }
+    fprintf(fp, "end\n");
 
-    /* nuke the data alread sent */
-    if (offset >= pCEServing->wbuf->used - 1) {
-	BuildString((char *)0, pCEServing->wbuf);
-    } else if (offset > 0) {
-	ShiftString(pCEServing->wbuf, offset);
-    }
+    ReExec("group", fp);
 
-    if (pCEServing->wbuf->used > 1) {
-	char *iac = StringChar(pCEServing->wbuf, 0, (char)IAC);
-	CONDDEBUG((1, "Kiddie(): hunting for new IAC for [%s]",
-		   pCEServing->server));
-	if (iac == (char *)0)
-	    pCEServing->wbufIAC = 0;
-	else
-	    pCEServing->wbufIAC = (iac - pCEServing->wbuf->string) + 2;
-	CONDDEBUG((1,
-		   "Kiddie(): watching writability for fd %d 'cause we have buffered data",
-		   FileFDNum(pCEServing->cofile)));
-	FD_SET(FileFDNum(pCEServing->cofile), &winit);
-    } else {
-	pCEServing->wbufIAC = 0;
-	if (FileBufEmpty(pCEServing->cofile)) {
-	    CONDDEBUG((1,
-		       "Kiddie(): removing writability for fd %d 'cause we don't have buffered data",
-		       FileFDNum(pCEServing->cofile)));
-	    FD_CLR(FileFDNum(pCEServing->cofile), &winit);
+    /* still us, so put things back and carry on */
+    fclose(fp);
+    ReopenUnifiedlog();
+    for (pCE = pGE->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
+	if (!pCE->fup || pCE->logfile == (char *)0 ||
+	    pCE->fdlog != (CONSFILE *)0)
+	    continue;
+	if ((CONSFILE *)0 == (pCE->fdlog = LogOpen(pCE))) {
+	    Error("[%s] FileOpen(%s): %s: forcing down", pCE->server,
+		  pCE->logfile, strerror(errno));
+	    ConsDown(pCE, FLAGTRUE, FLAGTRUE);
 	}
     }
-    pCEServing->lastWrite = time((time_t *)0);
-    if (pCEServing->idletimeout != (time_t)0 &&
-	(timers[T_CIDLE] == (time_t)0 ||
-	 timers[T_CIDLE] >
-	 pCEServing->lastWrite + pCEServing->idletimeout))
-	timers[T_CIDLE] = pCEServing->lastWrite + pCEServing->idletimeout;
+    ReUp(pGE, 0);
+}
+#endif
+
+/* go through the consoles and clients an older binary handed us (see
+ * GroupUpgrade()), and if adopt is set, pick them up.  consoles that
+ * are gone from the config, or now talk to something else, are let go,
+ * and come up the usual way if they're still around.  returns 1 if the
+ * state was all there (up to its "end"), 0 if not.
+ */
+static int
+GroupAdoptRecords(GRPENT *pGE, FILE *fp, FLAG adopt)
+{
+    static STRING *name = (STRING *)0;
+    static STRING *where, *slave, *wbuf, *queue;
+    static STRING *user, *acid, *peer, *actym;
+    char kind[16];
+    char *pcName;
+    CONSENT *pCE;
+    CONSCLIENT *pCL, **ppCL;
+    int fd, slavefd, ts, echo, sga, fronly, nolog, iac;
+    int fcon, fwr, fwantwr, fro, fecho, fiwait, susp, caccess, ic0, ic1;
+    unsigned short replay, playback;
+    unsigned long ipid;
+    long tym, typetym;
+
+    if (name == (STRING *)0) {
+	name = AllocString();
+	where = AllocString();
+	slave = AllocString();
+	wbuf = AllocString();
+	queue = AllocString();
+	user = AllocString();
+	acid = AllocString();
+	peer = AllocString();
+	actym = AllocString();
+    }
+
+    kind[0] = '\000';
+    while (fscanf(fp, " %15s", kind) == 1 && strcmp(kind, "end") != 0) {
+	if (strcmp(kind, "console") == 0) {
+	    if (fscanf(fp, "%d %d %lu %d %d %d %d %d %d", &fd, &slavefd,
+		       &ipid, &ts, &echo, &sga, &fronly, &nolog,
+		       &iac) != 9 ||
+		(pcName = UpgradeLoad(fp, name)) == (char *)0 ||
+		UpgradeLoad(fp, where) == (char *)0 ||
+		UpgradeLoad(fp, slave) == (char *)0 ||
+		UpgradeLoad(fp, wbuf) == (char *)0 ||
+		UpgradeLoad(fp, queue) == (char *)0)
+		break;
+	    if (adopt == FLAGFALSE)
+		continue;
+	    for (pCE = pGE->pCElist; pCE != (CONSENT *)0;
+		 pCE = pCE->pCEnext)
+		if (strcmp(pCE->server, pcName) == 0)
+		    break;
+	    if (pCE == (CONSENT *)0 || where->used == 0 ||
+		strcmp(UpgradeWhere(pCE), where->string) != 0) {
+		Msg("[%s] not carried over by upgrade", pcName);
+		if (fd != -1)
+		    close(fd);
+		if (slavefd != 0)
+		    close(slavefd);
+		if (ipid != 0)
+		    kill((pid_t)ipid, SIGHUP);
+		continue;
+	    }
+	    pCE->execSlaveFD = slavefd;
+	    if (slave->used > 1) {
+		if (pCE->execSlave != (char *)0)
+		    free(pCE->execSlave);
+		if ((pCE->execSlave = StrDup(slave->string)) == (char *)0)
+		    OutOfMem();
+	    }
+	    pCE->ipid = (pid_t)ipid;
+	    pCE->telnetState = ts;
+	    pCE->sentDoEcho = echo;
+	    pCE->sentDoSGA = sga;
+	    pCE->fronly = fronly;
+	    ConsAdopt(pCE, fd);
+	    if (!pCE->fup)
+		continue;
+	    pCE->nolog = nolog;
+	    if (queue->used > 1)
+		FileWrite(pCE->cofile, FLAGFALSE, queue->string,
+			  queue->used - 1);
+	    if (wbuf->used > 1) {
+		BuildStringN(wbuf->string, wbuf->used - 1, pCE->wbuf);
+		pCE->wbufIAC = iac;
+		FlushConsole(pCE);
+	    }
+	} else if (strcmp(kind, "client") == 0) {
+	    if (fscanf(fp, "%d %d %d %d %d %d %d %d %d %d %d %hu %hu %ld %ld",
+		       &fd, &fcon, &fwr, &fwantwr, &fro, &fecho, &fiwait,
+		       &susp, &caccess, &ic0, &ic1, &replay, &playback,
+		       &tym, &typetym) != 15 ||
+		(pcName = UpgradeLoad(fp, name)) == (char *)0 ||
+		UpgradeLoad(fp, user) == (char *)0 ||
+		UpgradeLoad(fp, acid) == (char *)0 ||
+		UpgradeLoad(fp, peer) == (char *)0 ||
+		UpgradeLoad(fp, actym) == (char *)0 ||
+		UpgradeLoad(fp, queue) == (char *)0)
+		break;
+	    if (adopt == FLAGFALSE)
+		continue;
+	    if ((pCL = KiddieNewClient(pGE, fd)) == (CONSCLIENT *)0)
+		continue;
+	    pCL->ioState = ISNORMAL;
+	    pCL->iState = susp ? S_SUSP : S_NORMAL;
+	    pCL->fcon = fcon;
+	    pCL->fwr = fwr;
+	    pCL->fwantwr = fwantwr;
+	    pCL->fro = fro;
+	    pCL->fecho = fecho;
+	    pCL->fiwait = fiwait;
+	    pCL->caccess = caccess;
+	    pCL->ic[0] = ic0;
+	    pCL->ic[1] = ic1;
+	    pCL->replay = replay;
+	    pCL->playback = playback;
+	    pCL->tym = (time_t)tym;
+	    pCL->typetym = (time_t)typetym;
+	    if (actym->used > 1)
+		StrCpy(pCL->actym, actym->string, sizeof(pCL->actym));
+	    if (user->used > 1) {
+		BuildString((char *)0, pCL->username);
+		BuildString(user->string, pCL->username);
+	    }
+	    if (acid->used > 1) {
+		BuildString((char *)0, pCL->acid);
+		BuildString(acid->string, pCL->acid);
+	    }
+	    if (peer->used > 1)
+		BuildString(peer->string, pCL->peername);
+	    if (queue->used > 1) {
+		FileSetQuoteIAC(pCL->fd, FLAGFALSE);
+		FileWrite(pCL->fd, FLAGFALSE, queue->string,
+			  queue->used - 1);
+		FileSetQuoteIAC(pCL->fd, FLAGTRUE);
+	    }
+
+	    /* on the control console is where KiddieNewClient() left it */
+	    if (*pcName == '\000')
+		continue;
+	    for (pCE = pGE->pCElist; pCE != (CONSENT *)0;
+		 pCE = pCE->pCEnext)
+		if (strcmp(pCE->server, pcName) == 0)
+		    break;
+	    if (pCE == (CONSENT *)0) {
+		FilePrint(pCL->fd, FLAGFALSE, "%s: no such console\r\n",
+			  pcName);
+		DisconnectClient(pGE, pCL, (char *)0, FLAGFALSE);
+		continue;
+	    }
+	    if ((CONSCLIENT *)0 != pCL->pCLnext) {
+		pCL->pCLnext->ppCLbnext = pCL->ppCLbnext;
+	    }
+	    *(pCL->ppCLbnext) = pCL->pCLnext;
+	    for (ppCL = &pCE->pCLon; *ppCL != (CONSCLIENT *)0;
+		 ppCL = &(*ppCL)->pCLnext);
+	    pCL->pCEto = pCE;
+	    pCL->pCLnext = (CONSCLIENT *)0;
+	    pCL->ppCLbnext = ppCL;
+	    *ppCL = pCL;
+	    if (pCL->fwr) {
+		if (pCE->pCLwr == (CONSCLIENT *)0)
+		    pCE->pCLwr = pCL;
+		else {
+		    pCL->fwr = 0;
+		    pCL->fwantwr = 1;
+		}
+	    }
+	} else
+	    break;
+    }
+    return strcmp(kind, "end") == 0;
+}
+
+/* pick up what an older binary handed us, but only once we know it's
+ * all there - otherwise every console and client it passed along is
+ * closed, and the consoles come up fresh (see ReUp())
+ */
+static void
+GroupAdopt(GRPENT *pGE, FILE *fp, int sfd)
+{
+    long start;
+
+    if ((start = ftell(fp)) == -1 ||
+	GroupAdoptRecords(pGE, fp, FLAGFALSE) == 0 ||
+	fseek(fp, start, SEEK_SET) != 0) {
+	Error("GroupAdopt(): upgrade state is incomplete: starting over");
+	UpgradeAbandon(fp, sfd, pGE->hfd);
+	return;
+    }
+    GroupAdoptRecords(pGE, fp, FLAGTRUE);
+    fclose(fp);
 }
 
 /* routine used by the child processes.				   (ksb/fine)
@@ -4367,7 +6657,7 @@ FlushConsole(CONSENT *pCEServing)
  *		
  */
 static void
-Kiddie(GRPENT *pGE, int sfd)
+Kiddie(GRPENT *pGE, int sfd, FILE *fpResume)
 {
     CONSCLIENT *pCL,		/* console we must scan/notify          */
      *pCLServing;		/* client we are serving                */
@@ -4378,9 +6668,9 @@ Kiddie(GRPENT *pGE, int sfd)
     time_t tyme;
     time_t tymer;
     int fd;
+    int kind;
+    void *owner;
     socklen_t so;
-    fd_set rmask;
-    fd_set wmask;
     struct timeval tv;
     struct timeval *tvp;
 
@@ -4401,6 +6691,7 @@ Kiddie(GRPENT *pGE, int sfd)
 	DestroyRemoteConsole(pRCList);
 	pRCList = pRCtmp;
     }
+    NameIndexDrop();
 
     if ((pGE->pCEctl = (CONSENT *)calloc(1, sizeof(CONSENT)))
 	== (CONSENT *)0)
@@ -4433,22 +6724,12 @@ Kiddie(GRPENT *pGE, int sfd)
 	== (char *)0)
 	OutOfMem();
 
-    /* set up stuff for the select() call once, then just copy it
-     * rinit is all the fd's we might get data on, we copy it
-     * to rmask before we call select, this saves lots of prep work
-     * we used to do in the loop, but we have to mod rinit whenever
-     * we add a connection or drop one...   (ksb)
+    /* start a fresh watch list for this process, we have to keep
+     * it up to date whenever we add a connection or drop one
      */
-    /*maxfd = GetMaxFiles(); */
-    FD_ZERO(&rinit);
-    FD_ZERO(&winit);
-    FD_SET(sfd, &rinit);
-    if (maxfd < sfd + 1)
-	maxfd = sfd + 1;
-    /* open all the files we need for the consoles in our group
-     * if we can't get one (bitch and) flag as down
-     */
-    ReUp(pGE, 0);
+    FDWatchReset();
+    FDWatch(sfd, FDWATCH_READ);
+    FDWatch(pGE->hfd, FDWATCH_READ);
 
     /* prime the list of free connection slots
      */
@@ -4459,6 +6740,17 @@ Kiddie(GRPENT *pGE, int sfd)
     pGE->pCLfree->username = AllocString();
     pGE->pCLfree->peername = AllocString();
     pGE->pCLfree->accmd = AllocString();
+    pGE->pCLall = (CONSCLIENT *)0;
+
+    /* pick up the consoles and clients an older binary handed us
+     */
+    if (fpResume != (FILE *)0)
+	GroupAdopt(pGE, fpResume, sfd);
+
+    /* open all the files we need for the consoles in our group
+     * if we can't get one (bitch and) flag as down
+     */
+    ReUp(pGE, 0);
 
     /* on a SIGHUP we should close and reopen our log files and
      * reread the config file
@@ -4473,12 +6765,12 @@ Kiddie(GRPENT *pGE, int sfd)
     SimpleSignal(SIGUSR1, FlagReUp);
 
     /* prime the pump */
-    RollLogs(pGE);
-    Mark(pGE);
+    for (pCEServing = pGE->pCElist; pCEServing != (CONSENT *)0;
+	 pCEServing = pCEServing->pCEnext)
+	ConsMarkReset(pCEServing);
 
     /* the MAIN loop a group server
      */
-    pGE->pCLall = (CONSCLIENT *)0;
     while (1) {
 	/* check signal flags */
 	if (fSawGoAway) {
@@ -4495,6 +6787,8 @@ Kiddie(GRPENT *pGE, int sfd)
 	    ReopenUnifiedlog();
 	    ReReadCfg(sfd, -1);
 	    pGE = pGroups;
+	    /* (the reread starts a fresh watch list) */
+	    FDWatch(pGE->hfd, FDWATCH_READ);
 	    ReOpen(pGE);
 	    ReUp(pGE, 0);
 	}
@@ -4509,85 +6803,19 @@ Kiddie(GRPENT *pGE, int sfd)
 	    fSawReUp = 0;
 	    ReUp(pGE, 0);
 	}
-
-	/* check for timeouts with consoles */
-	tymer = (time_t)0;
-	tyme = time((time_t *)0);
-
-	/* check for state timeouts (currently connect() timeouts) */
-	if (timers[T_STATE] != (time_t)0 && tyme >= timers[T_STATE]) {
-	    timers[T_STATE] = (time_t)0;
-	    for (pCEServing = pGE->pCElist; pCEServing != (CONSENT *)0;
-		 pCEServing = pCEServing->pCEnext) {
-		if (pCEServing->stateTimer == (time_t)0)
-		    continue;
-		if (pCEServing->stateTimer > tyme) {
-		    if (timers[T_STATE] == (time_t)0 ||
-			timers[T_STATE] > pCEServing->stateTimer)
-			timers[T_STATE] = pCEServing->stateTimer;
-		    continue;
-		}
-		pCEServing->stateTimer = (time_t)0;
-		if (pCEServing->ioState != INCONNECT)
-		    continue;
-		SendIWaitClientsMsg(pCEServing, "down]\r\n");
-		Error("[%s] connect timeout: forcing down",
-		      pCEServing->server);
-		/* can't use ConsoleError() here otherwise we could reinit
-		 * the console repeatedly (immediately).  we know there are
-		 * no clients attached, so it's basically the same.
-		 */
-		ConsDown(pCEServing, FLAGTRUE, FLAGTRUE);
-	    }
-	}
-
-	/* process any idle timeouts */
-	if (timers[T_CIDLE] != (time_t)0 && tyme >= timers[T_CIDLE]) {
-	    timers[T_CIDLE] = (time_t)0;
-	    for (pCEServing = pGE->pCElist; pCEServing != (CONSENT *)0;
-		 pCEServing = pCEServing->pCEnext) {
-		/* if we aren't in a normal state, skip it */
-		if (!(pCEServing->fup && pCEServing->ioState == ISNORMAL))
-		    continue;
-		/* should we check for a r/w user too and only idle when
-		 * they aren't connected?  right now, i think we want to
-		 * do the idle stuff even if we have users
-		 */
-		if (pCEServing->idletimeout != 0) {
-		    time_t chime =
-			pCEServing->lastWrite + pCEServing->idletimeout;
-		    if (tyme < chime) {
-			if (timers[T_CIDLE] == (time_t)0 ||
-			    timers[T_CIDLE] > chime)
-			    timers[T_CIDLE] = chime;
-			continue;
-		    }
-		    ExpandString(pCEServing->idlestring, pCEServing, 0);
-		    TagLogfileAct(pCEServing, "idle timeout");
-		    FlushConsole(pCEServing);
-		    SendClientsMsg(pCEServing, "[-- idle timeout --]\r\n");
-		    /* we're not technically correct here in saying the write
-		     * happened, but we don't want to accidentally trigger
-		     * another idle action, so we lie...when the buffer gets
-		     * flushed, this will be updated and correct.
-		     */
-		    pCEServing->lastWrite = tyme;
-		    chime = tyme + pCEServing->idletimeout;
-		    if (timers[T_CIDLE] == (time_t)0 ||
-			timers[T_CIDLE] > chime)
-			timers[T_CIDLE] = chime;
-		}
-	    }
+#if defined(SCM_RIGHTS)
+	if (fSawUpgrade) {
+	    fSawUpgrade = 0;
+	    GroupUpgrade(pGE, sfd);
 	}
+#endif
 
-	/* see if we need to bring things back up or mark logfiles
-	 * or do other such events here.  we call time() each time
-	 * in case one of the subroutines actually takes a long time
-	 * to complete */
-	if (timers[T_MARK] != (time_t)0 &&
-	    time((time_t *)0) >= timers[T_MARK])
-	    Mark(pGE);
+	/* fire any console timers that have come due */
+	RunConsTimers();
 
+	/* see if we need to bring things back up or do other such
+	 * events here.  we call time() each time in case one of the
+	 * subroutines actually takes a long time to complete */
 	if (timers[T_INITDELAY] != (time_t)0 &&
 	    time((time_t *)0) >= timers[T_INITDELAY]) {
 	    timers[T_INITDELAY] = (time_t)0;
@@ -4603,15 +6831,11 @@ Kiddie(GRPENT *pGE, int sfd)
 	    time((time_t *)0) >= timers[T_AUTOUP])
 	    ReUp(pGE, 1);
 
-	/* do we need to check on log file sizes? */
-	if (timers[T_ROLL] != (time_t)0 &&
-	    time((time_t *)0) >= timers[T_ROLL])
-	    RollLogs(pGE);
-
 	/* check on various timers and set the appropriate timeout */
 	/* all this so we don't have to use alarm() any more... */
 
 	/* look for the next nearest timeout */
+	tymer = (time_t)0;
 	for (ret = 0; ret < T_MAX; ret++) {
 	    if (timers[ret] != (time_t)0 &&
 		(tymer == (time_t)0 || tymer > timers[ret]))
@@ -4619,6 +6843,7 @@ Kiddie(GRPENT *pGE, int sfd)
 	}
 
 	/* if we have a timer, figure out the delay left */
+	tvp = (struct timeval *)0;
 	if (tymer != (time_t)0) {
 	    tyme = time((time_t *)0);
 	    if (tymer > tyme)	/* in the future */
@@ -4627,277 +6852,96 @@ Kiddie(GRPENT *pGE, int sfd)
 		tv.tv_sec = 1;
 	    tv.tv_usec = 0;
 	    tvp = &tv;
-	} else			/* no timeout */
-	    tvp = (struct timeval *)0;
+	}
+	/* console timers have sub-second resolution */
+	if (ctUsed > 0) {
+	    struct timeval now, left;
+	    TimerNow(&now);
+	    if (timercmp(&ctHeap[0].when, &now, >))
+		timersub(&ctHeap[0].when, &now, &left);
+	    else
+		timerclear(&left);
+	    if (tvp == (struct timeval *)0 || timercmp(&left, tvp, <)) {
+		tv = left;
+		tvp = &tv;
+	    }
+	}
 	if (tvp == (struct timeval *)0) {
 	    CONDDEBUG((1, "Kiddie(): no select timeout"));
 	} else {
-	    CONDDEBUG((1, "Kiddie(): select timeout of %d seconds",
-		       tv.tv_sec));
+	    CONDDEBUG((1, "Kiddie(): select timeout of %d.%06d seconds",
+		       (int)tv.tv_sec, (int)tv.tv_usec));
 	}
 
-	rmask = rinit;
-	wmask = winit;
-
-	if ((ret = select(maxfd, &rmask, &wmask, (fd_set *)0, tvp)) == -1) {
+	ResolveWatch();
+	if (FDWait(tvp) == -1) {
 	    if (errno != EINTR) {
-		Error("Kiddie(): select(): %s", strerror(errno));
+		Error("Kiddie(): FDWait(): %s", strerror(errno));
 		break;
 	    }
 	    continue;
 	}
 
-	if (ret == 0)		/* timeout -- loop back up and handle it */
-	    continue;
-
-	/* anything on a console? */
-	for (pCEServing = pGE->pCElist; pCEServing != (CONSENT *)0;
-	     pCEServing = pCEServing->pCEnext) {
-	    if (!pCEServing->fup || pCEServing->type == NOOP)
-		continue;
-	    switch (pCEServing->ioState) {
-		case INCONNECT:
-#if HAVE_FREEIPMI
-		    if (pCEServing->type == IPMI) {
-			if (FileCanRead
-			    (pCEServing->cofile, &rmask, &wmask)) {
-			    if (IPMICONSOLE_CTX_STATUS_SOL_ESTABLISHED ==
-				ipmiconsole_ctx_status
-				(pCEServing->ipmictx)) {
-				/* Read in the NULL from OUTPUT_ON_SOL_ESTABLISHED flag */
-				char b[1];
-				FileRead(pCEServing->cofile, b, 1);	/* trust it's NULL */
-			    } else {
-				Error("[%s] IPMI error: %s: forcing down",
-				      pCEServing->server,
-				      ipmiconsole_ctx_errormsg(pCEServing->
-							       ipmictx));
-				/* no ConsoleError() for same reason as above */
-				SendIWaitClientsMsg(pCEServing,
-						    "down]\r\n");
-				ConsDown(pCEServing, FLAGTRUE, FLAGTRUE);
-				break;
-			    }
-			} else
-			    break;
-		    } else {
-#endif /* freeipmi */
-			/* deal with this state above as well */
-			if (FileCanWrite
-			    (pCEServing->cofile, &rmask, &wmask)) {
-			    socklen_t slen;
-			    int flags = 0;
-			    int cofile = FileFDNum(pCEServing->cofile);
-			    slen = sizeof(flags);
-			    /* So, getsockopt seems to return -1 if there is
-			     * something interesting in SO_ERROR under
-			     * solaris...sheesh.  So, the error message has
-			     * the small change it's not accurate.
-			     */
-			    if (getsockopt
-				(cofile, SOL_SOCKET, SO_ERROR,
-				 (char *)&flags, &slen) < 0) {
-				Error
-				    ("[%s] getsockopt(%u,SO_ERROR): %s: forcing down",
-				     pCEServing->server, cofile,
-				     strerror(errno));
-				/* no ConsoleError() for same reason as above */
-				SendIWaitClientsMsg(pCEServing,
-						    "down]\r\n");
-				ConsDown(pCEServing, FLAGTRUE, FLAGTRUE);
-				break;
-			    }
-			    if (flags != 0) {
-				Error("[%s] connect(%u): %s: forcing down",
-				      pCEServing->server, cofile,
-				      strerror(flags));
-				/* no ConsoleError() for same reason as above */
-				SendIWaitClientsMsg(pCEServing,
-						    "down]\r\n");
-				ConsDown(pCEServing, FLAGTRUE, FLAGTRUE);
-				break;
-			    }
-
-			    /* waiting for a connect(), we watch the write bit,
-			     * so switch around and now watch for the read and
-			     * start gathering data
-			     */
-			    FD_SET(cofile, &rinit);
-			    FD_CLR(cofile, &winit);
-			} else
-			    break;
-#if HAVE_FREEIPMI
-		    }
-#endif
-
-		    pCEServing->ioState = ISNORMAL;
-		    pCEServing->lastWrite = time((time_t *)0);
-#if HAVE_GETTIMEOFDAY
-		    if (gettimeofday(&tv, (void *)0) == 0)
-			pCEServing->lastInit = tv;
-#else
-		    if ((tv = time((time_t *)0)) != (time_t)-1)
-			pCEServing->lastInit = tv;
-#endif
-		    if (pCEServing->idletimeout != (time_t)0 &&
-			(timers[T_CIDLE] == (time_t)0 ||
-			 timers[T_CIDLE] >
-			 pCEServing->lastWrite + pCEServing->idletimeout))
-			timers[T_CIDLE] =
-			    pCEServing->lastWrite +
-			    pCEServing->idletimeout;
-		    if (pCEServing->downHard == FLAGTRUE) {
-			Msg("[%s] console up", pCEServing->server);
-			pCEServing->downHard = FLAGFALSE;
-		    }
-		    SendIWaitClientsMsg(pCEServing, "up]\r\n");
-		    StartInit(pCEServing);
-		    break;
-		case ISNORMAL:
-		    if (FileCanRead(pCEServing->cofile, &rmask, &wmask))
-			DoConsoleRead(pCEServing);
-		    if (FileCanRead(pCEServing->initfile, &rmask, &wmask))
-			DoCommandRead(pCEServing);
-		    if (FileCanRead(pCEServing->taskfile, &rmask, &wmask))
-			DoTaskRead(pCEServing);
-		    /* fall through to ISFLUSHING for buffered data */
-		case ISFLUSHING:
-		    /* write cofile data */
-		    if (!FileBufEmpty(pCEServing->cofile) &&
-			FileCanWrite(pCEServing->cofile, &rmask, &wmask)) {
-			CONDDEBUG((1, "Master(): flushing fd %d",
-				   FileFDNum(pCEServing->cofile)));
-			if (FileWrite
-			    (pCEServing->cofile, FLAGFALSE, (char *)0,
-			     0) < 0) {
-			    Error("[%s] write failure",
-				  pCEServing->server);
-			    ConsoleError(pCEServing);
-			    break;
-			}
-		    }
-		    /* write fdlog data */
-		    if (!FileBufEmpty(pCEServing->fdlog) &&
-			FileCanWrite(pCEServing->fdlog, &rmask, &wmask)) {
-			CONDDEBUG((1, "Kiddie(): flushing fd %d",
-				   FileFDNum(pCEServing->fdlog)));
-			if (FileWrite
-			    (pCEServing->fdlog, FLAGFALSE, (char *)0,
-			     0) < 0) {
-			    Error("[%s] write failure",
-				  pCEServing->server);
-			    ConsoleError(pCEServing);
-			    break;
-			}
-		    }
-		    /* write initfile data */
-		    if (!FileBufEmpty(pCEServing->initfile) &&
-			FileCanWrite(pCEServing->initfile, &rmask,
-				     &wmask)) {
-			CONDDEBUG((1, "Kiddie(): flushing fd %d",
-				   FileFDNum(pCEServing->initfile)));
-			if (FileWrite
-			    (pCEServing->initfile, FLAGFALSE, (char *)0,
-			     0) < 0) {
-			    Error("[%s] write failure",
-				  pCEServing->server);
-			    ConsoleError(pCEServing);
-			    break;
-			}
-		    }
-		    /* stop if we're in ISFLUSHING state and out of data */
-		    if ((pCEServing->ioState == ISFLUSHING) &&
-			FileBufEmpty(pCEServing->cofile) &&
-			FileBufEmpty(pCEServing->fdlog) &&
-			FileBufEmpty(pCEServing->initfile))
-			/* no ConsoleError() for same reason as above */
-			ConsDown(pCEServing, FLAGFALSE, FLAGTRUE);
-		    break;
-		default:
-		    /* this really can't ever happen */
-		    Error
-			("Kiddie(): console socket state == %d -- THIS IS A BUG",
-			 pCEServing->ioState);
-		    /* no ConsoleError() for same reason as above */
-		    ConsDown(pCEServing, FLAGTRUE, FLAGTRUE);
-		    break;
+	/* consoles and clients waiting on the resolver get another look */
+	if (ResolveReady() > 0) {
+	    CONSCLIENT *pCLnext;
+	    ConsResolved();
+	    for (pCL = pGE->pCLall; pCL != (CONSCLIENT *)0; pCL = pCLnext) {
+		pCLnext = pCL->pCLscan;
+		if (pCL->ioState == INRESOLVE)
+		    KiddieClientAccess(pGE, pCL);
+		else
+		    ClientPeerName(pCL);
 	    }
 	}
 
-	/* anything on a client? */
-	for (pCLServing = pGE->pCLall; (CONSCLIENT *)0 != pCLServing;
-	     pCLServing = pCLServing->pCLscan) {
-	    switch (pCLServing->ioState) {
-#if HAVE_OPENSSL
-		case INSSLACCEPT:
-		    if (FileCanSSLAccept(pCLServing->fd, &rmask, &wmask)) {
-			int r;
-			if ((r = FileSSLAccept(pCLServing->fd)) < 0)
-			    DisconnectClient(pGE, pCLServing, (char *)0,
-					     FLAGFALSE);
-			else if (r == 1)
-			    pCLServing->ioState = ISNORMAL;
-		    }
-		    break;
-#endif
-#if HAVE_GSSAPI
-		case INGSSACCEPT:
-		    {
-			int r;
-			if ((r = AttemptGSSAPI(pCLServing)) < 0)
-			    DisconnectClient(pGE, pCLServing, (char *)0,
-					     FLAGFALSE);
-			else if (r == 1)
-			    pCLServing->ioState = ISNORMAL;
-		    }
-		    break;
-#endif
-		case ISNORMAL:
-		    if (FileCanRead(pCLServing->fd, &rmask, &wmask))
-			DoClientRead(pGE, pCLServing);
-		    /* fall through to ISFLUSHING for buffered data */
-		case ISFLUSHING:
-		    if (!FileBufEmpty(pCLServing->fd) &&
-			FileCanWrite(pCLServing->fd, &rmask, &wmask)) {
-			CONDDEBUG((1, "Kiddie(): flushing fd %d",
-				   FileFDNum(pCLServing->fd)));
-			if (FileWrite
-			    (pCLServing->fd, FLAGFALSE, (char *)0,
-			     0) < 0) {
-			    DisconnectClient(pGE, pCLServing, (char *)0,
-					     FLAGTRUE);
-			    break;
-			}
-		    }
-		    if ((pCLServing->ioState == ISFLUSHING) &&
-			FileBufEmpty(pCLServing->fd))
-			DisconnectClient(pGE, pCLServing, (char *)0,
-					 FLAGFALSE);
-		    break;
-		default:
-		    /* this really can't ever happen */
-		    Error
-			("Kiddie(): client socket state == %d -- THIS IS A BUG",
-			 pCLServing->ioState);
-		    DisconnectClient(pGE, pCLServing, (char *)0,
-				     FLAGFALSE);
-		    break;
-	    }
+	/* gather up whoever owns the fds that came back ready */
+	ret = 0;
+	while ((owner = FileNextReady(&ret, &kind)) != (void *)0) {
+	    if (kind == FDOWNER_CONSOLE)
+		PendConsole((CONSENT *)owner);
+	    else if (kind == FDOWNER_CLIENT)
+		PendClient((CONSCLIENT *)owner);
+	}
+
+	/* anything on a console? */
+	for (pCEServing = pCEpend; pCEServing != (CONSENT *)0;
+	     pCEServing = pCEServing->pCEpend)
+	    DoConsoleIO(pGE, pCEServing);
+
+	/* anything on a client?  a client may have been dropped
+	 * while working on someone else, in which case its fd is gone
+	 */
+	while ((pCLServing = pCLpend) != (CONSCLIENT *)0) {
+	    pCLpend = pCLServing->pCLpend;
+	    pCLServing->fpending = 0;
+	    if (pCLServing->fd != (CONSFILE *)0)
+		DoClientIO(pGE, pCLServing);
 	}
 
 	/* we buffered console data in PutConsole() so that we can
 	 * send more than 1-byte payloads, if we get more than 1-byte
 	 * of data from a client connection.  here we flush that buffer,
 	 * possibly putting it into the write buffer (but we don't really
-	 * need to worry about that here).
+	 * need to worry about that here).  PutConsole() put anyone with
+	 * data on the pending list, along with the consoles we just
+	 * serviced (which may be waiting on a heavy IAC to drain).
 	 */
-	for (pCEServing = pGE->pCElist; pCEServing != (CONSENT *)0;
-	     pCEServing = pCEServing->pCEnext)
+	while ((pCEServing = pCEpend) != (CONSENT *)0) {
+	    pCEpend = pCEServing->pCEpend;
+	    pCEServing->fpending = 0;
 	    FlushConsole(pCEServing);
+	}
+
+#if defined(SCM_RIGHTS)
+	/* clients the master passes along */
+	if (FDIsReady(pGE->hfd, FDWATCH_READ))
+	    KiddieHandOff(pGE);
+#endif
 
 	/* if nothing on control line, get more
 	 */
-	if (!FD_ISSET(sfd, &rmask)) {
+	if (!FDIsReady(sfd, FDWATCH_READ)) {
 	    continue;
 	}
 
@@ -4917,15 +6961,7 @@ Kiddie(GRPENT *pGE, int sfd)
 	    continue;
 	}
 
-	if (SetFlags(fd, O_NONBLOCK, 0)) {
-	    pGE->pCLfree->fd = FileOpenFD(fd, simpleSocket);
-	    FileSetQuoteIAC(pGE->pCLfree->fd, FLAGTRUE);
-	} else
-	    pGE->pCLfree->fd = (CONSFILE *)0;
-
-	if ((CONSFILE *)0 == pGE->pCLfree->fd) {
-	    Error("Kiddie(): FileOpenFD(): %s", strerror(errno));
-	    close(fd);
+	if ((pCL = KiddieNewClient(pGE, fd)) == (CONSCLIENT *)0) {
 #if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
 	    CONDDEBUG((1, "Kiddie(): dmalloc / MarkClientConnection"));
 	    dmalloc_log_changed(dmallocMarkClientConnection, 1, 0, 1);
@@ -4933,84 +6969,7 @@ Kiddie(GRPENT *pGE, int sfd)
 	    continue;
 	}
 
-	/* save pCL so we can advance to the next free one
-	 */
-	pCL = pGE->pCLfree;
-	pGE->pCLfree = pCL->pCLnext;
-
-	/* init the identification stuff
-	 */
-	BuildString((char *)0, pCL->peername);
-	BuildString((char *)0, pCL->acid);
-	BuildString("<unknown>@", pCL->acid);
-	BuildString((char *)0, pCL->username);
-	BuildString("<unknown>", pCL->username);
-	StrCpy(pCL->actym, StrTime(&(pCL->tym)), sizeof(pCL->actym));
-	pCL->typetym = pCL->tym;
-
-	/* link into the control list for the dummy console
-	 */
-	pCL->pCEto = pGE->pCEctl;
-	pCL->pCLnext = pGE->pCEctl->pCLon;
-	pCL->ppCLbnext = &pGE->pCEctl->pCLon;
-	if ((CONSCLIENT *)0 != pCL->pCLnext) {
-	    pCL->pCLnext->ppCLbnext = &pCL->pCLnext;
-	}
-	pGE->pCEctl->pCLon = pCL;
-
-	/* link into all clients list
-	 */
-	pCL->pCLscan = pGE->pCLall;
-	pCL->ppCLbscan = &pGE->pCLall;
-	if ((CONSCLIENT *)0 != pCL->pCLscan) {
-	    pCL->pCLscan->ppCLbscan = &pCL->pCLscan;
-	}
-	pGE->pCLall = pCL;
-
-	FD_SET(FileFDNum(pCL->fd), &rinit);
-	if (maxfd < FileFDNum(pCL->fd) + 1)
-	    maxfd = FileFDNum(pCL->fd) + 1;
-
-	/* init the fsm
-	 */
-	pCL->fecho = 0;
-	pCL->iState = S_IDENT;
-	pCL->ic[0] = DEFATTN;
-	pCL->ic[1] = DEFESC;
-	pCL->replay = DEFREPLAY;
-	pCL->playback = DEFPLAYBACK;
-	BuildString((char *)0, pCL->accmd);
-
-	/* mark as stopped (no output from console)
-	 * and spy only (on chars to console)
-	 */
-	pCL->fcon = 0;
-	pCL->fwr = 0;
-	pCL->fwantwr = 0;
-
-	/* remove from the free list
-	 * if we ran out of free slots, calloc one...
-	 */
-	if ((CONSCLIENT *)0 == pGE->pCLfree) {
-	    if ((pGE->pCLfree =
-		 (CONSCLIENT *)calloc(1, sizeof(CONSCLIENT)))
-		== (CONSCLIENT *)0)
-		OutOfMem();
-	    pGE->pCLfree->acid = AllocString();
-	    pGE->pCLfree->username = AllocString();
-	    pGE->pCLfree->peername = AllocString();
-	    pGE->pCLfree->accmd = AllocString();
-	}
-
-	if (ClientAccessOk(pCL)) {
-	    pCL->ioState = ISNORMAL;
-	    /* say hi to start */
-	    FileWrite(pCL->fd, FLAGFALSE, "ok\r\n", -1);
-	    BuildString(pCL->peername->string, pCL->acid);
-	    CONDDEBUG((1, "Kiddie(): client acid initialized to `%s'",
-		       pCL->acid->string));
-	} else
-	    DisconnectClient(pGE, pCL, (char *)0, FLAGFALSE);
+	KiddieClientAccess(pGE, pCL);
     }
 }
 
@@ -5022,6 +6981,7 @@ Spawn(GRPENT *pGE, int msfd)
 {
     pid_t pid;
     int sfd;
+    int hsv[2];
 #if USE_IPV6 || !USE_UNIX_DOMAIN_SOCKETS
 # if USE_IPV6
     int error;
@@ -5226,6 +7186,19 @@ Spawn(GRPENT *pGE, int msfd)
     pGE->port = ntohs(lstn_port.sin_port);
 #endif
 
+    /* and a channel for the master to hand us clients on */
+    if (pGE->hfd != -1) {
+	close(pGE->hfd);
+	pGE->hfd = -1;
+    }
+    hsv[0] = hsv[1] = -1;
+#if defined(SCM_RIGHTS)
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, hsv) < 0) {
+	Error("Spawn(): socketpair(): %s", strerror(errno));
+	hsv[0] = hsv[1] = -1;
+    }
+#endif
+
     fflush(stderr);
     fflush(stdout);
     switch (pid = fork()) {
@@ -5234,6 +7207,15 @@ Spawn(GRPENT *pGE, int msfd)
 	    Bye(EX_OSERR);
 	default:
 	    close(sfd);
+	    if (hsv[0] != -1) {
+		close(hsv[1]);
+		/* consoles we exec don't need it */
+		fcntl(hsv[0], F_SETFD, FD_CLOEXEC);
+		if (SetFlags(hsv[0], O_NONBLOCK, 0))
+		    pGE->hfd = hsv[0];
+		else
+		    close(hsv[0]);
+	    }
 	    /* hmm...there seems to be a potential linux bug here as well.
 	     * if you have a parent and child both sharing a socket and the
 	     * parent is able to close it and create a new socket (same port
@@ -5251,9 +7233,22 @@ Spawn(GRPENT *pGE, int msfd)
 	case 0:
 	    pGE->pid = thepid = getpid();
 	    isMaster = 0;
+	    /* the master's resolver isn't ours */
+	    ResolveReset();
+	    /* so groups don't all pick the same reinit delays */
+	    srand((unsigned int)(thepid ^ time((time_t *)0)));
 	    break;
     }
 
+    if (hsv[0] != -1) {
+	close(hsv[0]);
+	fcntl(hsv[1], F_SETFD, FD_CLOEXEC);
+	if (SetFlags(hsv[1], O_NONBLOCK, 0))
+	    pGE->hfd = hsv[1];
+	else
+	    close(hsv[1]);
+    }
+
 #if HAVE_SETPROCTITLE
     if (config->setproctitle == FLAGTRUE)
 	setproctitle("group %u: port %hu, %d %s", pGE->id, pGE->port,
@@ -5277,8 +7272,6 @@ Spawn(GRPENT *pGE, int msfd)
 	    pCLmall->fd = (CONSFILE *)0;
 	    CONDDEBUG((1, "Spawn(): closing Master() client fd %d", fd));
 	    close(fd);
-	    FD_CLR(fd, &rinit);
-	    FD_CLR(fd, &winit);
 	}
 	pCL = pCLmall->pCLscan;
 	DestroyClient(pCLmall);
@@ -5300,7 +7293,7 @@ Spawn(GRPENT *pGE, int msfd)
 #endif
 	Bye(EX_OSERR);
     }
-    Kiddie(pGE, sfd);
+    Kiddie(pGE, sfd, (FILE *)0);
 
     /* should never get here...but on errors we could */
     close(sfd);
@@ -5309,3 +7302,53 @@ Spawn(GRPENT *pGE, int msfd)
 #endif
     Bye(EX_SOFTWARE);
 }
+
+/* the group half of an upgrade: we're the fresh copy of conserver a
+ * group exec'd (see GroupUpgrade()), so find that group in the config
+ * we just read and carry on with what it handed us
+ */
+void
+GroupResume(FILE *fp)
+{
+    GRPENT *pGE;
+    unsigned int id;
+    unsigned short port;
+    int sfd, hfd;
+
+    isMaster = 0;
+    if (fscanf(fp, "%u %hu %d %d", &id, &port, &sfd, &hfd) != 4) {
+	Error("GroupResume(): bad upgrade state");
+	Bye(EX_SOFTWARE);
+    }
+    for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext)
+	if (pGE->id == id && pGE->imembers != 0)
+	    break;
+    if (pGE == (GRPENT *)0) {
+	/* the master won't be expecting us either (see MasterResume()) */
+	Error("group #%u is no longer configured", id);
+	Bye(EX_SOFTWARE);
+    }
+
+    pGE->pid = thepid;
+    pGE->port = port;
+    if (hfd != -1)
+	fcntl(hfd, F_SETFD, FD_CLOEXEC);
+    pGE->hfd = hfd;
+    /* so groups don't all pick the same reinit delays */
+    srand((unsigned int)(thepid ^ time((time_t *)0)));
+
+#if HAVE_SETPROCTITLE
+    if (config->setproctitle == FLAGTRUE)
+	setproctitle("group %u: port %hu, %d %s", pGE->id, pGE->port,
+		     pGE->imembers,
+		     pGE->imembers == 1 ? "console" : "consoles");
+#endif
+
+    Verbose("group #%d pid %lu on port %hu upgraded", pGE->id,
+	    (unsigned long)pGE->pid, pGE->port);
+    Kiddie(pGE, sfd, fp);
+
+    /* should never get here...but on errors we could */
+    close(sfd);
+    Bye(EX_SOFTWARE);
+}
@@ -33,14 +33,22 @@
  */
 
 /* timers used to have various things happen */
-#define T_STATE		0
-#define T_CIDLE		1
-#define T_MARK		2
-#define T_REINIT	3
-#define T_AUTOUP	4
-#define T_ROLL		5
-#define T_INITDELAY	6
-#define T_MAX		7	/* T_MAX *must* be last */
+/* (per-console timers live in the timer heap - see CT_* in consent.h) */
+#define T_REINIT	0
+#define T_AUTOUP	1
+#define T_INITDELAY	2
+#define T_MAX		3	/* T_MAX *must* be last */
+
+/* automatic reinit backoff and the per-host connect cap (ConsReUpLater())
+ */
+#define REUPMIN		2	/* first backoff (seconds)              */
+#define REUPMAX		60	/* longest backoff (seconds)            */
+#define REUPPERHOST	4	/* connects in flight to one host       */
+
+/* longest client handoff message from the master to a group */
+#define HANDOFFMAX	2048
+/* and the one (with no client) that has the group upgrade */
+#define HANDOFFUPGRADE	"upgrade"
 
 /* return values used by CheckPass()
  */
@@ -52,6 +60,7 @@ typedef struct grpent {		/* group info                           */
     unsigned int id;		/* uniqueue group id                    */
     unsigned short port;	/* port group listens on                */
     pid_t pid;			/* pid of server for group              */
+    int hfd;			/* master/group client handoff (or -1)  */
     int imembers;		/* number of consoles in this group     */
     CONSENT *pCElist;		/* list of consoles in this group       */
     CONSENT *pCEctl;		/* our control `console'                */
@@ -62,14 +71,27 @@ typedef struct grpent {		/* group info                           */
 
 extern time_t timers[];
 
+extern void TimerNow(struct timeval *);
 extern void Spawn(GRPENT *, int);
+extern void GroupResume(FILE *);
 extern int CheckPass(char *, char *, FLAG);
-extern void TagLogfile(const CONSENT *, char *, ...);
-extern void TagLogfileAct(const CONSENT *, char *, ...);
+extern void TagLogfile(CONSENT *, char *, ...);
+extern void TagLogfileAct(CONSENT *, char *, ...);
+extern void LogFlush(CONSENT *);
+extern CONSFILE *LogOpen(CONSENT *);
+extern LOGSEGS *LogSegments(CONSENT *);
+extern void LogSegmentsDrop(CONSENT *);
+extern void ScrollbackInit(CONSENT *);
 extern void DestroyGroup(GRPENT *);
 extern void DestroyConsent(GRPENT *, CONSENT *);
 extern void SendClientsMsg(CONSENT *, char *);
 extern void ResetMark(void);
+extern void ConsTimerSet(CONSENT *, int, long);
+extern void ConsTimerSetAt(CONSENT *, int, struct timeval *);
+extern void ConsTimerClear(CONSENT *, int);
+extern void ReUpRelease(CONSENT *);
+extern void ConsIdleReset(CONSENT *);
+extern void ConsMarkReset(CONSENT *);
 extern void DestroyConsentUsers(CONSENTUSERS **);
 extern CONSENTUSERS *ConsentFindUser(CONSENTUSERS *, char *);
 extern int ConsentUserOk(CONSENTUSERS *, char *);
@@ -0,0 +1,189 @@
+/*
+ *  Copyright conserver.com, 2000
+ *
+ *  Maintainer/Enhancer: Bryan Stansell (bryan@conserver.com)
+ */
+
+/*
+ * convert console logfiles between the plain and framed formats (see
+ * FileFrames() and the logformat option)
+ */
+
+#include <compat.h>
+
+#include <cutil.h>
+
+#if HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+#if defined(USE_LIBWRAP)
+/* we don't use it...but we link to it */
+int allow_severity;
+int deny_severity;
+#endif
+
+
+SECTION sections[] = {
+    {(char *)0, (void *)0, (void *)0, (void *)0, (void *)0}
+};
+
+void
+DestroyDataStructures()
+{
+}
+
+/* plain logfile in to framed logfile out (with a line index) */
+static int
+Frame(char *in, char *out)
+{
+    CONSFILE *fdIn, *fdOut;
+    char buf[FRAMEMAX];
+    int r;
+
+    if ((fdIn = FileOpen(in, O_RDONLY, 0644)) == (CONSFILE *)0) {
+	Error("open(%s): %s", in, strerror(errno));
+	return 1;
+    }
+    if (FileFrames(fdIn, in, FLAGFALSE) != 0) {
+	Error("%s is already framed", in);
+	return 1;
+    }
+    if ((fdOut =
+	 FileOpen(out, O_RDWR | O_CREAT | O_TRUNC, 0644)) == (CONSFILE *)0)
+    {
+	Error("open(%s): %s", out, strerror(errno));
+	return 1;
+    }
+    if (FileFrames(fdOut, out, FLAGTRUE) != 1)
+	return 1;
+    FileIndexLines(fdOut, out, FLAGTRUE);
+
+    while ((r = FileRead(fdIn, buf, sizeof(buf))) > 0) {
+	FileWrite(fdOut, FLAGTRUE, buf, r);
+	if (FileWrite(fdOut, FLAGFALSE, (char *)0, 0) < 0) {
+	    Error("write(%s) failed", out);
+	    return 1;
+	}
+    }
+    FileClose(&fdOut);
+    FileClose(&fdIn);
+    return 0;
+}
+
+/* framed logfile in to plain logfile out (or stdout).  this is just
+ * reading gzip members one after the other, so it doesn't need (or
+ * trust) the frame index
+ */
+static int
+Unframe(char *in, char *out)
+{
+#if HAVE_ZLIB
+    z_stream zs;
+    char ibuf[8192], obuf[FRAMEMAX];
+    int fdIn, fdOut = 1;
+    int r, n, w, ret = Z_OK;
+
+    if ((fdIn = open(in, O_RDONLY)) < 0) {
+	Error("open(%s): %s", in, strerror(errno));
+	return 1;
+    }
+    if (out != (char *)0 &&
+	(fdOut = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	Error("open(%s): %s", out, strerror(errno));
+	return 1;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+	OutOfMem();
+
+    zs.avail_in = 0;
+    for (;;) {
+	if (zs.avail_in == 0) {
+	    if ((r = read(fdIn, ibuf, sizeof(ibuf))) < 0) {
+		if (errno == EINTR)
+		    continue;
+		Error("read(%s): %s", in, strerror(errno));
+		return 1;
+	    }
+	    if (r == 0)
+		break;
+	    zs.next_in = (Bytef *)ibuf;
+	    zs.avail_in = r;
+	}
+	zs.next_out = (Bytef *)obuf;
+	zs.avail_out = sizeof(obuf);
+	ret = inflate(&zs, Z_NO_FLUSH);
+	if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+	    Error("%s: bad frame at %lu", in, (unsigned long)zs.total_in);
+	    return 1;
+	}
+	for (n = 0; n < sizeof(obuf) - zs.avail_out; n += w) {
+	    if ((w = write(fdOut, obuf + n,
+			   sizeof(obuf) - zs.avail_out - n)) < 0) {
+		if (errno == EINTR) {
+		    w = 0;
+		    continue;
+		}
+		Error("write(%s): %s", (out == (char *)0) ? "stdout" : out,
+		      strerror(errno));
+		return 1;
+	    }
+	}
+	/* and on to the next frame */
+	if (ret == Z_STREAM_END) {
+	    r = zs.avail_in;
+	    inflateReset(&zs);
+	    zs.avail_in = r;
+	}
+    }
+    if (ret != Z_STREAM_END && zs.total_in != 0) {
+	Error("%s: the last frame is unfinished", in);
+	return 1;
+    }
+    if (out != (char *)0 && close(fdOut) != 0) {
+	Error("close(%s): %s", out, strerror(errno));
+	return 1;
+    }
+    return 0;
+#else
+    Error("%s: no zlib support", in);
+    return 1;
+#endif
+}
+
+/* bring the frame index of a framed logfile up to date */
+static int
+Reindex(char *path)
+{
+    CONSFILE *cfp;
+    int r;
+
+    if ((cfp = FileOpen(path, O_RDWR, 0644)) == (CONSFILE *)0) {
+	Error("open(%s): %s", path, strerror(errno));
+	return 1;
+    }
+    if ((r = FileFrames(cfp, path, FLAGTRUE)) == 0)
+	Error("%s isn't framed", path);
+    FileClose(&cfp);
+    return (r == 1) ? 0 : 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    progname = "logconv";
+    fDebug = 0;
+
+    if (argc == 4 && strcmp(argv[1], "-f") == 0)
+	return Frame(argv[2], argv[3]);
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "-p") == 0)
+	return Unframe(argv[2], (argc == 4) ? argv[3] : (char *)0);
+    if (argc == 3 && strcmp(argv[1], "-i") == 0)
+	return Reindex(argv[2]);
+
+    Error("Usage: logconv -f plain-logfile framed-logfile");
+    Error("       logconv -p framed-logfile [plain-logfile]");
+    Error("       logconv -i framed-logfile");
+    return 1;
+}
@@ -51,6 +51,7 @@ int fAll = 0, fNoinit = 0, fVersion = 0, fStrip = 0, fReopen =
     0, fNoautoreup = 0, fSyntaxOnly = 0;
 
 char *pcConfig = CONFIGFILE;
+char *pcSnapshot = (char *)0;
 int cMaxMemb = MAXMEMB;
 #if USE_IPV6
 struct addrinfo *bindAddr;
@@ -62,13 +63,24 @@ unsigned short bindBasePort;
 struct sockaddr_in in_port;
 #endif
 static STRING *startedMsg = (STRING *)0;
+/* how we were started, so an upgrade can exec us the same way */
+static char **upgradeArgv = (char **)0;
+#define UPGRADEENV	"CONSERVER_UPGRADE"
+/* the first line of the upgrade state, which names the layout of the
+ * rest and every descriptor that came along with it.  bump the format
+ * whenever what GroupUpgrade() or MasterUpgrade() write changes
+ */
+#define UPGRADEMAGIC	"conserver-upgrade"
+#define UPGRADEFORMAT	1
+static int *upgradeFds = (int *)0;	/* what ReExec() hands on */
+static int upgradeCount = 0, upgradeSize = 0;
 CONFIG *optConf = (CONFIG *)0;
 CONFIG *config = (CONFIG *)0;
 char *interface = (char *)0;
 CONFIG defConfig =
     { (STRING *)0, FLAGTRUE, 'r', FLAGFALSE, LOGFILEPATH, PASSWDFILE,
     DEFPORT,
-    FLAGTRUE, FLAGTRUE, 0, DEFBASEPORT, (char *)0, 0
+    FLAGTRUE, FLAGTRUE, 0, DEFBASEPORT, (char *)0, 0, 0
 #if HAVE_SETPROCTITLE
 	, FLAGFALSE
 #endif
@@ -572,7 +584,7 @@ static void
 Usage(int wantfull)
 {
     static char u_terse[] =
-	"[-7dDEFhinoRSuvV] [-a type] [-m max] [-M master] [-p port] [-b port] [-c cred] [-C config] [-P passwd] [-L logfile] [-O min] [-U logfile]";
+	"[-7dDEFhinoRSuvV] [-a type] [-m max] [-M master] [-p port] [-b port] [-c cred] [-C config] [-k snapshot] [-P passwd] [-L logfile] [-O min] [-U logfile]";
     static char *full[] = {
 	"7          strip the high bit off all console data",
 	"a type     set the default access type",
@@ -593,6 +605,7 @@ Usage(int wantfull)
 	"F          do not automatically reinitialize failed consoles",
 	"h          output this message",
 	"i          initialize console connections on demand",
+	"k snapshot use (and keep up to date) a configuration snapshot",
 	"L logfile  give a new logfile path to the server process",
 	"m max      maximum consoles managed per process",
 #if USE_UNIX_DOMAIN_SOCKETS
@@ -747,12 +760,14 @@ DestroyDataStructures(void)
 	DestroyRemoteConsole(pRCList);
 	pRCList = pRC;
     }
+    NameIndexDrop();
 
     while (pACList != (ACCESS *)0) {
 	pAC = pACList->pACnext;
 	DestroyAccessList(pACList);
 	pACList = pAC;
     }
+    AccessCompile();
     DestroyConsentUsers(&pADList);
     DestroyConsentUsers(&pLUList);
 
@@ -835,6 +850,8 @@ SummarizeDataStructures(void)
 		size += strlen(pCE->execSlave);
 	    if (pCE->motd != (char *)0)
 		size += strlen(pCE->motd);
+	    if (pCE->logcompress != (char *)0)
+		size += strlen(pCE->logcompress);
 	    if (pCE->idlestring != (char *)0)
 		size += strlen(pCE->idlestring);
 	    if (pCE->replstring != (char *)0)
@@ -1057,8 +1074,10 @@ DumpDataStructures(void)
 	    CONDDEBUG((1,
 		       "DumpDataStructures():  reinitoncc=%s, striphigh=%s",
 		       FLAGSTR(pCE->reinitoncc), FLAGSTR(pCE->striphigh)));
-	    CONDDEBUG((1, "DumpDataStructures():  unloved=%s, login=%s",
-		       FLAGSTR(pCE->unloved), FLAGSTR(pCE->login)));
+	    CONDDEBUG((1,
+		       "DumpDataStructures():  unloved=%s, login=%s, logindex=%s",
+		       FLAGSTR(pCE->unloved), FLAGSTR(pCE->login),
+		       FLAGSTR(pCE->logindex)));
 	    CONDDEBUG((1,
 		       "DumpDataStructures():  initpid=%lu, initcmd=%s, initfile=%d",
 		       (unsigned long)pCE->initpid, EMPTYSTR(pCE->initcmd),
@@ -1066,10 +1085,31 @@ DumpDataStructures(void)
 	    CONDDEBUG((1, "DumpDataStructures():  inituid=%d, initgid=%d",
 		       pCE->inituid, pCE->initgid));
 	    CONDDEBUG((1,
-		       "DumpDataStructures():  motd=%s, idletimeout=%d, idlestring=%s, replstring=%s",
+		       "DumpDataStructures():  motd=%s, idletimeout=%ldms, idlestring=%s, replstring=%s",
 		       EMPTYSTR(pCE->motd), pCE->idletimeout,
 		       EMPTYSTR(pCE->idlestring),
 		       EMPTYSTR(pCE->replstring)));
+	    CONDDEBUG((1,
+		       "DumpDataStructures():  outputlimit=%d, outputpolicy=%d, fstalled=%hu",
+		       pCE->outputlimit, pCE->outputpolicy, pCE->fstalled));
+	    CONDDEBUG((1,
+		       "DumpDataStructures():  logbuffer=%d, logflush=%ldms, loglines=%d, logsync=%ldms, logpending=%d",
+		       pCE->logbuffer, pCE->logflush, pCE->loglines,
+		       pCE->logsync, pCE->logpending));
+	    CONDDEBUG((1,
+		       "DumpDataStructures():  logfilemax=%ld, logfilekeep=%d, logfileage=%lds, logcompress=%s, logsize=%ld, logformat=%d",
+		       (long)pCE->logfilemax, pCE->logfilekeep,
+		       pCE->logfileage, EMPTYSTR(pCE->logcompress),
+		       (long)pCE->logsize, pCE->logformat));
+	    CONDDEBUG((1,
+		       "DumpDataStructures():  outskipped=%lu, outdisconnects=%lu, outstalls=%lu",
+		       pCE->outskipped, pCE->outdisconnects,
+		       pCE->outstalls));
+	    CONDDEBUG((1,
+		       "DumpDataStructures():  scrollback=%d, sb.used=%d, sb.wrapped=%d",
+		       pCE->scrollback,
+		       pCE->sb == (SCROLLBACK *)0 ? 0 : pCE->sb->used,
+		       pCE->sb == (SCROLLBACK *)0 ? 0 : pCE->sb->wrapped));
 	    CONDDEBUG((1,
 		       "DumpDataStructures():  tasklist=%s, breaklist=%s, taskpid=%lu, taskfile=%d",
 		       EMPTYSTR(pCE->tasklist), EMPTYSTR(pCE->breaklist),
@@ -1208,6 +1248,202 @@ VerifyEmptyDirectory(char *d)
 }
 #endif
 
+/* keep fd open across the coming ReExec() (and list it in the state, so
+ * a copy of us that can't make sense of the rest can still close it)
+ */
+void
+UpgradePass(int fd)
+{
+    if (fd < 0)
+	return;
+    if (upgradeCount == upgradeSize) {
+	upgradeSize += 16;
+	if ((upgradeFds =
+	     (int *)realloc(upgradeFds,
+			    upgradeSize * sizeof(int))) == (int *)0)
+	    OutOfMem();
+    }
+    upgradeFds[upgradeCount++] = fd;
+    fcntl(fd, F_SETFD, 0);
+}
+
+/* replace ourselves with a fresh copy of the binary, handing it the
+ * state saved in fp (see UpgradeState()) and the descriptors given to
+ * UpgradePass().  kind says who's upgrading ("group" or "master").  if
+ * we come back at all, the exec failed, the descriptors are closed on
+ * exec again, and we just keep running as we were
+ */
+void
+ReExec(char *kind, FILE *fp)
+{
+    extern char **environ;
+    char **oldenv = environ;
+    char **env;
+    static STRING *var = (STRING *)0;
+    FILE *state;
+    char buf[BUFSIZ];
+    size_t n;
+    int i, j;
+
+    if (fflush(fp) != 0 || ferror(fp)) {
+	Error("ReExec(): can't write state: %s", strerror(errno));
+	goto failed;
+    }
+    if ((state = tmpfile()) == (FILE *)0) {
+	Error("ReExec(): tmpfile(): %s", strerror(errno));
+	goto failed;
+    }
+    fprintf(state, "%s %d %s %d", UPGRADEMAGIC, UPGRADEFORMAT, kind,
+	    upgradeCount);
+    for (i = 0; i < upgradeCount; i++)
+	fprintf(state, " %d", upgradeFds[i]);
+    fputc('\n', state);
+    rewind(fp);
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+	fwrite(buf, 1, n, state);
+    if (ferror(fp) || fflush(state) != 0 || ferror(state)) {
+	Error("ReExec(): can't write state: %s", strerror(errno));
+	fclose(state);
+	goto failed;
+    }
+
+    if (var == (STRING *)0)
+	var = AllocString();
+    BuildStringPrint(var, "%s=%d", UPGRADEENV, fileno(state));
+
+    for (i = 0; oldenv[i] != (char *)0; i++);
+    if ((env = (char **)calloc(i + 2, sizeof(char *))) == (char **)0)
+	OutOfMem();
+    env[0] = var->string;
+    for (i = 0, j = 1; oldenv[i] != (char *)0; i++)
+	if (strncmp(oldenv[i], UPGRADEENV "=", sizeof(UPGRADEENV)) != 0)
+	    env[j++] = oldenv[i];
+
+    rewind(state);
+    fcntl(fileno(state), F_SETFD, 0);
+    fflush(stdout);
+    fflush(stderr);
+
+    environ = env;
+    execvp(upgradeArgv[0], upgradeArgv);
+    environ = oldenv;
+    free(env);
+    fclose(state);
+    Error("ReExec(): execvp(%s): %s", upgradeArgv[0], strerror(errno));
+
+  failed:
+    for (i = 0; i < upgradeCount; i++)
+	fcntl(upgradeFds[i], F_SETFD, FD_CLOEXEC);
+    upgradeCount = 0;
+}
+
+/* give up on the upgrade state in fp: close every descriptor its first
+ * line says came with it (other than keep1 and keep2, which the caller
+ * is still using), so none of them are left holding a console or a
+ * port open, and the caller can start over
+ */
+void
+UpgradeAbandon(FILE *fp, int keep1, int keep2)
+{
+    char magic[32], kind[8];
+    int format, count, fd;
+
+    rewind(fp);
+    if (fscanf(fp, "%31s %d %7s %d", magic, &format, kind, &count) == 4 &&
+	strcmp(magic, UPGRADEMAGIC) == 0)
+	while (count-- > 0 && fscanf(fp, "%d", &fd) == 1)
+	    if (fd > 2 && fd != keep1 && fd != keep2 && fd != fileno(fp))
+		close(fd);
+    fclose(fp);
+}
+
+/* the absolute path of the binary at path (relative to where we are
+ * now), for ReExec().  symlinks aren't resolved, so one that's been
+ * pointed at a new binary by the time of an upgrade gets followed then.
+ */
+static char *
+UpgradePath(char *path)
+{
+    static STRING *full = (STRING *)0;
+    char *cwd = (char *)0;
+    size_t len = 256;
+
+    if (path[0] == '/' || strchr(path, '/') == (char *)0)
+	return StrDup(path);	/* absolute, or searched for in PATH */
+    for (;;) {
+	if ((cwd = (char *)malloc(len)) == (char *)0)
+	    OutOfMem();
+	if (getcwd(cwd, len) != (char *)0)
+	    break;
+	free(cwd);
+	if (errno != ERANGE) {
+	    Error("getcwd(): %s", strerror(errno));
+	    return StrDup(path);
+	}
+	len *= 2;
+    }
+    if (full == (STRING *)0)
+	full = AllocString();
+    BuildString((char *)0, full);
+    while (path[0] == '.' && path[1] == '/')
+	path += 2;
+    BuildStringPrint(full, "%s/%s", strcmp(cwd, "/") == 0 ? "" : cwd,
+		     path);
+    free(cwd);
+    return StrDup(full->string);
+}
+
+/* if ReExec() started us, pick up the state it left behind (and keep it
+ * out of anything we exec).  kind is set to who left it.  state in a
+ * format we don't know is thrown away (see UpgradeAbandon()) - a group
+ * just goes, and the master respawns it, while the master itself starts
+ * over as if it hadn't been upgraded at all (and so returns (FILE *)0)
+ */
+static FILE *
+UpgradeState(char *kind)
+{
+    extern char **environ;
+    char *pcEnv;
+    char magic[32];
+    FILE *fp;
+    int fd, i, j, format, count;
+
+    if ((pcEnv = getenv(UPGRADEENV)) == (char *)0)
+	return (FILE *)0;
+    fd = atoi(pcEnv);
+    for (i = j = 0; environ[i] != (char *)0; i++)
+	if (strncmp(environ[i], UPGRADEENV "=", sizeof(UPGRADEENV)) != 0)
+	    environ[j++] = environ[i];
+    environ[j] = (char *)0;
+
+    if ((fp = fdopen(fd, "r")) == (FILE *)0) {
+	Error("fdopen(%d): %s", fd, strerror(errno));
+	Bye(EX_OSERR);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (fscanf(fp, "%31s %d %7s %d", magic, &format, kind, &count) != 4 ||
+	strcmp(magic, UPGRADEMAGIC) != 0 ||
+	(strcmp(kind, "group") != 0 && strcmp(kind, "master") != 0)) {
+	Error("unusable upgrade state");
+	Bye(EX_SOFTWARE);
+    }
+    if (format != UPGRADEFORMAT) {
+	Error("upgrade state is format %d, not %d: starting over", format,
+	      UPGRADEFORMAT);
+	UpgradeAbandon(fp, -1, -1);
+	if (strcmp(kind, "group") == 0)
+	    Bye(EX_TEMPFAIL);
+	return (FILE *)0;
+    }
+    while (count-- > 0)
+	if (fscanf(fp, "%d", &fd) != 1) {
+	    Error("unusable upgrade state");
+	    Bye(EX_SOFTWARE);
+	}
+    Msg("upgraded");
+    return fp;
+}
+
 /* find out where/who we are						(ksb)
  * parse optons
  * read in the config file, open the log file
@@ -1221,7 +1457,9 @@ main(int argc, char **argv)
 {
     int i;
     FILE *fpConfig = (FILE *)0;
-    static char acOpts[] = "7a:b:c:C:dDEFhiL:m:M:noO:p:P:RSuU:Vv";
+    FILE *fpUpgrade = (FILE *)0;
+    char kind[8];
+    static char acOpts[] = "7a:b:c:C:dDEFhik:L:m:M:noO:p:P:RSuU:Vv";
     extern int optopt;
     extern char *optarg;
     struct passwd *pwd;
@@ -1249,6 +1487,16 @@ main(int argc, char **argv)
 	++progname;
     }
 
+    if ((upgradeArgv = (char **)calloc(argc + 1, sizeof(char *)))
+	== (char **)0)
+	OutOfMem();
+    /* pinned down now, in case we've moved by the time of an upgrade */
+    for (i = 0; i < argc; i++)
+	if ((upgradeArgv[i] =
+	     (i == 0) ? UpgradePath(argv[i]) : StrDup(argv[i])) ==
+	    (char *)0)
+	    OutOfMem();
+
     setpwent();
 
     /* if we read from stdin (by accident) we don't wanna block.
@@ -1333,6 +1581,9 @@ main(int argc, char **argv)
 	    case 'i':
 		fNoinit = 1;
 		break;
+	    case 'k':
+		pcSnapshot = optarg;
+		break;
 	    case 'L':
 		if ((optConf->logfile = StrDup(optarg)) == (char *)0)
 		    OutOfMem();
@@ -1451,6 +1702,9 @@ main(int argc, char **argv)
     for (i = 0; i < T_MAX; i++)
 	timers[i] = (time_t)0;
 
+    /* are we picking up where an older copy of us left off? */
+    fpUpgrade = UpgradeState(kind);
+
     /* read the config file */
     if ((FILE *)0 == (fpConfig = fopen(pcConfig, "r"))) {
 	Error("fopen(%s): %s", pcConfig, strerror(errno));
@@ -1661,6 +1915,13 @@ main(int argc, char **argv)
     else
 	config->initdelay = defConfig.initdelay;
 
+    if (optConf->passwdcache != 0)
+	config->passwdcache = optConf->passwdcache;
+    else if (pConfig->passwdcache != 0)
+	config->passwdcache = pConfig->passwdcache;
+    else
+	config->passwdcache = defConfig.passwdcache;
+
 #if HAVE_OPENSSL
     if (optConf->sslrequired != FLAGUNKNOWN)
 	config->sslrequired = optConf->sslrequired;
@@ -1712,7 +1973,8 @@ main(int argc, char **argv)
     } else if (fSyntaxOnly) {
 	/* short-circuit */
 #if USE_UNIX_DOMAIN_SOCKETS
-    } else if (VerifyEmptyDirectory(interface) == -1) {
+    } else if (fpUpgrade == (FILE *)0 &&
+	       VerifyEmptyDirectory(interface) == -1) {
 	Error("Master(): %s: unusable socket directory", interface);
 #endif
     } else {
@@ -1724,8 +1986,13 @@ main(int argc, char **argv)
 	SetupGSSAPI();
 #endif
 
-	if (config->daemonmode == FLAGTRUE)
-	    Daemonize();
+	/* an upgrade is already detached, it just needs the logfile */
+	if (config->daemonmode == FLAGTRUE) {
+	    if (fpUpgrade == (FILE *)0)
+		Daemonize();
+	    else
+		ReopenLogfile();
+	}
 
 	ReopenUnifiedlog();
 
@@ -1738,15 +2005,24 @@ main(int argc, char **argv)
 	    SetDefAccess(myAddrs, myHostname);
 #endif
 
-	/* spawn all the children, so fix kids has an initial pid
+	/* spawn all the children, so fix kids has an initial pid (or,
+	 * after an upgrade, take back the ones we already had - a group
+	 * never comes back from GroupResume())
 	 */
-	for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext) {
-	    if (pGE->imembers == 0)
-		continue;
+	if (fpUpgrade != (FILE *)0) {
+	    if (strcmp(kind, "group") == 0)
+		GroupResume(fpUpgrade);
+	    else
+		MasterResume(fpUpgrade);
+	} else {
+	    for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext) {
+		if (pGE->imembers == 0)
+		    continue;
 
-	    Spawn(pGE, -1);
-	    Verbose("group #%d pid %lu on port %hu", pGE->id,
-		    (unsigned long)pGE->pid, pGE->port);
+		Spawn(pGE, -1);
+		Verbose("group #%d pid %lu on port %hu", pGE->id,
+			(unsigned long)pGE->pid, pGE->port);
+	    }
 	}
 
 #if HAVE_SETPROCTITLE
@@ -45,6 +45,7 @@ extern struct sockaddr_in in_port;
 #endif
 extern unsigned short bindPort, bindBasePort;
 extern char *pcConfig;
+extern char *pcSnapshot;
 extern int cMaxMemb;
 extern CONFIG *optConf;
 extern CONFIG *config;
@@ -63,3 +64,6 @@ extern gss_cred_id_t gss_mycreds;
 extern void ReopenLogfile(void);
 extern void ReopenUnifiedlog(void);
 extern void DumpDataStructures(void);
+extern void UpgradePass(int);
+extern void ReExec(char *, FILE *);
+extern void UpgradeAbandon(FILE *, int, int);
@@ -35,12 +35,27 @@
 #include <master.h>
 #include <readcfg.h>
 #include <main.h>
+#include <resolve.h>
 
 
 static sig_atomic_t fSawQuit = 0, fSawHUP = 0, fSawUSR2 = 0, fSawUSR1 =
     0, fSawCHLD = 0;
+/* an upgrade was asked for (at tUpgrade), or we are one (see
+ * MasterResume())
+ */
+static int fSawUpgrade = 0, msfdResumed = -1;
+static time_t tUpgrade = (time_t)0;
+
+/* how long an upgrade waits for master clients to finish up */
+#define UPGRADEWAIT	5
 CONSCLIENT *pCLmfree = (CONSCLIENT *)0;
 CONSCLIENT *pCLmall = (CONSCLIENT *)0;
+/* clients with I/O to do on this pass through Master() */
+static CONSCLIENT *pCLpend = (CONSCLIENT *)0;
+
+/* most connections we'll accept() per wakeup */
+#define MAXACCEPTBATCH	64
+
 #if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
 static unsigned long dmallocMarkClientConnection = 0;
 #endif
@@ -192,43 +207,117 @@ SignalKids(int arg)
 REMOTE *
 FindRemoteConsole(char *args)
 {
-    REMOTE *pRC;
-    NAMES *name;
-
-    for (pRC = pRCList; (REMOTE *)0 != pRC; pRC = pRC->pRCnext) {
-	if (strcasecmp(args, pRC->rserver) == 0)
-	    return pRC;
-	for (name = pRC->aliases; name != (NAMES *)0; name = name->next) {
-	    if (strcasecmp(args, name->name) == 0)
-		return pRC;
-	}
+    NAMEREF **refs;
+    int i, n;
+
+    n = FindConsoleRefs(args, FLAGFALSE, &refs);
+    for (i = 0; i < n; i++) {
+	if (refs[i]->pRC != (REMOTE *)0)
+	    return refs[i]->pRC;
     }
-    return pRC;
+    return (REMOTE *)0;
 }
 
-void
-CommandCall(CONSCLIENT *pCL, char *args)
+#if defined(SCM_RIGHTS)
+/* pass pCL's connection on to the group serving the console it wants,
+ * so the client doesn't need a second connection (and login) to get
+ * there.  the group is told who it is along with the fd (see
+ * KiddieHandOff() in group.c).  returns 0 if the group has it now,
+ * -1 if the client should be sent the port instead.  ssl state can't
+ * be passed along, so encrypted clients always get the port.
+ */
+static int
+HandOff(CONSCLIENT *pCL, GRPENT *pGE, char *args)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+	struct cmsghdr cm;
+	char space[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *cmp;
+    char buf[HANDOFFMAX];
+    int len, fd;
+
+    if (pGE->hfd == -1 || pGE->pid == -1 ||
+	FileGetType(pCL->fd) != simpleSocket || !FileBufEmpty(pCL->fd))
+	return -1;
+
+    len = snprintf(buf, sizeof(buf), "%c%c\n%s\n%s\n%s\n%s",
+		   pCL->caccess, pCL->fpeerwait ? 'w' : '-',
+		   pCL->username->string, pCL->acid->string,
+		   pCL->peername->string, args);
+    if (len < 0 || len >= sizeof(buf))
+	return -1;
+
+    fd = FileFDNum(pCL->fd);
+# if HAVE_MEMSET
+    memset((void *)&msg, 0, sizeof(msg));
+    memset((void *)&ctl, 0, sizeof(ctl));
+# else
+    bzero((char *)&msg, sizeof(msg));
+    bzero((char *)&ctl, sizeof(ctl));
+# endif
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    cmp = CMSG_FIRSTHDR(&msg);
+    cmp->cmsg_level = SOL_SOCKET;
+    cmp->cmsg_type = SCM_RIGHTS;
+    cmp->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmp), &fd, sizeof(int));
+
+    if (sendmsg(pGE->hfd, &msg, 0) != len) {
+	CONDDEBUG((1, "HandOff(): sendmsg(group #%u): %s", pGE->id,
+		   strerror(errno)));
+	return -1;
+    }
+
+    /* it's the group's now - just let go of our copy (no shutdown) */
+    Verbose("<master> handoff %s to group #%u", pCL->acid->string,
+	    pGE->id);
+    fd = FileUnopen(pCL->fd);
+    pCL->fd = (CONSFILE *)0;
+    close(fd);
+    return 0;
+}
+#endif
+
+/* tell the client where a console is.  if attach is set and the
+ * console is ours, hand the client to its group instead and return 1
+ * (pCL is done with then), otherwise 0.
+ */
+int
+CommandCall(CONSCLIENT *pCL, char *args, FLAG attach)
 {
     int found;
     REMOTE *pRC, *pRCFound;
     unsigned short prnum = 0;
     char *ambiguous = (char *)0;
-    CONSENT *pCE;
-    GRPENT *pGE;
+    GRPENT *pGE, *pGEFound = (GRPENT *)0;
+    NAMEREF **refs;
+    int i, n;
 
     found = 0;
     pRCFound = (REMOTE *)0;
     ambiguous = BuildTmpString((char *)0);
-    /* look for a local machine */
-    for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext) {
-	if (pGE->imembers == 0)
+    /* look for a local machine - the first match in each group counts
+     * (the matches come back in configuration order, so a group's are
+     * all together)
+     */
+    n = FindConsoleRefs(args, FLAGFALSE, &refs);
+    for (pGE = (GRPENT *)0, i = 0; i < n; i++) {
+	if (refs[i]->pCE == (CONSENT *)0 || refs[i]->pGE == pGE)
 	    continue;
-	if ((pCE = FindConsoleName(pGE->pCElist, args)) != (CONSENT *)0) {
-	    prnum = pGE->port;
-	    ambiguous = BuildTmpString(pCE->server);
-	    ambiguous = BuildTmpString(", ");
-	    ++found;
-	}
+	pGE = refs[i]->pGE;
+	prnum = pGE->port;
+	pGEFound = pGE;
+	ambiguous = BuildTmpString(refs[i]->pCE->server);
+	ambiguous = BuildTmpString(", ");
+	++found;
     }
     if (config->redirect == FLAGTRUE ||
 	(config->redirect != FLAGTRUE && found == 0)) {
@@ -240,61 +329,34 @@ CommandCall(CONSCLIENT *pCL, char *args)
 	}
     }
     if (found == 0 && config->autocomplete == FLAGTRUE) {
-	/* Then look for substring matches */
-	NAMES *name = (NAMES *)0;
-	int foundOne = 0;
-	for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext) {
-	    if (0 == pGE->imembers)
-		continue;
-	    for (pCE = pGE->pCElist; pCE != (CONSENT *)0;
-		 pCE = pCE->pCEnext) {
-		foundOne = 0;
-		if (strncasecmp(args, pCE->server, strlen(args)) == 0) {
-		    prnum = pGE->port;
-		    ambiguous = BuildTmpString(pCE->server);
-		    ambiguous = BuildTmpString(", ");
-		    ++foundOne;
-		}
-		for (name = pCE->aliases; name != (NAMES *)0;
-		     name = name->next) {
-		    if (strncasecmp(args, name->name, strlen(args))
-			!= 0)
-			continue;
-		    prnum = pGE->port;
-		    ambiguous = BuildTmpString(name->name);
-		    ambiguous = BuildTmpString(", ");
-		    ++foundOne;
-		}
-		if (foundOne)
-		    ++found;
+	/* Then look for substring matches - each console with a
+	 * matching name or alias counts once, but all the names
+	 * are listed
+	 */
+	CONSENT *pCE = (CONSENT *)0;
+	n = FindConsoleRefs(args, FLAGTRUE, &refs);
+	for (i = 0; i < n && refs[i]->pCE != (CONSENT *)0; i++) {
+	    if (refs[i]->pCE != pCE) {
+		pCE = refs[i]->pCE;
+		++found;
 	    }
+	    prnum = refs[i]->pGE->port;
+	    pGEFound = refs[i]->pGE;
+	    ambiguous = BuildTmpString(refs[i]->name);
+	    ambiguous = BuildTmpString(", ");
 	}
 	/* look for a remote server if redirect is enabled or if
 	 * redirect is not enabled and we haven't found a unique
 	 * console match */
 	if (config->redirect == FLAGTRUE ||
 	    (config->redirect != FLAGTRUE && found != 1)) {
-	    for (pRC = pRCList; (REMOTE *)0 != pRC; pRC = pRC->pRCnext) {
-		foundOne = 0;
-		if (strncasecmp(args, pRC->rserver, strlen(args))
-		    == 0) {
-		    pRCFound = pRC;
-		    ambiguous = BuildTmpString(pRC->rserver);
-		    ambiguous = BuildTmpString(", ");
-		    ++foundOne;
-		}
-		for (name = pRC->aliases; name != (NAMES *)0;
-		     name = name->next) {
-		    if (strncasecmp(args, name->name, strlen(args))
-			!= 0)
-			continue;
-		    pRCFound = pRC;
-		    ambiguous = BuildTmpString(name->name);
-		    ambiguous = BuildTmpString(", ");
-		    ++foundOne;
-		}
-		if (foundOne)
+	    for (; i < n; i++) {
+		if (refs[i]->pRC != pRCFound) {
+		    pRCFound = refs[i]->pRC;
 		    ++found;
+		}
+		ambiguous = BuildTmpString(refs[i]->name);
+		ambiguous = BuildTmpString(", ");
 	    }
 	}
     }
@@ -314,6 +376,13 @@ CommandCall(CONSCLIENT *pCL, char *args)
 			      pRCFound->rhost);
 		}
 	    } else {
+#if defined(SCM_RIGHTS)
+		if (attach == FLAGTRUE &&
+		    HandOff(pCL, pGEFound, args) == 0) {
+		    BuildTmpString((char *)0);
+		    return 1;
+		}
+#endif
 		FilePrint(pCL->fd, FLAGFALSE, "%hu\r\n", prnum);
 	    }
 	    break;
@@ -327,6 +396,7 @@ CommandCall(CONSCLIENT *pCL, char *args)
     }
     BuildTmpString((char *)0);	/* we're done - clean up */
     ambiguous = (char *)0;
+    return 0;
 }
 
 void
@@ -340,12 +410,11 @@ DropMasterClient(CONSCLIENT *pCLServing, FLAG force)
 	return;
     }
 
-    if (pCLServing->iState == S_NORMAL)
+    /* (no fd means it went to a group - see HandOff()) */
+    if (pCLServing->iState == S_NORMAL && pCLServing->fd != (CONSFILE *)0)
 	Verbose("<master> logout %s", pCLServing->acid->string);
 
     /* drop a connection */
-    FD_CLR(FileFDNum(pCLServing->fd), &rinit);
-    FD_CLR(FileFDNum(pCLServing->fd), &winit);
     FileClose(&pCLServing->fd);
     pCLServing->ioState = ISDISCONNECTED;
 
@@ -437,6 +506,7 @@ DoNormalRead(CONSCLIENT *pCLServing)
 		    (char *)0
 		};
 		static char *apcHelp2[] = {
+		    "attach     connect to given console (or provide its port)\r\n",
 		    "call       provide port for given console\r\n",
 		    "exit       disconnect\r\n",
 		    "groups     provide ports for group leaders\r\n",
@@ -449,6 +519,7 @@ DoNormalRead(CONSCLIENT *pCLServing)
 		    "reconfig*  reread config file (SIGHUP)\r\n",
 		    "version    provide version info for server\r\n",
 		    "up*        bring up all downed consoles (SIGUSR1)\r\n",
+		    "upgrade*   re-exec conserver, keeping consoles and clients\r\n",
 		    "* = requires admin privileges\r\n",
 		    (char *)0
 		};
@@ -618,6 +689,29 @@ DoNormalRead(CONSCLIENT *pCLServing)
 		} else
 		    FileWrite(pCLServing->fd, FLAGFALSE,
 			      "unauthorized command\r\n", -1);
+	    } else if (pCLServing->iState == S_NORMAL &&
+		       strcmp(pcCmd, "upgrade") == 0) {
+		if (ConsentUserOk(pADList, pCLServing->username->string) !=
+		    1)
+		    FileWrite(pCLServing->fd, FLAGFALSE,
+			      "unauthorized command\r\n", -1);
+		else if (UpgradeLayoutSame() != 1) {
+		    /* the upgraded groups would each let go of consoles
+		     * that a fresh read puts somewhere else
+		     */
+		    FileWrite(pCLServing->fd, FLAGFALSE,
+			      "consoles would change groups -- restart instead\r\n",
+			      -1);
+		    Msg("upgrade command by %s refused: consoles would change groups",
+			pCLServing->acid->string);
+		} else {
+		    FileWrite(pCLServing->fd, FLAGFALSE,
+			      "ok -- upgrading\r\n", -1);
+		    Verbose("upgrade command by %s",
+			    pCLServing->acid->string);
+		    fSawUpgrade = 1;
+		    tUpgrade = time((time_t *)0);
+		}
 	    } else if (pCLServing->iState == S_NORMAL &&
 		       strcmp(pcCmd, "up") == 0) {
 		if (ConsentUserOk(pADList, pCLServing->username->string) ==
@@ -657,12 +751,19 @@ DoNormalRead(CONSCLIENT *pCLServing)
 		}
 		FileWrite(pCLServing->fd, FLAGFALSE, "\r\n", 2);
 	    } else if (pCLServing->iState == S_NORMAL &&
-		       strcmp(pcCmd, "call") == 0) {
+		       (strcmp(pcCmd, "call") == 0 ||
+			strcmp(pcCmd, "attach") == 0)) {
 		if (pcArgs == (char *)0)
-		    FileWrite(pCLServing->fd, FLAGFALSE,
-			      "call requires argument\r\n", -1);
-		else
-		    CommandCall(pCLServing, pcArgs);
+		    FilePrint(pCLServing->fd, FLAGFALSE,
+			      "%s requires argument\r\n", pcCmd);
+		else if (CommandCall(pCLServing, pcArgs,
+				     (pcCmd[0] == 'a' && i + 1 == nr) ?
+				     FLAGTRUE : FLAGFALSE)) {
+		    /* the group has it (and nothing was left unread) */
+		    BuildString((char *)0, pCLServing->accmd);
+		    DropMasterClient(pCLServing, FLAGTRUE);
+		    return;
+		}
 	    } else {
 		FileWrite(pCLServing->fd, FLAGFALSE, "unknown command\r\n",
 			  -1);
@@ -676,13 +777,322 @@ DoNormalRead(CONSCLIENT *pCLServing)
 
 /* this routine is used by the master console server process		(ksb)
  */
+/* do whatever I/O the last FDWait() says a client is ready for */
+static void
+DoMasterClientIO(CONSCLIENT *pCLServing)
+{
+    switch (pCLServing->ioState) {
+#if HAVE_OPENSSL
+	case INSSLACCEPT:
+	    if (FileCanSSLAccept(pCLServing->fd)) {
+		int r;
+		if ((r = FileSSLAccept(pCLServing->fd)) < 0)
+		    DropMasterClient(pCLServing, FLAGFALSE);
+		else if (r == 1)
+		    pCLServing->ioState = ISNORMAL;
+	    }
+	    break;
+#endif
+#if HAVE_GSSAPI
+	case INGSSACCEPT:
+	    {
+		int r;
+		if ((r = AttemptGSSAPI(pCLServing)) < 0)
+		    DropMasterClient(pCLServing, FLAGFALSE);
+		else if (r == 1)
+		    pCLServing->ioState = ISNORMAL;
+	    }
+	    break;
+#endif
+	case INRESOLVE:
+	    /* still not listening (see MasterClientAccess()) */
+	    FDUnwatch(FileFDNum(pCLServing->fd), FDWATCH_READ);
+	    break;
+	case ISNORMAL:
+	    if (FileCanRead(pCLServing->fd))
+		DoNormalRead(pCLServing);
+	    /* a client handed to a group is already gone */
+	    if (pCLServing->fd == (CONSFILE *)0)
+		break;
+	    /* fall through to ISFLUSHING for buffered data */
+	case ISFLUSHING:
+	    if (!FileBufEmpty(pCLServing->fd) &&
+		FileCanWrite(pCLServing->fd)) {
+		CONDDEBUG((1, "Master(): flushing fd %d",
+			   FileFDNum(pCLServing->fd)));
+		if (FileWrite(pCLServing->fd, FLAGFALSE, (char *)0, 0) < 0) {
+		    DropMasterClient(pCLServing, FLAGTRUE);
+		    break;
+		}
+	    }
+	    if ((pCLServing->ioState == ISFLUSHING) &&
+		FileBufEmpty(pCLServing->fd))
+		DropMasterClient(pCLServing, FLAGFALSE);
+	    break;
+	default:
+	    /* this really can't ever happen */
+	    Error("Master(): client socket state == %d -- THIS IS A BUG",
+		  pCLServing->ioState);
+	    DropMasterClient(pCLServing, FLAGFALSE);
+	    break;
+    }
+}
+
+/* let a new client in (or not), unless ClientAccessOk() has to wait
+ * on the resolver - then we don't listen to it until we know
+ */
+static void
+MasterClientAccess(CONSCLIENT *pCL)
+{
+    switch (ClientAccessOk(pCL)) {
+	case 1:
+	    pCL->ioState = ISNORMAL;
+	    FDWatch(FileFDNum(pCL->fd), FDWATCH_READ);
+	    /* say hi to start */
+	    FileWrite(pCL->fd, FLAGFALSE, "ok\r\n", 4);
+	    break;
+	case 0:
+	    DropMasterClient(pCL, FLAGFALSE);
+	    break;
+	default:
+	    pCL->ioState = INRESOLVE;
+	    FDUnwatch(FileFDNum(pCL->fd), FDWATCH_READ);
+	    break;
+    }
+}
+
+/* accept one new connection on msfd and get it going.
+ * returns 1 if we pulled a connection off the queue (even if we
+ * turned it away), 0 if there was nothing there, -1 on error.
+ */
+static int
+AcceptMasterClient(int msfd)
+{
+    int cfd;
+    socklen_t so;
+    CONSCLIENT *pCL;
+
+#if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
+    dmallocMarkClientConnection = dmalloc_mark();
+#endif
+
+    do {
+	so = sizeof(pCLmfree->cnct_port);
+#if HAVE_ACCEPT4
+	/* saves the fcntl() calls SetFlags() would do */
+	cfd = accept4(msfd, (struct sockaddr *)&pCLmfree->cnct_port, &so,
+		      SOCK_NONBLOCK);
+#else
+	cfd = accept(msfd, (struct sockaddr *)&pCLmfree->cnct_port, &so);
+#endif
+    } while (cfd < 0 && errno == EINTR);
+    if (cfd < 0) {
+#if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
+	CONDDEBUG((1, "Master(): dmalloc / MarkClientConnection"));
+	dmalloc_log_changed(dmallocMarkClientConnection, 1, 0, 1);
+#endif
+	/* drained the queue, or the client gave up while waiting */
+	if (errno == EAGAIN || errno == EWOULDBLOCK
+#ifdef ECONNABORTED
+	    || errno == ECONNABORTED
+#endif
+	    )
+	    return 0;
+	Error("Master(): accept(%u): %s", msfd, strerror(errno));
+	return -1;
+    }
+
+    /* set to non-blocking and wrap in a File object */
+#if HAVE_ACCEPT4
+    pCLmfree->fd = FileOpenFD(cfd, simpleSocket);
+#else
+    if (SetFlags(cfd, O_NONBLOCK, 0))
+	pCLmfree->fd = FileOpenFD(cfd, simpleSocket);
+    else
+	pCLmfree->fd = (CONSFILE *)0;
+#endif
+
+    if ((CONSFILE *)0 == pCLmfree->fd) {
+	Error("Master(): FileOpenFD(%u): %s", cfd, strerror(errno));
+	close(cfd);
+#if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
+	CONDDEBUG((1, "Master(): dmalloc / MarkClientConnection"));
+	dmalloc_log_changed(dmallocMarkClientConnection, 1, 0, 1);
+#endif
+	return 1;
+    }
+    FileSetQuoteIAC(pCLmfree->fd, FLAGTRUE);
+
+    /* remove from the free list */
+    pCL = pCLmfree;
+    pCLmfree = pCL->pCLnext;
+
+    /* add another if we ran out */
+    if (pCLmfree == (CONSCLIENT *)0) {
+	if ((pCLmfree = (CONSCLIENT *)calloc(1, sizeof(CONSCLIENT)))
+	    == (CONSCLIENT *)0)
+	    OutOfMem();
+	pCLmfree->accmd = AllocString();
+	pCLmfree->peername = AllocString();
+	pCLmfree->username = AllocString();
+	pCLmfree->acid = AllocString();
+    }
+
+    /* link into all clients list */
+    pCL->pCLscan = pCLmall;
+    pCL->ppCLbscan = &pCLmall;
+    if ((CONSCLIENT *)0 != pCL->pCLscan) {
+	pCL->pCLscan->ppCLbscan = &pCL->pCLscan;
+    }
+    pCLmall = pCL;
+
+    FileSetOwner(pCL->fd, FDOWNER_CLIENT, pCL);
+    FDWatch(cfd, FDWATCH_READ);
+
+    /* init the fsm */
+    pCL->iState = S_IDENT;
+    BuildString((char *)0, pCL->accmd);
+    BuildString((char *)0, pCL->peername);
+    BuildString((char *)0, pCL->username);
+    BuildString((char *)0, pCL->acid);
+
+    MasterClientAccess(pCL);
+    return 1;
+}
+
+/* pick up after MasterUpgrade(): the listening socket and the groups
+ * (still our kids, since the pid didn't change).  groups that weren't
+ * there before get spawned now, ones no longer configured are left to
+ * fend for themselves.  if the state isn't all there we start over:
+ * everything it handed us is closed, the groups we could make out are
+ * told to go, and all of them are spawned fresh
+ */
+void
+MasterResume(FILE *fp)
+{
+    char kind[8];
+    struct resumed {
+	unsigned int id;
+	unsigned long pid;
+	unsigned short port;
+	int hfd;
+    } *groups = (struct resumed *)0;
+    int count = 0, size = 0, i;
+    GRPENT *pGE;
+
+    kind[0] = '\000';
+    if (fscanf(fp, "%d", &msfdResumed) == 1) {
+	while (fscanf(fp, "%7s", kind) == 1 && strcmp(kind, "group") == 0) {
+	    if (count == size) {
+		size += 16;
+		if ((groups =
+		     (struct resumed *)realloc(groups,
+					       size *
+					       sizeof(struct resumed))) ==
+		    (struct resumed *)0)
+		    OutOfMem();
+	    }
+	    if (fscanf(fp, "%u %lu %hu %d", &groups[count].id,
+		       &groups[count].pid, &groups[count].port,
+		       &groups[count].hfd) != 4)
+		break;
+	    count++;
+	}
+    }
+    if (strcmp(kind, "end") != 0) {
+	Error("MasterResume(): upgrade state is incomplete: starting over");
+	for (i = 0; i < count; i++)
+	    if ((pid_t)groups[i].pid > 1)
+		kill((pid_t)groups[i].pid, SIGTERM);
+	count = 0;
+	msfdResumed = -1;
+	UpgradeAbandon(fp, -1, -1);
+    } else
+	fclose(fp);
+
+    for (i = 0; i < count; i++) {
+	for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext)
+	    if (pGE->id == groups[i].id && pGE->imembers != 0)
+		break;
+	if (pGE == (GRPENT *)0) {
+	    Msg("group #%u pid %lu is no longer configured", groups[i].id,
+		groups[i].pid);
+	    if (groups[i].hfd != -1)
+		close(groups[i].hfd);
+	    continue;
+	}
+	pGE->pid = (pid_t)groups[i].pid;
+	pGE->port = groups[i].port;
+	if ((pGE->hfd = groups[i].hfd) != -1)
+	    fcntl(pGE->hfd, F_SETFD, FD_CLOEXEC);
+	Verbose("group #%d pid %lu on port %hu", pGE->id,
+		(unsigned long)pGE->pid, pGE->port);
+    }
+    if (groups != (struct resumed *)0)
+	free(groups);
+
+    for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext) {
+	if (pGE->imembers == 0 || pGE->pid != -1)
+	    continue;
+	Spawn(pGE, msfdResumed);
+	Verbose("group #%d pid %lu on port %hu", pGE->id,
+		(unsigned long)pGE->pid, pGE->port);
+    }
+}
+
+/* re-exec ourselves, keeping the listening socket and the groups.  each
+ * group is told to do the same (it keeps its consoles and clients) -
+ * our own clients are only ever here for a moment, so they just go
+ */
+static void
+MasterUpgrade(int msfd)
+{
+    FILE *fp;
+    GRPENT *pGE;
+
+    if ((fp = tmpfile()) == (FILE *)0) {
+	Error("MasterUpgrade(): tmpfile(): %s", strerror(errno));
+	return;
+    }
+    Msg("upgrading");
+
+    fprintf(fp, "%d\n", msfd);
+    for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext) {
+	if (pGE->imembers == 0 || pGE->pid == -1)
+	    continue;
+	if (pGE->hfd == -1 ||
+	    send(pGE->hfd, HANDOFFUPGRADE, sizeof(HANDOFFUPGRADE) - 1,
+		 0) != sizeof(HANDOFFUPGRADE) - 1)
+	    Error("group #%u pid %lu can't be upgraded", pGE->id,
+		  (unsigned long)pGE->pid);
+	fprintf(fp, "group %u %lu %hu %d\n", pGE->id,
+		(unsigned long)pGE->pid, pGE->port, pGE->hfd);
+    }
+    fprintf(fp, "end\n");
+
+    while (pCLmall != (CONSCLIENT *)0)
+	DropMasterClient(pCLmall, FLAGTRUE);
+    if (unifiedlog != (CONSFILE *)0)
+	FileClose(&unifiedlog);
+
+    CloseFilesOnExec();
+    UpgradePass(msfd);
+    for (pGE = pGroups; pGE != (GRPENT *)0; pGE = pGE->pGEnext)
+	if (pGE->imembers != 0 && pGE->hfd != -1)
+	    UpgradePass(pGE->hfd);
+
+    ReExec("master", fp);
+
+    /* still here, so carry on as we were */
+    fclose(fp);
+    ReopenUnifiedlog();
+}
+
 void
 Master(void)
 {
-    int cfd;
     int msfd;
-    socklen_t so;
-    fd_set rmask, wmask;
+    int i, kind;
 #if USE_IPV6 || !USE_UNIX_DOMAIN_SOCKETS
 # if USE_IPV6
     struct addrinfo *rp;
@@ -695,8 +1105,12 @@ Master(void)
 #else
     struct sockaddr_un master_port;
     static STRING *portPath = (STRING *)0;
+#endif
+#if USE_UNIX_DOMAIN_SOCKETS
+    socklen_t so;
 #endif
     FILE *fp;
+    struct timeval tv;
     CONSCLIENT *pCLServing = (CONSCLIENT *)0;
     CONSCLIENT *pCL = (CONSCLIENT *)0;
 
@@ -717,6 +1131,10 @@ Master(void)
     SimpleSignal(SIGXFSZ, SIG_IGN);
 #endif
     SimpleSignal(SIGCHLD, FlagSawCHLD);
+    /* anyone that died while we weren't looking (kids that went
+     * while an upgrade was exec'ing us, say)
+     */
+    fSawCHLD = 1;
     SimpleSignal(SIGTERM, FlagQuitIt);
     SimpleSignal(SIGUSR1, FlagSawUSR1);
     SimpleSignal(SIGHUP, FlagSawHUP);
@@ -742,6 +1160,17 @@ Master(void)
 # endif
 #endif
 
+    /* after an upgrade, we already have one */
+    if (msfdResumed != -1) {
+	msfd = msfdResumed;
+	fcntl(msfd, F_SETFD, FD_CLOEXEC);
+#if USE_UNIX_DOMAIN_SOCKETS
+	so = sizeof(master_port);
+	getsockname(msfd, (struct sockaddr *)&master_port, &so);
+#endif
+	goto listening;
+    }
+
 #if USE_IPV6
     for (rp = bindAddr; rp != NULL; rp = rp->ai_next) {
 	if ((msfd =
@@ -768,9 +1197,6 @@ Master(void)
 	Error("Master(): listen(): %s", strerror(errno));
 	return;
     }
-
-    /* save addrlen for accept */
-    so = rp->ai_addrlen;
 #elif USE_UNIX_DOMAIN_SOCKETS
     master_port.sun_family = AF_UNIX;
 
@@ -845,6 +1271,7 @@ Master(void)
     }
 #endif
 
+  listening:
     fp = fopen(PIDFILE, "w");
     if (fp) {
 	fprintf(fp, "%lu\n", (unsigned long)getpid());
@@ -854,9 +1281,8 @@ Master(void)
 	      strerror(errno));
     }
 
-    FD_ZERO(&rinit);
-    FD_SET(msfd, &rinit);
-    maxfd = msfd + 1;
+    FDWatchReset();
+    FDWatch(msfd, FDWATCH_READ);
 
     for (fSawQuit = 0; !fSawQuit; /* can't close here :-( */ ) {
 	if (fSawCHLD) {
@@ -873,11 +1299,9 @@ Master(void)
 	    /* fix up the client descriptors since ReReadCfg() doesn't
 	     * see them like it can in the child processes */
 	    for (pCL = pCLmall; pCL != (CONSCLIENT *)0; pCL = pCL->pCLscan) {
-		FD_SET(FileFDNum(pCL->fd), &rinit);
-		if (maxfd < FileFDNum(pCL->fd) + 1)
-		    maxfd = FileFDNum(pCL->fd) + 1;
+		FDWatch(FileFDNum(pCL->fd), FDWATCH_READ);
 		if (!FileBufEmpty(pCL->fd))
-		    FD_SET(FileFDNum(pCL->fd), &winit);
+		    FDWatch(FileFDNum(pCL->fd), FDWATCH_WRITE);
 	    }
 	}
 	if (fSawUSR1) {
@@ -892,163 +1316,69 @@ Master(void)
 	    ReopenUnifiedlog();
 	    SignalKids(SIGUSR2);
 	}
+	/* let the client that asked (and any others) go first */
+	if (fSawUpgrade && (pCLmall == (CONSCLIENT *)0 ||
+			    time((time_t *)0) >= tUpgrade + UPGRADEWAIT)) {
+	    fSawUpgrade = 0;
+	    MasterUpgrade(msfd);
+	}
 	if (fSawQuit) {		/* Something above set the quit flag */
 	    break;
 	}
 
-	rmask = rinit;
-	wmask = winit;
-
-	if (-1 ==
-	    select(maxfd, &rmask, &wmask, (fd_set *)0,
-		   (struct timeval *)0)) {
+	ResolveWatch();
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if (FDWait(fSawUpgrade ? &tv : (struct timeval *)0) == -1) {
 	    if (errno != EINTR) {
-		Error("Master(): select(): %s", strerror(errno));
+		Error("Master(): FDWait(): %s", strerror(errno));
 		break;
 	    }
 	    continue;
 	}
 
-	/* anything on a connection? */
-	for (pCLServing = pCLmall; (CONSCLIENT *)0 != pCLServing;
-	     pCLServing = pCLServing->pCLscan) {
-	    switch (pCLServing->ioState) {
-#if HAVE_OPENSSL
-		case INSSLACCEPT:
-		    if (FileCanSSLAccept(pCLServing->fd, &rmask, &wmask)) {
-			int r;
-			if ((r = FileSSLAccept(pCLServing->fd)) < 0)
-			    DropMasterClient(pCLServing, FLAGFALSE);
-			else if (r == 1)
-			    pCLServing->ioState = ISNORMAL;
-		    }
-		    break;
-#endif
-#if HAVE_GSSAPI
-		case INGSSACCEPT:
-		    {
-			int r;
-			if ((r = AttemptGSSAPI(pCLServing)) < 0)
-			    DropMasterClient(pCLServing, FLAGFALSE);
-			else if (r == 1)
-			    pCLServing->ioState = ISNORMAL;
-		    }
-		    break;
-#endif
-		case ISNORMAL:
-		    if (FileCanRead(pCLServing->fd, &rmask, &wmask))
-			DoNormalRead(pCLServing);
-		    /* fall through to ISFLUSHING for buffered data */
-		case ISFLUSHING:
-		    if (!FileBufEmpty(pCLServing->fd) &&
-			FileCanWrite(pCLServing->fd, &rmask, &wmask)) {
-			CONDDEBUG((1, "Master(): flushing fd %d",
-				   FileFDNum(pCLServing->fd)));
-			if (FileWrite
-			    (pCLServing->fd, FLAGFALSE, (char *)0,
-			     0) < 0) {
-			    DropMasterClient(pCLServing, FLAGTRUE);
-			    break;
-			}
-		    }
-		    if ((pCLServing->ioState == ISFLUSHING) &&
-			FileBufEmpty(pCLServing->fd))
-			DropMasterClient(pCLServing, FLAGFALSE);
-		    break;
-		default:
-		    /* this really can't ever happen */
-		    Error
-			("Master(): client socket state == %d -- THIS IS A BUG",
-			 pCLServing->ioState);
-		    DropMasterClient(pCLServing, FLAGFALSE);
-		    break;
+	/* clients waiting on the resolver get another look */
+	if (ResolveReady() > 0) {
+	    CONSCLIENT *pCLnext;
+	    for (pCL = pCLmall; pCL != (CONSCLIENT *)0; pCL = pCLnext) {
+		pCLnext = pCL->pCLscan;
+		if (pCL->ioState == INRESOLVE)
+		    MasterClientAccess(pCL);
+		else
+		    ClientPeerName(pCL);
 	    }
 	}
 
-	/* if nothing on control line, get more */
-	if (!FD_ISSET(msfd, &rmask))
-	    continue;
-
-	/* accept new connections and deal with them
+	/* anything on a connection?  a client may have been dropped
+	 * while working on someone else, in which case its fd is gone
 	 */
-#if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
-	dmallocMarkClientConnection = dmalloc_mark();
-#endif
-
-#if !USE_IPV6
-	so = sizeof(struct sockaddr_in);
-#endif
-	for (cfd = 0; cfd == 0;) {
-	    cfd =
-		accept(msfd, (struct sockaddr *)&pCLmfree->cnct_port, &so);
-	    if (cfd < 0 && errno == EINTR)
-		cfd = 0;
+	i = 0;
+	while ((pCLServing =
+		(CONSCLIENT *)FileNextReady(&i, &kind)) != (CONSCLIENT *)0) {
+	    if (kind != FDOWNER_CLIENT || pCLServing->fpending)
+		continue;
+	    pCLServing->fpending = 1;
+	    pCLServing->pCLpend = pCLpend;
+	    pCLpend = pCLServing;
 	}
-	if (cfd < 0) {
-	    Error("Master(): accept(%u): %s", msfd, strerror(errno));
-#if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
-	    CONDDEBUG((1, "Master(): dmalloc / MarkClientConnection"));
-	    dmalloc_log_changed(dmallocMarkClientConnection, 1, 0, 1);
-#endif
-	    continue;
+	while ((pCLServing = pCLpend) != (CONSCLIENT *)0) {
+	    pCLpend = pCLServing->pCLpend;
+	    pCLServing->fpending = 0;
+	    if (pCLServing->fd != (CONSFILE *)0)
+		DoMasterClientIO(pCLServing);
 	}
 
-	/* set to non-blocking and wrap in a File object */
-	if (SetFlags(cfd, O_NONBLOCK, 0)) {
-	    pCLmfree->fd = FileOpenFD(cfd, simpleSocket);
-	    FileSetQuoteIAC(pCLmfree->fd, FLAGTRUE);
-	} else
-	    pCLmfree->fd = (CONSFILE *)0;
-
-	if ((CONSFILE *)0 == pCLmfree->fd) {
-	    Error("Master(): FileOpenFD(%u): %s", cfd, strerror(errno));
-#if HAVE_DMALLOC && DMALLOC_MARK_CLIENT_CONNECTION
-	    CONDDEBUG((1, "Master(): dmalloc / MarkClientConnection"));
-	    dmalloc_log_changed(dmallocMarkClientConnection, 1, 0, 1);
-#endif
+	/* if nothing on control line, get more */
+	if (!FDIsReady(msfd, FDWATCH_READ))
 	    continue;
-	}
-
-	/* remove from the free list */
-	pCL = pCLmfree;
-	pCLmfree = pCL->pCLnext;
-
-	/* add another if we ran out */
-	if (pCLmfree == (CONSCLIENT *)0) {
-	    if ((pCLmfree = (CONSCLIENT *)calloc(1, sizeof(CONSCLIENT)))
-		== (CONSCLIENT *)0)
-		OutOfMem();
-	    pCLmfree->accmd = AllocString();
-	    pCLmfree->peername = AllocString();
-	    pCLmfree->username = AllocString();
-	    pCLmfree->acid = AllocString();
-	}
-
-	/* link into all clients list */
-	pCL->pCLscan = pCLmall;
-	pCL->ppCLbscan = &pCLmall;
-	if ((CONSCLIENT *)0 != pCL->pCLscan) {
-	    pCL->pCLscan->ppCLbscan = &pCL->pCLscan;
-	}
-	pCLmall = pCL;
-
-	FD_SET(cfd, &rinit);
-	if (maxfd < cfd + 1)
-	    maxfd = cfd + 1;
-
-	/* init the fsm */
-	pCL->iState = S_IDENT;
-	BuildString((char *)0, pCL->accmd);
-	BuildString((char *)0, pCL->peername);
-	BuildString((char *)0, pCL->username);
-	BuildString((char *)0, pCL->acid);
 
-	if (ClientAccessOk(pCL)) {
-	    pCL->ioState = ISNORMAL;
-	    /* say hi to start */
-	    FileWrite(pCL->fd, FLAGFALSE, "ok\r\n", 4);
-	} else
-	    DropMasterClient(pCL, FLAGFALSE);
+	/* accept new connections and deal with them.  we take a batch
+	 * at a time so a rush of clients doesn't cost a trip through
+	 * FDWait() each, but stop short of starving the ones we have.
+	 */
+	for (i = 0; i < MAXACCEPTBATCH; i++)
+	    if (AcceptMasterClient(msfd) <= 0)
+		break;
     }
 
     close(msfd);
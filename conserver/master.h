@@ -38,4 +38,5 @@
 extern CONSCLIENT *pCLmall;
 extern CONSCLIENT *pCLmfree;
 extern void Master(void);
+extern void MasterResume(FILE *);
 extern void SignalKids(int);
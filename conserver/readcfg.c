@@ -553,6 +553,8 @@ DestroyParserDefaultOrConsole(CONSENT *c, CONSENT **ph, CONSENT ***pt)
 	free(c->initcmd);
     if (c->motd != (char *)0)
 	free(c->motd);
+    if (c->logcompress != (char *)0)
+	free(c->logcompress);
     if (c->idlestring != (char *)0)
 	free(c->idlestring);
     if (c->replstring != (char *)0)
@@ -609,6 +611,26 @@ ApplyDefault(CONSENT *d, CONSENT *c)
 	c->idletimeout = d->idletimeout;
     if (d->logfilemax != 0)
 	c->logfilemax = d->logfilemax;
+    if (d->logfilekeep != 0)
+	c->logfilekeep = d->logfilekeep;
+    if (d->logfileage != 0)
+	c->logfileage = d->logfileage;
+    if (d->outputlimit != 0)
+	c->outputlimit = d->outputlimit;
+    if (d->outputpolicy != UNKNOWNPOLICY)
+	c->outputpolicy = d->outputpolicy;
+    if (d->scrollback != 0)
+	c->scrollback = d->scrollback;
+    if (d->logbuffer != 0)
+	c->logbuffer = d->logbuffer;
+    if (d->logflush != 0)
+	c->logflush = d->logflush;
+    if (d->loglines != 0)
+	c->loglines = d->loglines;
+    if (d->logsync != 0)
+	c->logsync = d->logsync;
+    if (d->logformat != UNKNOWNFORMAT)
+	c->logformat = d->logformat;
     if (d->inituid != 0)
 	c->inituid = d->inituid;
     if (d->initgid != 0)
@@ -667,6 +689,8 @@ ApplyDefault(CONSENT *d, CONSENT *c)
 	c->unloved = d->unloved;
     if (d->login != FLAGUNKNOWN)
 	c->login = d->login;
+    if (d->logindex != FLAGUNKNOWN)
+	c->logindex = d->logindex;
     if (d->host != (char *)0) {
 	if (c->host != (char *)0)
 	    free(c->host);
@@ -739,6 +763,12 @@ ApplyDefault(CONSENT *d, CONSENT *c)
 	if ((c->motd = StrDup(d->motd)) == (char *)0)
 	    OutOfMem();
     }
+    if (d->logcompress != (char *)0) {
+	if (c->logcompress != (char *)0)
+	    free(c->logcompress);
+	if ((c->logcompress = StrDup(d->logcompress)) == (char *)0)
+	    OutOfMem();
+    }
     if (d->idlestring != (char *)0) {
 	if (c->idlestring != (char *)0)
 	    free(c->idlestring);
@@ -1606,6 +1636,40 @@ DefaultItemLogfile(char *id)
     ProcessLogfile(parserDefaultTemp, id);
 }
 
+void
+ProcessLogformat(CONSENT *c, char *id)
+{
+    if ((id == (char *)0) || (*id == '\000')) {
+	c->logformat = UNKNOWNFORMAT;
+	return;
+    }
+
+    if (strcasecmp(id, "plain") == 0) {
+	c->logformat = LFPLAIN;
+	return;
+    }
+    if (strcasecmp(id, "framed") == 0) {
+#if HAVE_ZLIB
+	c->logformat = LFFRAMED;
+#else
+	if (isMaster)
+	    Error
+		("logformat framed ignored - zlib not compiled into code [%s:%d]",
+		 file, line);
+#endif
+	return;
+    }
+    if (isMaster)
+	Error("invalid logformat `%s' [%s:%d]", id, file, line);
+}
+
+void
+DefaultItemLogformat(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogformat(%s) [%s:%d]", id, file, line));
+    ProcessLogformat(parserDefaultTemp, id);
+}
+
 void
 ProcessLogfilemax(CONSENT *c, char *id)
 {
@@ -1655,6 +1719,252 @@ DefaultItemLogfilemax(char *id)
     ProcessLogfilemax(parserDefaultTemp, id);
 }
 
+void
+ProcessLogfilekeep(CONSENT *c, char *id)
+{
+    char *p;
+
+    c->logfilekeep = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    for (p = id; *p != '\000'; p++)
+	if (!isdigit((int)(*p)))
+	    break;
+
+    /* if it wasn't a number */
+    if (*p != '\000') {
+	if (isMaster)
+	    Error("invalid `logfilekeep' specification `%s' [%s:%d]", id,
+		  file, line);
+	return;
+    }
+    c->logfilekeep = atoi(id);
+}
+
+void
+DefaultItemLogfilekeep(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogfilekeep(%s) [%s:%d]", id, file, line));
+    ProcessLogfilekeep(parserDefaultTemp, id);
+}
+
+void
+ProcessLogfileage(CONSENT *c, char *id)
+{
+    char *p;
+    long v = 0;
+
+    c->logfileage = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    for (p = id; *p != '\000'; p++) {
+	if (!isdigit((int)(*p)))
+	    break;
+	v = v * 10 + (*p - '0');
+    }
+
+    /* if it wasn't just numbers (seconds) */
+    if (*p != '\000') {
+	if ((*p == 's' || *p == 'S') && *(p + 1) == '\000') {
+	    /* already seconds */
+	} else if ((*p == 'm' || *p == 'M') && *(p + 1) == '\000') {
+	    v *= 60;
+	} else if ((*p == 'h' || *p == 'H') && *(p + 1) == '\000') {
+	    v *= 60 * 60;
+	} else if ((*p == 'd' || *p == 'D') && *(p + 1) == '\000') {
+	    v *= 24 * 60 * 60;
+	} else if ((*p == 'w' || *p == 'W') && *(p + 1) == '\000') {
+	    v *= 7 * 24 * 60 * 60;
+	} else {
+	    if (isMaster)
+		Error("invalid `logfileage' specification `%s' [%s:%d]",
+		      id, file, line);
+	    return;
+	}
+    }
+
+    c->logfileage = v;
+}
+
+void
+DefaultItemLogfileage(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogfileage(%s) [%s:%d]", id, file, line));
+    ProcessLogfileage(parserDefaultTemp, id);
+}
+
+void
+ProcessLogcompress(CONSENT *c, char *id)
+{
+    if (c->logcompress != (char *)0) {
+	free(c->logcompress);
+	c->logcompress = (char *)0;
+    }
+    if (id == (char *)0 || id[0] == '\000') {
+	return;
+    }
+    if ((c->logcompress = StrDup(id)) == (char *)0)
+	OutOfMem();
+}
+
+void
+DefaultItemLogcompress(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogcompress(%s) [%s:%d]", id, file, line));
+    ProcessLogcompress(parserDefaultTemp, id);
+}
+
+void
+ProcessLogbuffer(CONSENT *c, char *id)
+{
+    char *p;
+    int v = 0;
+
+    c->logbuffer = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    for (p = id; *p != '\000'; p++) {
+	if (!isdigit((int)(*p)))
+	    break;
+	v = v * 10 + (*p - '0');
+    }
+
+    /* if it wasn't just numbers */
+    if (*p != '\000') {
+	if ((*p == 'k' || *p == 'K') && *(p + 1) == '\000') {
+	    v *= 1024;
+	} else if ((*p == 'm' || *p == 'M') && *(p + 1) == '\000') {
+	    v *= 1024 * 1024;
+	} else {
+	    if (isMaster)
+		Error("invalid `logbuffer' specification `%s' [%s:%d]",
+		      id, file, line);
+	    return;
+	}
+    }
+
+    /* zero means "don't buffer", which isn't the default (unset) */
+    c->logbuffer = (v == 0) ? -1 : v;
+}
+
+void
+DefaultItemLogbuffer(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogbuffer(%s) [%s:%d]", id, file, line));
+    ProcessLogbuffer(parserDefaultTemp, id);
+}
+
+/* a time in the style of idletimeout (a number with an optional ms, s,
+ * m, or h qualifier, seconds if there isn't one) in milliseconds, or
+ * -1 after complaining about it
+ */
+static long
+ParseMsec(char *what, char *id)
+{
+    char *p;
+    int factor = 0;
+
+    for (p = id; factor == 0 && *p != '\000'; p++)
+	if ((*p == 'm' || *p == 'M') && (p[1] == 's' || p[1] == 'S')) {
+	    factor = 1;
+	    p++;
+	} else if (*p == 's' || *p == 'S')
+	    factor = 1000;
+	else if (*p == 'm' || *p == 'M')
+	    factor = 60 * 1000;
+	else if (*p == 'h' || *p == 'H')
+	    factor = 60 * 60 * 1000;
+	else if (!isdigit((int)(*p)))
+	    break;
+    /* if it wasn't a number or a qualifier wasn't at the end */
+    if (*p != '\000') {
+	if (isMaster)
+	    Error("invalid `%s' specification `%s' [%s:%d]", what, id,
+		  file, line);
+	return -1;
+    }
+    return atol(id) * (factor == 0 ? 1000 : factor);
+}
+
+void
+ProcessLogflush(CONSENT *c, char *id)
+{
+    long v;
+
+    c->logflush = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    if ((v = ParseMsec("logflush", id)) >= 0)
+	c->logflush = v;
+}
+
+void
+DefaultItemLogflush(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogflush(%s) [%s:%d]", id, file, line));
+    ProcessLogflush(parserDefaultTemp, id);
+}
+
+void
+ProcessLoglines(CONSENT *c, char *id)
+{
+    char *p;
+
+    c->loglines = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    for (p = id; *p != '\000'; p++)
+	if (!isdigit((int)(*p)))
+	    break;
+
+    /* if it wasn't a number */
+    if (*p != '\000') {
+	if (isMaster)
+	    Error("invalid `loglines' specification `%s' [%s:%d]", id,
+		  file, line);
+	return;
+    }
+    c->loglines = atoi(id);
+}
+
+void
+DefaultItemLoglines(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLoglines(%s) [%s:%d]", id, file, line));
+    ProcessLoglines(parserDefaultTemp, id);
+}
+
+void
+ProcessLogsync(CONSENT *c, char *id)
+{
+    long v;
+
+    c->logsync = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    if ((v = ParseMsec("logsync", id)) >= 0)
+	c->logsync = v;
+}
+
+void
+DefaultItemLogsync(char *id)
+{
+    CONDDEBUG((1, "DefaultItemLogsync(%s) [%s:%d]", id, file, line));
+    ProcessLogsync(parserDefaultTemp, id);
+}
+
 void
 DefaultItemInitcmd(char *id)
 {
@@ -1718,6 +2028,7 @@ ProcessOptions(CONSENT *c, char *id)
 	c->autoreinit = FLAGUNKNOWN;
 	c->unloved = FLAGUNKNOWN;
 	c->login = FLAGUNKNOWN;
+	c->logindex = FLAGUNKNOWN;
 	return;
     }
 
@@ -1755,6 +2066,8 @@ ProcessOptions(CONSENT *c, char *id)
 	    c->unloved = negative ? FLAGFALSE : FLAGTRUE;
 	else if (strcasecmp("login", token) == 0)
 	    c->login = negative ? FLAGFALSE : FLAGTRUE;
+	else if (strcasecmp("logindex", token) == 0)
+	    c->logindex = negative ? FLAGFALSE : FLAGTRUE;
 	else if (isMaster)
 	    Error("invalid option `%s' [%s:%d]", token, file, line);
     }
@@ -1767,6 +2080,78 @@ DefaultItemOptions(char *id)
     ProcessOptions(parserDefaultTemp, id);
 }
 
+void
+ProcessOutputlimit(CONSENT *c, char *id)
+{
+    char *p;
+    int v = 0;
+
+    c->outputlimit = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    for (p = id; *p != '\000'; p++) {
+	if (!isdigit((int)(*p)))
+	    break;
+	v = v * 10 + (*p - '0');
+    }
+
+    /* if it wasn't just numbers */
+    if (*p != '\000') {
+	if ((*p == 'k' || *p == 'K') && *(p + 1) == '\000') {
+	    v *= 1024;
+	} else if ((*p == 'm' || *p == 'M') && *(p + 1) == '\000') {
+	    v *= 1024 * 1024;
+	} else {
+	    if (isMaster)
+		Error("invalid `outputlimit' specification `%s' [%s:%d]",
+		      id, file, line);
+	    return;
+	}
+    }
+
+    c->outputlimit = v;
+}
+
+void
+DefaultItemOutputlimit(char *id)
+{
+    CONDDEBUG((1, "DefaultItemOutputlimit(%s) [%s:%d]", id, file, line));
+    ProcessOutputlimit(parserDefaultTemp, id);
+}
+
+void
+ProcessOutputpolicy(CONSENT *c, char *id)
+{
+    if ((id == (char *)0) || (*id == '\000')) {
+	c->outputpolicy = UNKNOWNPOLICY;
+	return;
+    }
+
+    if (strcasecmp(id, "drop") == 0) {
+	c->outputpolicy = OPDROP;
+	return;
+    }
+    if (strcasecmp(id, "disconnect") == 0) {
+	c->outputpolicy = OPDISCONNECT;
+	return;
+    }
+    if (strcasecmp(id, "block") == 0) {
+	c->outputpolicy = OPBLOCK;
+	return;
+    }
+    if (isMaster)
+	Error("invalid outputpolicy `%s' [%s:%d]", id, file, line);
+}
+
+void
+DefaultItemOutputpolicy(char *id)
+{
+    CONDDEBUG((1, "DefaultItemOutputpolicy(%s) [%s:%d]", id, file, line));
+    ProcessOutputpolicy(parserDefaultTemp, id);
+}
+
 void
 ProcessParity(CONSENT *c, char *id)
 {
@@ -2125,13 +2510,17 @@ ProcessIdletimeout(CONSENT *c, char *id)
 	c->idletimeout = 0;
 	return;
     }
+    /* the timeout is kept in milliseconds */
     for (p = id; factor == 0 && *p != '\000'; p++)
-	if (*p == 's' || *p == 'S')
+	if ((*p == 'm' || *p == 'M') && (p[1] == 's' || p[1] == 'S')) {
 	    factor = 1;
+	    p++;
+	} else if (*p == 's' || *p == 'S')
+	    factor = 1000;
 	else if (*p == 'm' || *p == 'M')
-	    factor = 60;
+	    factor = 60 * 1000;
 	else if (*p == 'h' || *p == 'H')
-	    factor = 60 * 60;
+	    factor = 60 * 60 * 1000;
 	else if (!isdigit((int)(*p)))
 	    break;
     /* if it wasn't a number or a qualifier wasn't at the end */
@@ -2141,7 +2530,7 @@ ProcessIdletimeout(CONSENT *c, char *id)
 		  file, line);
 	return;
     }
-    c->idletimeout = (time_t)atoi(id) * (factor == 0 ? 1 : factor);
+    c->idletimeout = atol(id) * (factor == 0 ? 1000 : factor);
 }
 
 void
@@ -2193,6 +2582,47 @@ DefaultItemRw(char *id)
     ProcessRoRw(&(parserDefaultTemp->rw), id);
 }
 
+void
+ProcessScrollback(CONSENT *c, char *id)
+{
+    char *p;
+    int v = 0;
+
+    c->scrollback = 0;
+
+    if (id == (char *)0 || id[0] == '\000')
+	return;
+
+    for (p = id; *p != '\000'; p++) {
+	if (!isdigit((int)(*p)))
+	    break;
+	v = v * 10 + (*p - '0');
+    }
+
+    /* if it wasn't just numbers */
+    if (*p != '\000') {
+	if ((*p == 'k' || *p == 'K') && *(p + 1) == '\000') {
+	    v *= 1024;
+	} else if ((*p == 'm' || *p == 'M') && *(p + 1) == '\000') {
+	    v *= 1024 * 1024;
+	} else {
+	    if (isMaster)
+		Error("invalid `scrollback' specification `%s' [%s:%d]",
+		      id, file, line);
+	    return;
+	}
+    }
+
+    c->scrollback = v;
+}
+
+void
+DefaultItemScrollback(char *id)
+{
+    CONDDEBUG((1, "DefaultItemScrollback(%s) [%s:%d]", id, file, line));
+    ProcessScrollback(parserDefaultTemp, id);
+}
+
 void
 ProcessTimestamp(CONSENT *c, char *id)
 {
@@ -2382,6 +2812,31 @@ DefaultItemType(char *id)
 CONSENT *parserConsoles = (CONSENT *)0;
 CONSENT **parserConsolesTail = &parserConsoles;
 CONSENT *parserConsoleTemp = (CONSENT *)0;
+/* parserConsoles by name, and by name and alias */
+static NAMEMAP *parserServers = (NAMEMAP *)0;
+static NAMEMAP *parserNames = (NAMEMAP *)0;
+
+static void
+ParserConsoleNames(CONSENT *c, FLAG add)
+{
+    NAMES *n;
+
+    if (parserServers == (NAMEMAP *)0) {
+	parserServers = NameMapNew();
+	parserNames = NameMapNew();
+    }
+    if (add == FLAGTRUE) {
+	NameMapAdd(parserServers, c->server, c);
+	NameMapAdd(parserNames, c->server, c);
+	for (n = c->aliases; n != (NAMES *)0; n = n->next)
+	    NameMapAdd(parserNames, n->name, c);
+    } else {
+	NameMapDelete(parserServers, c->server, c);
+	NameMapDelete(parserNames, c->server, c);
+	for (n = c->aliases; n != (NAMES *)0; n = n->next)
+	    NameMapDelete(parserNames, n->name, c);
+    }
+}
 
 void
 ConsoleBegin(char *id)
@@ -2563,18 +3018,19 @@ ConsoleEnd(void)
     }
 
     /* if we're overriding an existing console, nuke it */
-    if ((c =
-	 FindParserDefaultOrConsole(parserConsoles,
+    if ((c = (CONSENT *)NameMapFind(parserServers,
 				    parserConsoleTemp->server)) !=
 	(CONSENT *)0) {
 	if (isMaster)
 	    Error("console definition for `%s' overridden [%s:%d]",
 		  parserConsoleTemp->server, file, line);
+	ParserConsoleNames(c, FLAGFALSE);
 	DestroyParserDefaultOrConsole(c, &parserConsoles,
 				      &parserConsolesTail);
     }
 
     /* add the temp to the tail of the list */
+    ParserConsoleNames(parserConsoleTemp, FLAGTRUE);
     *parserConsolesTail = parserConsoleTemp;
     parserConsolesTail = &(parserConsoleTemp->pCEnext);
     parserConsoleTemp = (CONSENT *)0;
@@ -2627,18 +3083,48 @@ ExpandLogfile(CONSENT *c, char *id)
 	OutOfMem();
 }
 
+/* state kept while ConsoleDestroy() adds the parsed consoles: the
+ * old consoles by name (with their groups), the staged copies of the
+ * old groups by group id, and what IsMe() said about each master
+ */
+typedef struct oldConsole {
+    CONSENT *pCE;
+    GRPENT *pGE;
+} OLDCONSOLE;
+
+static NAMEMAP *oldConsoles = (NAMEMAP *)0;
+static OLDCONSOLE *oldConsoleList = (OLDCONSOLE *)0;
+static int oldConsoleCount = 0;
+static GRPENT **pGEstaged = (GRPENT **)0;
+static NAMEMAP *masters = (NAMEMAP *)0;
+
+static int
+MasterIsMe(char *master)
+{
+    static int no = 0, yes = 1;
+    int *r;
+
+    if (masters == (NAMEMAP *)0)
+	masters = NameMapNew();
+    if ((r = (int *)NameMapFind(masters, master)) == (int *)0) {
+	r = IsMe(master) ? &yes : &no;
+	NameMapAdd(masters, master, r);
+    }
+    return *r;
+}
+
 /* this will adjust parserConsoles/parserConsolesTail if we're adding
- * a new console.
+ * a new console.  ph is the link in parserConsoles that points at c.
  */
 void
-ConsoleAdd(CONSENT *c)
+ConsoleAdd(CONSENT *c, CONSENT **ph)
 {
     CONSENT *pCEmatch = (CONSENT *)0;
     GRPENT *pGEmatch = (GRPENT *)0, *pGEtmp = (GRPENT *)0;
     CONSCLIENT *pCLtmp = (CONSCLIENT *)0;
 
     /* check for remote consoles */
-    if (!IsMe(c->master)) {
+    if (!MasterIsMe(c->master)) {
 	if (isMaster) {
 	    REMOTE *pRCTemp;
 	    if ((pRCTemp = (REMOTE *)calloc(1, sizeof(REMOTE)))
@@ -2681,23 +3167,17 @@ ConsoleAdd(CONSENT *c)
      * in the slave and a mix of real (new) and empty in the master.
      */
     if (!isStartup) {
-	CONSENT **ppCE;
+	OLDCONSOLE *oc;
 	/* hunt for a local match, "pCEmatch != (CONSENT *)0" if found */
 	pCEmatch = (CONSENT *)0;
-	for (pGEmatch = pGroupsOld; pGEmatch != (GRPENT *)0;
-	     pGEmatch = pGEmatch->pGEnext) {
-	    for (ppCE = &pGEmatch->pCElist, pCEmatch = pGEmatch->pCElist;
-		 pCEmatch != (CONSENT *)0;
-		 ppCE = &pCEmatch->pCEnext, pCEmatch = pCEmatch->pCEnext) {
-		if (strcasecmp(c->server, pCEmatch->server) == 0) {
-		    /* extract pCEmatch from the linked list */
-		    *ppCE = pCEmatch->pCEnext;
-		    pGEmatch->imembers--;
-		    break;
-		}
-	    }
-	    if (pCEmatch != (CONSENT *)0)
-		break;
+	if ((oc = (OLDCONSOLE *)NameMapFind(oldConsoles, c->server)) !=
+	    (OLDCONSOLE *)0) {
+	    NameMapDelete(oldConsoles, c->server, oc);
+	    pCEmatch = oc->pCE;
+	    pGEmatch = oc->pGE;
+	    /* take it out of the old group (see ConsoleDestroy()) */
+	    oc->pCE = (CONSENT *)0;
+	    pGEmatch->imembers--;
 	}
 
 	/* we're a child and we didn't find a match, next! */
@@ -2724,6 +3204,7 @@ ConsoleAdd(CONSENT *c)
 	    OutOfMem();
 	pGE = pGroups;
 	pGE->pid = -1;
+	pGE->hfd = -1;
 	pGE->id = groupID++;
     }
 
@@ -2735,22 +3216,14 @@ ConsoleAdd(CONSENT *c)
 	    OutOfMem();
 	pGE = pGE->pGEnext;
 	pGE->pid = -1;
+	pGE->hfd = -1;
 	pGE->id = groupID++;
     }
 
     /* ok, now for the hard part of the reread */
     if (pCEmatch == (CONSENT *)0) {	/* add new console */
-	CONSENT **ph = &parserConsoles;
-	while (*ph != (CONSENT *)0) {
-	    if (*ph == c) {
-		break;
-	    } else {
-		ph = &((*ph)->pCEnext);
-	    }
-	}
-
 	/* if we were in a chain... */
-	if (*ph != (CONSENT *)0) {
+	if (*ph == c) {
 	    /* unlink from the chain */
 	    *ph = c->pCEnext;
 	    /* and possibly fix tail ptr... */
@@ -2767,11 +3240,7 @@ ConsoleAdd(CONSENT *c)
     } else {			/* pCEmatch != (CONSENT *) 0  - modify console */
 	short closeMatch = 1;
 	/* see if the group is already staged */
-	for (pGEtmp = pGEstage; pGEtmp != (GRPENT *)0;
-	     pGEtmp = pGEtmp->pGEnext) {
-	    if (pGEtmp->id == pGEmatch->id)
-		break;
-	}
+	pGEtmp = pGEstaged[pGEmatch->id];
 
 	/* if not, allocate one, copy the data, and reset things */
 	if (pGEtmp == (GRPENT *)0) {
@@ -2782,8 +3251,9 @@ ConsoleAdd(CONSENT *c)
 	    /* copy the data */
 	    *pGEtmp = *pGEmatch;
 
-	    /* don't destroy the fake console */
+	    /* don't destroy the fake console (or close the handoff) */
 	    pGEmatch->pCEctl = (CONSENT *)0;
+	    pGEmatch->hfd = -1;
 
 	    /* prep counters and such */
 	    pGEtmp->pCElist = (CONSENT *)0;
@@ -2793,6 +3263,7 @@ ConsoleAdd(CONSENT *c)
 	    /* link in to the staging area */
 	    pGEtmp->pGEnext = pGEstage;
 	    pGEstage = pGEtmp;
+	    pGEstaged[pGEmatch->id] = pGEtmp;
 
 	    /* fix the free list (the easy one) */
 	    /* the ppCLbnext link needs to point to the new group */
@@ -2819,11 +3290,9 @@ ConsoleAdd(CONSENT *c)
 		    }
 		    pGEtmp->pCLall = pCLtmp;
 		    /* set file descriptors */
-		    FD_SET(FileFDNum(pCLtmp->fd), &rinit);
-		    if (maxfd < FileFDNum(pCLtmp->fd) + 1)
-			maxfd = FileFDNum(pCLtmp->fd) + 1;
+		    FDWatch(FileFDNum(pCLtmp->fd), FDWATCH_READ);
 		    if (!FileBufEmpty(pCLtmp->fd))
-			FD_SET(FileFDNum(pCLtmp->fd), &winit);
+			FDWatch(FileFDNum(pCLtmp->fd), FDWATCH_WRITE);
 		}
 	    }
 	}
@@ -2845,11 +3314,9 @@ ConsoleAdd(CONSENT *c)
 	    }
 	    pGEtmp->pCLall = pCLtmp;
 	    /* set file descriptors */
-	    FD_SET(FileFDNum(pCLtmp->fd), &rinit);
-	    if (maxfd < FileFDNum(pCLtmp->fd) + 1)
-		maxfd = FileFDNum(pCLtmp->fd) + 1;
+	    FDWatch(FileFDNum(pCLtmp->fd), FDWATCH_READ);
 	    if (!FileBufEmpty(pCLtmp->fd))
-		FD_SET(FileFDNum(pCLtmp->fd), &winit);
+		FDWatch(FileFDNum(pCLtmp->fd), FDWATCH_WRITE);
 	}
 
 	/* add the original console to the new group */
@@ -2858,26 +3325,20 @@ ConsoleAdd(CONSENT *c)
 	pGEtmp->imembers++;
 	if (pCEmatch->cofile != (CONSFILE *)0) {
 	    int cofile = FileFDNum(pCEmatch->cofile);
-	    FD_SET(cofile, &rinit);
-	    if (maxfd < cofile + 1)
-		maxfd = cofile + 1;
+	    FDWatch(cofile, FDWATCH_READ);
 	    if (!FileBufEmpty(pCEmatch->cofile))
-		FD_SET(cofile, &winit);
+		FDWatch(cofile, FDWATCH_WRITE);
 	}
 
 	if (pCEmatch->initfile != (CONSFILE *)0) {
 	    int initfile = FileFDNum(pCEmatch->initfile);
-	    FD_SET(initfile, &rinit);
-	    if (maxfd < initfile + 1)
-		maxfd = initfile + 1;
+	    FDWatch(initfile, FDWATCH_READ);
 	    if (!FileBufEmpty(pCEmatch->initfile))
-		FD_SET(FileFDOutNum(pCEmatch->initfile), &winit);
+		FDWatch(FileFDOutNum(pCEmatch->initfile), FDWATCH_WRITE);
 	}
 	if (pCEmatch->taskfile != (CONSFILE *)0) {
 	    int taskfile = FileFDNum(pCEmatch->taskfile);
-	    FD_SET(taskfile, &rinit);
-	    if (maxfd < taskfile + 1)
-		maxfd = taskfile + 1;
+	    FDWatch(taskfile, FDWATCH_READ);
 	}
 
 	/* now check for any changes between pCEmatch & c.
@@ -3107,18 +3568,42 @@ ConsoleAdd(CONSENT *c)
 
 	/* and now the rest (minus the "runtime" members - see below) */
 	pCEmatch->idletimeout = c->idletimeout;
-	if (pCEmatch->idletimeout != (time_t)0 &&
-	    (timers[T_CIDLE] == (time_t)0 ||
-	     timers[T_CIDLE] >
-	     pCEmatch->lastWrite + pCEmatch->idletimeout))
-	    timers[T_CIDLE] = pCEmatch->lastWrite + pCEmatch->idletimeout;
+	if (pCEmatch->idletimeout == 0)
+	    ConsTimerClear(pCEmatch, CT_IDLE);
+	else if (pCEmatch->fup && pCEmatch->ioState == ISNORMAL &&
+		 pCEmatch->ctslot[CT_IDLE] == 0)
+	    ConsTimerSet(pCEmatch, CT_IDLE, pCEmatch->idletimeout);
 
 	pCEmatch->logfilemax = c->logfilemax;
-	if (pCEmatch->logfilemax != (off_t) 0 &&
-	    timers[T_ROLL] == (time_t)0)
-	    timers[T_ROLL] = time((time_t *)0);
+	if (pCEmatch->logfilemax == (off_t) 0)
+	    ConsTimerClear(pCEmatch, CT_LOGROLL);
+	else if (pCEmatch->logsize >= pCEmatch->logfilemax &&
+		 pCEmatch->ctslot[CT_LOGROLL] == 0)
+	    ConsTimerSet(pCEmatch, CT_LOGROLL, 0);
+	pCEmatch->logfilekeep = c->logfilekeep;
+	/* only new logfiles see it, the current one keeps its format */
+	pCEmatch->logformat = c->logformat;
+	pCEmatch->logfileage = c->logfileage;
+
+	pCEmatch->outputlimit = c->outputlimit;
+	pCEmatch->outputpolicy = c->outputpolicy;
+	pCEmatch->logbuffer = c->logbuffer;
+	pCEmatch->logflush = c->logflush;
+	pCEmatch->loglines = c->loglines;
+	if (pCEmatch->logsync != c->logsync) {
+	    pCEmatch->logsync = c->logsync;
+	    ConsTimerClear(pCEmatch, CT_LOGSYNC);
+	}
+	/* write out anything buffered under the old rules */
+	LogFlush(pCEmatch);
+	if (pCEmatch->scrollback != c->scrollback) {
+	    pCEmatch->scrollback = c->scrollback;
+	    if (pCEmatch->sb != (SCROLLBACK *)0)
+		ScrollbackInit(pCEmatch);
+	}
 
 	SwapStr(&pCEmatch->motd, &c->motd);
+	SwapStr(&pCEmatch->logcompress, &c->logcompress);
 	SwapStr(&pCEmatch->idlestring, &c->idlestring);
 	SwapStr(&pCEmatch->replstring, &c->breaklist);
 	SwapStr(&pCEmatch->tasklist, &c->tasklist);
@@ -3133,6 +3618,7 @@ ConsoleAdd(CONSENT *c)
 	pCEmatch->raw = c->raw;
 	pCEmatch->mark = c->mark;
 	pCEmatch->nextMark = c->nextMark;
+	ConsMarkReset(pCEmatch);
 	pCEmatch->breakNum = c->breakNum;
 	pCEmatch->ondemand = c->ondemand;
 	pCEmatch->striphigh = c->striphigh;
@@ -3140,6 +3626,8 @@ ConsoleAdd(CONSENT *c)
 	pCEmatch->autoreinit = c->autoreinit;
 	pCEmatch->unloved = c->unloved;
 	pCEmatch->login = c->login;
+	/* like logformat, it's up to the next logfile opened */
+	pCEmatch->logindex = c->logindex;
 	pCEmatch->inituid = c->inituid;
 	pCEmatch->initgid = c->initgid;
 	while (pCEmatch->aliases != (NAMES *)0) {
@@ -3180,10 +3668,16 @@ ConsoleDestroy(void)
     GRPENT *pGEtmp = (GRPENT *)0;
     CONSENT *c = (CONSENT *)0;
     CONSENT *cNext = (CONSENT *)0;
+    CONSENT **ppc = (CONSENT **)0;
     REMOTE *pRCtmp = (REMOTE *)0;
+    int i;
 
     CONDDEBUG((1, "ConsoleDestroy() [%s:%d]", file, line));
 
+    /* done parsing, so done looking up names */
+    NameMapDestroy(&parserServers);
+    NameMapDestroy(&parserNames);
+
     /* move aside any existing groups */
     pGroupsOld = pGroups;
     pGroups = (GRPENT *)0;
@@ -3191,6 +3685,34 @@ ConsoleDestroy(void)
     /* init other trackers */
     pGE = pGEstage = (GRPENT *)0;
 
+    /* index the old consoles so ConsoleAdd() finds each one directly.
+     * the old groups' console lists are taken apart here and whatever
+     * ConsoleAdd() doesn't claim is put back afterwards, so claiming
+     * one doesn't mean hunting for it in its list
+     */
+    if (!isStartup) {
+	for (i = 0, pGEtmp = pGroupsOld; pGEtmp != (GRPENT *)0;
+	     pGEtmp = pGEtmp->pGEnext)
+	    i += pGEtmp->imembers;
+	if ((oldConsoleList =
+	     (OLDCONSOLE *)calloc(i + 1, sizeof(OLDCONSOLE))) ==
+	    (OLDCONSOLE *)0 ||
+	    (pGEstaged =
+	     (GRPENT **)calloc(groupID, sizeof(GRPENT *))) == (GRPENT **)0)
+	    OutOfMem();
+	oldConsoles = NameMapNew();
+	for (i = 0, pGEtmp = pGroupsOld; pGEtmp != (GRPENT *)0;
+	     pGEtmp = pGEtmp->pGEnext) {
+	    for (c = pGEtmp->pCElist; c != (CONSENT *)0; c = c->pCEnext) {
+		oldConsoleList[i].pCE = c;
+		oldConsoleList[i].pGE = pGEtmp;
+		NameMapAdd(oldConsoles, c->server, &oldConsoleList[i++]);
+	    }
+	    pGEtmp->pCElist = (CONSENT *)0;
+	}
+	oldConsoleCount = i;
+    }
+
     /* nuke the old remote consoles */
     while (pRCList != (REMOTE *)0) {
 	pRCtmp = pRCList->pRCnext;
@@ -3203,7 +3725,8 @@ ConsoleDestroy(void)
      * this will potentially adjust parserConsoles/parserConsolesTail
      * so we need to peek at the pCEnext pointer ahead of time
      */
-    for (c = parserConsoles; c != (CONSENT *)0; c = cNext) {
+    for (ppc = &parserConsoles, c = parserConsoles; c != (CONSENT *)0;
+	 c = cNext) {
 	/* time to set some defaults and fix up values */
 
 #if HAVE_FREEIPMI
@@ -3301,6 +3824,18 @@ ConsoleDestroy(void)
 	    (c->idlestring = StrDup("\\n")) == (char *)0)
 	    OutOfMem();
 
+	/* slow clients lose their oldest output by default */
+	if (c->outputpolicy == UNKNOWNPOLICY)
+	    c->outputpolicy = OPDROP;
+
+	/* and logfile writes are collected unless told otherwise */
+	if (c->logbuffer == 0)
+	    c->logbuffer = LOGBUFFERSIZE;
+	if (c->logflush == 0)
+	    c->logflush = LOGFLUSHTIME;
+	if (c->logformat == UNKNOWNFORMAT)
+	    c->logformat = LFPLAIN;
+
 	/* set the options that default true */
 	if (c->autoreinit == FLAGUNKNOWN)
 	    c->autoreinit = FLAGTRUE;
@@ -3342,6 +3877,8 @@ ConsoleDestroy(void)
 	    c->unloved = FLAGFALSE;
 	if (c->login == FLAGUNKNOWN)
 	    c->login = FLAGTRUE;
+	if (c->logindex == FLAGUNKNOWN)
+	    c->logindex = FLAGTRUE;
 
 	/* set some forced options, based on situations */
 	if (c->type == NOOP) {
@@ -3432,7 +3969,28 @@ ConsoleDestroy(void)
 	    BuildStringChar('}', s);
 	    Msg("%s", s->string);
 	}
-	ConsoleAdd(c);
+	ConsoleAdd(c, ppc);
+	/* still in the list (remote, or matched an old console)? */
+	if (*ppc == c)
+	    ppc = &c->pCEnext;
+    }
+
+    NameMapDestroy(&oldConsoles);
+    NameMapDestroy(&masters);
+    if (oldConsoleList != (OLDCONSOLE *)0) {
+	/* the unclaimed old consoles go back where they were */
+	for (i = oldConsoleCount - 1; i >= 0; i--) {
+	    if ((c = oldConsoleList[i].pCE) == (CONSENT *)0)
+		continue;
+	    c->pCEnext = oldConsoleList[i].pGE->pCElist;
+	    oldConsoleList[i].pGE->pCElist = c;
+	}
+	free(oldConsoleList);
+	oldConsoleList = (OLDCONSOLE *)0;
+    }
+    if (pGEstaged != (GRPENT **)0) {
+	free(pGEstaged);
+	pGEstaged = (GRPENT **)0;
     }
 
     /* go through and nuke groups (if a child or are empty) */
@@ -3525,6 +4083,205 @@ FindConsoleName(CONSENT *c, char *id)
     return c;
 }
 
+/* the console name index.  every name and alias of the local consoles
+ * (in groups with members) and of the remote consoles, sorted by
+ * lowercased name so a prefix is a binary search and a scan, and
+ * hashed for exact matches.  it's thrown away whenever the
+ * configuration changes and rebuilt on the next lookup.
+ */
+static NAMEREF *nameRefs = (NAMEREF *)0;
+static int nameRefCount = -1;	/* -1 means it needs a rebuild */
+static char *nameKeys = (char *)0;
+static int *nameHash = (int *)0;
+static unsigned long nameHashMask = 0;
+static NAMEREF **nameFound = (NAMEREF **)0;
+
+void
+NameIndexDrop(void)
+{
+    if (nameRefs != (NAMEREF *)0) {
+	free(nameRefs);
+	nameRefs = (NAMEREF *)0;
+    }
+    if (nameKeys != (char *)0) {
+	free(nameKeys);
+	nameKeys = (char *)0;
+    }
+    if (nameHash != (int *)0) {
+	free(nameHash);
+	nameHash = (int *)0;
+    }
+    if (nameFound != (NAMEREF **)0) {
+	free(nameFound);
+	nameFound = (NAMEREF **)0;
+    }
+    nameRefCount = -1;
+}
+
+static int
+NameRefCmp(const void *a, const void *b)
+{
+    const NAMEREF *ra = a, *rb = b;
+    int r;
+
+    if ((r = strcmp(ra->key, rb->key)) != 0)
+	return r;
+    return ra->seq - rb->seq;
+}
+
+static int
+NameRefSeqCmp(const void *a, const void *b)
+{
+    return (*(NAMEREF **)a)->seq - (*(NAMEREF **)b)->seq;
+}
+
+static void
+NameRefAdd(char *name, CONSENT *pCE, REMOTE *pRC, GRPENT *pGE,
+	   char **keys)
+{
+    NAMEREF *r = &nameRefs[nameRefCount];
+    char *k;
+
+    r->key = *keys;
+    for (k = name; *k != '\000'; k++)
+	*(*keys)++ = tolower((unsigned char)*k);
+    *(*keys)++ = '\000';
+    r->name = name;
+    r->pCE = pCE;
+    r->pRC = pRC;
+    r->pGE = pGE;
+    r->seq = nameRefCount++;
+}
+
+static void
+NameIndexBuild(void)
+{
+    GRPENT *pGEi;
+    CONSENT *pCE;
+    REMOTE *pRC;
+    NAMES *n;
+    int count = 0, i;
+    size_t len = 0;
+    unsigned long h;
+    char *keys;
+
+    NameIndexDrop();
+
+    for (pGEi = pGroups; pGEi != (GRPENT *)0; pGEi = pGEi->pGEnext) {
+	if (pGEi->imembers == 0)
+	    continue;
+	for (pCE = pGEi->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
+	    count++;
+	    len += strlen(pCE->server) + 1;
+	    for (n = pCE->aliases; n != (NAMES *)0; n = n->next) {
+		count++;
+		len += strlen(n->name) + 1;
+	    }
+	}
+    }
+    for (pRC = pRCList; pRC != (REMOTE *)0; pRC = pRC->pRCnext) {
+	count++;
+	len += strlen(pRC->rserver) + 1;
+	for (n = pRC->aliases; n != (NAMES *)0; n = n->next) {
+	    count++;
+	    len += strlen(n->name) + 1;
+	}
+    }
+
+    for (nameHashMask = 1; nameHashMask < 2 * count; nameHashMask <<= 1);
+    if ((nameRefs =
+	 (NAMEREF *)malloc((count + 1) * sizeof(NAMEREF))) == (NAMEREF *)0
+	|| (nameKeys = (char *)malloc(len + 1)) == (char *)0 ||
+	(nameHash = (int *)malloc(nameHashMask * sizeof(int))) == (int *)0
+	|| (nameFound =
+	    (NAMEREF **)malloc((count + 1) * sizeof(NAMEREF *))) ==
+	(NAMEREF **)0)
+	OutOfMem();
+    nameHashMask--;
+
+    /* configuration order, which is what the matching rules go by */
+    nameRefCount = 0;
+    keys = nameKeys;
+    for (pGEi = pGroups; pGEi != (GRPENT *)0; pGEi = pGEi->pGEnext) {
+	if (pGEi->imembers == 0)
+	    continue;
+	for (pCE = pGEi->pCElist; pCE != (CONSENT *)0; pCE = pCE->pCEnext) {
+	    NameRefAdd(pCE->server, pCE, (REMOTE *)0, pGEi, &keys);
+	    for (n = pCE->aliases; n != (NAMES *)0; n = n->next)
+		NameRefAdd(n->name, pCE, (REMOTE *)0, pGEi, &keys);
+	}
+    }
+    for (pRC = pRCList; pRC != (REMOTE *)0; pRC = pRC->pRCnext) {
+	NameRefAdd(pRC->rserver, (CONSENT *)0, pRC, (GRPENT *)0, &keys);
+	for (n = pRC->aliases; n != (NAMES *)0; n = n->next)
+	    NameRefAdd(n->name, (CONSENT *)0, pRC, (GRPENT *)0, &keys);
+    }
+
+    qsort(nameRefs, nameRefCount, sizeof(NAMEREF), NameRefCmp);
+
+    /* chains are built back to front so each runs in sorted order */
+    for (h = 0; h <= nameHashMask; h++)
+	nameHash[h] = -1;
+    for (i = nameRefCount - 1; i >= 0; i--) {
+	h = NameHash(nameRefs[i].key) & nameHashMask;
+	nameRefs[i].next = nameHash[h];
+	nameHash[h] = i;
+    }
+
+    CONDDEBUG((1, "NameIndexBuild(): %d names", nameRefCount));
+}
+
+/* find the console names matching `id' (case-insensitive), either
+ * exactly or, with `prefix', all those starting with it.  *refs is
+ * set to the matches in configuration order (local consoles, then
+ * remote ones, each name followed by its aliases) and stays valid
+ * until the next call or configuration change.  returns the count.
+ */
+int
+FindConsoleRefs(char *id, FLAG prefix, NAMEREF ***refs)
+{
+    static STRING *key = (STRING *)0;
+    int found = 0, lo, hi, mid;
+    size_t len;
+    char *k, *lid;
+
+    if (nameRefCount < 0)
+	NameIndexBuild();
+    *refs = nameFound;
+
+    if (key == (STRING *)0)
+	key = AllocString();
+    BuildString((char *)0, key);
+    for (k = id; *k != '\000'; k++)
+	BuildStringChar(tolower((unsigned char)*k), key);
+    lid = (key->used == 0) ? "" : key->string;
+    len = strlen(lid);
+
+    if (prefix != FLAGTRUE) {
+	for (lo = nameHash[NameHash(lid) & nameHashMask]; lo >= 0;
+	     lo = nameRefs[lo].next) {
+	    if (strcmp(nameRefs[lo].key, lid) == 0)
+		nameFound[found++] = &nameRefs[lo];
+	}
+	return found;
+    }
+
+    /* first key not less than the prefix */
+    for (lo = 0, hi = nameRefCount; lo < hi;) {
+	mid = lo + (hi - lo) / 2;
+	if (strcmp(nameRefs[mid].key, lid) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (; lo < nameRefCount &&
+	 strncmp(nameRefs[lo].key, lid, len) == 0; lo++)
+	nameFound[found++] = &nameRefs[lo];
+    if (found > 1)
+	qsort(nameFound, found, sizeof(NAMEREF *), NameRefSeqCmp);
+    return found;
+}
+
 void
 ConsoleItemAliases(char *id)
 {
@@ -3545,7 +4302,8 @@ ConsoleItemAliases(char *id)
     }
     for (token = strtok(id, ALLWORDSEP); token != (char *)0;
 	 token = strtok(NULL, ALLWORDSEP)) {
-	if ((c = FindConsoleName(parserConsoles, token)) != (CONSENT *)0) {
+	if ((c = (CONSENT *)NameMapFind(parserNames, token)) !=
+	    (CONSENT *)0) {
 	    if (isMaster)
 		Error
 		    ("alias name `%s' invalid: already in use by console `%s' [%s:%d]",
@@ -3716,6 +4474,62 @@ ConsoleItemLogfilemax(char *id)
     ProcessLogfilemax(parserConsoleTemp, id);
 }
 
+void
+ConsoleItemLogformat(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogformat(%s) [%s:%d]", id, file, line));
+    ProcessLogformat(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLogfilekeep(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogfilekeep(%s) [%s:%d]", id, file, line));
+    ProcessLogfilekeep(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLogfileage(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogfileage(%s) [%s:%d]", id, file, line));
+    ProcessLogfileage(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLogcompress(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogcompress(%s) [%s:%d]", id, file, line));
+    ProcessLogcompress(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLogbuffer(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogbuffer(%s) [%s:%d]", id, file, line));
+    ProcessLogbuffer(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLogflush(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogflush(%s) [%s:%d]", id, file, line));
+    ProcessLogflush(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLoglines(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLoglines(%s) [%s:%d]", id, file, line));
+    ProcessLoglines(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemLogsync(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemLogsync(%s) [%s:%d]", id, file, line));
+    ProcessLogsync(parserConsoleTemp, id);
+}
+
 void
 ConsoleItemInitcmd(char *id)
 {
@@ -3751,6 +4565,20 @@ ConsoleItemOptions(char *id)
     ProcessOptions(parserConsoleTemp, id);
 }
 
+void
+ConsoleItemOutputlimit(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemOutputlimit(%s) [%s:%d]", id, file, line));
+    ProcessOutputlimit(parserConsoleTemp, id);
+}
+
+void
+ConsoleItemOutputpolicy(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemOutputpolicy(%s) [%s:%d]", id, file, line));
+    ProcessOutputpolicy(parserConsoleTemp, id);
+}
+
 void
 ConsoleItemParity(char *id)
 {
@@ -3851,6 +4679,13 @@ ConsoleItemRw(char *id)
     ProcessRoRw(&(parserConsoleTemp->rw), id);
 }
 
+void
+ConsoleItemScrollback(char *id)
+{
+    CONDDEBUG((1, "ConsoleItemScrollback(%s) [%s:%d]", id, file, line));
+    ProcessScrollback(parserConsoleTemp, id);
+}
+
 void
 ConsoleItemTimestamp(char *id)
 {
@@ -4093,6 +4928,8 @@ AccessDestroy(void)
 	DestroyParserAccess(parserAccesses);
     DestroyParserAccess(parserAccessTemp);
     parserAccesses = parserAccessTemp = (PARSERACCESS *)0;
+
+    AccessCompile();
 }
 
 void
@@ -4368,6 +5205,8 @@ ConfigEnd(void)
 		pConfig->reinitcheck = parserConfigTemp->reinitcheck;
 	    if (parserConfigTemp->initdelay != 0)
 		pConfig->initdelay = parserConfigTemp->initdelay;
+	    if (parserConfigTemp->passwdcache != 0)
+		pConfig->passwdcache = parserConfigTemp->passwdcache;
 	    if (parserConfigTemp->secondaryport != (char *)0) {
 		if (pConfig->secondaryport != (char *)0)
 		    free(pConfig->secondaryport);
@@ -4601,6 +5440,32 @@ ConfigItemInitdelay(char *id)
     parserConfigTemp->initdelay = atoi(id);
 }
 
+void
+ConfigItemPasswdcache(char *id)
+{
+    char *p;
+
+    CONDDEBUG((1, "ConfigItemPasswdcache(%s) [%s:%d]", id, file, line));
+
+    if ((id == (char *)0) || (*id == '\000')) {
+	parserConfigTemp->passwdcache = 0;
+	return;
+    }
+
+    for (p = id; *p != '\000'; p++)
+	if (!isdigit((int)(*p)))
+	    break;
+
+    /* if it wasn't a number */
+    if (*p != '\000') {
+	if (isMaster)
+	    Error("invalid passwdcache value `%s' [%s:%d]", id, file,
+		  line);
+	return;
+    }
+    parserConfigTemp->passwdcache = atoi(id);
+}
+
 void
 ConfigItemSecondaryport(char *id)
 {
@@ -4878,11 +5743,21 @@ ITEM keyDefault[] = {
     {"initspinmax", DefaultItemInitspinmax},
     {"initspintimer", DefaultItemInitspintimer},
     {"initsubst", DefaultItemInitsubst},
+    {"logbuffer", DefaultItemLogbuffer},
+    {"logcompress", DefaultItemLogcompress},
     {"logfile", DefaultItemLogfile},
+    {"logfileage", DefaultItemLogfileage},
+    {"logfilekeep", DefaultItemLogfilekeep},
     {"logfilemax", DefaultItemLogfilemax},
+    {"logflush", DefaultItemLogflush},
+    {"logformat", DefaultItemLogformat},
+    {"loglines", DefaultItemLoglines},
+    {"logsync", DefaultItemLogsync},
     {"master", DefaultItemMaster},
     {"motd", DefaultItemMOTD},
     {"options", DefaultItemOptions},
+    {"outputlimit", DefaultItemOutputlimit},
+    {"outputpolicy", DefaultItemOutputpolicy},
     {"parity", DefaultItemParity},
     {"port", DefaultItemPort},
     {"portbase", DefaultItemPortbase},
@@ -4891,6 +5766,7 @@ ITEM keyDefault[] = {
     {"replstring", DefaultItemReplstring},
     {"ro", DefaultItemRo},
     {"rw", DefaultItemRw},
+    {"scrollback", DefaultItemScrollback},
     {"tasklist", DefaultItemTasklist},
     {"timestamp", DefaultItemTimestamp},
     {"type", DefaultItemType},
@@ -4927,11 +5803,21 @@ ITEM keyConsole[] = {
     {"initspinmax", ConsoleItemInitspinmax},
     {"initspintimer", ConsoleItemInitspintimer},
     {"initsubst", ConsoleItemInitsubst},
+    {"logbuffer", ConsoleItemLogbuffer},
+    {"logcompress", ConsoleItemLogcompress},
     {"logfile", ConsoleItemLogfile},
+    {"logfileage", ConsoleItemLogfileage},
+    {"logfilekeep", ConsoleItemLogfilekeep},
     {"logfilemax", ConsoleItemLogfilemax},
+    {"logflush", ConsoleItemLogflush},
+    {"logformat", ConsoleItemLogformat},
+    {"loglines", ConsoleItemLoglines},
+    {"logsync", ConsoleItemLogsync},
     {"master", ConsoleItemMaster},
     {"motd", ConsoleItemMOTD},
     {"options", ConsoleItemOptions},
+    {"outputlimit", ConsoleItemOutputlimit},
+    {"outputpolicy", ConsoleItemOutputpolicy},
     {"parity", ConsoleItemParity},
     {"port", ConsoleItemPort},
     {"portbase", ConsoleItemPortbase},
@@ -4940,6 +5826,7 @@ ITEM keyConsole[] = {
     {"replstring", ConsoleItemReplstring},
     {"ro", ConsoleItemRo},
     {"rw", ConsoleItemRw},
+    {"scrollback", ConsoleItemScrollback},
     {"tasklist", ConsoleItemTasklist},
     {"timestamp", ConsoleItemTimestamp},
     {"type", ConsoleItemType},
@@ -4973,6 +5860,7 @@ ITEM keyConfig[] = {
     {"initdelay", ConfigItemInitdelay},
     {"logfile", ConfigItemLogfile},
     {"loghostnames", ConfigItemLoghostnames},
+    {"passwdcache", ConfigItemPasswdcache},
     {"passwdfile", ConfigItemPasswordfile},
     {"primaryport", ConfigItemPrimaryport},
     {"redirect", ConfigItemRedirect},
@@ -5015,6 +5903,9 @@ ReadCfg(char *filename, FILE *fp)
 #endif
     isStartup = (pGroups == (GRPENT *)0 && pRCList == (REMOTE *)0);
 
+    /* the name index points into what we're about to rework */
+    NameIndexDrop();
+
     /* initialize the break lists */
     for (i = 0; i < BREAKLISTSIZE; i++) {
 	if (breakList[i].seq == (STRING *)0) {
@@ -5048,8 +5939,33 @@ ReadCfg(char *filename, FILE *fp)
     /* initialize the substition bits */
     InitSubstCallback();
 
-    /* ready to read in the data */
-    ParseFile(filename, fp, 0);
+    /* ready to read in the data - from the snapshot, if we've got one
+     * and it's still good (and then we write a new one)
+     */
+    if (pcSnapshot == (char *)0) {
+	ParseFile(filename, fp, 0);
+    } else if (fSyntaxOnly) {
+	SnapshotRecord(FLAGTRUE);
+	ParseFile(filename, fp, 0);
+	if (SnapshotCompare(pcSnapshot) == 0)
+	    Msg("snapshot `%s' is current", pcSnapshot);
+	else
+	    Error("snapshot `%s' is stale", pcSnapshot);
+	SnapshotRecord(FLAGFALSE);
+    } else if (SnapshotReplay(pcSnapshot, filename) == 0) {
+	Verbose("configuration read from snapshot `%s'", pcSnapshot);
+    } else {
+	int errors = fErrorPrinted;
+
+	/* only a clean parse is worth keeping */
+	fErrorPrinted = 0;
+	SnapshotRecord(FLAGTRUE);
+	ParseFile(filename, fp, 0);
+	if (isMaster && !fErrorPrinted)
+	    SnapshotSave(pcSnapshot);
+	SnapshotRecord(FLAGFALSE);
+	fErrorPrinted |= errors;
+    }
 
 #if HAVE_DMALLOC && DMALLOC_MARK_READCFG
     CONDDEBUG((1, "ReadCfg(): dmalloc / MarkReadCfg"));
@@ -5061,6 +5977,8 @@ void
 ReReadCfg(int fd, int msfd)
 {
     FILE *fpConfig;
+    struct timeval start, done;
+    long ms;
 
     if ((FILE *)0 == (fpConfig = fopen(pcConfig, "r"))) {
 	if (isMaster)
@@ -5068,18 +5986,25 @@ ReReadCfg(int fd, int msfd)
 	return;
     }
 
-    FD_ZERO(&rinit);
-    FD_ZERO(&winit);
-    if (fd > 0) {
-	FD_SET(fd, &rinit);
-	if (maxfd < fd + 1)
-	    maxfd = fd + 1;
-    }
+    FDWatchReset();
+    if (fd > 0)
+	FDWatch(fd, FDWATCH_READ);
 
+    TimerNow(&start);
     ReadCfg(pcConfig, fpConfig);
+    TimerNow(&done);
 
     fclose(fpConfig);
 
+    /* a group process isn't reading its consoles while it does this,
+     * so say so when it takes a while
+     */
+    ms = (done.tv_sec - start.tv_sec) * 1000L +
+	(done.tv_usec - start.tv_usec) / 1000L;
+    if (isMaster || ms >= 1000)
+	Msg("configuration reread in %ld.%03ld seconds", ms / 1000,
+	    ms % 1000);
+
     if (pGroups == (GRPENT *)0 && pRCList == (REMOTE *)0) {
 	if (isMaster) {
 	    Error("no consoles found in configuration file");
@@ -5196,6 +6121,14 @@ ReReadCfg(int fd, int msfd)
 	    config->initdelay = pConfig->initdelay;
 	/* gets used on-the-fly */
     }
+
+    if (optConf->passwdcache == 0) {
+	if (pConfig->passwdcache == 0)
+	    config->passwdcache = defConfig.passwdcache;
+	else if (pConfig->passwdcache != config->passwdcache)
+	    config->passwdcache = pConfig->passwdcache;
+	/* gets used on-the-fly */
+    }
 #if HAVE_OPENSSL
     if (optConf->sslrequired == FLAGUNKNOWN) {
 	if (pConfig->sslrequired == FLAGUNKNOWN)
@@ -5383,3 +6316,76 @@ ReReadCfg(int fd, int msfd)
     }
 #endif
 }
+
+/* would a fresh copy of us (see MasterUpgrade()) put each console in
+ * the group it's in now?  rereads leave consoles where they were, so
+ * the groups depend on history, while a fresh read just fills them in
+ * config order - and an upgraded group only takes back consoles that
+ * are still its own.  the only way to tell is to read the config from
+ * scratch, which is done in a child so nothing here is disturbed
+ * (we wait for it, so it holds up the master for that long).  returns
+ * 1 if the layout would stay the same, 0 if not, -1 if we can't tell.
+ */
+int
+UpgradeLayoutSame(void)
+{
+    int pfd[2], fd;
+    pid_t pid;
+    char c = '\000';
+    FILE *fpConfig;
+    NAMEMAP *was;
+    GRPENT *pGEold, *pGEnew;
+    CONSENT *pCE;
+
+    if (pipe(pfd) < 0) {
+	Error("UpgradeLayoutSame(): pipe(): %s", strerror(errno));
+	return -1;
+    }
+    switch (pid = fork()) {
+	case -1:
+	    Error("UpgradeLayoutSame(): fork(): %s", strerror(errno));
+	    close(pfd[0]);
+	    close(pfd[1]);
+	    return -1;
+	case 0:
+	    close(pfd[0]);
+	    /* anything wrong with the config gets said on the reread */
+	    if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+	    }
+	    was = NameMapNew();
+	    for (pGEold = pGroups; pGEold != (GRPENT *)0;
+		 pGEold = pGEold->pGEnext)
+		for (pCE = pGEold->pCElist; pCE != (CONSENT *)0;
+		     pCE = pCE->pCEnext)
+		    NameMapAdd(was, pCE->server, pGEold);
+	    pGroups = (GRPENT *)0;
+	    pRCList = (REMOTE *)0;
+	    groupID = 1;
+	    pcSnapshot = (char *)0;
+	    if ((fpConfig = fopen(pcConfig, "r")) != (FILE *)0) {
+		ReadCfg(pcConfig, fpConfig);
+		c = '1';
+		for (pGEnew = pGroups; pGEnew != (GRPENT *)0 && c == '1';
+		     pGEnew = pGEnew->pGEnext)
+		    for (pCE = pGEnew->pCElist; pCE != (CONSENT *)0;
+			 pCE = pCE->pCEnext)
+			if ((pGEold =
+			     (GRPENT *)NameMapFind(was, pCE->server)) !=
+			    (GRPENT *)0 && pGEold->id != pGEnew->id) {
+			    c = '0';
+			    break;
+			}
+	    }
+	    write(pfd[1], &c, 1);
+	    _exit(EX_OK);
+	default:
+	    break;
+    }
+    close(pfd[1]);
+    while (read(pfd[0], &c, 1) < 0 && errno == EINTR);
+    close(pfd[0]);
+    while (waitpid(pid, (int *)0, 0) < 0 && errno == EINTR);
+    return (c == '1') ? 1 : (c == '0') ? 0 : -1;
+}
@@ -22,6 +22,7 @@ typedef struct config {
     char *secondaryport;
     char *unifiedlog;
     int initdelay;
+    int passwdcache;
 #if HAVE_SETPROCTITLE
     FLAG setproctitle;
 #endif
@@ -50,6 +51,18 @@ typedef struct tasks {
     struct tasks *next;
 } TASKS;
 
+/* one console name or alias in the lookup index (see FindConsoleRefs())
+ */
+typedef struct nameRef {
+    char *key;			/* name, lowercased */
+    char *name;			/* name as configured */
+    CONSENT *pCE;		/* the local console it names, or */
+    REMOTE *pRC;		/* the remote console it names */
+    GRPENT *pGE;		/* group of a local console */
+    int seq;			/* position in configuration order */
+    int next;			/* next in the hash chain */
+} NAMEREF;
+
 extern NAMES *userList;		/* user list */
 extern GRPENT *pGroups;		/* group info */
 extern REMOTE *pRCList;		/* list of remote consoles we know about */
@@ -65,6 +78,7 @@ extern SUBST *substData;	/* substitution function data */
 
 extern void ReadCfg(char *, FILE *);
 extern void ReReadCfg(int, int);
+extern int UpgradeLayoutSame(void);
 extern void DestroyBreakList(void);
 extern void InitBreakList(void);
 extern void DestroyTaskList(void);
@@ -73,3 +87,5 @@ extern void DestroyConfig(CONFIG *);
 extern NAMES *FindUserList(char *);
 extern NAMES *AddUserList(char *);
 extern CONSENT *FindConsoleName(CONSENT *, char *);
+extern int FindConsoleRefs(char *, FLAG, NAMEREF ***);
+extern void NameIndexDrop(void);
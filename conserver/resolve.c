@@ -0,0 +1,719 @@
+/*
+ *  Copyright conserver.com, 2000
+ *
+ *  Maintainer/Enhancer: Bryan Stansell (bryan@conserver.com)
+ */
+
+/*
+ * gethostbyname() and friends take as long as the nameservers like,
+ * and the master and group processes can't wait that long - they're
+ * serving everyone else.  so the lookups go to helper processes over
+ * socketpairs (a few, so one slow name doesn't hold up the rest) and
+ * the answers (and the failures) are cached here for a while.  callers
+ * get RESOLVE_PENDING until an answer shows up and try again once
+ * ResolveReady() says something arrived.
+ */
+
+#include <compat.h>
+
+#include <cutil.h>
+#include <resolve.h>
+
+#if USE_IPV6
+# include <sys/socket.h>
+# include <netdb.h>
+#endif
+
+#define RESOLVEPOSTTL	300	/* seconds an answer is good for */
+#define RESOLVENEGTTL	60	/* seconds a failure is good for */
+#define RESOLVEMAX	1024	/* answers we keep, oldest go first */
+#define RESOLVEMAXMSG	65536	/* biggest request the helper takes */
+#define RESOLVEHELPERS	4	/* so one slow lookup doesn't hold up all */
+
+/* a request is the header and the key ('r' and an address, or 'f'
+ * and a hostname).  an answer is the header, the key, and then
+ * hdr.count answers.  the strings are all nul terminated.
+ */
+typedef struct resolveHdr {
+    int ok;
+    int count;
+    int len;			/* bytes after the header */
+} RESOLVEHDR;
+
+/* someone (a console, say) to hand back through ResolveWaiter() once
+ * the lookup it's waiting on is done
+ */
+typedef struct resolveWait {
+    void *who;
+    struct resolveWait *next;
+} RESOLVEWAIT;
+
+typedef struct resolveEnt {
+    char *key;
+    int state;			/* RESOLVE_* */
+    time_t expires;
+    char **list;		/* (char *)0 terminated answers */
+    int helper;			/* who's working on it */
+    RESOLVEWAIT *waiters;	/* while it's RESOLVE_PENDING */
+    struct resolveEnt *pREnext;	/* in the order they were asked for */
+    struct resolveEnt **ppREbnext;
+} RESOLVEENT;
+
+typedef struct resolveBuf {
+    char *buf;
+    int used;
+    int allocated;
+} RESOLVEBUF;
+
+/* helpers are started as they're needed, and a slot with a pid of 0
+ * doesn't have one
+ */
+static struct resolveHelper {
+    pid_t pid;
+    int fd;
+    int busy;			/* questions it hasn't answered yet */
+    RESOLVEBUF in, out;
+} rsHelpers[RESOLVEHELPERS];
+
+static int rsNews = 0;		/* lost a helper, so waiters should look */
+static NAMEMAP *rsMap = (NAMEMAP *)0;
+static RESOLVEENT *pREall = (RESOLVEENT *)0;
+static RESOLVEENT **ppREtail = &pREall;
+static int rsCount = 0;
+static char *rsNone[] = { (char *)0 };
+static RESOLVEWAIT *rsDone = (RESOLVEWAIT *)0;	/* for ResolveWaiter() */
+static RESOLVEWAIT **ppRWdoneTail = &rsDone;
+
+static void
+ResolveBufAdd(RESOLVEBUF *b, const void *p, int n)
+{
+    if (b->used + n > b->allocated) {
+	while (b->used + n > b->allocated)
+	    b->allocated = (b->allocated == 0) ? 1024 : b->allocated * 2;
+	if ((b->buf = (char *)realloc(b->buf, b->allocated)) == (char *)0)
+	    OutOfMem();
+    }
+    memcpy(b->buf + b->used, p, n);
+    b->used += n;
+}
+
+/* all of a read or write, for the helper (which can block all it likes) */
+static int
+ResolveIO(int fd, char *p, int n, int wr)
+{
+    int r;
+
+    while (n > 0) {
+	r = wr ? write(fd, p, n) : read(fd, p, n);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return -1;
+	p += r;
+	n -= r;
+    }
+    return 0;
+}
+
+/* do the lookup for key, in the helper, adding the answers to b.
+ * returns 1 if it worked, 0 if not.
+ */
+static int
+ResolveLookup(char *key, RESOLVEBUF *b, int *count)
+{
+#if USE_IPV6
+    struct addrinfo hints, *ai, *rp;
+    char host[NI_MAXHOST];
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (key[0] == 'r') {
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(key + 1, NULL, &hints, &ai) != 0)
+	    return 0;
+	error =
+	    getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof(host),
+			NULL, 0, NI_NAMEREQD);
+	freeaddrinfo(ai);
+	if (error) {
+	    CONDDEBUG((1, "ResolveLookup(): getnameinfo(%s): %s", key + 1,
+		       gai_strerror(error)));
+	    return 0;
+	}
+	ResolveBufAdd(b, host, strlen(host) + 1);
+	(*count)++;
+	return 1;
+    }
+    hints.ai_flags = AI_ADDRCONFIG;
+    if ((error = getaddrinfo(key + 1, NULL, &hints, &ai)) != 0) {
+	Error("ResolveLookup(): getaddrinfo(%s): %s", key + 1,
+	      gai_strerror(error));
+	return 0;
+    }
+    for (rp = ai; rp != (struct addrinfo *)0; rp = rp->ai_next) {
+	if (getnameinfo(rp->ai_addr, rp->ai_addrlen, host, sizeof(host),
+			NULL, 0, NI_NUMERICHOST) == 0) {
+	    ResolveBufAdd(b, host, strlen(host) + 1);
+	    (*count)++;
+	}
+    }
+    freeaddrinfo(ai);
+    return 1;
+#else
+    struct hostent *he;
+    struct in_addr addr;
+    char *p;
+    int a;
+
+    if (key[0] == 'r') {
+# if HAVE_INET_ATON
+	if (inet_aton(key + 1, &addr) == 0)
+	    return 0;
+# else
+	if ((addr.s_addr = inet_addr(key + 1)) == (in_addr_t) (-1))
+	    return 0;
+# endif
+	if ((he =
+	     gethostbyaddr((char *)&addr, sizeof(addr),
+			   AF_INET)) == (struct hostent *)0 ||
+	    he->h_name == (char *)0) {
+	    CONDDEBUG((1, "ResolveLookup(): gethostbyaddr(%s): %s",
+		       key + 1, hstrerror(h_errno)));
+	    return 0;
+	}
+	ResolveBufAdd(b, he->h_name, strlen(he->h_name) + 1);
+	(*count)++;
+	for (a = 0; he->h_aliases[a] != (char *)0; a++) {
+	    ResolveBufAdd(b, he->h_aliases[a],
+			  strlen(he->h_aliases[a]) + 1);
+	    (*count)++;
+	}
+	return 1;
+    }
+    if ((he = gethostbyname(key + 1)) == (struct hostent *)0) {
+	Error("ResolveLookup(): gethostbyname(%s): %s", key + 1,
+	      hstrerror(h_errno));
+	return 0;
+    }
+    if (4 != he->h_length || AF_INET != he->h_addrtype) {
+	Error
+	    ("ResolveLookup(): gethostbyname(%s): wrong address size (4 != %d) or address family (%d != %d)",
+	     key + 1, he->h_length, AF_INET, he->h_addrtype);
+	return 0;
+    }
+    for (a = 0; he->h_addr_list[a] != (char *)0; a++) {
+	p = inet_ntoa(*(struct in_addr *)(he->h_addr_list[a]));
+	ResolveBufAdd(b, p, strlen(p) + 1);
+	(*count)++;
+    }
+    return 1;
+#endif
+}
+
+/* the helper: one request at a time until the other end goes away */
+static void
+ResolveHelper(int fd)
+{
+    RESOLVEHDR hdr;
+    RESOLVEBUF b;
+    char *key = (char *)0;
+    int count;
+
+    memset(&b, 0, sizeof(b));
+    for (;;) {
+	if (ResolveIO(fd, (char *)&hdr, sizeof(hdr), 0) != 0 ||
+	    hdr.len < 2 || hdr.len > RESOLVEMAXMSG)
+	    break;
+	if ((key = (char *)realloc(key, hdr.len)) == (char *)0)
+	    OutOfMem();
+	if (ResolveIO(fd, key, hdr.len, 0) != 0)
+	    break;
+	key[hdr.len - 1] = '\000';
+
+	b.used = 0;
+	ResolveBufAdd(&b, &hdr, sizeof(hdr));
+	ResolveBufAdd(&b, key, hdr.len);
+	count = 0;
+	hdr.ok = ResolveLookup(key, &b, &count);
+	hdr.count = count;
+	hdr.len = b.used - sizeof(hdr);
+	memcpy(b.buf, &hdr, sizeof(hdr));
+	if (ResolveIO(fd, b.buf, b.used, 1) != 0)
+	    break;
+    }
+}
+
+/* fork off a helper into slot h.  returns 0 if it's there. */
+static int
+ResolveStart(int h)
+{
+    struct resolveHelper *pRH = &rsHelpers[h];
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	Error("ResolveStart(): socketpair(): %s", strerror(errno));
+	return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    switch (pRH->pid = fork()) {
+	case -1:
+	    Error("ResolveStart(): fork(): %s", strerror(errno));
+	    close(sv[0]);
+	    close(sv[1]);
+	    pRH->pid = 0;
+	    return -1;
+	case 0:
+	    thepid = getpid();
+	    break;
+	default:
+	    close(sv[1]);
+	    if (!SetFlags(sv[0], O_NONBLOCK, 0)) {
+		close(sv[0]);
+		pRH->pid = 0;
+		return -1;
+	    }
+	    /* consoles we exec don't need it */
+	    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	    pRH->fd = sv[0];
+	    pRH->busy = 0;
+	    pRH->in.used = pRH->out.used = 0;
+	    CONDDEBUG((1, "ResolveStart(): helper #%d pid %lu", h,
+		       (unsigned long)pRH->pid));
+	    return 0;
+    }
+
+    /* the helper goes when we do (it sees the eof) */
+    SimpleSignal(SIGHUP, SIG_IGN);
+    SimpleSignal(SIGUSR1, SIG_IGN);
+    SimpleSignal(SIGUSR2, SIG_IGN);
+    SimpleSignal(SIGINT, SIG_DFL);
+    SimpleSignal(SIGTERM, SIG_DFL);
+    SimpleSignal(SIGCHLD, SIG_DFL);
+    SimpleSignal(SIGPIPE, SIG_IGN);
+
+    CloseFiles(sv[1], -1);
+
+    ResolveHelper(sv[1]);
+    exit(EX_OK);
+}
+
+/* the helper with the least to do - or a new one, if they're all
+ * busy and there's room for another.  -1 if there's none to be had.
+ */
+static int
+ResolvePick(void)
+{
+    int h, best = -1, unused = -1;
+
+    for (h = 0; h < RESOLVEHELPERS; h++) {
+	if (rsHelpers[h].pid == 0) {
+	    if (unused == -1)
+		unused = h;
+	} else if (best == -1 || rsHelpers[h].busy < rsHelpers[best].busy)
+	    best = h;
+    }
+    if ((best == -1 || rsHelpers[best].busy > 0) && unused != -1 &&
+	ResolveStart(unused) == 0)
+	return unused;
+    return best;
+}
+
+static RESOLVEENT *
+ResolveAdd(char *key)
+{
+    RESOLVEENT *pRE;
+
+    if (rsMap == (NAMEMAP *)0)
+	rsMap = NameMapNew();
+    if ((pRE = (RESOLVEENT *)calloc(1, sizeof(RESOLVEENT)))
+	== (RESOLVEENT *)0 || (pRE->key = StrDup(key)) == (char *)0)
+	OutOfMem();
+    pRE->state = RESOLVE_PENDING;
+    pRE->list = rsNone;
+    pRE->helper = -1;
+    pRE->ppREbnext = ppREtail;
+    *ppREtail = pRE;
+    ppREtail = &pRE->pREnext;
+    NameMapAdd(rsMap, pRE->key, pRE);
+    rsCount++;
+    return pRE;
+}
+
+static void
+ResolveFreeList(RESOLVEENT *pRE)
+{
+    char **p;
+
+    if (pRE->list == rsNone)
+	return;
+    for (p = pRE->list; *p != (char *)0; p++)
+	free(*p);
+    free(pRE->list);
+    pRE->list = rsNone;
+}
+
+/* the lookup's done, one way or the other, so its waiters are up */
+static void
+ResolveWake(RESOLVEENT *pRE)
+{
+    if (pRE->waiters == (RESOLVEWAIT *)0)
+	return;
+    *ppRWdoneTail = pRE->waiters;
+    while (*ppRWdoneTail != (RESOLVEWAIT *)0)
+	ppRWdoneTail = &(*ppRWdoneTail)->next;
+    pRE->waiters = (RESOLVEWAIT *)0;
+}
+
+static void
+ResolveFreeWaiters(RESOLVEWAIT **ppRW)
+{
+    RESOLVEWAIT *pRW;
+
+    while ((pRW = *ppRW) != (RESOLVEWAIT *)0) {
+	*ppRW = pRW->next;
+	free(pRW);
+    }
+}
+
+static void
+ResolveDrop(RESOLVEENT *pRE)
+{
+    NameMapDelete(rsMap, pRE->key, pRE);
+    ResolveFreeWaiters(&pRE->waiters);
+    if (pRE->pREnext != (RESOLVEENT *)0)
+	pRE->pREnext->ppREbnext = pRE->ppREbnext;
+    else
+	ppREtail = pRE->ppREbnext;
+    *(pRE->ppREbnext) = pRE->pREnext;
+    ResolveFreeList(pRE);
+    free(pRE->key);
+    free(pRE);
+    rsCount--;
+}
+
+/* helper h went away.  whatever it owed us fails (for a little
+ * while) and the slot is free for another.
+ */
+static void
+ResolveLost(int h)
+{
+    struct resolveHelper *pRH = &rsHelpers[h];
+    RESOLVEENT *pRE;
+    time_t now;
+
+    Error("ResolveLost(): lost resolver #%d (pid %lu)", h,
+	  (unsigned long)pRH->pid);
+    FDUnwatch(pRH->fd, FDWATCH_READ | FDWATCH_WRITE);
+    close(pRH->fd);
+    pRH->pid = 0;
+    pRH->busy = 0;
+    pRH->in.used = pRH->out.used = 0;
+    time(&now);
+    for (pRE = pREall; pRE != (RESOLVEENT *)0; pRE = pRE->pREnext) {
+	if (pRE->state == RESOLVE_PENDING && pRE->helper == h) {
+	    pRE->state = RESOLVE_FAIL;
+	    pRE->expires = now + RESOLVENEGTTL;
+	    ResolveWake(pRE);
+	}
+    }
+    rsNews = 1;
+}
+
+static void
+ResolveFlush(int h)
+{
+    struct resolveHelper *pRH = &rsHelpers[h];
+    int r;
+
+    while (pRH->out.used > 0) {
+	if ((r = write(pRH->fd, pRH->out.buf, pRH->out.used)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		ResolveLost(h);
+	    return;
+	}
+	MemMove(pRH->out.buf, pRH->out.buf + r, pRH->out.used - r);
+	pRH->out.used -= r;
+    }
+}
+
+static int
+ResolveFind(char type, char *what, char ***list, void *who)
+{
+    static STRING *key = (STRING *)0;
+    RESOLVEENT *pRE = (RESOLVEENT *)0;
+    RESOLVEWAIT *pRW;
+    RESOLVEHDR hdr;
+    int h;
+
+    *list = rsNone;
+    if (key == (STRING *)0)
+	key = AllocString();
+    BuildString((char *)0, key);
+    BuildStringChar(type, key);
+    BuildString(what, key);
+
+    if (rsMap != (NAMEMAP *)0 &&
+	(pRE = (RESOLVEENT *)NameMapFind(rsMap, key->string))
+	!= (RESOLVEENT *)0 && pRE->state != RESOLVE_PENDING &&
+	pRE->expires <= time((time_t *)0)) {
+	ResolveDrop(pRE);
+	pRE = (RESOLVEENT *)0;
+    }
+    if (pRE == (RESOLVEENT *)0) {
+	if ((h = ResolvePick()) == -1)
+	    return RESOLVE_FAIL;
+	pRE = ResolveAdd(key->string);
+	pRE->helper = h;
+	rsHelpers[h].busy++;
+	hdr.ok = hdr.count = 0;
+	hdr.len = strlen(key->string) + 1;
+	ResolveBufAdd(&rsHelpers[h].out, &hdr, sizeof(hdr));
+	ResolveBufAdd(&rsHelpers[h].out, key->string, hdr.len);
+	CONDDEBUG((1, "ResolveFind(): helper #%d looking up %s", h,
+		   key->string));
+	ResolveFlush(h);
+    }
+    if (who != (void *)0 && pRE->state == RESOLVE_PENDING) {
+	for (pRW = pRE->waiters; pRW != (RESOLVEWAIT *)0; pRW = pRW->next)
+	    if (pRW->who == who)
+		break;
+	if (pRW == (RESOLVEWAIT *)0) {
+	    if ((pRW = (RESOLVEWAIT *)calloc(1, sizeof(RESOLVEWAIT)))
+		== (RESOLVEWAIT *)0)
+		OutOfMem();
+	    pRW->who = who;
+	    pRW->next = pRE->waiters;
+	    pRE->waiters = pRW;
+	}
+    }
+    *list = pRE->list;
+    return pRE->state;
+}
+
+/* the names for a numeric address, or the numeric addresses for a
+ * hostname.  the (char *)0 terminated list we point at stays good
+ * until the next ResolveReady() (or the lookup isn't RESOLVE_OK and
+ * the list is empty).
+ */
+int
+ResolveName(char *addr, char ***names)
+{
+    return ResolveFind('r', addr, names, (void *)0);
+}
+
+/* if it's RESOLVE_PENDING and who isn't (void *)0, who comes back out
+ * of ResolveWaiter() once the answer (or a failure) is in
+ */
+int
+ResolveHost(char *host, char ***addrs, void *who)
+{
+    return ResolveFind('f', host, addrs, who);
+}
+
+/* the next waiter (see ResolveHost()) whose lookup is done, after a
+ * ResolveReady(), or (void *)0 when there are no more
+ */
+void *
+ResolveWaiter(void)
+{
+    RESOLVEWAIT *pRW;
+    void *who;
+
+    if ((pRW = rsDone) == (RESOLVEWAIT *)0)
+	return (void *)0;
+    if ((rsDone = pRW->next) == (RESOLVEWAIT *)0)
+	ppRWdoneTail = &rsDone;
+    who = pRW->who;
+    free(pRW);
+    return who;
+}
+
+/* who is going away, so it mustn't be handed back later */
+void
+ResolveForget(void *who)
+{
+    RESOLVEENT *pRE;
+    RESOLVEWAIT **ppRW, *pRW;
+
+    for (pRE = pREall; pRE != (RESOLVEENT *)0; pRE = pRE->pREnext) {
+	for (ppRW = &pRE->waiters; (pRW = *ppRW) != (RESOLVEWAIT *)0;) {
+	    if (pRW->who == who) {
+		*ppRW = pRW->next;
+		free(pRW);
+	    } else
+		ppRW = &pRW->next;
+	}
+    }
+    for (ppRW = &rsDone; (pRW = *ppRW) != (RESOLVEWAIT *)0;) {
+	if (pRW->who == who) {
+	    *ppRW = pRW->next;
+	    free(pRW);
+	} else
+	    ppRW = &pRW->next;
+    }
+    ppRWdoneTail = ppRW;
+}
+
+/* have FDWait() watch for the helpers' answers (and for room to ask
+ * them more) - call before each FDWait(), since FDWatchReset() forgets
+ */
+void
+ResolveWatch(void)
+{
+    int h;
+
+    for (h = 0; h < RESOLVEHELPERS; h++) {
+	if (rsHelpers[h].pid == 0)
+	    continue;
+	FDWatch(rsHelpers[h].fd, FDWATCH_READ);
+	if (rsHelpers[h].out.used > 0)
+	    FDWatch(rsHelpers[h].fd, FDWATCH_WRITE);
+	else
+	    FDUnwatch(rsHelpers[h].fd, FDWATCH_WRITE);
+    }
+}
+
+static void
+ResolveAnswer(RESOLVEHDR *hdr, char *body)
+{
+    RESOLVEENT *pRE;
+    char *p, *end = body + hdr->len;
+    int i;
+
+    body[hdr->len - 1] = '\000';
+    if (rsMap == (NAMEMAP *)0 ||
+	(pRE = (RESOLVEENT *)NameMapFind(rsMap, body)) == (RESOLVEENT *)0)
+	pRE = ResolveAdd(body);
+    ResolveFreeList(pRE);
+    pRE->state = hdr->ok ? RESOLVE_OK : RESOLVE_FAIL;
+    pRE->expires =
+	time((time_t *)0) + (hdr->ok ? RESOLVEPOSTTL : RESOLVENEGTTL);
+    ResolveWake(pRE);
+    if (hdr->count <= 0)
+	return;
+    if ((pRE->list =
+	 (char **)calloc(hdr->count + 1, sizeof(char *))) == (char **)0)
+	OutOfMem();
+    p = body + strlen(body) + 1;
+    for (i = 0; i < hdr->count && p < end; i++) {
+	if ((pRE->list[i] = StrDup(p)) == (char *)0)
+	    OutOfMem();
+	p += strlen(p) + 1;
+    }
+    CONDDEBUG((1, "ResolveAnswer(): %s is %s", pRE->key,
+	       pRE->list[0] == (char *)0 ? "(none)" : pRE->list[0]));
+}
+
+/* take in what helper h has answered.  returns the count. */
+static int
+ResolveRead(int h)
+{
+    struct resolveHelper *pRH = &rsHelpers[h];
+    RESOLVEHDR hdr;
+    char buf[4096];
+    int r, off, lost = 0, answered = 0;
+
+    for (;;) {
+	if ((r = read(pRH->fd, buf, sizeof(buf))) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	}
+	if (r <= 0) {
+	    lost = 1;
+	    break;
+	}
+	ResolveBufAdd(&pRH->in, buf, r);
+	if (r < sizeof(buf))
+	    break;
+    }
+
+    for (off = 0; pRH->in.used - off >= sizeof(hdr); off += hdr.len) {
+	memcpy(&hdr, pRH->in.buf + off, sizeof(hdr));
+	if (hdr.len < 2 || hdr.len > RESOLVEMAXMSG * 4) {
+	    lost = 1;
+	    break;
+	}
+	if (pRH->in.used - off - sizeof(hdr) < hdr.len)
+	    break;
+	off += sizeof(hdr);
+	ResolveAnswer(&hdr, pRH->in.buf + off);
+	pRH->busy--;
+	answered++;
+    }
+    if (off > 0) {
+	MemMove(pRH->in.buf, pRH->in.buf + off, pRH->in.used - off);
+	pRH->in.used -= off;
+    }
+    if (lost) {
+	ResolveLost(h);
+	answered++;
+    }
+    return answered;
+}
+
+/* take in whatever the helpers have answered, after an FDWait().
+ * returns how many lookups finished - if any did, whoever got
+ * RESOLVE_PENDING should try again.
+ */
+int
+ResolveReady(void)
+{
+    RESOLVEENT *pRE, *pREnext;
+    int h, answered = 0;
+
+    for (h = 0; h < RESOLVEHELPERS; h++) {
+	if (rsHelpers[h].pid == 0)
+	    continue;
+	if (FDIsReady(rsHelpers[h].fd, FDWATCH_WRITE))
+	    ResolveFlush(h);
+	if (rsHelpers[h].pid != 0 &&
+	    FDIsReady(rsHelpers[h].fd, FDWATCH_READ))
+	    answered += ResolveRead(h);
+    }
+    answered += rsNews;
+    rsNews = 0;
+
+    /* keep it to RESOLVEMAX, but don't forget what's still coming */
+    for (pRE = pREall; rsCount > RESOLVEMAX && pRE != (RESOLVEENT *)0;
+	 pRE = pREnext) {
+	pREnext = pRE->pREnext;
+	if (pRE->state != RESOLVE_PENDING)
+	    ResolveDrop(pRE);
+    }
+    return answered;
+}
+
+/* for a new process (see Spawn()): the helpers and what they owe us
+ * belong to the parent
+ */
+void
+ResolveReset(void)
+{
+    RESOLVEENT *pRE, *pREnext;
+    int h;
+
+    for (h = 0; h < RESOLVEHELPERS; h++) {
+	if (rsHelpers[h].pid == 0)
+	    continue;
+	close(rsHelpers[h].fd);
+	rsHelpers[h].pid = 0;
+	rsHelpers[h].busy = 0;
+	rsHelpers[h].in.used = rsHelpers[h].out.used = 0;
+    }
+    rsNews = 0;
+    ResolveFreeWaiters(&rsDone);
+    ppRWdoneTail = &rsDone;
+    for (pRE = pREall; pRE != (RESOLVEENT *)0; pRE = pREnext) {
+	pREnext = pRE->pREnext;
+	if (pRE->state == RESOLVE_PENDING)
+	    ResolveDrop(pRE);
+    }
+}
@@ -0,0 +1,21 @@
+/*
+ *  Copyright conserver.com, 2000
+ *
+ *  Maintainer/Enhancer: Bryan Stansell (bryan@conserver.com)
+ */
+
+/*
+ * name lookups done by a helper process so the server loops never
+ * wait on dns (see ResolveName())
+ */
+#define RESOLVE_OK	1
+#define RESOLVE_FAIL	0
+#define RESOLVE_PENDING	(-1)
+
+extern int ResolveName(char *, char ***);
+extern int ResolveHost(char *, char ***, void *);
+extern void *ResolveWaiter(void);
+extern void ResolveForget(void *);
+extern void ResolveWatch(void);
+extern int ResolveReady(void);
+extern void ResolveReset(void);
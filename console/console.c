@@ -46,6 +46,7 @@
 
 
 int fReplay = 0, fVersion = 0;
+char *pcSince = (char *)0;
 int showExecData = 1;
 int chAttn = -1, chEsc = -1;
 unsigned short bindPort;
@@ -294,6 +295,7 @@ Usage(int wantfull)
 	"r(R)      display (master) daemon version (think 'r'emote version)",
 	"s(S)      spy on a console (and replay)",
 	"t         send a text message to [user][@console]",
+	"T time    replay what was logged since time (with -a, -f, or -s)",
 	"u         show users on the various consoles",
 #if HAVE_OPENSSL
 	"U         allow unencrypted connections if SSL not available",
@@ -308,7 +310,7 @@ Usage(int wantfull)
 	(char *)0
     };
 
-    fprintf(stderr, "usage: %s [generic-args] [-aAfFsS] [-e esc] console\n\
+    fprintf(stderr, "usage: %s [generic-args] [-aAfFsS] [-e esc] [-T time] console\n\
        %s [generic-args] [-iIuwWx] [console]\n\
        %s [generic-args] [-hPqQrRV] [-[bB] message] [-d [user][@console]]\n\
                               [-t [user][@console] message] [-[zZ] cmd]\n\n\
@@ -892,9 +894,7 @@ ExecCmd(void)
 	    }
 	    FilePrint(cfstdout, FLAGFALSE,
 		      "[local command running - pid %lu]\r\n", execCmdPid);
-	    FD_SET(pin[0], &rinit);
-	    if (maxfd < pin[0] + 1)
-		maxfd = pin[0] + 1;
+	    FDWatch(pin[0], FDWATCH_READ);
 	    fflush(stderr);
 	    return;
     }
@@ -1024,8 +1024,6 @@ DoExec(CONSFILE *pcf)
 		FileWrite(cfstdout, FLAGFALSE,
 			  "[no longer read-write - aborting command]\r\n",
 			  -1);
-		FD_CLR(FileFDNum(execCmdFile), &rinit);
-		FD_CLR(FileFDOutNum(execCmdFile), &winit);
 		FileClose(&execCmdFile);
 		FileSetQuoteIAC(pcf, FLAGFALSE);
 		FilePrint(pcf, FLAGFALSE, "%c%c", OB_IAC, OB_ABRT);
@@ -1155,7 +1153,6 @@ Interact(CONSFILE *pcf, char *pcMach)
 {
     int i;
     int nc;
-    fd_set rmask, wmask;
     int justSuspended = 0;
     static char acMesg[8192];
 
@@ -1186,31 +1183,23 @@ Interact(CONSFILE *pcf, char *pcMach)
     SetFlags(FileFDNum(pcf), O_NONBLOCK, 0);
 
     /* read from stdin and the socket (non-blocking!).
-     * rmask indicates which descriptors to read from,
-     * the others are not used, nor is the result from
-     * select, read, or write.
+     * the watch list says which descriptors to read from,
+     * FDWait() tells us which are ready.
      */
-    FD_ZERO(&rinit);
-    FD_ZERO(&winit);
-    FD_SET(FileFDNum(pcf), &rinit);
-    FD_SET(0, &rinit);
-    if (maxfd < FileFDNum(pcf) + 1)
-	maxfd = FileFDNum(pcf) + 1;
+    FDWatchReset();
+    FDWatch(FileFDNum(pcf), FDWATCH_READ);
+    FDWatch(0, FDWATCH_READ);
     for (;;) {
 	justSuspended = 0;
 	if (fSawReapVirt) {
 	    fSawReapVirt = 0;
 	    ReapVirt();
 	}
-	/* reset read mask and select on it
+	/* wait for something to do
 	 */
-	rmask = rinit;
-	wmask = winit;
-	if (-1 ==
-	    select(maxfd, &rmask, &wmask, (fd_set *)0,
-		   (struct timeval *)0)) {
+	if (FDWait((struct timeval *)0) == -1) {
 	    if (errno != EINTR) {
-		Error("Master(): select(): %s", strerror(errno));
+		Error("Interact(): FDWait(): %s", strerror(errno));
 		break;
 	    }
 	    continue;
@@ -1218,11 +1207,9 @@ Interact(CONSFILE *pcf, char *pcMach)
 
 	/* anything from execCmd */
 	if (execCmdFile != (CONSFILE *)0) {
-	    if (FileCanRead(execCmdFile, &rmask, &wmask)) {
+	    if (FileCanRead(execCmdFile)) {
 		if ((nc =
 		     FileRead(execCmdFile, acMesg, sizeof(acMesg))) < 0) {
-		    FD_CLR(FileFDNum(execCmdFile), &rinit);
-		    FD_CLR(FileFDOutNum(execCmdFile), &winit);
 		    FileClose(&execCmdFile);
 		    FileSetQuoteIAC(pcf, FLAGFALSE);
 		    FilePrint(pcf, FLAGFALSE, "%c%c", OB_IAC, OB_ABRT);
@@ -1235,7 +1222,7 @@ Interact(CONSFILE *pcf, char *pcMach)
 		    FileWrite(pcf, FLAGFALSE, acMesg, nc);
 		}
 	    } else if (!FileBufEmpty(execCmdFile) &&
-		       FileCanWrite(execCmdFile, &rmask, &wmask)) {
+		       FileCanWrite(execCmdFile)) {
 		CONDDEBUG((1, "Interact(): flushing fd %d",
 			   FileFDNum(execCmdFile)));
 		if (FileWrite(execCmdFile, FLAGFALSE, (char *)0, 0) < 0) {
@@ -1246,7 +1233,7 @@ Interact(CONSFILE *pcf, char *pcMach)
 	}
 
 	/* anything from socket? */
-	if (FileCanRead(pcf, &rmask, &wmask)) {
+	if (FileCanRead(pcf)) {
 	    int l;
 	    if ((nc = FileRead(pcf, acMesg, sizeof(acMesg))) < 0) {
 		/* if we got an error/eof after returning from suspend */
@@ -1291,8 +1278,6 @@ Interact(CONSFILE *pcf, char *pcMach)
 			}
 		    } else {
 			if (FileSawQuoteAbrt(pcf) == FLAGTRUE) {
-			    FD_CLR(FileFDNum(execCmdFile), &rinit);
-			    FD_CLR(FileFDOutNum(execCmdFile), &winit);
 			    FileClose(&execCmdFile);
 			    kill(execCmdPid, SIGHUP);
 			}
@@ -1312,7 +1297,7 @@ Interact(CONSFILE *pcf, char *pcMach)
 		nc -= l;
 		MemMove(acMesg, acMesg + l, nc);
 	    }
-	} else if (!FileBufEmpty(pcf) && FileCanWrite(pcf, &rmask, &wmask)) {
+	} else if (!FileBufEmpty(pcf) && FileCanWrite(pcf)) {
 	    CONDDEBUG((1, "Interact(): flushing fd %d", FileFDNum(pcf)));
 	    if (FileWrite(pcf, FLAGFALSE, (char *)0, 0) < 0) {
 		/* -bryan */
@@ -1321,12 +1306,12 @@ Interact(CONSFILE *pcf, char *pcMach)
 	}
 
 	/* anything from stdin? */
-	if (FD_ISSET(0, &rmask)) {
+	if (FDIsReady(0, FDWATCH_READ)) {
 	    if ((nc = read(0, acMesg, sizeof(acMesg))) <= 0) {
 		if (screwy)
 		    break;
 		else {
-		    FD_CLR(0, &rinit);
+		    FDUnwatch(0, FDWATCH_READ);
 		    continue;
 		}
 	    }
@@ -1521,7 +1506,9 @@ CallUp(CONSFILE *pcf, char *pcMaster, char *pcMach, char *pcHow,
 	} else if (fIn != (*pcHow == 'f' ? 'a' : *pcHow)) {
 	    FilePrint(pcf, FLAGFALSE, "%c%c%c", chAttn, chEsc, *pcHow);
 	}
-	if (fReplay) {
+	if (pcSince != (char *)0) {
+	    FilePrint(pcf, FLAGFALSE, "%c%ct%s\r", chAttn, chEsc, pcSince);
+	} else if (fReplay) {
 	    FilePrint(pcf, FLAGFALSE, "%c%cr", chAttn, chEsc);
 	} else if (fVerbose) {
 	    FilePrint(pcf, FLAGFALSE, "%c%c\022", chAttn, chEsc);
@@ -1723,20 +1710,35 @@ DoCmds(char *master, char *pports, int cmdi)
 #endif
 
 	/* now that we're logged in, we can do something */
+	/* a master can pass us straight on to the console's group
+	 * (older ones don't know "attach", so ask again with "call")
+	 */
+	t = (char *)0;
+	if (cmdi != 0 && cmds[cmdi][0] == 'c' && interact == FLAGTRUE &&
+	    *ports == '\000') {
+	    FilePrint(pcf, FLAGFALSE, "attach %s\r\n", cmdarg);
+	    t = ReadReply(pcf, FLAGFALSE);
+	    if (strcmp(t, "unknown command\r\n") == 0)
+		t = (char *)0;
+	}
 	/* if we're on the last cmd or the command is 'call' and we
 	 * have an arg (always true if it's 'call'), then send the arg
 	 */
-	if ((cmdi == 0 || cmds[cmdi][0] == 'c') && cmdarg != (char *)0)
-	    FilePrint(pcf, FLAGFALSE, "%s %s\r\n", cmds[cmdi], cmdarg);
-	else
-	    FilePrint(pcf, FLAGFALSE, "%s\r\n", cmds[cmdi]);
+	if (t == (char *)0) {
+	    if ((cmdi == 0 || cmds[cmdi][0] == 'c') && cmdarg != (char *)0)
+		FilePrint(pcf, FLAGFALSE, "%s %s\r\n", cmds[cmdi],
+			  cmdarg);
+	    else
+		FilePrint(pcf, FLAGFALSE, "%s\r\n", cmds[cmdi]);
+	}
 
 	/* if we haven't gone down the stack, do "normal" stuff.
 	 * if we did hit the bottom, we send the exit\r\n now so
 	 * that the ReadReply can stop once the socket closes.
 	 */
 	if (cmdi != 0) {
-	    t = ReadReply(pcf, FLAGFALSE);
+	    if (t == (char *)0)
+		t = ReadReply(pcf, FLAGFALSE);
 	    /* save the result */
 	    if (result != (char *)0)
 		free(result);
@@ -1843,7 +1845,7 @@ DoCmds(char *master, char *pports, int cmdi)
 		} else if ((cmds[0][0] != 'b' && cmds[0][0] != 't') ||
 			   (result[0] != 'o' || result[1] != 'k')) {
 		    /* did a 'master' before this or doing a 'disconnect',
-		     * 'reconfig', 'newlogs', or 'up'
+		     * 'reconfig', 'newlogs', 'up', or 'upgrade'
 		     */
 		    if ((cmds[1] != (char *)0 && cmds[1][0] == 'm') ||
 			cmds[0][0] == 'd' || cmds[0][0] == 'r' ||
@@ -1891,7 +1893,7 @@ main(int argc, char **argv)
     int fLocal;
     static STRING *acPorts = (STRING *)0;
     static char acOpts[] =
-	"7aAb:B:c:C:d:De:EfFhiIl:M:np:PqQrRsSt:uUvVwWxz:Z:";
+	"7aAb:B:c:C:d:De:EfFhiIl:M:np:PqQrRsSt:T:uUvVwWxz:Z:";
     extern int optind;
     extern int optopt;
     extern char *optarg;
@@ -1914,6 +1916,8 @@ main(int argc, char **argv)
 	 "reread configuration file, then do 'reopen' actions"},
 	{"reopen, SIGUSR2", "newlogs",
 	 "reopen all logfiles, then do 'bringup' actions"},
+	{"upgrade", "upgrade",
+	 "re-exec the server, keeping consoles and clients"},
 	{"version", "version", "display version information"}
     };
     int isZap = 0;
@@ -2065,6 +2069,10 @@ main(int argc, char **argv)
 		pcCmd = "spy";
 		break;
 
+	    case 'T':		/* replay since a time */
+		pcSince = optarg;
+		break;
+
 	    case 't':
 		BuildString((char *)0, textMsg);
 		if (optarg == (char *)0 || *optarg == '\000') {